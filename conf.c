@@ -175,6 +175,154 @@ static int parse_config_default(struct local_conf *lc, struct ini_cfgobj *co)
 		lc->default_port = port;
 	}
 
+	ret = ini_get_config_valueobj("default", "LsaHoldDown", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int hold_down;
+
+		hold_down = ini_get_int_config_value(vo, 1, 0, &ret);
+		if (ret || hold_down < 0) {
+			fprintf(stderr, "error retrieving LsaHoldDown value\n");
+			return -1;
+		}
+
+		lc->conf->lsa_hold_down = hold_down;
+	} else {
+		lc->conf->lsa_hold_down = 1000;
+	}
+
+	ret = ini_get_config_valueobj("default", "KernelTLS", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int kernel_tls;
+
+		kernel_tls = ini_get_bool_config_value(vo, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving KernelTLS value\n");
+			return -1;
+		}
+
+		lc->conf->kernel_tls = kernel_tls;
+	} else {
+		lc->conf->kernel_tls = 0;
+	}
+
+	ret = ini_get_config_valueobj("default", "UdpDataChannel", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int udp_data_channel;
+
+		udp_data_channel = ini_get_bool_config_value(vo, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving UdpDataChannel "
+					"value\n");
+			return -1;
+		}
+
+		lc->conf->udp_data_channel = udp_data_channel;
+	} else {
+		lc->conf->udp_data_channel = 0;
+	}
+
+	ret = ini_get_config_valueobj("default", "ForwardTransit", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int forward_transit;
+
+		forward_transit = ini_get_bool_config_value(vo, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving ForwardTransit "
+					"value\n");
+			return -1;
+		}
+
+		lc->conf->forward_transit = forward_transit;
+	} else {
+		lc->conf->forward_transit = 0;
+	}
+
+	ret = ini_get_config_valueobj("default", "TunOffload", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int tun_offload;
+
+		tun_offload = ini_get_bool_config_value(vo, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving TunOffload "
+					"value\n");
+			return -1;
+		}
+
+		lc->conf->tun_offload = tun_offload;
+	} else {
+		lc->conf->tun_offload = 0;
+	}
+
+	ret = ini_get_config_valueobj("default", "IoUring", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int io_uring;
+
+		io_uring = ini_get_bool_config_value(vo, 0, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving IoUring value\n");
+			return -1;
+		}
+
+		lc->conf->io_uring = io_uring;
+	} else {
+		lc->conf->io_uring = 0;
+	}
+
+	ret = ini_get_config_valueobj("default", "SharedTunInterface", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		char *itf;
+
+		itf = ini_get_string_config_value(vo, &ret);
+		if (ret) {
+			fprintf(stderr, "error retrieving SharedTunInterface "
+					"value\n");
+			return -1;
+		}
+
+		lc->conf->shared_tunitf = itf;
+	}
+
+	ret = ini_get_config_valueobj("default", "DataPlaneThreads", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int threads;
+
+		threads = ini_get_int_config_value(vo, 1, 0, &ret);
+		if (ret || threads < 0) {
+			fprintf(stderr, "error retrieving DataPlaneThreads "
+					"value\n");
+			return -1;
+		}
+
+		lc->conf->data_plane_threads = threads;
+	} else {
+		lc->conf->data_plane_threads = 0;
+	}
+
+	ret = ini_get_config_valueobj("default", "TLSOffloadThreads", co,
+				      INI_GET_FIRST_VALUE, &vo);
+	if (ret == 0 && vo != NULL) {
+		int threads;
+
+		threads = ini_get_int_config_value(vo, 1, 0, &ret);
+		if (ret || threads < 0) {
+			fprintf(stderr, "error retrieving TLSOffloadThreads "
+					"value\n");
+			return -1;
+		}
+
+		lc->conf->tls_offload_threads = threads;
+	} else {
+		lc->conf->tls_offload_threads = 0;
+	}
+
 	return 0;
 }
 
@@ -618,6 +766,7 @@ struct conf *parse_config(const char *file)
 
 	conf->private_key = NULL;
 	conf->node_name = NULL;
+	conf->shared_tunitf = NULL;
 	INIT_IV_AVL_TREE(&conf->connect_entries, compare_connect_entries);
 	INIT_IV_AVL_TREE(&conf->listening_sockets, compare_listening_sockets);
 
@@ -667,6 +816,8 @@ void free_config(struct conf *conf)
 
 	free(conf->node_name);
 
+	free(conf->shared_tunitf);
+
 	free(conf->private_key);
 
 	free(conf->role_key);
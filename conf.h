@@ -35,11 +35,21 @@ enum conf_fp_type {
 #include "tconn_connect.h"
 #include "tconn_listen.h"
 #include "tun.h"
+#include "udpchan.h"
 
 struct conf {
 	char			*node_name;
 	char			*private_key;
 	char			*role_key;
+	int			lsa_hold_down;
+	int			kernel_tls;
+	int			udp_data_channel;
+	char			*shared_tunitf;
+	int			forward_transit;
+	int			tun_offload;
+	int			io_uring;
+	int			data_plane_threads;
+	int			tls_offload_threads;
 	struct iv_avl_tree	connect_entries;
 	struct iv_avl_tree	listening_sockets;
 };
@@ -57,6 +67,7 @@ struct direct_peer {
 	struct iv_avl_node	an;
 	uint8_t			addr[16];
 	char			*itfname;
+	int			ifindex;
 };
 
 struct conf_connect_entry {
@@ -85,6 +96,9 @@ struct conf_listening_socket {
 
 	int				registered;
 	struct tconn_listen_socket	tls;
+
+	int				udp_registered;
+	struct udpchan_socket		us;
 };
 
 struct conf_listen_entry {
@@ -48,10 +48,17 @@ static void handle_dgp_read(void *_dc)
 {
 	struct dgp_connect *dc = _dc;
 
-	if (dgp_reader_read(&dc->dr, dc->fd.fd) < 0)
+	if (dgp_reader_read(&dc->dr) < 0)
 		io_error(dc);
 }
 
+static void handle_dgp_write(void *_dc)
+{
+	struct dgp_connect *dc = _dc;
+
+	dgp_writer_pollout(&dc->dw);
+}
+
 static void connect_success(struct dgp_connect *dc, int fd)
 {
 	dc->state = STATE_ESTABLISHED;
@@ -63,7 +70,6 @@ static void connect_success(struct dgp_connect *dc, int fd)
 
 	dgp_reader_register(&dc->dr);
 
-	dc->dw.fd = dc->fd.fd;
 	dgp_writer_register(&dc->dw);
 }
 
@@ -217,17 +223,21 @@ void dgp_connect_start(struct dgp_connect *dc)
 	IV_FD_INIT(&dc->fd);
 	dc->fd.cookie = dc;
 
+	dc->dr.fd = &dc->fd;
 	dc->dr.myid = dc->myid;
 	dc->dr.remoteid = dc->remoteid;
 	dc->dr.rib = dc->loc_rib;
 	dc->dr.cookie = dc;
 	dc->dr.io_error = dr_dw_io_error;
 
+	dc->dw.fd = &dc->fd;
 	dc->dw.myid = dc->myid;
 	dc->dw.remoteid = dc->remoteid;
 	dc->dw.rib = dc->loc_rib;
 	dc->dw.cookie = dc;
 	dc->dw.io_error = dr_dw_io_error;
+	dc->dw.handler_out = handle_dgp_write;
+	dc->dw.writev = NULL;
 
 	try_connect(dc);
 }
@@ -72,10 +72,17 @@ static void handle_dgp_read(void *_conn)
 {
 	struct conn *conn = _conn;
 
-	if (dgp_reader_read(&conn->dr, conn->fd.fd) < 0)
+	if (dgp_reader_read(&conn->dr) < 0)
 		conn_kill(conn);
 }
 
+static void handle_dgp_write(void *_conn)
+{
+	struct conn *conn = _conn;
+
+	dgp_writer_pollout(&conn->dw);
+}
+
 static void dr_dw_io_error(void *_conn)
 {
 	struct conn *conn = _conn;
@@ -140,6 +147,7 @@ static void got_connection(void *_dls)
 	conn->fd.handler_in = handle_dgp_read;
 	iv_fd_register(&conn->fd);
 
+	conn->dr.fd = &conn->fd;
 	conn->dr.myid = dls->myid;
 	conn->dr.remoteid = (dle != NULL) ? dle->remoteid : NULL;
 	conn->dr.rib = dls->loc_rib;
@@ -147,12 +155,14 @@ static void got_connection(void *_dls)
 	conn->dr.io_error = dr_dw_io_error;
 	dgp_reader_register(&conn->dr);
 
-	conn->dw.fd = fd;
+	conn->dw.fd = &conn->fd;
 	conn->dw.myid = dls->myid;
 	conn->dw.remoteid = (dle != NULL) ? dle->remoteid : NULL;
 	conn->dw.rib = dls->loc_rib;
 	conn->dw.cookie = conn;
 	conn->dw.io_error = dr_dw_io_error;
+	conn->dw.handler_out = handle_dgp_write;
+	conn->dw.writev = NULL;
 	dgp_writer_register(&conn->dw);
 }
 
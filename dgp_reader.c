@@ -20,13 +20,41 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <iv.h>
+#include <iv_list.h>
 #include <string.h>
 #include "dgp_reader.h"
 #include "lsa_deserialise.h"
+#include "lsa_verify.h"
 #include "util.h"
 
 #define KEEPALIVE_TIMEOUT	15
 
+/*
+ * Received LSAs are queued until their signatures have been checked
+ * by the verification thread pool, and are then handed to the
+ * adj-RIB-in in the order in which they arrived.  When too many LSAs
+ * are outstanding, we stop reading from the socket until the backlog
+ * has been worked off, so that TCP flow control pushes back on the
+ * sender instead of us buffering an unbounded number of LSAs.
+ *
+ * A reader that is fed from TLS records with dgp_reader_feed(), or
+ * with already parsed LSAs through dgp_reader_feed_lsas(), has no
+ * socket of its own, and asks its owner to stop delivering input
+ * through ->pause_input instead.  LSAs that were already on their way
+ * are parked in a backlog until there is room for them again, and if
+ * that backlog grows beyond MAX_BACKLOG_BYTES, the session is failed.
+ */
+#define MAX_PENDING		1024
+#define RESUME_PENDING		(MAX_PENDING / 2)
+#define MAX_BACKLOG_BYTES	(4 * 1048576)
+
+struct dgp_reader_lsa {
+	struct iv_list_head		list;
+	struct dgp_reader		*dr;
+	struct lsa_verify_request	req;
+	int				done;
+};
+
 static void dgp_reader_keepalive_timeout(void *_dr)
 {
 	struct dgp_reader *dr = _dr;
@@ -34,9 +62,26 @@ static void dgp_reader_keepalive_timeout(void *_dr)
 	dr->io_error(dr->cookie);
 }
 
+static void dgp_reader_rearm(struct dgp_reader *dr)
+{
+	if (iv_timer_registered(&dr->keepalive_timeout))
+		iv_timer_unregister(&dr->keepalive_timeout);
+
+	iv_validate_now();
+	dr->keepalive_timeout.expires = iv_now;
+	timespec_add_ms(&dr->keepalive_timeout.expires,
+			1000 * KEEPALIVE_TIMEOUT, 1000 * KEEPALIVE_TIMEOUT);
+	iv_timer_register(&dr->keepalive_timeout);
+}
+
 void dgp_reader_register(struct dgp_reader *dr)
 {
 	dr->bytes = 0;
+	INIT_IV_LIST_HEAD(&dr->pending);
+	dr->num_pending = 0;
+	dr->paused = 0;
+	INIT_IV_LIST_HEAD(&dr->backlog);
+	dr->backlog_bytes = 0;
 
 	if (dr->remoteid != NULL) {
 		dr->adj_rib_in.myid = dr->myid;
@@ -59,39 +104,184 @@ void dgp_reader_register(struct dgp_reader *dr)
 	iv_timer_register(&dr->keepalive_timeout);
 }
 
-int dgp_reader_read(struct dgp_reader *dr, int fd)
+static void dgp_reader_pause(struct dgp_reader *dr)
+{
+	dr->paused = 1;
+
+	if (dr->fd == NULL) {
+		if (dr->pause_input != NULL)
+			dr->pause_input(dr->cookie, 1);
+	} else if (dr->fd->handler_in != NULL) {
+		dr->handler_in = dr->fd->handler_in;
+		iv_fd_set_handler_in(dr->fd, NULL);
+	}
+}
+
+static int dgp_reader_parse(struct dgp_reader *dr);
+static void dgp_reader_queue(struct dgp_reader *dr, struct lsa *lsa);
+
+static void dgp_reader_unpark(struct dgp_reader *dr)
+{
+	while (!iv_list_empty(&dr->backlog) && dr->num_pending < MAX_PENDING) {
+		struct dgp_reader_lsa *drl;
+
+		drl = iv_container_of(dr->backlog.next,
+				      struct dgp_reader_lsa, list);
+
+		iv_list_del(&drl->list);
+		dr->backlog_bytes -= drl->req.lsa->bytes;
+
+		dgp_reader_queue(dr, drl->req.lsa);
+
+		lsa_put(drl->req.lsa);
+		free(drl);
+	}
+
+	if (iv_list_empty(&dr->backlog) && dr->num_pending < MAX_PENDING) {
+		dr->paused = 0;
+		if (dr->pause_input != NULL)
+			dr->pause_input(dr->cookie, 0);
+	}
+}
+
+static void dgp_reader_deliver(struct dgp_reader *dr)
 {
+	while (!iv_list_empty(&dr->pending)) {
+		struct dgp_reader_lsa *drl;
+
+		drl = iv_container_of(dr->pending.next,
+				      struct dgp_reader_lsa, list);
+		if (!drl->done)
+			break;
+
+		iv_list_del(&drl->list);
+		dr->num_pending--;
+
+		adj_rib_in_add_lsa(&dr->adj_rib_in, drl->req.lsa);
+
+		lsa_put(drl->req.lsa);
+		free(drl);
+	}
+
+	if (!dr->paused || dr->num_pending > RESUME_PENDING)
+		return;
+
+	/*
+	 * We haven't been reading from the socket while we were
+	 * paused, so don't let the peer time out on us.
+	 */
+	dgp_reader_rearm(dr);
+
+	if (dr->fd == NULL) {
+		dgp_reader_unpark(dr);
+		return;
+	}
+
+	dr->paused = 0;
+	if (dgp_reader_parse(dr) < 0) {
+		dr->io_error(dr->cookie);
+		return;
+	}
+
+	if (!dr->paused)
+		iv_fd_set_handler_in(dr->fd, dr->handler_in);
+}
+
+static void dgp_reader_verified(void *_drl, int ret)
+{
+	struct dgp_reader_lsa *drl = _drl;
+
+	drl->done = 1;
+	dgp_reader_deliver(drl->dr);
+}
+
+static void dgp_reader_queue(struct dgp_reader *dr, struct lsa *lsa)
+{
+	struct dgp_reader_lsa *drl;
 	int ret;
-	int off;
 
-	do {
-		ret = read(fd, dr->buf + dr->bytes,
-			   sizeof(dr->buf) - dr->bytes);
-	} while (ret < 0 && errno == EINTR);
+	drl = malloc(sizeof(*drl));
+	if (drl == NULL) {
+		fprintf(stderr, "dgp_reader_queue: memory allocation "
+				"failure\n");
+		return;
+	}
 
-	if (ret <= 0) {
-		if (ret < 0) {
-			if (errno == EAGAIN)
-				return 0;
-			perror("dgp_reader_read");
-		}
+	drl->dr = dr;
+	drl->req.lsa = lsa_get(lsa);
+	drl->req.cookie = drl;
+	drl->req.handler = dgp_reader_verified;
+
+	/*
+	 * Withdrawals don't carry a signature, and go straight to the
+	 * adj-RIB-in, as do LSAs whose fate is already known, if there
+	 * is nothing queued ahead of them.
+	 */
+	if (iv_avl_tree_empty(&lsa->root.attrs)) {
+		drl->req.task = NULL;
+		ret = 0;
+	} else {
+		ret = lsa_verify_submit(&drl->req);
+	}
+
+	if (ret <= 0 && iv_list_empty(&dr->pending)) {
+		adj_rib_in_add_lsa(&dr->adj_rib_in, lsa);
+		lsa_put(lsa);
+		free(drl);
+		return;
+	}
+
+	drl->done = (ret <= 0);
+	iv_list_add_tail(&drl->list, &dr->pending);
+	dr->num_pending++;
+}
+
+static int dgp_reader_input(struct dgp_reader *dr, struct lsa *lsa)
+{
+	struct dgp_reader_lsa *drl;
+
+	if (!dr->paused && dr->num_pending >= MAX_PENDING)
+		dgp_reader_pause(dr);
+
+	if (!dr->paused) {
+		dgp_reader_queue(dr, lsa);
+		return 0;
+	}
+
+	if (dr->backlog_bytes + lsa->bytes > MAX_BACKLOG_BYTES) {
+		fprintf(stderr, "dgp_reader_input: backlog overflow\n");
 		return -1;
 	}
 
-	dr->bytes += ret;
+	drl = malloc(sizeof(*drl));
+	if (drl == NULL) {
+		fprintf(stderr, "dgp_reader_input: memory allocation "
+				"failure\n");
+		return -1;
+	}
 
-	iv_timer_unregister(&dr->keepalive_timeout);
-	iv_validate_now();
-	dr->keepalive_timeout.expires = iv_now;
-	timespec_add_ms(&dr->keepalive_timeout.expires,
-			1000 * KEEPALIVE_TIMEOUT, 1000 * KEEPALIVE_TIMEOUT);
-	iv_timer_register(&dr->keepalive_timeout);
+	drl->dr = dr;
+	drl->req.lsa = lsa_get(lsa);
+	iv_list_add_tail(&drl->list, &dr->backlog);
+	dr->backlog_bytes += lsa->bytes;
+
+	return 0;
+}
+
+static int dgp_reader_parse(struct dgp_reader *dr)
+{
+	int off;
 
 	off = 0;
 	while (off < dr->bytes) {
 		int len;
 		struct lsa *lsa;
 
+		if (dr->fd != NULL && dr->num_pending >= MAX_PENDING) {
+			dgp_reader_pause(dr);
+			break;
+		}
+
 		len = lsa_deserialise(&lsa, dr->buf + off, dr->bytes - off);
 		if (len < 0)
 			return -1;
@@ -103,10 +293,16 @@ int dgp_reader_read(struct dgp_reader *dr, int fd)
 		}
 
 		if (lsa != NULL) {
+			int ret;
+
+			ret = 0;
 			if (dr->remoteid != NULL)
-				adj_rib_in_add_lsa(&dr->adj_rib_in, lsa);
+				ret = dgp_reader_input(dr, lsa);
 
 			lsa_put(lsa);
+
+			if (ret < 0)
+				return -1;
 		}
 
 		off += len;
@@ -118,8 +314,95 @@ int dgp_reader_read(struct dgp_reader *dr, int fd)
 	return 0;
 }
 
+int dgp_reader_read(struct dgp_reader *dr)
+{
+	int ret;
+
+	do {
+		ret = read(dr->fd->fd, dr->buf + dr->bytes,
+			   sizeof(dr->buf) - dr->bytes);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret <= 0) {
+		if (ret < 0) {
+			if (errno == EAGAIN)
+				return 0;
+			perror("dgp_reader_read");
+		}
+		return -1;
+	}
+
+	dr->bytes += ret;
+
+	dgp_reader_rearm(dr);
+
+	return dgp_reader_parse(dr);
+}
+
+/*
+ * Takes LSAs that were split off the byte stream elsewhere (see
+ * dgp_stream_feed()), which counts as having heard from the peer.
+ * The caller keeps its references.
+ */
+int dgp_reader_feed_lsas(struct dgp_reader *dr, struct lsa **lsas, int num)
+{
+	int i;
+
+	dgp_reader_rearm(dr);
+
+	if (dr->remoteid == NULL)
+		return 0;
+
+	for (i = 0; i < num; i++) {
+		if (dgp_reader_input(dr, lsas[i]) < 0)
+			return -1;
+	}
+
+	return 0;
+}
+
+int dgp_reader_feed(struct dgp_reader *dr, const uint8_t *buf, int len)
+{
+	if (len > sizeof(dr->buf) - dr->bytes) {
+		fprintf(stderr, "dgp_reader_feed: receive buffer overflow\n");
+		return -1;
+	}
+
+	memcpy(dr->buf + dr->bytes, buf, len);
+	dr->bytes += len;
+
+	dgp_reader_rearm(dr);
+
+	return dgp_reader_parse(dr);
+}
+
 void dgp_reader_unregister(struct dgp_reader *dr)
 {
+	while (!iv_list_empty(&dr->pending)) {
+		struct dgp_reader_lsa *drl;
+
+		drl = iv_container_of(dr->pending.next,
+				      struct dgp_reader_lsa, list);
+
+		iv_list_del(&drl->list);
+		lsa_verify_cancel(&drl->req);
+		lsa_put(drl->req.lsa);
+		free(drl);
+	}
+	dr->num_pending = 0;
+
+	while (!iv_list_empty(&dr->backlog)) {
+		struct dgp_reader_lsa *drl;
+
+		drl = iv_container_of(dr->backlog.next,
+				      struct dgp_reader_lsa, list);
+
+		iv_list_del(&drl->list);
+		lsa_put(drl->req.lsa);
+		free(drl);
+	}
+	dr->backlog_bytes = 0;
+
 	if (dr->remoteid != NULL) {
 		adj_rib_in_truncate(&dr->adj_rib_in);
 		rib_listener_to_loc_deinit(&dr->to_loc);
@@ -128,3 +411,56 @@ void dgp_reader_unregister(struct dgp_reader *dr)
 	if (iv_timer_registered(&dr->keepalive_timeout))
 		iv_timer_unregister(&dr->keepalive_timeout);
 }
+
+
+/*
+ * A dgp_stream only cuts a DGP byte stream up into LSAs, and touches
+ * no other state, so that this can be done on a different thread than
+ * the one that the dgp_reader that the LSAs are fed to runs on.  The
+ * lsa_received callback is handed the only reference to each LSA, and
+ * the stream doesn't touch the LSA after that, so that the callback
+ * can pass it on to another thread right away.
+ */
+void dgp_stream_init(struct dgp_stream *ds)
+{
+	ds->bytes = 0;
+}
+
+int dgp_stream_feed(struct dgp_stream *ds, const uint8_t *buf, int len)
+{
+	int off;
+
+	if (len > sizeof(ds->buf) - ds->bytes) {
+		fprintf(stderr, "dgp_stream_feed: receive buffer overflow\n");
+		return -1;
+	}
+
+	memcpy(ds->buf + ds->bytes, buf, len);
+	ds->bytes += len;
+
+	off = 0;
+	while (off < ds->bytes) {
+		int ret;
+		struct lsa *lsa;
+
+		ret = lsa_deserialise(&lsa, ds->buf + off, ds->bytes - off);
+		if (ret < 0)
+			return -1;
+
+		if (ret == 0) {
+			if (off == 0 && ds->bytes == sizeof(ds->buf))
+				return -1;
+			break;
+		}
+
+		if (lsa != NULL)
+			ds->lsa_received(ds->cookie, lsa);
+
+		off += ret;
+	}
+
+	ds->bytes -= off;
+	memmove(ds->buf, ds->buf + off, ds->bytes);
+
+	return 0;
+}
@@ -21,28 +21,50 @@
 #define __DGP_READER_H
 
 #include <iv.h>
+#include <iv_list.h>
 #include "adj_rib_in.h"
 #include "loc_rib.h"
 #include "rib_listener.h"
 #include "rib_listener_to_loc.h"
 
 struct dgp_reader {
+	struct iv_fd		*fd;
 	const uint8_t		*myid;
 	const uint8_t		*remoteid;
 	struct loc_rib		*rib;
 	void			*cookie;
 	void			(*io_error)(void *cookie);
+	void			(*pause_input)(void *cookie, int pause);
 
 	int				bytes;
 	uint8_t				buf[65536];
 	struct adj_rib_in		adj_rib_in;
 	struct rib_listener_to_loc	to_loc;
 	struct iv_timer			keepalive_timeout;
+	struct iv_list_head		pending;
+	int				num_pending;
+	int				paused;
+	void				(*handler_in)(void *cookie);
+	struct iv_list_head		backlog;
+	int				backlog_bytes;
 };
 
 void dgp_reader_register(struct dgp_reader *dr);
-int dgp_reader_read(struct dgp_reader *dr, int fd);
+int dgp_reader_read(struct dgp_reader *dr);
+int dgp_reader_feed(struct dgp_reader *dr, const uint8_t *buf, int len);
+int dgp_reader_feed_lsas(struct dgp_reader *dr, struct lsa **lsas, int num);
 void dgp_reader_unregister(struct dgp_reader *dr);
 
+struct dgp_stream {
+	void			*cookie;
+	void			(*lsa_received)(void *cookie, struct lsa *lsa);
+
+	int			bytes;
+	uint8_t			buf[65536];
+};
+
+void dgp_stream_init(struct dgp_stream *ds);
+int dgp_stream_feed(struct dgp_stream *ds, const uint8_t *buf, int len);
+
 
 #endif
@@ -0,0 +1,212 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv.h>
+#include <string.h>
+#include "dgp_record.h"
+
+/*
+ * Runs a DGP session inside the TLS connection to a directly connected
+ * peer, instead of over a separate TCP connection through the tunnel.
+ * The LSA byte stream is cut into records of at most DGP_RECORD_MAX_LEN
+ * bytes, which the owner sends in a transmit class that is never
+ * dropped, as losing part of the stream would desynchronise it.
+ *
+ * Sending a record can tear down the connection, and with it this
+ * dgp_record, so the writer's output is staged one record at a time
+ * and sent from an iv_task as the last thing that it does.  The writer
+ * is also held off while more than DGP_RECORD_MAX_BACKLOG bytes are
+ * queued up on the connection, and resumed from ->tx_ready, so that
+ * the DGP writer queue keeps absorbing (and coalescing) LSA updates
+ * instead of the connection's transmit queue.
+ *
+ * Errors are reported to the owner from an iv_task as well, as the
+ * reader and writer can run into them while they are still busy.
+ *
+ * When the reader has too many LSAs waiting for verification, it has
+ * the owner stop receiving from the connection through ->rx_pause,
+ * so that the peer is pushed back on by TCP flow control.
+ */
+#define DGP_RECORD_MAX_BACKLOG	65536
+
+static void dgp_record_error(void *_drec)
+{
+	struct dgp_record *drec = _drec;
+
+	if (!drec->failed) {
+		drec->failed = 1;
+		iv_task_register(&drec->error_task);
+	}
+}
+
+static void dgp_record_error_task(void *_drec)
+{
+	struct dgp_record *drec = _drec;
+
+	drec->session_error(drec->cookie);
+}
+
+static void dgp_record_pause_input(void *_drec, int pause)
+{
+	struct dgp_record *drec = _drec;
+
+	if (drec->rx_pause != NULL)
+		drec->rx_pause(drec->cookie, pause);
+}
+
+static ssize_t
+dgp_record_writev(void *_drec, const struct iovec *iov, int iovcnt)
+{
+	struct dgp_record *drec = _drec;
+	int backlog;
+	int i;
+
+	if (drec->failed || drec->tx_len) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	backlog = drec->tx_backlog(drec->cookie);
+	if (backlog < 0 || backlog >= DGP_RECORD_MAX_BACKLOG) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	for (i = 0; i < iovcnt && drec->tx_len < DGP_RECORD_MAX_LEN; i++) {
+		size_t len;
+
+		len = iov[i].iov_len;
+		if (len > DGP_RECORD_MAX_LEN - drec->tx_len)
+			len = DGP_RECORD_MAX_LEN - drec->tx_len;
+
+		memcpy(drec->tx_buf + drec->tx_len, iov[i].iov_base, len);
+		drec->tx_len += len;
+	}
+
+	if (drec->tx_len && !iv_task_registered(&drec->send_task))
+		iv_task_register(&drec->send_task);
+
+	return drec->tx_len;
+}
+
+static void dgp_record_send(void *_drec)
+{
+	struct dgp_record *drec = _drec;
+	uint8_t buf[DGP_RECORD_MAX_LEN];
+	int len;
+
+	if (drec->failed)
+		return;
+
+	len = drec->tx_len;
+	memcpy(buf, drec->tx_buf, len);
+
+	/*
+	 * Let the writer stage the next record before this one goes
+	 * out, as we can't touch the writer anymore after that.
+	 */
+	drec->tx_len = 0;
+	if (drec->dw.blocked)
+		dgp_writer_pollout(&drec->dw);
+
+	drec->record_send(drec->cookie, buf, len);
+}
+
+void dgp_record_start(struct dgp_record *drec)
+{
+	drec->failed = 0;
+
+	IV_TASK_INIT(&drec->send_task);
+	drec->send_task.cookie = drec;
+	drec->send_task.handler = dgp_record_send;
+
+	IV_TASK_INIT(&drec->error_task);
+	drec->error_task.cookie = drec;
+	drec->error_task.handler = dgp_record_error_task;
+
+	drec->tx_len = 0;
+
+	drec->dr.fd = NULL;
+	drec->dr.myid = drec->myid;
+	drec->dr.remoteid = drec->remoteid;
+	drec->dr.rib = drec->loc_rib;
+	drec->dr.cookie = drec;
+	drec->dr.io_error = dgp_record_error;
+	drec->dr.pause_input = dgp_record_pause_input;
+	dgp_reader_register(&drec->dr);
+
+	drec->dw.fd = NULL;
+	drec->dw.myid = drec->myid;
+	drec->dw.remoteid = drec->remoteid;
+	drec->dw.rib = drec->loc_rib;
+	drec->dw.cookie = drec;
+	drec->dw.io_error = dgp_record_error;
+	drec->dw.handler_out = NULL;
+	drec->dw.writev = dgp_record_writev;
+	dgp_writer_register(&drec->dw);
+}
+
+void dgp_record_received(struct dgp_record *drec, const uint8_t *buf, int len)
+{
+	if (drec->failed)
+		return;
+
+	if (dgp_reader_feed(&drec->dr, buf, len) < 0)
+		dgp_record_error(drec);
+}
+
+/*
+ * For owners that split the received DGP stream into LSAs themselves,
+ * on the thread that receives the connection's records.
+ */
+void dgp_record_lsas_received(struct dgp_record *drec,
+			      struct lsa **lsas, int num)
+{
+	if (drec->failed)
+		return;
+
+	if (dgp_reader_feed_lsas(&drec->dr, lsas, num) < 0)
+		dgp_record_error(drec);
+}
+
+void dgp_record_stream_error(struct dgp_record *drec)
+{
+	dgp_record_error(drec);
+}
+
+void dgp_record_tx_ready(struct dgp_record *drec)
+{
+	if (!drec->failed && !drec->tx_len && drec->dw.blocked)
+		dgp_writer_pollout(&drec->dw);
+}
+
+void dgp_record_stop(struct dgp_record *drec)
+{
+	dgp_writer_unregister(&drec->dw);
+	dgp_reader_unregister(&drec->dr);
+
+	if (iv_task_registered(&drec->send_task))
+		iv_task_unregister(&drec->send_task);
+
+	if (iv_task_registered(&drec->error_task))
+		iv_task_unregister(&drec->error_task);
+}
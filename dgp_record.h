@@ -0,0 +1,63 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __DGP_RECORD_H
+#define __DGP_RECORD_H
+
+#include <iv.h>
+#include "loc_rib.h"
+#include "dgp_reader.h"
+#include "dgp_writer.h"
+
+/*
+ * Leaves room for the record type byte that the owner puts in
+ * front of each record.
+ */
+#define DGP_RECORD_MAX_LEN	16383
+
+struct dgp_record {
+	const uint8_t		*myid;
+	const uint8_t		*remoteid;
+	struct loc_rib		*loc_rib;
+	void			*cookie;
+	void			(*record_send)(void *cookie,
+					       const uint8_t *buf, int len);
+	int			(*tx_backlog)(void *cookie);
+	void			(*rx_pause)(void *cookie, int pause);
+	void			(*session_error)(void *cookie);
+
+	int			failed;
+	struct iv_task		send_task;
+	struct iv_task		error_task;
+	int			tx_len;
+	uint8_t			tx_buf[DGP_RECORD_MAX_LEN];
+	struct dgp_reader	dr;
+	struct dgp_writer	dw;
+};
+
+void dgp_record_start(struct dgp_record *drec);
+void dgp_record_received(struct dgp_record *drec, const uint8_t *buf, int len);
+void dgp_record_lsas_received(struct dgp_record *drec,
+			      struct lsa **lsas, int num);
+void dgp_record_stream_error(struct dgp_record *drec);
+void dgp_record_tx_ready(struct dgp_record *drec);
+void dgp_record_stop(struct dgp_record *drec);
+
+
+#endif
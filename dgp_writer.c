@@ -19,78 +19,353 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <iv_list.h>
 #include <netinet/tcp.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "dgp_writer.h"
 #include "lsa_path.h"
 #include "lsa_serialise.h"
-#include "lsa_type.h"
 #include "util.h"
 
 #define KEEPALIVE_INTERVAL	10
 
-static struct lsa *map(struct dgp_writer *dw, struct lsa *lsa)
+/*
+ * Output to DGP peers is queued, and written out from a POLLOUT
+ * handler whenever the socket can't take it right away.  Queued LSAs
+ * that haven't been started on yet are indexed by origin ID, so that
+ * a newer version of an LSA (or a withdrawal) replaces the queued one
+ * in place, and the queue never holds more than one not yet started
+ * entry per origin.  A peer that lets more than DGP_WRITER_MAX_BYTES
+ * pile up is disconnected.  The initial RIB dump doesn't count towards
+ * that limit, as its size depends on the size of the network and not
+ * on how well the peer keeps up, but whatever is queued on top of the
+ * dump while it is still draining does.
+ *
+ * A writer without a socket of its own hands its output to ->writev
+ * instead, which returns -1 with errno set to EAGAIN when it can't
+ * take more, after which the owner calls dgp_writer_pollout() once
+ * it can.
+ */
+#define DGP_WRITER_MAX_BYTES	(4 * 1048576)
+#define DGP_WRITER_MAX_IOV	64
+
+struct dgp_writer_buf {
+	struct iv_list_head	list;
+	struct iv_avl_node	an;
+	int			indexed;
+	int			dump;
+	uint8_t			id[NODE_ID_LEN];
+	struct lsa_wire		*wire;
+	size_t			off;
+};
+
+static struct iv_list_head writers = IV_LIST_HEAD_INIT(writers);
+static uint64_t total_coalesced;
+static uint64_t total_overflows;
+
+static uint8_t keepalive;
+
+static uint8_t *buf_data(struct dgp_writer_buf *b)
+{
+	return (b->wire != NULL) ? b->wire->buf : &keepalive;
+}
+
+static size_t buf_len(struct dgp_writer_buf *b)
+{
+	return (b->wire != NULL) ? b->wire->len : 1;
+}
+
+static int compare_bufs(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct dgp_writer_buf *a;
+	struct dgp_writer_buf *b;
+
+	a = iv_container_of(_a, struct dgp_writer_buf, an);
+	b = iv_container_of(_b, struct dgp_writer_buf, an);
+
+	return memcmp(a->id, b->id, NODE_ID_LEN);
+}
+
+static struct dgp_writer_buf *
+dgp_writer_find_buf(struct dgp_writer *dw, const uint8_t *id)
+{
+	struct iv_avl_node *an;
+
+	an = dw->queued.root;
+	while (an != NULL) {
+		struct dgp_writer_buf *b;
+		int ret;
+
+		b = iv_container_of(an, struct dgp_writer_buf, an);
+
+		ret = memcmp(id, b->id, NODE_ID_LEN);
+		if (ret == 0)
+			return b;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static void dgp_writer_free_buf(struct dgp_writer *dw, struct dgp_writer_buf *b)
+{
+	iv_list_del(&b->list);
+	if (b->indexed)
+		iv_avl_tree_delete(&dw->queued, &b->an);
+
+	dw->queue_len--;
+	dw->queue_bytes -= buf_len(b) - b->off;
+	if (b->dump)
+		dw->dump_bytes -= buf_len(b) - b->off;
+
+	lsa_wire_put(b->wire);
+	free(b);
+}
+
+static void dgp_writer_rearm(struct dgp_writer *dw)
 {
-	struct lsa_attr *attr;
+	iv_timer_unregister(&dw->keepalive_timer);
+	iv_validate_now();
+	dw->keepalive_timer.expires = iv_now;
+	timespec_add_ms(&dw->keepalive_timer.expires,
+			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
+	iv_timer_register(&dw->keepalive_timer);
+}
+
+/*
+ * Takes over the caller's reference to @wire, which is NULL for a
+ * keepalive.  Returns nonzero if the session was torn down.
+ */
+static int dgp_writer_queue(struct dgp_writer *dw, const uint8_t *id,
+			    struct lsa_wire *wire)
+{
+	struct dgp_writer_buf *b;
+
+	b = (id != NULL) ? dgp_writer_find_buf(dw, id) : NULL;
+	if (b != NULL) {
+		dw->queue_bytes -= buf_len(b);
+		if (b->dump)
+			dw->dump_bytes -= buf_len(b);
+		lsa_wire_put(b->wire);
+
+		b->wire = wire;
+		b->dump = dw->dumping;
+		dw->queue_bytes += buf_len(b);
+		if (b->dump)
+			dw->dump_bytes += buf_len(b);
+
+		dw->num_coalesced++;
+		total_coalesced++;
+	} else {
+		b = malloc(sizeof(*b));
+		if (b == NULL) {
+			fprintf(stderr, "dgp_writer_queue: memory "
+					"allocation failure\n");
+			lsa_wire_put(wire);
+			dw->io_error(dw->cookie);
+			return 1;
+		}
+
+		b->indexed = (id != NULL);
+		if (id != NULL) {
+			memcpy(b->id, id, NODE_ID_LEN);
+			iv_avl_tree_insert(&dw->queued, &b->an);
+		}
+		b->dump = dw->dumping;
+		b->wire = wire;
+		b->off = 0;
+
+		iv_list_add_tail(&b->list, &dw->queue);
+		dw->queue_len++;
+		dw->queue_bytes += buf_len(b);
+		if (b->dump)
+			dw->dump_bytes += buf_len(b);
+	}
+
+	if (dw->queue_bytes - dw->dump_bytes > DGP_WRITER_MAX_BYTES) {
+		fprintf(stderr, "dgp_writer_queue: output queue to peer ");
+		if (dw->remoteid != NULL)
+			print_fingerprint(stderr, dw->remoteid);
+		else
+			fprintf(stderr, "(readonly)");
+		fprintf(stderr, " overflowed, disconnecting\n");
+
+		total_overflows++;
+		dw->io_error(dw->cookie);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int dgp_writer_flush(struct dgp_writer *dw)
+{
+	while (!iv_list_empty(&dw->queue)) {
+		struct iovec iov[DGP_WRITER_MAX_IOV];
+		struct iv_list_head *lh;
+		int n;
+		ssize_t ret;
+
+		n = 0;
+		iv_list_for_each (lh, &dw->queue) {
+			struct dgp_writer_buf *b;
+
+			if (n == DGP_WRITER_MAX_IOV)
+				break;
+
+			b = iv_container_of(lh, struct dgp_writer_buf, list);
+			iov[n].iov_base = buf_data(b) + b->off;
+			iov[n].iov_len = buf_len(b) - b->off;
+			n++;
+		}
+
+		do {
+			if (dw->writev != NULL)
+				ret = dw->writev(dw->cookie, iov, n);
+			else
+				ret = writev(dw->fd->fd, iov, n);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			if (errno == EAGAIN) {
+				if (!dw->blocked) {
+					dw->blocked = 1;
+					if (dw->fd != NULL) {
+						iv_fd_set_handler_out(dw->fd,
+							dw->handler_out);
+					}
+				}
+				return 0;
+			}
+
+			perror("dgp_writer_flush: writev");
+			dw->io_error(dw->cookie);
+			return 1;
+		}
+
+		while (ret > 0) {
+			struct dgp_writer_buf *b;
+			size_t left;
+
+			b = iv_container_of(dw->queue.next,
+					    struct dgp_writer_buf, list);
+
+			left = buf_len(b) - b->off;
+			if (ret >= left) {
+				ret -= left;
+				dgp_writer_free_buf(dw, b);
+				continue;
+			}
+
+			/*
+			 * A partially sent LSA can't be replaced anymore,
+			 * so newer versions have to queue up behind it.
+			 */
+			if (b->indexed) {
+				iv_avl_tree_delete(&dw->queued, &b->an);
+				b->indexed = 0;
+			}
+
+			b->off += ret;
+			dw->queue_bytes -= ret;
+			if (b->dump)
+				dw->dump_bytes -= ret;
+			ret = 0;
+		}
+	}
+
+	if (dw->blocked) {
+		dw->blocked = 0;
+		if (dw->fd != NULL)
+			iv_fd_set_handler_out(dw->fd, NULL);
+	}
+
+	return 0;
+}
 
+static int dgp_writer_kick(struct dgp_writer *dw)
+{
+	if (dw->blocked)
+		return 0;
+
+	return dgp_writer_flush(dw);
+}
+
+static struct lsa *map(struct dgp_writer *dw, struct lsa *lsa)
+{
 	if (lsa == NULL)
 		return NULL;
 
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
-	if (attr == NULL)
+	if (lsa_decode(lsa)->adv_path_len < 0)
 		return NULL;
 
-	if (dw->remoteid != NULL && lsa_path_contains(attr, dw->remoteid))
+	if (dw->remoteid != NULL && lsa_path_contains(lsa, dw->remoteid))
 		return NULL;
 
 	return lsa;
 }
 
+/*
+ * Returns -1 if the peer isn't to be told about this change (and
+ * nothing was queued), and like dgp_writer_queue() otherwise.
+ */
 static int
-dgp_writer_output_lsa(struct dgp_writer *dw, struct lsa *old, struct lsa *new)
+dgp_writer_queue_lsa(struct dgp_writer *dw, struct lsa *old, struct lsa *new)
 {
-	size_t serlen;
-	size_t buflen;
-	uint8_t *buf;
-	size_t len;
+	struct lsa_wire *wire;
 	struct lsa dummy;
 	struct lsa *lsa;
 
 	lsa = map(dw, new);
-	if (lsa == NULL) {
-		if (map(dw, old) == NULL)
-			return 0;
+	if (lsa != NULL) {
+		wire = lsa_wire_get(lsa_serialise_wire(lsa, dw->myid));
+	} else {
+		size_t serlen;
+		size_t buflen;
+
+		lsa = map(dw, old);
+		if (lsa == NULL)
+			return -1;
 
 		memcpy(&dummy.id, old->id, NODE_ID_LEN);
 		INIT_IV_AVL_TREE(&dummy.root.attrs, NULL);
 
-		lsa = &dummy;
-	}
-
-	serlen = lsa_serialise_length(lsa, 0, dw->myid);
-	if (serlen > 65536 - 128)
-		abort();
+		serlen = lsa_serialise_length(&dummy, 0, dw->myid);
+		buflen = serlen + MAX_SERIALISED_INT_LEN;
 
-	buflen = serlen + 128;
-	buf = alloca(buflen);
-
-	len = lsa_serialise(buf, buflen, serlen, lsa, 0, dw->myid);
-	if (len > buflen)
-		abort();
+		wire = malloc(sizeof(*wire) + buflen);
+		if (wire != NULL) {
+			wire->refcount = 1;
+			wire->have_preid = 0;
+			wire->len = lsa_serialise(wire->buf, buflen, serlen,
+						  &dummy, 0, dw->myid);
+		}
+	}
 
-	if (write(dw->fd, buf, len) != len) {
+	if (wire == NULL) {
+		fprintf(stderr, "dgp_writer_queue_lsa: memory "
+				"allocation failure\n");
 		dw->io_error(dw->cookie);
 		return 1;
 	}
 
-	iv_timer_unregister(&dw->keepalive_timer);
-	iv_validate_now();
-	dw->keepalive_timer.expires = iv_now;
-	timespec_add_ms(&dw->keepalive_timer.expires,
-			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
-	iv_timer_register(&dw->keepalive_timer);
+	return dgp_writer_queue(dw, lsa->id, wire);
+}
 
-	return 0;
+static void dgp_writer_output_lsa(struct dgp_writer *dw,
+				  struct lsa *old, struct lsa *new)
+{
+	if (dgp_writer_queue_lsa(dw, old, new))
+		return;
+
+	dgp_writer_rearm(dw);
+	dgp_writer_kick(dw);
 }
 
 static void dgp_writer_lsa_add(void *_dw, struct lsa *lsa, uint32_t cost)
@@ -123,26 +398,14 @@ static void cork_fd(int fd, int state)
 	}
 }
 
-static int dgp_writer_send_keepalive(struct dgp_writer *dw)
-{
-	if (write(dw->fd, "", 1) != 1) {
-		dw->io_error(dw->cookie);
-		return 1;
-	}
-
-	return 0;
-}
-
 static void dgp_writer_rib_dump(struct dgp_writer *dw)
 {
 	struct iv_avl_node *an;
 
-	if (iv_avl_tree_empty(&dw->rib->ids)) {
-		dgp_writer_send_keepalive(dw);
-		return;
-	}
+	if (dw->fd != NULL)
+		cork_fd(dw->fd->fd, 1);
 
-	cork_fd(dw->fd, 1);
+	dw->dumping = 1;
 
 	iv_avl_tree_for_each (an, &dw->rib->ids) {
 		struct loc_rib_id *rid;
@@ -151,14 +414,29 @@ static void dgp_writer_rib_dump(struct dgp_writer *dw)
 		if (rid->best == NULL)
 			continue;
 
-		if (dgp_writer_output_lsa(dw, NULL, rid->best))
+		if (dgp_writer_queue_lsa(dw, NULL, rid->best) > 0)
 			return;
+
+		/*
+		 * Start pushing the dump out as we go, rather than
+		 * building up the entire RIB in the queue first.
+		 */
+		if (dw->queue_len >= DGP_WRITER_MAX_IOV &&
+		    dgp_writer_kick(dw)) {
+			return;
+		}
 	}
 
-	if (dgp_writer_send_keepalive(dw))
+	if (dgp_writer_queue(dw, NULL, NULL))
 		return;
 
-	cork_fd(dw->fd, 0);
+	dw->dumping = 0;
+
+	if (dgp_writer_kick(dw))
+		return;
+
+	if (dw->fd != NULL)
+		cork_fd(dw->fd->fd, 0);
 }
 
 static void dgp_writer_keepalive_timer(void *_dw)
@@ -171,11 +449,31 @@ static void dgp_writer_keepalive_timer(void *_dw)
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&dw->keepalive_timer);
 
-	dgp_writer_send_keepalive(dw);
+	/*
+	 * If there is still output queued, the peer will hear from
+	 * us as soon as its socket drains.
+	 */
+	if (!iv_list_empty(&dw->queue))
+		return;
+
+	if (dgp_writer_queue(dw, NULL, NULL))
+		return;
+
+	dgp_writer_kick(dw);
 }
 
 void dgp_writer_register(struct dgp_writer *dw)
 {
+	INIT_IV_AVL_TREE(&dw->queued, compare_bufs);
+	INIT_IV_LIST_HEAD(&dw->queue);
+	dw->blocked = 0;
+	dw->queue_len = 0;
+	dw->queue_bytes = 0;
+	dw->dumping = 0;
+	dw->dump_bytes = 0;
+	dw->num_coalesced = 0;
+	iv_list_add_tail(&dw->list, &writers);
+
 	dw->from_loc.cookie = dw;
 	dw->from_loc.lsa_add = dgp_writer_lsa_add;
 	dw->from_loc.lsa_mod = dgp_writer_lsa_mod;
@@ -194,8 +492,49 @@ void dgp_writer_register(struct dgp_writer *dw)
 	dgp_writer_rib_dump(dw);
 }
 
+void dgp_writer_pollout(struct dgp_writer *dw)
+{
+	dgp_writer_flush(dw);
+}
+
 void dgp_writer_unregister(struct dgp_writer *dw)
 {
 	loc_rib_listener_unregister(dw->rib, &dw->from_loc);
 	iv_timer_unregister(&dw->keepalive_timer);
+
+	while (!iv_list_empty(&dw->queue)) {
+		struct dgp_writer_buf *b;
+
+		b = iv_container_of(dw->queue.next,
+				    struct dgp_writer_buf, list);
+		dgp_writer_free_buf(dw, b);
+	}
+
+	iv_list_del(&dw->list);
+}
+
+void dgp_writer_print_stats(FILE *fp)
+{
+	struct iv_list_head *lh;
+
+	fprintf(fp, "dgp writers: %llu LSAs coalesced, "
+		    "%llu output queue overflows\n",
+		(unsigned long long)total_coalesced,
+		(unsigned long long)total_overflows);
+
+	iv_list_for_each (lh, &writers) {
+		struct dgp_writer *dw;
+
+		dw = iv_container_of(lh, struct dgp_writer, list);
+
+		fprintf(fp, "  ");
+		if (dw->remoteid != NULL)
+			print_fingerprint(fp, dw->remoteid);
+		else
+			fprintf(fp, "(readonly)");
+		fprintf(fp, ": %d queued (%d bytes), %llu coalesced%s\n",
+			dw->queue_len, dw->queue_bytes,
+			(unsigned long long)dw->num_coalesced,
+			dw->blocked ? ", blocked" : "");
+	}
 }
@@ -20,24 +20,42 @@
 #ifndef __DGP_WRITER_H
 #define __DGP_WRITER_H
 
+#include <stdio.h>
 #include <iv.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <sys/uio.h>
 #include "loc_rib.h"
 #include "rib_listener.h"
 
 struct dgp_writer {
-	int			fd;
+	struct iv_fd		*fd;
 	const uint8_t		*myid;
 	const uint8_t		*remoteid;
 	struct loc_rib		*rib;
 	void			*cookie;
 	void			(*io_error)(void *cookie);
+	void			(*handler_out)(void *cookie);
+	ssize_t			(*writev)(void *cookie,
+					  const struct iovec *iov, int iovcnt);
 
+	struct iv_list_head	list;
 	struct rib_listener	from_loc;
 	struct iv_timer		keepalive_timer;
+	struct iv_avl_tree	queued;
+	struct iv_list_head	queue;
+	int			blocked;
+	int			queue_len;
+	int			queue_bytes;
+	int			dumping;
+	int			dump_bytes;
+	uint64_t		num_coalesced;
 };
 
 void dgp_writer_register(struct dgp_writer *dw);
+void dgp_writer_pollout(struct dgp_writer *dw);
 void dgp_writer_unregister(struct dgp_writer *dw);
+void dgp_writer_print_stats(FILE *fp);
 
 
 #endif
@@ -19,36 +19,58 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <errno.h>
 #include <gnutls/abstract.h>
 #include <gnutls/x509.h>
 #include <iv.h>
 #include <iv_signal.h>
 #include <net/if.h>
+#include <netinet/in.h>
+#include <stddef.h>
 #include <string.h>
+#include <sys/uio.h>
 #include "conf.h"
 #include "confdiff.h"
+#include "dgp_record.h"
+#include "dgp_writer.h"
+#include "fib.h"
+#include "gso.h"
 #include "itf.h"
 #include "loc_rib_print.h"
 #include "lsa.h"
 #include "lsa_path.h"
+#include "lsa_peer.h"
 #include "lsa_serialise.h"
 #include "lsa_type.h"
+#include "lsa_verify.h"
 #include "rt_builder.h"
+#include "rt_sync.h"
+#include "rtnl.h"
 #include "tconn_connect.h"
 #include "tconn_listen.h"
 #include "tun.h"
+#include "udpchan.h"
 #include "util.h"
+#include "worker.h"
 #include "x509.h"
 
+static const char *config = "/etc/dvpn.ini";
+static struct conf *conf;
 static gnutls_x509_privkey_t privkey;
 static gnutls_x509_privkey_t rolekey;
 static uint8_t keyid[NODE_ID_LEN];
+static uint8_t myaddr[16];
 static int numcrts;
 static gnutls_x509_crt_t crt[2];
 static struct loc_rib loc_rib;
 static struct rt_builder rb;
+static struct rt_sync rs;
 static struct iv_avl_tree direct_peers;
 static struct dgp_listen_socket dls;
+static struct fib fib;
+static int shared_tun_registered;
+static struct tun_interface shared_tun;
+static struct dgp_listen_socket shared_dls;
 static struct lsa *me;
 
 static struct direct_peer *dp_find(uint8_t *addr)
@@ -75,49 +97,48 @@ static struct direct_peer *dp_find(uint8_t *addr)
 	return NULL;
 }
 
-static char *peer_itfname(uint8_t *addr)
+static int peer_ifindex(uint8_t *addr)
 {
 	struct direct_peer *dp;
 
 	dp = dp_find(addr);
 	if (dp != NULL)
-		return dp->itfname;
+		return dp->ifindex;
 
-	return NULL;
+	return 0;
 }
 
 static void rt_add(void *_dummy, uint8_t *dest, uint8_t *nh)
 {
+	fib_route_set(&fib, dest, (nh != NULL) ? nh : dest);
+	if (shared_tun_registered)
+		return;
+
 	if (nh != NULL)
-		itf_add_route_v6_direct(dest, peer_itfname(nh));
+		rt_sync_set(&rs, dest, peer_ifindex(nh));
 	else
-		itf_add_route_v6_direct(dest, peer_itfname(dest));
+		rt_sync_set(&rs, dest, peer_ifindex(dest));
 }
 
 static void rt_mod(void *_dummy, uint8_t *dest, uint8_t *oldnh, uint8_t *newnh)
 {
-	const char *itfname;
+	fib_route_set(&fib, dest, (newnh != NULL) ? newnh : dest);
+	if (shared_tun_registered)
+		return;
 
 	if (newnh != NULL)
-		itfname = peer_itfname(newnh);
+		rt_sync_set(&rs, dest, peer_ifindex(newnh));
 	else
-		itfname = peer_itfname(dest);
-
-	if (itf_chg_route_v6_direct(dest, itfname) < 0)
-		itf_add_route_v6_direct(dest, itfname);
+		rt_sync_set(&rs, dest, peer_ifindex(dest));
 }
 
 static void rt_del(void *_dummy, uint8_t *dest, uint8_t *nh)
 {
-	const char *itfname;
-
-	if (nh != NULL)
-		itfname = peer_itfname(nh);
-	else
-		itfname = peer_itfname(dest);
+	fib_route_set(&fib, dest, NULL);
+	if (shared_tun_registered)
+		return;
 
-	if (itfname != NULL)
-		itf_del_route_v6_direct(dest, itfname);
+	rt_sync_set(&rs, dest, 0);
 }
 
 static int compare_direct_peers(struct iv_avl_node *_a, struct iv_avl_node *_b)
@@ -253,28 +274,139 @@ static void lsa_sign(struct lsa *lsa)
 		     sig.data, sig.size);
 
 	gnutls_free(sig.data);
+
+	lsa_decode(lsa);
 }
 
-static void
-mylsa_add_peer(const uint8_t *id, enum conf_peer_type type, int cost)
+/*
+ * Peer up/down events are not reflected in our own LSA right away.
+ * Instead, the most recent state of each affected peer is recorded,
+ * and all recorded changes are applied with a single clone, version
+ * bump and signature, at most once per LsaHoldDown milliseconds.
+ * The first change after a quiet period goes out without delay, from
+ * an iv_task, so that events from one event loop iteration are still
+ * batched.  Changes that cancel out don't cause a new LSA at all.
+ */
+struct mylsa_change {
+	struct iv_avl_node	an;
+	uint8_t			id[NODE_ID_LEN];
+	int			up;
+	int			metric;
+	uint32_t		flags;
+};
+
+static struct iv_avl_tree mylsa_changes;
+static struct iv_task mylsa_publish;
+static struct iv_timer mylsa_hold_down;
+
+static int compare_mylsa_changes(struct iv_avl_node *_a, struct iv_avl_node *_b)
 {
-	struct lsa *newme;
+	struct mylsa_change *a;
+	struct mylsa_change *b;
+
+	a = iv_container_of(_a, struct mylsa_change, an);
+	b = iv_container_of(_b, struct mylsa_change, an);
+
+	return memcmp(a->id, b->id, NODE_ID_LEN);
+}
+
+static struct mylsa_change *mylsa_find_change(const uint8_t *id)
+{
+	struct iv_avl_node *an;
+
+	an = mylsa_changes.root;
+	while (an != NULL) {
+		struct mylsa_change *mc;
+		int ret;
+
+		mc = iv_container_of(an, struct mylsa_change, an);
+
+		ret = memcmp(id, mc->id, NODE_ID_LEN);
+		if (ret == 0)
+			return mc;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static int mylsa_apply_change(struct lsa *newme, struct mylsa_change *mc)
+{
+	struct lsa_peer_info lpi;
+	int present;
 	struct lsa_attr_set *set;
 	uint16_t metric;
 	uint8_t peer_flags;
 
-	newme = lsa_clone(me);
+	present = !lsa_get_peer_info(&lpi, me, mc->id);
+
+	if (!mc->up) {
+		if (!present)
+			return 0;
+
+		lsa_del_attr_bykey(newme, LSA_ATTR_TYPE_PEER,
+				   mc->id, NODE_ID_LEN);
+
+		return 1;
+	}
+
+	if (present && lpi.metric == mc->metric && lpi.flags == mc->flags)
+		return 0;
 
-	set = lsa_add_attr_set(newme, LSA_ATTR_TYPE_PEER, 1, id, NODE_ID_LEN);
+	if (present) {
+		lsa_del_attr_bykey(newme, LSA_ATTR_TYPE_PEER,
+				   mc->id, NODE_ID_LEN);
+	}
+
+	set = lsa_add_attr_set(newme, LSA_ATTR_TYPE_PEER, 1,
+			       mc->id, NODE_ID_LEN);
 
-	metric = htons(cost);
+	metric = htons(mc->metric);
 	lsa_attr_set_add_attr(newme, set, LSA_PEER_ATTR_TYPE_METRIC, 1,
 			      NULL, 0, &metric, sizeof(metric));
 
-	peer_flags = conf_peer_type_to_lsa_peer_flags(type);
+	peer_flags = mc->flags;
 	lsa_attr_set_add_attr(newme, set, LSA_PEER_ATTR_TYPE_PEER_FLAGS, 1,
 			      NULL, 0, &peer_flags, sizeof(peer_flags));
 
+	return 1;
+}
+
+static void mylsa_flush(void *_dummy)
+{
+	struct lsa *newme;
+	int changed;
+
+	newme = lsa_clone(me);
+
+	changed = 0;
+	while (mylsa_changes.root != NULL) {
+		struct mylsa_change *mc;
+
+		mc = iv_container_of(mylsa_changes.root,
+				     struct mylsa_change, an);
+
+		if (newme != NULL)
+			changed |= mylsa_apply_change(newme, mc);
+
+		iv_avl_tree_delete(&mylsa_changes, &mc->an);
+		free(mc);
+	}
+
+	if (newme == NULL) {
+		fprintf(stderr, "mylsa_flush: error cloning LSA\n");
+		return;
+	}
+
+	if (!changed) {
+		lsa_put(newme);
+		return;
+	}
+
 	lsa_update_version(newme);
 
 	lsa_sign(newme);
@@ -283,96 +415,1485 @@ mylsa_add_peer(const uint8_t *id, enum conf_peer_type type, int cost)
 
 	lsa_put(me);
 	me = newme;
+
+	iv_validate_now();
+	mylsa_hold_down.expires = iv_now;
+	timespec_add_ms(&mylsa_hold_down.expires,
+			conf->lsa_hold_down, conf->lsa_hold_down);
+	iv_timer_register(&mylsa_hold_down);
 }
 
-static void mylsa_del_peer(const uint8_t *id)
+static void mylsa_queue_change(const uint8_t *id, int up, int metric,
+			       uint32_t flags)
 {
-	struct lsa *newme;
+	struct mylsa_change *mc;
+
+	mc = mylsa_find_change(id);
+	if (mc == NULL) {
+		mc = malloc(sizeof(*mc));
+		if (mc == NULL) {
+			fprintf(stderr, "mylsa_queue_change: memory "
+					"allocation failure\n");
+			return;
+		}
 
-	newme = lsa_clone(me);
+		memcpy(mc->id, id, NODE_ID_LEN);
+		iv_avl_tree_insert(&mylsa_changes, &mc->an);
+	}
 
-	lsa_del_attr_bykey(newme, LSA_ATTR_TYPE_PEER, id, NODE_ID_LEN);
+	mc->up = up;
+	mc->metric = metric;
+	mc->flags = flags;
 
-	lsa_update_version(newme);
+	if (!iv_task_registered(&mylsa_publish) &&
+	    !iv_timer_registered(&mylsa_hold_down)) {
+		iv_task_register(&mylsa_publish);
+	}
+}
 
-	lsa_sign(newme);
+static void mylsa_init(void)
+{
+	INIT_IV_AVL_TREE(&mylsa_changes, compare_mylsa_changes);
 
-	loc_rib_mod_lsa(&loc_rib, me, newme);
+	IV_TASK_INIT(&mylsa_publish);
+	mylsa_publish.handler = mylsa_flush;
 
-	lsa_put(me);
-	me = newme;
+	IV_TIMER_INIT(&mylsa_hold_down);
+	mylsa_hold_down.handler = mylsa_flush;
 }
 
-struct connect_entry_conn {
-	struct iv_list_head		list;
+static void mylsa_deinit(void)
+{
+	if (iv_task_registered(&mylsa_publish))
+		iv_task_unregister(&mylsa_publish);
 
-	struct conf_connect_entry	*cce;
-	void				*conn;
-	uint8_t				peerid[NODE_ID_LEN];
+	if (iv_timer_registered(&mylsa_hold_down))
+		iv_timer_unregister(&mylsa_hold_down);
 
-	struct tun_interface		tun;
-	struct direct_peer		dp;
-	struct dgp_connect		dc;
+	while (mylsa_changes.root != NULL) {
+		struct mylsa_change *mc;
+
+		mc = iv_container_of(mylsa_changes.root,
+				     struct mylsa_change, an);
+
+		iv_avl_tree_delete(&mylsa_changes, &mc->an);
+		free(mc);
+	}
+}
+
+static void
+mylsa_add_peer(const uint8_t *id, enum conf_peer_type type, int cost)
+{
+	mylsa_queue_change(id, 1, cost, conf_peer_type_to_lsa_peer_flags(type));
+}
+
+static void mylsa_del_peer(const uint8_t *id)
+{
+	mylsa_queue_change(id, 0, 0, 0);
+}
+
+/*
+ * Data records carry either a single packet (RECORD_TYPE_PACKET) or a
+ * sequence of packets (RECORD_TYPE_PACKETS), each preceded by its
+ * 16-bit length.  Packets that are read from the tun interface in the
+ * same wakeup are aggregated into as few records as possible, but only
+ * for peers that have announced that they understand multi-packet
+ * records, by sending us a RECORD_TYPE_CAPS record, which older
+ * versions of dvpn silently ignore.
+ *
+ * A peer that has a UDP data channel set up for this connection also
+ * sets CAP_UDP_DATA and appends the receiver id of its channel and,
+ * on the listening side, the UDP port to send to.  Once both sides
+ * have seen each other's, packets go out over UDP whenever the
+ * channel is confirmed to work, and over the TLS connection when not.
+ *
+ * Peers that both set CAP_DGP run their DGP session inside the TLS
+ * connection, as RECORD_TYPE_DGP records, instead of over a separate
+ * TCP connection to port 173 through the tunnel.  If the peer's caps
+ * don't include it, or don't show up within DGP_FALLBACK_TIMEOUT
+ * seconds, we fall back to the TCP session.
+ *
+ * With TunOffload set, per-peer tun interfaces are opened with a
+ * virtio-net header, and CAP_GSO is set.  Once the peer's caps have
+ * it too, checksum and TSO offload are enabled on the interface, and
+ * the TCP super-packets that the kernel then hands us are carried to
+ * the peer in RECORD_TYPE_GSO fragment records (see gso.c), header
+ * and all, to be written to the peer's tun interface as they are,
+ * leaving the segmentation to the peer's kernel (or to GRO on the
+ * way in, if the packet ends up being routed).  Super-packets always
+ * go out over the TLS connection, in the bulk class, so that their
+ * fragments stay in order, and are never forwarded in transit.
+ */
+#define RECORD_TYPE_PACKET	0x00
+#define RECORD_TYPE_PACKETS	0x01
+#define RECORD_TYPE_CAPS	0x02
+#define RECORD_TYPE_DGP		0x03
+#define RECORD_TYPE_GSO		0x04
+
+#define CAP_MULTI_PACKET	0x01
+#define CAP_UDP_DATA		0x02
+#define CAP_DGP			0x04
+#define CAP_GSO			0x08
+
+#define DGP_MODE_NONE		0
+#define DGP_MODE_TCP		1
+#define DGP_MODE_RECORD		2
+
+#define DGP_FALLBACK_TIMEOUT	3
+
+#define MAX_RECORD_LEN		16384
+
+/*
+ * Packets that keep the overlay itself running -- DGP sessions, ICMPv6
+ * (which includes neighbour discovery) and anything marked with the
+ * network control or expedited forwarding DSCPs -- are sent in their
+ * own records in the TCONN_CLASS_PRIO class, so that they overtake
+ * bulk traffic that is queued up on a congested connection instead of
+ * waiting behind it (and risking a DGP keepalive timeout).
+ */
+#define DGP_PORT		173
+
+#define DSCP_EF			46
+#define DSCP_CS6		48
+
+static int packet_class(const uint8_t *pkt, int len)
+{
+	const uint8_t *l4;
+	int dscp;
+	int proto;
+	int hlen;
+
+	if (len < 1)
+		return TCONN_CLASS_BULK;
+
+	if ((pkt[0] >> 4) == 6) {
+		if (len < 40)
+			return TCONN_CLASS_BULK;
+
+		dscp = ((pkt[0] & 0x0f) << 2) | (pkt[1] >> 6);
+		proto = pkt[6];
+		hlen = 40;
+	} else if ((pkt[0] >> 4) == 4) {
+		if (len < 20)
+			return TCONN_CLASS_BULK;
+
+		dscp = pkt[1] >> 2;
+		proto = pkt[9];
+		hlen = (pkt[0] & 0x0f) * 4;
+		if (hlen < 20 || hlen > len)
+			return TCONN_CLASS_BULK;
+	} else {
+		return TCONN_CLASS_BULK;
+	}
+
+	if (dscp == DSCP_EF || dscp >= DSCP_CS6)
+		return TCONN_CLASS_PRIO;
+
+	if (proto == IPPROTO_ICMPV6)
+		return TCONN_CLASS_PRIO;
+
+	l4 = pkt + hlen;
+	if (proto == IPPROTO_TCP && len - hlen >= 4) {
+		if (((l4[0] << 8) | l4[1]) == DGP_PORT ||
+		    ((l4[2] << 8) | l4[3]) == DGP_PORT) {
+			return TCONN_CLASS_PRIO;
+		}
+	}
+
+	return TCONN_CLASS_BULK;
+}
+
+struct tun_batch {
+	void			*conn;
+	void			(*record_sendv)(void *conn,
+						const struct iovec *iov,
+						int iovcnt, int cls);
+	struct udpchan		*uc;
+	struct worker		*worker;
+	struct iv_list_head	pending;
+	struct iv_task		send_caps;
+	int			gso;
+	int			peer_caps;
+	int			*destroyed;
+	struct gso_reasm	gr;
+	int			num;
+	int			len;
+	uint64_t		packets[TCONN_NUM_CLASSES];
+	uint8_t			buf[MAX_RECORD_LEN];
 };
 
-static void cec_tun_got_packet(void *_cec, uint8_t *buf, int len)
+static void tun_batch_send(struct tun_batch *tb, uint8_t *rec, int len,
+			   int cls)
 {
-	struct connect_entry_conn *cec = _cec;
-	uint8_t sndbuf[len + 3];
+	struct iovec iov;
 
-	sndbuf[0] = 0x00;
-	sndbuf[1] = len >> 8;
-	sndbuf[2] = len & 0xff;
-	memcpy(sndbuf + 3, buf, len);
+	iov.iov_base = rec;
+	iov.iov_len = len;
 
-	tconn_connect_record_send(cec->conn, sndbuf, len + 3);
+	tb->record_sendv(tb->conn, &iov, 1, cls);
 }
 
-static void cec_destroy(struct connect_entry_conn *cec)
+static void tun_batch_send_caps(void *_tb)
 {
-	iv_list_del(&cec->list);
+	struct tun_batch *tb = _tb;
+	uint8_t rec[8];
+	int len;
+
+	rec[0] = RECORD_TYPE_CAPS;
+	rec[1] = CAP_MULTI_PACKET | CAP_DGP;
+	if (tb->gso)
+		rec[1] |= CAP_GSO;
+	len = 2;
+
+	if (tb->uc != NULL) {
+		int port;
+
+		port = udpchan_socket_get_port(tb->uc->us);
+		if (port < 0)
+			port = 0;
+
+		rec[1] |= CAP_UDP_DATA;
+		rec[2] = tb->uc->rx_id >> 24;
+		rec[3] = tb->uc->rx_id >> 16;
+		rec[4] = tb->uc->rx_id >> 8;
+		rec[5] = tb->uc->rx_id & 0xff;
+		rec[6] = port >> 8;
+		rec[7] = port & 0xff;
+		len = 8;
+	}
 
-	dgp_connect_stop(&cec->dc);
+	tun_batch_send(tb, rec, len, TCONN_CLASS_PRIO);
+}
 
-	iv_avl_tree_delete(&direct_peers, &cec->dp.an);
+static void tun_batch_init(struct tun_batch *tb, void *conn,
+			   void (*record_sendv)(void *conn,
+						const struct iovec *iov,
+						int iovcnt, int cls),
+			   struct udpchan *uc, int gso)
+{
+	tb->conn = conn;
+	tb->record_sendv = record_sendv;
+	tb->uc = uc;
+	tb->worker = worker_self();
+	INIT_IV_LIST_HEAD(&tb->pending);
+
+	IV_TASK_INIT(&tb->send_caps);
+	tb->send_caps.cookie = tb;
+	tb->send_caps.handler = tun_batch_send_caps;
+	iv_task_register(&tb->send_caps);
+
+	tb->gso = gso;
+	tb->peer_caps = 0;
+	tb->destroyed = NULL;
+	gso_reasm_init(&tb->gr);
+	tb->num = 0;
+	tb->len = 0;
+	memset(tb->packets, 0, sizeof(tb->packets));
+}
 
-	tun_interface_unregister(&cec->tun);
+static void tun_batch_deinit(struct tun_batch *tb)
+{
+	if (tb->destroyed != NULL)
+		*tb->destroyed = 1;
 
-	if (cec->cce->peer_type != CONF_PEER_TYPE_DBONLY)
-		mylsa_del_peer(cec->peerid);
+	if (!iv_list_empty(&tb->pending))
+		iv_list_del(&tb->pending);
 
-	free(cec);
+	if (iv_task_registered(&tb->send_caps))
+		iv_task_unregister(&tb->send_caps);
+
+	gso_reasm_deinit(&tb->gr);
 }
 
-static void *cce_new_conn(void *_cce, void *conn, const uint8_t *id)
+/*
+ * Sending a record can tear down the connection, so each of these
+ * sends at most one record, as the very last thing it does.
+ */
+static int tun_batch_add(struct tun_batch *tb, uint8_t *pkt, int len)
 {
-	struct conf_connect_entry *cce = _cce;
-	uint8_t addr[16];
-	struct connect_entry_conn *cec;
-	int maxseg;
-	int mtu;
-	char *tunitf;
+	int cls;
 
-	v6_global_addr_from_key_id(addr, keyid);
-	if (dp_find(addr) != NULL)
-		return NULL;
+	/*
+	 * Priority packets don't wait for a pending batch of bulk
+	 * packets to be flushed, but go out on their own right away.
+	 */
+	cls = packet_class(pkt, len);
 
-	cec = calloc(1, sizeof(*cec));
-	if (cec == NULL)
-		return NULL;
+	if (tb->uc != NULL && udpchan_usable(tb->uc)) {
+		if (tb->len && cls != TCONN_CLASS_PRIO)
+			return -1;
 
-	cec->cce = cce;
-	cec->conn = conn;
-	memcpy(cec->peerid, id, NODE_ID_LEN);
+		udpchan_send(tb->uc, pkt, len);
+		tb->packets[cls]++;
+
+		return 0;
+	}
+
+	if (cls == TCONN_CLASS_PRIO || !(tb->peer_caps & CAP_MULTI_PACKET) ||
+	    len + 3 > MAX_RECORD_LEN) {
+		if (tb->len && cls != TCONN_CLASS_PRIO)
+			return -1;
+
+		/*
+		 * The tun layer leaves headroom in front of the packet,
+		 * so the record header can be put there, and the record
+		 * is encrypted straight out of the tun receive buffer.
+		 */
+		pkt -= 3;
+		pkt[0] = RECORD_TYPE_PACKET;
+		pkt[1] = len >> 8;
+		pkt[2] = len & 0xff;
+
+		tun_batch_send(tb, pkt, len + 3, cls);
+		tb->packets[cls]++;
+
+		return 0;
+	}
+
+	if (tb->len + 2 + len > MAX_RECORD_LEN)
+		return -1;
+
+	if (!tb->len) {
+		tb->buf[0] = RECORD_TYPE_PACKETS;
+		tb->len = 1;
+	}
+
+	tb->buf[tb->len] = len >> 8;
+	tb->buf[tb->len + 1] = len & 0xff;
+	memcpy(tb->buf + tb->len + 2, pkt, len);
+	tb->len += 2 + len;
+	tb->num++;
+	tb->packets[cls]++;
+
+	return 0;
+}
+
+static int tun_batch_gso_sendv(void *_tb, const struct iovec *iov, int iovcnt)
+{
+	struct tun_batch *tb = _tb;
+	int destroyed;
+
+	destroyed = 0;
+	tb->destroyed = &destroyed;
+
+	tb->record_sendv(tb->conn, iov, iovcnt, TCONN_CLASS_BULK);
+	if (destroyed)
+		return -1;
+
+	tb->destroyed = NULL;
+
+	return 0;
+}
+
+/*
+ * Unlike the above, this sends a super-packet as a series of records,
+ * and stops as soon as the batch is torn down by one of them.
+ */
+static int tun_batch_add_gso(struct tun_batch *tb, uint8_t *buf, int len)
+{
+	if (tb->len)
+		return -1;
+
+	if (!(tb->peer_caps & CAP_GSO))
+		return 0;
+
+	tb->packets[TCONN_CLASS_BULK]++;
+	gso_fragment(buf, len, RECORD_TYPE_GSO, MAX_RECORD_LEN,
+		     tb, tun_batch_gso_sendv);
+
+	return 0;
+}
+
+static void tun_batch_flush(struct tun_batch *tb)
+{
+	int len;
+
+	if (!tb->len)
+		return;
+
+	/*
+	 * A batch of one is sent as a plain single-packet record,
+	 * which has the same layout apart from the type byte.
+	 */
+	if (tb->num == 1)
+		tb->buf[0] = RECORD_TYPE_PACKET;
+
+	len = tb->len;
+	tb->num = 0;
+	tb->len = 0;
+
+	tun_batch_send(tb, tb->buf, len, TCONN_CLASS_BULK);
+}
+
+/*
+ * Batches that have been handed packets from outside of their own
+ * tun interface's read loop (from the shared tun interface, or by
+ * transit forwarding) are kept on a pending list, so that they can
+ * all be flushed once the packets at hand have been dealt with.
+ * Sending a record can tear down the connection, which also takes
+ * its batch off the list again.  With data plane threads, each
+ * thread has its own list, as it only ever touches its own batches.
+ */
+static __thread struct iv_list_head pending_batches;
+static __thread struct iv_task pending_flush;
+
+static struct iv_list_head *tun_batch_pending_list(void)
+{
+	if (pending_batches.next == NULL)
+		INIT_IV_LIST_HEAD(&pending_batches);
+
+	return &pending_batches;
+}
+
+static void tun_batch_mark_pending(struct tun_batch *tb)
+{
+	if (iv_list_empty(&tb->pending))
+		iv_list_add_tail(&tb->pending, tun_batch_pending_list());
+}
+
+static void tun_batch_flush_pending(void)
+{
+	struct iv_list_head *pending = tun_batch_pending_list();
+
+	while (!iv_list_empty(pending)) {
+		struct tun_batch *tb;
+
+		tb = iv_container_of(pending->next, struct tun_batch, pending);
+		iv_list_del_init(&tb->pending);
+
+		tun_batch_flush(tb);
+	}
+}
+
+static void tun_batch_pending_flush(void *_dummy)
+{
+	tun_batch_flush_pending();
+}
+
+/*
+ * A packet that needs to go out over a connection that belongs to
+ * another data plane thread is copied into a message to that thread,
+ * which adds it to the connection's batch, and flushes the batch from
+ * a task once it has worked through its queue of messages.
+ */
+struct tun_batch_handoff {
+	struct worker_msg	msg;
+	struct tun_batch	*tb;
+	int			len;
+	uint8_t			buf[0];
+};
+
+static void tun_batch_handoff_run(struct worker_msg *msg)
+{
+	struct tun_batch_handoff *h;
+	uint8_t *pkt;
+
+	h = iv_container_of(msg, struct tun_batch_handoff, msg);
+	pkt = h->buf + TUN_HEADROOM;
+
+	tun_batch_mark_pending(h->tb);
+	if (tun_batch_add(h->tb, pkt, h->len) < 0) {
+		tun_batch_flush(h->tb);
+		tun_batch_add(h->tb, pkt, h->len);
+	}
+
+	free(h);
+
+	if (pending_flush.handler == NULL) {
+		IV_TASK_INIT(&pending_flush);
+		pending_flush.handler = tun_batch_pending_flush;
+	}
+
+	if (!iv_task_registered(&pending_flush))
+		iv_task_register(&pending_flush);
+}
+
+static void tun_batch_handoff(struct tun_batch *tb, const uint8_t *pkt,
+			      int len)
+{
+	struct tun_batch_handoff *h;
+
+	h = malloc(sizeof(*h) + TUN_HEADROOM + len);
+	if (h == NULL)
+		return;
+
+	h->msg.handler = tun_batch_handoff_run;
+	h->tb = tb;
+	h->len = len;
+	memcpy(h->buf + TUN_HEADROOM, pkt, len);
+
+	worker_post(tb->worker, &h->msg);
+}
+
+/*
+ * Looks up the batch for the connection towards the next hop for
+ * the given destination.  If that connection belongs to another
+ * thread, the packet is handed off to that thread, and *handed_off
+ * is set.  Data plane threads hold the FIB read lock until the
+ * message has been posted, as the main thread only tears down a
+ * batch after having taken it out of the FIB, and after any messages
+ * that were queued to its thread before that point have been run.
+ */
+static struct tun_batch *fib_lookup_local(const uint8_t *dst,
+					  const uint8_t *pkt, int len,
+					  int *handed_off)
+{
+	struct worker *self;
+	struct tun_batch *tb;
+
+	*handed_off = 0;
+
+	self = worker_self();
+	if (self != NULL)
+		fib_read_lock(&fib);
+
+	tb = fib_lookup(&fib, dst);
+	if (tb != NULL && tb->worker != self) {
+		tun_batch_handoff(tb, pkt, len);
+		*handed_off = 1;
+		tb = NULL;
+	}
+
+	if (self != NULL)
+		fib_read_unlock(&fib);
+
+	return tb;
+}
+
+/*
+ * With ForwardTransit enabled (it is off by default), packets
+ * received from a peer that are for another node are looked up in the
+ * FIB, and handed straight to the connection towards their next hop,
+ * instead of going through the kernel and being read back from
+ * another tun interface.  Anything addressed to us, link-local
+ * and multicast traffic, IPv4, packets whose hop limit is about to
+ * expire (so that the kernel can report that) and packets that we
+ * have no usable route for are written to the tun interface as before.
+ */
+static int transit_candidate(const uint8_t *pkt, int len)
+{
+	const uint8_t *dst;
+
+	if (!conf->forward_transit)
+		return 0;
+
+	if (len < 40 || (pkt[0] >> 4) != 6 || pkt[7] <= 1)
+		return 0;
+
+	dst = pkt + 24;
+	if (dst[0] == 0xff || (dst[0] == 0xfe && (dst[1] & 0xc0) == 0x80))
+		return 0;
+
+	if (!memcmp(dst, myaddr, 16))
+		return 0;
+
+	return 1;
+}
+
+static void tun_batch_deliver(struct tun_batch *tb, struct tun_interface *tun,
+			      const uint8_t *pkt, int len)
+{
+	uint8_t buf[TUN_HEADROOM + MAX_RECORD_LEN];
+	uint8_t *fwd;
+
+	if (!transit_candidate(pkt, len)) {
+		tun_interface_send_packet(tun, pkt, len);
+		return;
+	}
+
+	/*
+	 * The received record can't be modified, and has no room in
+	 * front of the packet for the outgoing record header, so the
+	 * packet is copied (once) to a buffer with headroom.
+	 */
+	fwd = buf + TUN_HEADROOM;
+	memcpy(fwd, pkt, len);
+	fwd[7]--;
+
+	while (1) {
+		struct tun_batch *egress;
+		int handed_off;
+
+		egress = fib_lookup_local(fwd + 24, fwd, len, &handed_off);
+		if (handed_off)
+			return;
+
+		if (egress == NULL || egress == tb) {
+			tun_interface_send_packet(tun, pkt, len);
+			return;
+		}
+
+		tun_batch_mark_pending(egress);
+		if (tun_batch_add(egress, fwd, len) == 0)
+			return;
+
+		tun_batch_flush_pending();
+	}
+}
+
+static void tun_batch_record_received(struct tun_batch *tb,
+				      struct tun_interface *tun,
+				      const uint8_t *rec, int len)
+{
+	int off;
+	int plen;
+
+	if (len < 2)
+		return;
+
+	switch (rec[0]) {
+	case RECORD_TYPE_PACKET:
+		if (len <= 3 || ((rec[1] << 8) | rec[2]) + 3 != len)
+			return;
+
+		tun_batch_deliver(tb, tun, rec + 3, len - 3);
+		tun_batch_flush_pending();
+		break;
+
+	case RECORD_TYPE_PACKETS:
+		off = 1;
+		while (off + 2 <= len) {
+			plen = (rec[off] << 8) | rec[off + 1];
+			off += 2;
+
+			if (plen == 0 || plen > len - off)
+				return;
+
+			tun_batch_deliver(tb, tun, rec + off, plen);
+			off += plen;
+		}
+		tun_batch_flush_pending();
+		break;
+
+	case RECORD_TYPE_CAPS:
+		if (tb->gso && (rec[1] & CAP_GSO) &&
+		    !(tb->peer_caps & CAP_GSO)) {
+			tun_interface_set_offload(tun, 1);
+		}
+		tb->peer_caps = rec[1];
+		break;
+
+	case RECORD_TYPE_GSO:
+		plen = gso_reasm_add(&tb->gr, rec + 1, len - 1);
+		if (plen > 0)
+			tun_interface_send_gso_packet(tun, tb->gr.buf, plen);
+		break;
+	}
+}
+
+/*
+ * With data plane threads, connections are handed to a thread once
+ * their handshake is done, and their tun interface and batch are set
+ * up on that thread as the tconn attaches to it.  Data records are
+ * then dealt with right there, DGP records are parsed there (see
+ * below), and everything else is passed on to the main thread.
+ * Capability records are looked at in both places.
+ * Once the tconn goes away, the batch is left without a connection
+ * and drops whatever it is handed, until it is torn down as well.
+ */
+static void tun_batch_tconn_sendv(void *tc, const struct iovec *iov,
+				  int iovcnt, int cls)
+{
+	if (tc != NULL)
+		tconn_record_sendv(tc, iov, iovcnt, cls);
+}
+
+static int tun_batch_dp_record(struct tun_batch *tb, struct tun_interface *tun,
+			       const uint8_t *rec, int len)
+{
+	if (len < 1)
+		return -1;
+
+	switch (rec[0]) {
+	case RECORD_TYPE_PACKET:
+	case RECORD_TYPE_PACKETS:
+	case RECORD_TYPE_GSO:
+		tun_batch_record_received(tb, tun, rec, len);
+		return 0;
+
+	case RECORD_TYPE_CAPS:
+		tun_batch_record_received(tb, tun, rec, len);
+		return -1;
+	}
+
+	return -1;
+}
+
+/*
+ * With data plane threads, received DGP records are cut up into LSAs
+ * on the connection's thread as well, and the LSAs are handed to the
+ * main thread (which owns all RIBs) in batches, in order with the
+ * records that go there directly.  Every DGP record gives rise to a
+ * batch, even if it doesn't complete any LSA, as the main thread uses
+ * these to tell that the DGP session is alive.  Once a batch has had
+ * to be dropped, the stream is out of sync, and the session is failed.
+ */
+#define DGP_LSA_BATCH		64
+
+struct dgp_lsa_batch {
+	int			error;
+	int			num;
+	struct lsa		*lsas[DGP_LSA_BATCH];
+};
+
+struct dp_dgp {
+	struct tconn		*tc;
+	struct dgp_stream	ds;
+	struct dgp_lsa_batch	batch;
+};
+
+static void dp_dgp_batch_put(struct dgp_lsa_batch *b)
+{
+	int i;
+
+	for (i = 0; i < b->num; i++)
+		lsa_put(b->lsas[i]);
+	b->num = 0;
+}
+
+static void dp_dgp_flush(struct dp_dgp *dd)
+{
+	struct dgp_lsa_batch *b = &dd->batch;
+	int len;
+
+	len = offsetof(struct dgp_lsa_batch, lsas) +
+	      b->num * sizeof(b->lsas[0]);
+
+	if (dd->tc == NULL || tconn_dp_message_post(dd->tc, b, len) < 0) {
+		dp_dgp_batch_put(b);
+		b->error = 1;
+		return;
+	}
+
+	b->num = 0;
+}
+
+static void dp_dgp_lsa_received(void *_dd, struct lsa *lsa)
+{
+	struct dp_dgp *dd = _dd;
+
+	dd->batch.lsas[dd->batch.num++] = lsa;
+	if (dd->batch.num == DGP_LSA_BATCH)
+		dp_dgp_flush(dd);
+}
+
+static void dp_dgp_init(struct dp_dgp *dd, struct tconn *tc)
+{
+	dd->tc = tc;
+	dd->ds.cookie = dd;
+	dd->ds.lsa_received = dp_dgp_lsa_received;
+	dgp_stream_init(&dd->ds);
+	dd->batch.error = 0;
+	dd->batch.num = 0;
+}
+
+static int dp_dgp_record(struct dp_dgp *dd, const uint8_t *rec, int len)
+{
+	if (!dd->batch.error && dgp_stream_feed(&dd->ds, rec, len) < 0)
+		dd->batch.error = 1;
+
+	dp_dgp_flush(dd);
+
+	return 0;
+}
+
+static int dp_dgp_batch_get(struct dgp_lsa_batch *b,
+			    const uint8_t *msg, int len)
+{
+	if (len < offsetof(struct dgp_lsa_batch, lsas) || len > sizeof(*b))
+		return -1;
+
+	memcpy(b, msg, len);
+
+	return 0;
+}
+
+static void dp_dgp_deliver(struct dgp_record *drec, int active,
+			   const uint8_t *msg, int len)
+{
+	struct dgp_lsa_batch b;
+
+	if (dp_dgp_batch_get(&b, msg, len) < 0)
+		return;
+
+	if (active && b.error)
+		dgp_record_stream_error(drec);
+	else if (active)
+		dgp_record_lsas_received(drec, b.lsas, b.num);
+
+	dp_dgp_batch_put(&b);
+}
+
+static void dp_dgp_discard(const uint8_t *msg, int len)
+{
+	struct dgp_lsa_batch b;
+
+	if (dp_dgp_batch_get(&b, msg, len) == 0)
+		dp_dgp_batch_put(&b);
+}
+
+static int udp_data_peer_params(const uint8_t *rec, int len,
+				uint32_t *id, int *port)
+{
+	if (len < 8 || rec[0] != RECORD_TYPE_CAPS || !(rec[1] & CAP_UDP_DATA))
+		return 0;
+
+	*id = (rec[2] << 24) | (rec[3] << 16) | (rec[4] << 8) | rec[5];
+	*port = (rec[6] << 8) | rec[7];
+
+	return 1;
+}
+
+/*
+ * Interfaces for directly connected peers are configured with an MTU
+ * derived from the TCP segment size of the connection, so that each
+ * tunneled packet fits in a single segment.
+ */
+static void peer_tun_setup(const char *name, char *tunitf, int maxseg,
+			   void *cookie, void (*handler)(void *, int))
+{
+	uint8_t addr[16];
+	int mtu;
+
+	mtu = maxseg - 5 - 8 - 3 - 16;
+	if (mtu < 1280)
+		mtu = 1280;
+	else if (mtu > 1500)
+		mtu = 1500;
+
+	fprintf(stderr, "%s: setting interface MTU to %d\n", name, mtu);
+
+	itf_set_mtu(tunitf, mtu, cookie, handler);
+
+	itf_set_state(tunitf, 1, cookie, handler);
+
+	v6_linklocal_addr_from_key_id(addr, keyid);
+	itf_add_addr_v6(tunitf, addr, 10, cookie, handler);
+
+	v6_global_addr_from_key_id(addr, keyid);
+	itf_add_addr_v6(tunitf, addr, 128, cookie, handler);
+}
+
+/*
+ * With SharedTunInterface set, all peers share a single tun interface
+ * instead of getting one each.  Our global address is put on it with
+ * the length of the prefix that all node addresses are taken from, so
+ * that the kernel only needs the single covering route that that
+ * implies, and packets read from it are forwarded to the right peer
+ * by looking up their destination in an in-process FIB that is kept
+ * up to date from the rt_builder callbacks.  Link-local addresses of
+ * directly connected peers are added to the FIB as well, for the
+ * benefit of DGP over TCP.  Only IPv6 is forwarded in this mode.
+ *
+ * With data plane threads, the interface is opened in multi-queue
+ * mode, and each thread reads from a queue of its own, in addition
+ * to the main thread's queue.  Each thread also writes the packets
+ * for its own connections to its own queue, as each queue has an
+ * egress queue that only its own thread may touch.
+ */
+#define SHARED_TUN_MTU		1400
+#define V6_GLOBAL_PREFIX_LEN	32
+
+struct shared_tun_queue {
+	struct tun_interface	tun;
+	int			registered;
+};
+
+static struct shared_tun_queue *shared_tun_queues;
+static __thread struct tun_interface *shared_tun_local;
+
+static int shared_tun_got_packet(void *_dummy, uint8_t *buf, int len)
+{
+	struct tun_batch *tb;
+	int handed_off;
+
+	if (len < 40 || (buf[0] >> 4) != 6)
+		return 0;
+
+	tb = fib_lookup_local(buf + 24, buf, len, &handed_off);
+	if (tb == NULL)
+		return 0;
+
+	/*
+	 * Sending the packet can tear down the connection, which
+	 * also takes it off the pending list again.
+	 */
+	tun_batch_mark_pending(tb);
+
+	return tun_batch_add(tb, buf, len);
+}
+
+static void shared_tun_flush(void *_dummy)
+{
+	tun_batch_flush_pending();
+}
+
+static void shared_tun_itf_done(void *_dummy, int err)
+{
+	if (err < 0 && err != -EEXIST) {
+		fprintf(stderr, "%s: error configuring interface: %s\n",
+			tun_interface_get_name(&shared_tun), strerror(-err));
+	}
+}
+
+static void shared_tun_queue_start(void *_q)
+{
+	struct shared_tun_queue *q = _q;
+
+	q->tun.itfname = tun_interface_get_name(&shared_tun);
+	q->tun.multi_queue = 1;
+	q->tun.cookie = NULL;
+	q->tun.got_packet = shared_tun_got_packet;
+	q->tun.flush = shared_tun_flush;
+	if (tun_interface_register(&q->tun) == 0) {
+		q->registered = 1;
+		shared_tun_local = &q->tun;
+	}
+}
+
+static void shared_tun_queue_stop(void *_q)
+{
+	struct shared_tun_queue *q = _q;
+
+	tun_interface_unregister(&q->tun);
+	q->registered = 0;
+	shared_tun_local = NULL;
+}
+
+/*
+ * The shared tun interface only gets a queue on each worker if the
+ * workers are data plane threads.  Workers that only do TLS offload
+ * don't own any connections' batches, so packets read on them would
+ * have nowhere to go.
+ */
+static int shared_tun_num_queues(void)
+{
+	return conf->data_plane_threads ? worker_pool_size() : 0;
+}
+
+static void shared_tun_queues_stop(void)
+{
+	int i;
+
+	for (i = 0; i < shared_tun_num_queues(); i++) {
+		struct shared_tun_queue *q = &shared_tun_queues[i];
+
+		if (q->registered) {
+			worker_call(worker_pool_member(i),
+				    shared_tun_queue_stop, q);
+		}
+	}
+
+	free(shared_tun_queues);
+	shared_tun_queues = NULL;
+}
+
+static int shared_tun_queues_start(void)
+{
+	int num;
+	int i;
+
+	num = shared_tun_num_queues();
+	if (!num)
+		return 0;
+
+	shared_tun_queues = calloc(num, sizeof(struct shared_tun_queue));
+	if (shared_tun_queues == NULL)
+		return -1;
+
+	for (i = 0; i < num; i++) {
+		struct shared_tun_queue *q = &shared_tun_queues[i];
+
+		worker_call(worker_pool_member(i), shared_tun_queue_start, q);
+		if (!q->registered) {
+			shared_tun_queues_stop();
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+static int shared_tun_start(void)
+{
+	uint8_t addr[16];
+	char *tunitf;
+
+	shared_tun.itfname = conf->shared_tunitf;
+	shared_tun.multi_queue = !!shared_tun_num_queues();
+	shared_tun.cookie = NULL;
+	shared_tun.got_packet = shared_tun_got_packet;
+	shared_tun.flush = shared_tun_flush;
+	if (tun_interface_register(&shared_tun) < 0)
+		return -1;
+
+	if (shared_tun_queues_start() < 0) {
+		tun_interface_unregister(&shared_tun);
+		return -1;
+	}
+
+	tunitf = tun_interface_get_name(&shared_tun);
+
+	fprintf(stderr, "dvpn: forwarding all peer traffic over %s\n",
+		tunitf);
+
+	itf_set_mtu(tunitf, SHARED_TUN_MTU, NULL, shared_tun_itf_done);
+
+	itf_set_state(tunitf, 1, NULL, shared_tun_itf_done);
+
+	v6_linklocal_addr_from_key_id(addr, keyid);
+	itf_add_addr_v6(tunitf, addr, 10, NULL, shared_tun_itf_done);
+
+	v6_global_addr_from_key_id(addr, keyid);
+	itf_add_addr_v6(tunitf, addr, V6_GLOBAL_PREFIX_LEN,
+			NULL, shared_tun_itf_done);
+
+	shared_dls.myid = keyid;
+	shared_dls.ifindex = if_nametoindex(tunitf);
+	shared_dls.loc_rib = &loc_rib;
+	shared_dls.permit_readonly = 0;
+	if (dgp_listen_socket_register(&shared_dls)) {
+		shared_tun_queues_stop();
+		tun_interface_unregister(&shared_tun);
+		return -1;
+	}
+
+	shared_tun_registered = 1;
+	shared_tun_local = &shared_tun;
+
+	return 0;
+}
+
+static void shared_tun_stop(void)
+{
+	dgp_listen_socket_unregister(&shared_dls);
+	shared_tun_queues_stop();
+	tun_interface_unregister(&shared_tun);
+	shared_tun_registered = 0;
+	shared_tun_local = NULL;
+}
+
+/*
+ * Directly connected peers attach their connection to the FIB next
+ * hop for their address, both for the shared tun interface and for
+ * transit forwarding.
+ */
+static void peer_fib_attach(struct direct_peer *dp, const uint8_t *id,
+			    struct tun_batch *tb)
+{
+	uint8_t addr[16];
+
+	if (fib_nexthop_attach(&fib, dp->addr, tb) < 0)
+		return;
+
+	v6_linklocal_addr_from_key_id(addr, id);
+	fib_route_set(&fib, addr, dp->addr);
+}
+
+static void peer_fib_detach(struct direct_peer *dp, const uint8_t *id)
+{
+	uint8_t addr[16];
+
+	v6_linklocal_addr_from_key_id(addr, id);
+	fib_route_set(&fib, addr, NULL);
+
+	fib_nexthop_detach(&fib, dp->addr);
+}
+
+/*
+ * With TLSOffloadThreads set, only the TLS record layer of each peer
+ * connection is handed to a worker thread, which leaves the data
+ * plane on the main thread, and has records pass between the two
+ * through the tconn's rings.
+ */
+static struct worker *tls_offload_start(struct tconn *tc)
+{
+	struct worker *w;
+
+	if (tc == NULL || !conf->tls_offload_threads)
+		return NULL;
+
+	w = worker_get();
+	if (w != NULL && tconn_set_worker(tc, w) < 0) {
+		worker_put(w);
+		return NULL;
+	}
+
+	return w;
+}
+
+struct connect_entry_conn {
+	struct iv_list_head		list;
+
+	struct conf_connect_entry	*cce;
+	void				*conn;
+	uint8_t				peerid[NODE_ID_LEN];
+	struct worker			*worker;
+	struct tconn			*tconn;
+	struct worker			*tls_worker;
+	struct dp_dgp			dpd;
+
+	struct tun_interface		tun;
+	struct tun_interface		*tunp;
+	struct tun_batch		tb;
+	int				udp;
+	struct udpchan_socket		us;
+	struct udpchan			uc;
+	struct direct_peer		dp;
+	int				dgp_mode;
+	struct iv_timer			dgp_fallback;
+	struct dgp_connect		dc;
+	struct dgp_record		drec;
+};
+
+static int cec_tun_got_packet(void *_cec, uint8_t *buf, int len)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	return tun_batch_add(&cec->tb, buf, len);
+}
+
+static int cec_tun_got_gso_packet(void *_cec, uint8_t *buf, int len)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	return tun_batch_add_gso(&cec->tb, buf, len);
+}
+
+static void cec_tun_flush(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	tun_batch_flush(&cec->tb);
+}
+
+/*
+ * Runs on the connection's data plane thread, if it has one, as the
+ * tconn attaches to it.
+ */
+static void cec_dp_start(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	if (shared_tun_registered) {
+		cec->tunp = shared_tun_local;
+	} else {
+		cec->tun.itfname = cec->cce->tunitf;
+		cec->tun.cookie = cec;
+		cec->tun.vnet_hdr = conf->tun_offload;
+		cec->tun.got_packet = cec_tun_got_packet;
+		cec->tun.got_gso_packet = cec_tun_got_gso_packet;
+		cec->tun.flush = cec_tun_flush;
+		if (tun_interface_register(&cec->tun) < 0)
+			return;
+		cec->tunp = &cec->tun;
+	}
+
+	if (cec->worker != NULL) {
+		dp_dgp_init(&cec->dpd, cec->tconn);
+		tun_batch_init(&cec->tb, cec->tconn, tun_batch_tconn_sendv,
+			       NULL, cec->tunp->vnet_hdr);
+	} else {
+		tun_batch_init(&cec->tb, cec->conn, tconn_connect_record_sendv,
+			       cec->udp ? &cec->uc : NULL,
+			       cec->tunp->vnet_hdr);
+	}
+}
+
+static int cec_dp_record(void *_cec, const uint8_t *rec, int len)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	if (len >= 1 && rec[0] == RECORD_TYPE_DGP)
+		return dp_dgp_record(&cec->dpd, rec + 1, len - 1);
+
+	return tun_batch_dp_record(&cec->tb, cec->tunp, rec, len);
+}
+
+static void cec_dp_detached(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	cec->tconn = NULL;
+	cec->tb.conn = NULL;
+	cec->dpd.tc = NULL;
+}
+
+/*
+ * Runs on the main thread.
+ */
+static void cec_dp_message(void *_cec, const uint8_t *msg, int len)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	dp_dgp_deliver(&cec->drec, cec->dgp_mode == DGP_MODE_RECORD, msg, len);
+}
+
+static void cec_dp_stop(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	if (cec->tconn != NULL) {
+		cec->tconn->dp_record_received = NULL;
+		cec->tconn->dp_detached = NULL;
+		cec->tconn->dp_message = NULL;
+	}
+
+	if (cec->tunp == NULL)
+		return;
+
+	tun_batch_deinit(&cec->tb);
+	if (!shared_tun_registered)
+		tun_interface_unregister(&cec->tun);
+}
+
+static void cec_dp_set_worker(struct connect_entry_conn *cec)
+{
+	struct tconn *tc;
+
+	tc = tconn_connect_get_tconn(cec->conn);
+	if (tc == NULL)
+		return;
+
+	cec->tconn = tc;
+	tc->dp_cookie = cec;
+	tc->dp_attached = cec_dp_start;
+	tc->dp_record_received = cec_dp_record;
+	tc->dp_detached = cec_dp_detached;
+	tc->dp_message = cec_dp_message;
+	tc->dp_message_discard = dp_dgp_discard;
+	tconn_set_worker(tc, cec->worker);
+}
+
+static void cec_udp_packet(void *_cec, const uint8_t *pkt, int len)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	tun_batch_deliver(&cec->tb, cec->tunp, pkt, len);
+	tun_batch_flush_pending();
+}
+
+static void cec_udp_start(struct connect_entry_conn *cec)
+{
+	struct sockaddr_storage peer;
+
+	if (tconn_connect_get_peer_addr(cec->conn, &peer) < 0)
+		return;
+
+	memset(&cec->us.local_address, 0, sizeof(cec->us.local_address));
+	cec->us.local_address.ss_family = peer.ss_family;
+	if (udpchan_socket_register(&cec->us))
+		return;
+
+	cec->uc.us = &cec->us;
+	cec->uc.cookie = cec;
+	cec->uc.packet_received = cec_udp_packet;
+	if (udpchan_register(&cec->uc) < 0) {
+		udpchan_socket_unregister(&cec->us);
+		return;
+	}
+
+	cec->udp = 1;
+}
+
+static void cec_udp_set_keys(struct connect_entry_conn *cec,
+			     uint32_t id, int port)
+{
+	uint8_t keys[UDPCHAN_KEY_BYTES];
+	struct sockaddr_storage peer;
+
+	if (tconn_connect_get_peer_addr(cec->conn, &peer) < 0)
+		return;
+
+	if (peer.ss_family == AF_INET)
+		((struct sockaddr_in *)&peer)->sin_port = htons(port);
+	else if (peer.ss_family == AF_INET6)
+		((struct sockaddr_in6 *)&peer)->sin6_port = htons(port);
+	else
+		return;
+
+	if (tconn_connect_export_keys(cec->conn, UDPCHAN_KEY_LABEL,
+				      keys, sizeof(keys)) < 0)
+		return;
+
+	if (udpchan_set_keys(&cec->uc, keys, 1, id, &peer) == 0) {
+		fprintf(stderr, "%s: UDP data channel keyed\n",
+			cec->cce->name);
+	}
+
+	memset(keys, 0, sizeof(keys));
+}
+
+static void cec_dgp_record_send(void *_cec, const uint8_t *buf, int len)
+{
+	struct connect_entry_conn *cec = _cec;
+	uint8_t type;
+	struct iovec iov[2];
+
+	type = RECORD_TYPE_DGP;
+	iov[0].iov_base = &type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	tconn_connect_record_sendv(cec->conn, iov, 2, TCONN_CLASS_CTRL);
+}
+
+static int cec_dgp_tx_backlog(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+	struct tconn *tc;
+
+	tc = tconn_connect_get_tconn(cec->conn);
+	if (tc == NULL)
+		return -1;
+
+	return tconn_get_txq_backlog(tc, TCONN_CLASS_CTRL);
+}
+
+static void cec_dgp_rx_pause(void *_cec, int pause)
+{
+	struct connect_entry_conn *cec = _cec;
+	struct tconn *tc;
+
+	tc = tconn_connect_get_tconn(cec->conn);
+	if (tc != NULL)
+		tconn_set_rx_paused(tc, pause);
+}
+
+static void cec_dgp_session_error(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	fprintf(stderr, "%s: DGP session error\n", cec->cce->name);
+	tconn_connect_disconnect(cec->conn);
+}
+
+static void cec_dgp_start(struct connect_entry_conn *cec, int record)
+{
+	if (cec->dgp_mode != DGP_MODE_NONE)
+		return;
+
+	if (iv_timer_registered(&cec->dgp_fallback))
+		iv_timer_unregister(&cec->dgp_fallback);
+
+	if (record) {
+		cec->dgp_mode = DGP_MODE_RECORD;
+
+		cec->drec.myid = keyid;
+		cec->drec.remoteid = cec->peerid;
+		cec->drec.loc_rib = &loc_rib;
+		cec->drec.cookie = cec;
+		cec->drec.record_send = cec_dgp_record_send;
+		cec->drec.tx_backlog = cec_dgp_tx_backlog;
+		cec->drec.rx_pause = cec_dgp_rx_pause;
+		cec->drec.session_error = cec_dgp_session_error;
+		dgp_record_start(&cec->drec);
+	} else {
+		cec->dgp_mode = DGP_MODE_TCP;
+
+		cec->dc.myid = keyid;
+		cec->dc.remoteid = cec->peerid;
+		cec->dc.ifindex = cec->dp.ifindex;
+		cec->dc.loc_rib = &loc_rib;
+		dgp_connect_start(&cec->dc);
+	}
+}
+
+static void cec_dgp_fallback(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	cec_dgp_start(cec, 0);
+}
+
+static void cec_itf_done(void *_cec, int err)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	if (err < 0 && err != -EEXIST) {
+		fprintf(stderr, "%s: error configuring interface: %s\n",
+			cec->cce->name, strerror(-err));
+	}
+}
+
+static void cec_destroy(struct connect_entry_conn *cec)
+{
+	iv_list_del(&cec->list);
+
+	if (iv_timer_registered(&cec->dgp_fallback))
+		iv_timer_unregister(&cec->dgp_fallback);
+
+	if (cec->dgp_mode == DGP_MODE_TCP)
+		dgp_connect_stop(&cec->dc);
+	else if (cec->dgp_mode == DGP_MODE_RECORD)
+		dgp_record_stop(&cec->drec);
+
+	iv_avl_tree_delete(&direct_peers, &cec->dp.an);
+
+	rtnl_cancel(cec);
+
+	if (cec->udp) {
+		udpchan_unregister(&cec->uc);
+		udpchan_socket_unregister(&cec->us);
+	}
+
+	peer_fib_detach(&cec->dp, cec->peerid);
+
+	worker_call(cec->worker, cec_dp_stop, cec);
+	worker_put(cec->worker);
+	worker_put(cec->tls_worker);
+
+	if (cec->cce->peer_type != CONF_PEER_TYPE_DBONLY)
+		mylsa_del_peer(cec->peerid);
+
+	free(cec);
+}
+
+static void *cce_new_conn(void *_cce, void *conn, const uint8_t *id)
+{
+	struct conf_connect_entry *cce = _cce;
+	uint8_t addr[16];
+	struct connect_entry_conn *cec;
+	int maxseg;
+	char *tunitf;
+
+	v6_global_addr_from_key_id(addr, keyid);
+	if (dp_find(addr) != NULL)
+		return NULL;
+
+	cec = calloc(1, sizeof(*cec));
+	if (cec == NULL)
+		return NULL;
+
+	cec->cce = cce;
+	cec->conn = conn;
+	memcpy(cec->peerid, id, NODE_ID_LEN);
+
+	if (conf->data_plane_threads)
+		cec->worker = worker_get();
+
+	if (conf->udp_data_channel && cec->worker == NULL)
+		cec_udp_start(cec);
+
+	if (cec->worker != NULL)
+		cec_dp_set_worker(cec);
+	else
+		cec_dp_start(cec);
 
-	cec->tun.itfname = cce->tunitf;
-	cec->tun.cookie = cec;
-	cec->tun.got_packet = cec_tun_got_packet;
-	if (tun_interface_register(&cec->tun) < 0) {
+	if (cec->tunp == NULL) {
+		worker_call(cec->worker, cec_dp_stop, cec);
+		if (cec->udp) {
+			udpchan_unregister(&cec->uc);
+			udpchan_socket_unregister(&cec->us);
+		}
+		worker_put(cec->worker);
 		free(cec);
 		return NULL;
 	}
 
+	cec->tls_worker = tls_offload_start(tconn_connect_get_tconn(conn));
+
 	if (cce->peer_type != CONF_PEER_TYPE_DBONLY) {
 		int cost;
 
@@ -386,40 +1907,35 @@ static void *cce_new_conn(void *_cce, void *conn, const uint8_t *id)
 		mylsa_add_peer(cec->peerid, cce->peer_type, cost);
 	}
 
-	maxseg = tconn_connect_get_maxseg(conn);
-	if (maxseg < 0)
-		abort();
-
-	mtu = maxseg - 5 - 8 - 3 - 16;
-	if (mtu < 1280)
-		mtu = 1280;
-	else if (mtu > 1500)
-		mtu = 1500;
-
-	fprintf(stderr, "%s: setting interface MTU to %d\n", cce->name, mtu);
-
-	tunitf = tun_interface_get_name(&cec->tun);
+	tunitf = tun_interface_get_name(cec->tunp);
 
-	itf_set_mtu(tunitf, mtu);
+	if (!shared_tun_registered) {
+		maxseg = tconn_connect_get_maxseg(conn);
+		if (maxseg < 0)
+			abort();
 
-	itf_set_state(tunitf, 1);
-
-	v6_linklocal_addr_from_key_id(addr, keyid);
-	itf_add_addr_v6(tunitf, addr, 10);
-
-	v6_global_addr_from_key_id(addr, keyid);
-	itf_add_addr_v6(tunitf, addr, 128);
+		peer_tun_setup(cce->name, tunitf, maxseg, cec, cec_itf_done);
+	}
 
 	v6_global_addr_from_key_id(cec->dp.addr, id);
 	cec->dp.itfname = tunitf;
+	cec->dp.ifindex = if_nametoindex(tunitf);
 	if (iv_avl_tree_insert(&direct_peers, &cec->dp.an))
 		abort();
 
-	cec->dc.myid = keyid;
-	cec->dc.remoteid = cec->peerid;
-	cec->dc.ifindex = if_nametoindex(tunitf);
-	cec->dc.loc_rib = &loc_rib;
-	dgp_connect_start(&cec->dc);
+	peer_fib_attach(&cec->dp, id, &cec->tb);
+
+	cec->dgp_mode = DGP_MODE_NONE;
+
+	IV_TIMER_INIT(&cec->dgp_fallback);
+	iv_validate_now();
+	cec->dgp_fallback.expires = iv_now;
+	timespec_add_ms(&cec->dgp_fallback.expires,
+			1000 * DGP_FALLBACK_TIMEOUT,
+			1000 * DGP_FALLBACK_TIMEOUT);
+	cec->dgp_fallback.cookie = cec;
+	cec->dgp_fallback.handler = cec_dgp_fallback;
+	iv_timer_register(&cec->dgp_fallback);
 
 	iv_list_add_tail(&cec->list, &cce->connections);
 
@@ -429,19 +1945,31 @@ static void *cce_new_conn(void *_cce, void *conn, const uint8_t *id)
 static void cec_record_received(void *_cec, const uint8_t *rec, int len)
 {
 	struct connect_entry_conn *cec = _cec;
-	int rlen;
+	uint32_t id;
+	int port;
 
-	if (len <= 3)
+	if (len >= 1 && rec[0] == RECORD_TYPE_DGP) {
+		if (cec->dgp_mode == DGP_MODE_RECORD)
+			dgp_record_received(&cec->drec, rec + 1, len - 1);
 		return;
+	}
 
-	if (rec[0] != 0x00)
-		return;
+	if (cec->udp && udp_data_peer_params(rec, len, &id, &port))
+		cec_udp_set_keys(cec, id, port);
 
-	rlen = (rec[1] << 8) | rec[2];
-	if (rlen + 3 != len)
-		return;
+	if (cec->worker == NULL)
+		tun_batch_record_received(&cec->tb, cec->tunp, rec, len);
+
+	if (len >= 2 && rec[0] == RECORD_TYPE_CAPS)
+		cec_dgp_start(cec, !!(rec[1] & CAP_DGP));
+}
 
-	tun_interface_send_packet(&cec->tun, rec + 3, rlen);
+static void cec_tx_ready(void *_cec)
+{
+	struct connect_entry_conn *cec = _cec;
+
+	if (cec->dgp_mode == DGP_MODE_RECORD)
+		dgp_record_tx_ready(&cec->drec);
 }
 
 static void cec_disconnect(void *_cec)
@@ -457,24 +1985,264 @@ struct listen_entry_conn {
 	struct conf_listen_entry	*cle;
 	void				*conn;
 	uint8_t				peerid[NODE_ID_LEN];
+	struct worker			*worker;
+	struct tconn			*tconn;
+	struct worker			*tls_worker;
+	struct dp_dgp			dpd;
 
 	struct tun_interface		tun;
+	struct tun_interface		*tunp;
+	struct tun_batch		tb;
+	int				udp;
+	struct udpchan			uc;
 	struct direct_peer		dp;
+	int				dgp_mode;
+	struct iv_timer			dgp_fallback;
 	struct dgp_listen_socket	dls;
 	struct dgp_listen_entry		dle;
+	struct dgp_record		drec;
 };
 
-static void lec_tun_got_packet(void *_lec, uint8_t *buf, int len)
+static int lec_tun_got_packet(void *_lec, uint8_t *buf, int len)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	return tun_batch_add(&lec->tb, buf, len);
+}
+
+static int lec_tun_got_gso_packet(void *_lec, uint8_t *buf, int len)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	return tun_batch_add_gso(&lec->tb, buf, len);
+}
+
+static void lec_tun_flush(void *_lec)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	tun_batch_flush(&lec->tb);
+}
+
+/*
+ * Runs on the connection's data plane thread, if it has one, as the
+ * tconn attaches to it.
+ */
+static void lec_dp_start(void *_lec)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	if (shared_tun_registered) {
+		lec->tunp = shared_tun_local;
+	} else {
+		lec->tun.itfname = lec->cle->tunitf;
+		lec->tun.cookie = lec;
+		lec->tun.vnet_hdr = conf->tun_offload;
+		lec->tun.got_packet = lec_tun_got_packet;
+		lec->tun.got_gso_packet = lec_tun_got_gso_packet;
+		lec->tun.flush = lec_tun_flush;
+		if (tun_interface_register(&lec->tun) < 0)
+			return;
+		lec->tunp = &lec->tun;
+	}
+
+	if (lec->worker != NULL) {
+		dp_dgp_init(&lec->dpd, lec->tconn);
+		tun_batch_init(&lec->tb, lec->tconn, tun_batch_tconn_sendv,
+			       NULL, lec->tunp->vnet_hdr);
+	} else {
+		tun_batch_init(&lec->tb, lec->conn,
+			       tconn_listen_entry_record_sendv,
+			       lec->udp ? &lec->uc : NULL,
+			       lec->tunp->vnet_hdr);
+	}
+}
+
+static int lec_dp_record(void *_lec, const uint8_t *rec, int len)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	if (len >= 1 && rec[0] == RECORD_TYPE_DGP)
+		return dp_dgp_record(&lec->dpd, rec + 1, len - 1);
+
+	return tun_batch_dp_record(&lec->tb, lec->tunp, rec, len);
+}
+
+static void lec_dp_detached(void *_lec)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	lec->tconn = NULL;
+	lec->tb.conn = NULL;
+	lec->dpd.tc = NULL;
+}
+
+/*
+ * Runs on the main thread.
+ */
+static void lec_dp_message(void *_lec, const uint8_t *msg, int len)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	dp_dgp_deliver(&lec->drec, lec->dgp_mode == DGP_MODE_RECORD, msg, len);
+}
+
+static void lec_dp_stop(void *_lec)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	if (lec->tconn != NULL) {
+		lec->tconn->dp_record_received = NULL;
+		lec->tconn->dp_detached = NULL;
+		lec->tconn->dp_message = NULL;
+	}
+
+	if (lec->tunp == NULL)
+		return;
+
+	tun_batch_deinit(&lec->tb);
+	if (!shared_tun_registered)
+		tun_interface_unregister(&lec->tun);
+}
+
+static void lec_dp_set_worker(struct listen_entry_conn *lec)
+{
+	struct tconn *tc;
+
+	tc = tconn_listen_entry_get_tconn(lec->conn);
+	if (tc == NULL)
+		return;
+
+	lec->tconn = tc;
+	tc->dp_cookie = lec;
+	tc->dp_attached = lec_dp_start;
+	tc->dp_record_received = lec_dp_record;
+	tc->dp_detached = lec_dp_detached;
+	tc->dp_message = lec_dp_message;
+	tc->dp_message_discard = dp_dgp_discard;
+	tconn_set_worker(tc, lec->worker);
+}
+
+static void lec_udp_packet(void *_lec, const uint8_t *pkt, int len)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	tun_batch_deliver(&lec->tb, lec->tunp, pkt, len);
+	tun_batch_flush_pending();
+}
+
+static void lec_udp_set_keys(struct listen_entry_conn *lec, uint32_t id)
+{
+	uint8_t keys[UDPCHAN_KEY_BYTES];
+
+	if (tconn_listen_entry_export_keys(lec->conn, UDPCHAN_KEY_LABEL,
+					   keys, sizeof(keys)) < 0)
+		return;
+
+	if (udpchan_set_keys(&lec->uc, keys, 0, id, NULL) == 0) {
+		fprintf(stderr, "%s: UDP data channel keyed\n",
+			lec->cle->name);
+	}
+
+	memset(keys, 0, sizeof(keys));
+}
+
+static void lec_dgp_record_send(void *_lec, const uint8_t *buf, int len)
+{
+	struct listen_entry_conn *lec = _lec;
+	uint8_t type;
+	struct iovec iov[2];
+
+	type = RECORD_TYPE_DGP;
+	iov[0].iov_base = &type;
+	iov[0].iov_len = 1;
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	tconn_listen_entry_record_sendv(lec->conn, iov, 2, TCONN_CLASS_CTRL);
+}
+
+static int lec_dgp_tx_backlog(void *_lec)
+{
+	struct listen_entry_conn *lec = _lec;
+	struct tconn *tc;
+
+	tc = tconn_listen_entry_get_tconn(lec->conn);
+
+	return tconn_get_txq_backlog(tc, TCONN_CLASS_CTRL);
+}
+
+static void lec_dgp_rx_pause(void *_lec, int pause)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	tconn_set_rx_paused(tconn_listen_entry_get_tconn(lec->conn), pause);
+}
+
+static void lec_destroy(struct listen_entry_conn *lec, int disconnect_tconn);
+
+static void lec_dgp_session_error(void *_lec)
+{
+	struct listen_entry_conn *lec = _lec;
+
+	fprintf(stderr, "%s: DGP session error\n", lec->cle->name);
+	lec_destroy(lec, 1);
+}
+
+static void lec_dgp_start(struct listen_entry_conn *lec, int record)
+{
+	if (lec->dgp_mode != DGP_MODE_NONE)
+		return;
+
+	if (iv_timer_registered(&lec->dgp_fallback))
+		iv_timer_unregister(&lec->dgp_fallback);
+
+	if (record) {
+		lec->dgp_mode = DGP_MODE_RECORD;
+
+		lec->drec.myid = keyid;
+		lec->drec.remoteid = lec->peerid;
+		lec->drec.loc_rib = &loc_rib;
+		lec->drec.cookie = lec;
+		lec->drec.record_send = lec_dgp_record_send;
+		lec->drec.tx_backlog = lec_dgp_tx_backlog;
+		lec->drec.rx_pause = lec_dgp_rx_pause;
+		lec->drec.session_error = lec_dgp_session_error;
+		dgp_record_start(&lec->drec);
+	} else {
+		lec->dgp_mode = DGP_MODE_TCP;
+
+		if (shared_tun_registered) {
+			lec->dle.dls = &shared_dls;
+		} else {
+			lec->dls.myid = keyid;
+			lec->dls.ifindex = lec->dp.ifindex;
+			lec->dls.loc_rib = &loc_rib;
+			lec->dls.permit_readonly = 0;
+			dgp_listen_socket_register(&lec->dls);
+
+			lec->dle.dls = &lec->dls;
+		}
+		lec->dle.remoteid = lec->peerid;
+		dgp_listen_entry_register(&lec->dle);
+	}
+}
+
+static void lec_dgp_fallback(void *_lec)
 {
 	struct listen_entry_conn *lec = _lec;
-	uint8_t sndbuf[len + 3];
 
-	sndbuf[0] = 0x00;
-	sndbuf[1] = len >> 8;
-	sndbuf[2] = len & 0xff;
-	memcpy(sndbuf + 3, buf, len);
+	lec_dgp_start(lec, 0);
+}
+
+static void lec_itf_done(void *_lec, int err)
+{
+	struct listen_entry_conn *lec = _lec;
 
-	tconn_listen_entry_record_send(lec->conn, sndbuf, len + 3);
+	if (err < 0 && err != -EEXIST) {
+		fprintf(stderr, "%s: error configuring interface: %s\n",
+			lec->cle->name, strerror(-err));
+	}
 }
 
 static void lec_destroy(struct listen_entry_conn *lec, int disconnect_tconn)
@@ -483,15 +2251,32 @@ static void lec_destroy(struct listen_entry_conn *lec, int disconnect_tconn)
 
 	lec->cle->num_connections--;
 
-	dgp_listen_entry_unregister(&lec->dle);
-	dgp_listen_socket_unregister(&lec->dls);
+	if (iv_timer_registered(&lec->dgp_fallback))
+		iv_timer_unregister(&lec->dgp_fallback);
+
+	if (lec->dgp_mode == DGP_MODE_TCP) {
+		dgp_listen_entry_unregister(&lec->dle);
+		if (lec->dle.dls == &lec->dls)
+			dgp_listen_socket_unregister(&lec->dls);
+	} else if (lec->dgp_mode == DGP_MODE_RECORD) {
+		dgp_record_stop(&lec->drec);
+	}
 
 	if (disconnect_tconn)
 		tconn_listen_entry_disconnect(lec->conn);
 
 	iv_avl_tree_delete(&direct_peers, &lec->dp.an);
 
-	tun_interface_unregister(&lec->tun);
+	rtnl_cancel(lec);
+
+	if (lec->udp)
+		udpchan_unregister(&lec->uc);
+
+	peer_fib_detach(&lec->dp, lec->peerid);
+
+	worker_call(lec->worker, lec_dp_stop, lec);
+	worker_put(lec->worker);
+	worker_put(lec->tls_worker);
 
 	if (lec->cle->peer_type != CONF_PEER_TYPE_DBONLY)
 		mylsa_del_peer(lec->peerid);
@@ -502,10 +2287,10 @@ static void lec_destroy(struct listen_entry_conn *lec, int disconnect_tconn)
 static void *cle_new_conn(void *_cle, void *conn, const uint8_t *id)
 {
 	struct conf_listen_entry *cle = _cle;
+	struct conf_listening_socket *cls;
 	uint8_t addr[16];
 	struct listen_entry_conn *lec;
 	int maxseg;
-	int mtu;
 	char *tunitf;
 
 	v6_global_addr_from_key_id(addr, id);
@@ -520,14 +2305,35 @@ static void *cle_new_conn(void *_cle, void *conn, const uint8_t *id)
 	lec->conn = conn;
 	memcpy(lec->peerid, id, NODE_ID_LEN);
 
-	lec->tun.itfname = cle->tunitf;
-	lec->tun.cookie = lec;
-	lec->tun.got_packet = lec_tun_got_packet;
-	if (tun_interface_register(&lec->tun) < 0) {
+	if (conf->data_plane_threads)
+		lec->worker = worker_get();
+
+	cls = iv_container_of(cle->tle.tls, struct conf_listening_socket, tls);
+	if (conf->udp_data_channel && cls->udp_registered &&
+	    lec->worker == NULL) {
+		lec->uc.us = &cls->us;
+		lec->uc.cookie = lec;
+		lec->uc.packet_received = lec_udp_packet;
+		if (udpchan_register(&lec->uc) == 0)
+			lec->udp = 1;
+	}
+
+	if (lec->worker != NULL)
+		lec_dp_set_worker(lec);
+	else
+		lec_dp_start(lec);
+
+	if (lec->tunp == NULL) {
+		worker_call(lec->worker, lec_dp_stop, lec);
+		if (lec->udp)
+			udpchan_unregister(&lec->uc);
+		worker_put(lec->worker);
 		free(lec);
 		return NULL;
 	}
 
+	lec->tls_worker = tls_offload_start(tconn_listen_entry_get_tconn(conn));
+
 	if (cle->conn_limit == cle->num_connections) {
 		struct listen_entry_conn *oldlec;
 
@@ -552,44 +2358,35 @@ static void *cle_new_conn(void *_cle, void *conn, const uint8_t *id)
 		mylsa_add_peer(lec->peerid, cle->peer_type, cost);
 	}
 
-	maxseg = tconn_listen_entry_get_maxseg(conn);
-	if (maxseg < 0)
-		abort();
-
-	mtu = maxseg - 5 - 8 - 3 - 16;
-	if (mtu < 1280)
-		mtu = 1280;
-	else if (mtu > 1500)
-		mtu = 1500;
-
-	fprintf(stderr, "%s: setting interface MTU to %d\n", cle->name, mtu);
-
-	tunitf = tun_interface_get_name(&lec->tun);
+	tunitf = tun_interface_get_name(lec->tunp);
 
-	itf_set_mtu(tunitf, mtu);
+	if (!shared_tun_registered) {
+		maxseg = tconn_listen_entry_get_maxseg(conn);
+		if (maxseg < 0)
+			abort();
 
-	itf_set_state(tunitf, 1);
-
-	v6_linklocal_addr_from_key_id(addr, keyid);
-	itf_add_addr_v6(tunitf, addr, 10);
-
-	v6_global_addr_from_key_id(addr, keyid);
-	itf_add_addr_v6(tunitf, addr, 128);
+		peer_tun_setup(cle->name, tunitf, maxseg, lec, lec_itf_done);
+	}
 
 	v6_global_addr_from_key_id(lec->dp.addr, id);
 	lec->dp.itfname = tunitf;
+	lec->dp.ifindex = if_nametoindex(tunitf);
 	if (iv_avl_tree_insert(&direct_peers, &lec->dp.an))
 		abort();
 
-	lec->dls.myid = keyid;
-	lec->dls.ifindex = if_nametoindex(tunitf);
-	lec->dls.loc_rib = &loc_rib;
-	lec->dls.permit_readonly = 0;
-	dgp_listen_socket_register(&lec->dls);
+	peer_fib_attach(&lec->dp, id, &lec->tb);
+
+	lec->dgp_mode = DGP_MODE_NONE;
 
-	lec->dle.dls = &lec->dls;
-	lec->dle.remoteid = lec->peerid;
-	dgp_listen_entry_register(&lec->dle);
+	IV_TIMER_INIT(&lec->dgp_fallback);
+	iv_validate_now();
+	lec->dgp_fallback.expires = iv_now;
+	timespec_add_ms(&lec->dgp_fallback.expires,
+			1000 * DGP_FALLBACK_TIMEOUT,
+			1000 * DGP_FALLBACK_TIMEOUT);
+	lec->dgp_fallback.cookie = lec;
+	lec->dgp_fallback.handler = lec_dgp_fallback;
+	iv_timer_register(&lec->dgp_fallback);
 
 	cle->num_connections++;
 	iv_list_add_tail(&lec->list, &cle->connections);
@@ -600,19 +2397,31 @@ static void *cle_new_conn(void *_cle, void *conn, const uint8_t *id)
 static void lec_record_received(void *_lec, const uint8_t *rec, int len)
 {
 	struct listen_entry_conn *lec = _lec;
-	int rlen;
+	uint32_t id;
+	int port;
 
-	if (len <= 3)
+	if (len >= 1 && rec[0] == RECORD_TYPE_DGP) {
+		if (lec->dgp_mode == DGP_MODE_RECORD)
+			dgp_record_received(&lec->drec, rec + 1, len - 1);
 		return;
+	}
 
-	if (rec[0] != 0x00)
-		return;
+	if (lec->udp && udp_data_peer_params(rec, len, &id, &port))
+		lec_udp_set_keys(lec, id);
 
-	rlen = (rec[1] << 8) | rec[2];
-	if (rlen + 3 != len)
-		return;
+	if (lec->worker == NULL)
+		tun_batch_record_received(&lec->tb, lec->tunp, rec, len);
+
+	if (len >= 2 && rec[0] == RECORD_TYPE_CAPS)
+		lec_dgp_start(lec, !!(rec[1] & CAP_DGP));
+}
+
+static void lec_tx_ready(void *_lec)
+{
+	struct listen_entry_conn *lec = _lec;
 
-	tun_interface_send_packet(&lec->tun, rec + 3, rlen);
+	if (lec->dgp_mode == DGP_MODE_RECORD)
+		dgp_record_tx_ready(&lec->drec);
 }
 
 static void lec_disconnect(void *_lec)
@@ -638,6 +2447,7 @@ static int start_conf_connect_entry(struct conf_connect_entry *cce)
 	cce->tc.new_conn = cce_new_conn;
 	cce->tc.record_received = cec_record_received;
 	cce->tc.disconnect = cec_disconnect;
+	cce->tc.tx_ready = cec_tx_ready;
 	tconn_connect_start(&cce->tc);
 
 	INIT_IV_LIST_HEAD(&cce->connections);
@@ -675,6 +2485,7 @@ static int start_conf_listen_entry(struct conf_listening_socket *cls,
 	cle->tle.new_conn = cle_new_conn;
 	cle->tle.record_received = lec_record_received;
 	cle->tle.disconnect = lec_disconnect;
+	cle->tle.tx_ready = lec_tx_ready;
 	tconn_listen_entry_register(&cle->tle);
 
 	cle->num_connections = 0;
@@ -714,6 +2525,13 @@ static int start_conf_listening_socket(struct conf_listening_socket *cls)
 
 	cls->registered = 1;
 
+	cls->udp_registered = 0;
+	if (conf->udp_data_channel) {
+		cls->us.local_address = cls->listen_address;
+		if (udpchan_socket_register(&cls->us) == 0)
+			cls->udp_registered = 1;
+	}
+
 	iv_avl_tree_for_each (an, &cls->listen_entries) {
 		struct conf_listen_entry *cle;
 
@@ -739,6 +2557,9 @@ static void stop_conf_listening_socket(struct conf_listening_socket *cls)
 			stop_conf_listen_entry(cle);
 	}
 
+	if (cls->udp_registered)
+		udpchan_socket_unregister(&cls->us);
+
 	tconn_listen_socket_unregister(&cls->tls);
 }
 
@@ -791,8 +2612,6 @@ err:
 	return 1;
 }
 
-static const char *config = "/etc/dvpn.ini";
-static struct conf *conf;
 static struct iv_signal sighup;
 static struct iv_signal sigint;
 static struct iv_signal sigusr1;
@@ -861,8 +2680,20 @@ static void got_sighup(void *_dummy)
 	req.removed_listening_socket = removed_listening_socket;
 	req.new_listen_entry = new_listen_entry;
 	req.removed_listen_entry = removed_listen_entry;
+	conf->udp_data_channel = newconf->udp_data_channel;
 	diff_configs(&req);
 
+	conf->lsa_hold_down = newconf->lsa_hold_down;
+
+	conf->kernel_tls = newconf->kernel_tls;
+	tconn_set_kernel_tls(conf->kernel_tls);
+
+	conf->io_uring = newconf->io_uring;
+	tun_set_io_uring(conf->io_uring);
+	tconn_set_io_uring(conf->io_uring);
+
+	conf->forward_transit = newconf->forward_transit;
+
 	free_config(newconf);
 }
 
@@ -876,14 +2707,201 @@ static void got_sigint(void *_dummy)
 
 	rt_builder_deinit(&rb);
 
+	rt_sync_deinit(&rs);
+
 	stop_config(conf);
 
+	if (shared_tun_registered)
+		shared_tun_stop();
+
+	fib_deinit(&fib);
+
+	mylsa_deinit();
+
 	dgp_listen_socket_unregister(&dls);
+
+	tconn_set_handshake_offload(0);
+	worker_pool_stop();
+}
+
+static void print_txq_stats(FILE *fp, const char *name, struct tun_batch *tb,
+			    struct tconn_txq_stats *st)
+{
+	static const char *class_names[TCONN_NUM_CLASSES] = {
+		[TCONN_CLASS_BULK] = "bulk",
+		[TCONN_CLASS_PRIO] = "prio",
+		[TCONN_CLASS_CTRL] = "ctrl",
+	};
+	int i;
+
+	fprintf(fp, "  %s:\n", name);
+
+	for (i = TCONN_NUM_CLASSES - 1; i >= 0; i--) {
+		uint64_t avg;
+
+		avg = st[i].dequeued ?
+			st[i].sojourn_total_us / st[i].dequeued : 0;
+
+		fprintf(fp, "    %s: %llu packets, %d queued (%d bytes), "
+			    "%llu enqueued, %llu dropped, %llu overflows, "
+			    "sojourn avg %llu us max %d us\n",
+			class_names[i], (unsigned long long)tb->packets[i],
+			st[i].queue_len, st[i].queue_bytes,
+			(unsigned long long)st[i].enqueued,
+			(unsigned long long)st[i].dropped,
+			(unsigned long long)st[i].overflows,
+			(unsigned long long)avg, st[i].sojourn_max_us);
+	}
+}
+
+static void print_ring_stats(FILE *fp, const char *dir,
+			     struct tconn_ring_stats *st)
+{
+	uint64_t avg;
+
+	avg = st->records ? st->latency_total_us / st->records : 0;
+
+	fprintf(fp, "    %s ring: %d queued (%d bytes, max %d), "
+		    "%llu records, %llu spilled, %llu dropped, "
+		    "latency avg %llu us max %d us\n",
+		dir, st->queue_len, st->queue_bytes, st->queue_max_bytes,
+		(unsigned long long)st->records,
+		(unsigned long long)st->spilled,
+		(unsigned long long)st->dropped,
+		(unsigned long long)avg, st->latency_max_us);
+}
+
+static void print_rings(FILE *fp, struct tconn *tc)
+{
+	struct tconn_ring_stats rx;
+	struct tconn_ring_stats tx;
+
+	if (tc != NULL && tconn_get_ring_stats(tc, &rx, &tx) == 0) {
+		print_ring_stats(fp, "rx", &rx);
+		print_ring_stats(fp, "tx", &tx);
+	}
+}
+
+/*
+ * Tun interfaces are only ever touched by the thread that they were
+ * registered on, so their counters are read from there.
+ */
+struct tun_stats_query {
+	struct tun_interface	*tun;
+	struct tun_egress_stats	st;
+};
+
+static void tun_stats_run(void *_q)
+{
+	struct tun_stats_query *q = _q;
+
+	tun_interface_get_egress_stats(q->tun, &q->st);
+}
+
+static void print_tun_stats(FILE *fp, const char *name, struct worker *w,
+			    struct tun_interface *tun)
+{
+	struct tun_stats_query q;
+
+	q.tun = tun;
+	worker_call(w, tun_stats_run, &q);
+
+	fprintf(fp, "    %s egress: %d queued (%d bytes, max %d), "
+		    "%llu written, %llu deferred, %llu dropped\n",
+		name, q.st.queue_len, q.st.queue_bytes, q.st.queue_max_bytes,
+		(unsigned long long)q.st.written,
+		(unsigned long long)q.st.queued,
+		(unsigned long long)q.st.dropped);
+	fprintf(fp, "    %s backend: %s, %llu read/write syscalls\n",
+		name, q.st.io_uring ? "io_uring" : "read/write",
+		(unsigned long long)q.st.syscalls);
+}
+
+static void print_shared_tun_stats(FILE *fp)
+{
+	int i;
+
+	if (!shared_tun_registered)
+		return;
+
+	fprintf(fp, "shared tun interface %s:\n",
+		tun_interface_get_name(&shared_tun));
+	print_tun_stats(fp, "main", NULL, &shared_tun);
+
+	for (i = 0; i < shared_tun_num_queues(); i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "queue %d", i + 1);
+		print_tun_stats(fp, name, worker_pool_member(i),
+				&shared_tun_queues[i].tun);
+	}
+}
+
+static void print_tx_queues(FILE *fp)
+{
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+	struct iv_list_head *lh;
+	struct tconn_txq_stats st[TCONN_NUM_CLASSES];
+
+	fprintf(fp, "tconn transmit queues:\n");
+
+	iv_avl_tree_for_each (an, &conf->connect_entries) {
+		struct conf_connect_entry *cce;
+
+		cce = iv_container_of(an, struct conf_connect_entry, an);
+		iv_list_for_each (lh, &cce->connections) {
+			struct connect_entry_conn *cec;
+
+			cec = iv_container_of(lh, struct connect_entry_conn,
+					      list);
+			if (tconn_connect_get_txq_stats(cec->conn, st) == 0) {
+				print_txq_stats(fp, cce->name, &cec->tb, st);
+				print_rings(fp,
+					    tconn_connect_get_tconn(cec->conn));
+				if (cec->tunp == &cec->tun) {
+					print_tun_stats(fp, "tun", cec->worker,
+							&cec->tun);
+				}
+			}
+		}
+	}
+
+	iv_avl_tree_for_each (an, &conf->listening_sockets) {
+		struct conf_listening_socket *cls;
+
+		cls = iv_container_of(an, struct conf_listening_socket, an);
+		iv_avl_tree_for_each (an2, &cls->listen_entries) {
+			struct conf_listen_entry *cle;
+
+			cle = iv_container_of(an2, struct conf_listen_entry,
+					      an);
+			iv_list_for_each (lh, &cle->connections) {
+				struct listen_entry_conn *lec;
+				struct tconn *tc;
+
+				lec = iv_container_of(lh,
+					struct listen_entry_conn, list);
+				tconn_listen_entry_get_txq_stats(lec->conn, st);
+				print_txq_stats(fp, cle->name, &lec->tb, st);
+				tc = tconn_listen_entry_get_tconn(lec->conn);
+				print_rings(fp, tc);
+				if (lec->tunp == &lec->tun) {
+					print_tun_stats(fp, "tun", lec->worker,
+							&lec->tun);
+				}
+			}
+		}
+	}
 }
 
 static void got_sigusr1(void *_dummy)
 {
 	loc_rib_print(stderr, &loc_rib);
+	lsa_verify_print_stats(stderr);
+	dgp_writer_print_stats(stderr);
+	print_tx_queues(stderr);
+	print_shared_tun_stats(stderr);
 }
 
 int dvpn(const char *_config)
@@ -896,6 +2914,10 @@ int dvpn(const char *_config)
 
 	gnutls_global_init();
 
+	tconn_set_kernel_tls(conf->kernel_tls);
+	tun_set_io_uring(conf->io_uring);
+	tconn_set_io_uring(conf->io_uring);
+
 	if (x509_read_privkey(&rolekey, conf->role_key, 1) < 0)
 		return 1;
 
@@ -934,6 +2956,8 @@ int dvpn(const char *_config)
 	if (x509_get_privkey_id(keyid, privkey) < 0)
 		return 1;
 
+	v6_global_addr_from_key_id(myaddr, keyid);
+
 	if (x509_generate_self_signed_cert(&crt[0], privkey) < 0)
 		return 1;
 
@@ -965,6 +2989,46 @@ int dvpn(const char *_config)
 	loc_rib.myid = keyid;
 	loc_rib_init(&loc_rib);
 
+	rt_sync_init(&rs);
+
+	fib_init(&fib);
+
+	if (conf->data_plane_threads) {
+		if (worker_pool_start(conf->data_plane_threads) < 0)
+			return 1;
+
+		fprintf(stderr, "dvpn: using %d data plane threads\n",
+			conf->data_plane_threads);
+
+		if (conf->tls_offload_threads) {
+			fprintf(stderr, "dvpn: ignoring TLSOffloadThreads "
+					"as DataPlaneThreads is set\n");
+			conf->tls_offload_threads = 0;
+		}
+
+		if (conf->udp_data_channel) {
+			fprintf(stderr, "dvpn: UDP data channel is not "
+					"supported with data plane threads\n");
+		}
+	} else if (conf->tls_offload_threads) {
+		if (worker_pool_start(conf->tls_offload_threads) < 0)
+			return 1;
+
+		fprintf(stderr, "dvpn: offloading TLS record processing to "
+				"%d threads\n", conf->tls_offload_threads);
+	}
+
+	/*
+	 * With a worker pool, each connection's TLS handshake runs on
+	 * one of the workers too, so that a flood of (re)connecting
+	 * peers doesn't hold up the main thread.
+	 */
+	if (worker_pool_size())
+		tconn_set_handshake_offload(1);
+
+	if (conf->shared_tunitf != NULL && shared_tun_start() < 0)
+		return 1;
+
 	rb.rib = &loc_rib;
 	rb.myid = keyid;
 	rb.cookie = NULL;
@@ -994,6 +3058,8 @@ int dvpn(const char *_config)
 
 	loc_rib_add_lsa(&loc_rib, me);
 
+	mylsa_init();
+
 	if (start_config(conf))
 		return 1;
 
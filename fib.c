@@ -0,0 +1,305 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv_avl.h>
+#include <string.h>
+#include "fib.h"
+
+/*
+ * The forwarding table maps IPv6 /128 destinations to next hop
+ * addresses, as handed out by rt_builder, and each next hop to the
+ * cookie (typically a connection) that was attached to it, if any.
+ * Routes don't point at connections directly, so that connections
+ * can come and go without having to walk the route table, and a
+ * lookup is a single tree search followed by a pointer dereference.
+ *
+ * Next hops are shared between all routes that use them, and are
+ * freed once they are neither used by a route nor attached.
+ *
+ * The table is only ever modified by the thread that owns it, which
+ * can look things up without further ado.  Other threads (data plane
+ * workers) must hold the read lock around fib_lookup(), and for as
+ * long as they use the cookie that it returned.
+ */
+struct fib_nexthop {
+	struct iv_avl_node	an;
+	uint8_t			addr[16];
+	int			refcount;
+	void			*cookie;
+};
+
+struct fib_route {
+	struct iv_avl_node	an;
+	uint8_t			dest[16];
+	struct fib_nexthop	*nh;
+};
+
+static int compare_routes(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct fib_route *a;
+	struct fib_route *b;
+
+	a = iv_container_of(_a, struct fib_route, an);
+	b = iv_container_of(_b, struct fib_route, an);
+
+	return memcmp(a->dest, b->dest, 16);
+}
+
+static int compare_nexthops(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct fib_nexthop *a;
+	struct fib_nexthop *b;
+
+	a = iv_container_of(_a, struct fib_nexthop, an);
+	b = iv_container_of(_b, struct fib_nexthop, an);
+
+	return memcmp(a->addr, b->addr, 16);
+}
+
+void fib_init(struct fib *fib)
+{
+	INIT_IV_AVL_TREE(&fib->routes, compare_routes);
+	INIT_IV_AVL_TREE(&fib->nexthops, compare_nexthops);
+	pthread_rwlock_init(&fib->lock, NULL);
+}
+
+static struct fib_route *find_route(struct fib *fib, const uint8_t *dest)
+{
+	struct iv_avl_node *an;
+
+	an = fib->routes.root;
+	while (an != NULL) {
+		struct fib_route *r;
+		int ret;
+
+		r = iv_container_of(an, struct fib_route, an);
+
+		ret = memcmp(dest, r->dest, 16);
+		if (ret == 0)
+			return r;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static struct fib_nexthop *find_nexthop(struct fib *fib, const uint8_t *addr)
+{
+	struct iv_avl_node *an;
+
+	an = fib->nexthops.root;
+	while (an != NULL) {
+		struct fib_nexthop *nh;
+		int ret;
+
+		nh = iv_container_of(an, struct fib_nexthop, an);
+
+		ret = memcmp(addr, nh->addr, 16);
+		if (ret == 0)
+			return nh;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static struct fib_nexthop *get_nexthop(struct fib *fib, const uint8_t *addr)
+{
+	struct fib_nexthop *nh;
+
+	nh = find_nexthop(fib, addr);
+	if (nh != NULL) {
+		nh->refcount++;
+		return nh;
+	}
+
+	nh = malloc(sizeof(*nh));
+	if (nh == NULL) {
+		fprintf(stderr, "get_nexthop: memory allocation failure\n");
+		return NULL;
+	}
+
+	memcpy(nh->addr, addr, 16);
+	nh->refcount = 1;
+	nh->cookie = NULL;
+	iv_avl_tree_insert(&fib->nexthops, &nh->an);
+
+	return nh;
+}
+
+static void put_nexthop(struct fib *fib, struct fib_nexthop *nh)
+{
+	if (--nh->refcount == 0) {
+		iv_avl_tree_delete(&fib->nexthops, &nh->an);
+		free(nh);
+	}
+}
+
+void fib_deinit(struct fib *fib)
+{
+	while (fib->routes.root != NULL) {
+		struct fib_route *r;
+
+		r = iv_container_of(fib->routes.root, struct fib_route, an);
+		iv_avl_tree_delete(&fib->routes, &r->an);
+		put_nexthop(fib, r->nh);
+		free(r);
+	}
+
+	while (fib->nexthops.root != NULL) {
+		struct fib_nexthop *nh;
+
+		nh = iv_container_of(fib->nexthops.root,
+				     struct fib_nexthop, an);
+		iv_avl_tree_delete(&fib->nexthops, &nh->an);
+		free(nh);
+	}
+
+	pthread_rwlock_destroy(&fib->lock);
+}
+
+static int route_set(struct fib *fib, const uint8_t *dest, const uint8_t *nh)
+{
+	struct fib_route *r;
+
+	r = find_route(fib, dest);
+
+	if (nh == NULL) {
+		if (r != NULL) {
+			iv_avl_tree_delete(&fib->routes, &r->an);
+			put_nexthop(fib, r->nh);
+			free(r);
+		}
+		return 0;
+	}
+
+	if (r != NULL) {
+		struct fib_nexthop *old;
+
+		if (!memcmp(r->nh->addr, nh, 16))
+			return 0;
+
+		old = r->nh;
+		r->nh = get_nexthop(fib, nh);
+		if (r->nh == NULL) {
+			r->nh = old;
+			return -1;
+		}
+		put_nexthop(fib, old);
+
+		return 0;
+	}
+
+	r = malloc(sizeof(*r));
+	if (r == NULL) {
+		fprintf(stderr, "fib_route_set: memory allocation failure\n");
+		return -1;
+	}
+
+	memcpy(r->dest, dest, 16);
+	r->nh = get_nexthop(fib, nh);
+	if (r->nh == NULL) {
+		free(r);
+		return -1;
+	}
+	iv_avl_tree_insert(&fib->routes, &r->an);
+
+	return 0;
+}
+
+int fib_route_set(struct fib *fib, const uint8_t *dest, const uint8_t *nh)
+{
+	int ret;
+
+	pthread_rwlock_wrlock(&fib->lock);
+	ret = route_set(fib, dest, nh);
+	pthread_rwlock_unlock(&fib->lock);
+
+	return ret;
+}
+
+int fib_nexthop_attach(struct fib *fib, const uint8_t *addr, void *cookie)
+{
+	struct fib_nexthop *nh;
+	int ret;
+
+	pthread_rwlock_wrlock(&fib->lock);
+
+	ret = -1;
+
+	nh = get_nexthop(fib, addr);
+	if (nh != NULL) {
+		if (nh->cookie == NULL) {
+			nh->cookie = cookie;
+			ret = 0;
+		} else {
+			put_nexthop(fib, nh);
+		}
+	}
+
+	pthread_rwlock_unlock(&fib->lock);
+
+	return ret;
+}
+
+void fib_nexthop_detach(struct fib *fib, const uint8_t *addr)
+{
+	struct fib_nexthop *nh;
+
+	pthread_rwlock_wrlock(&fib->lock);
+
+	nh = find_nexthop(fib, addr);
+	if (nh != NULL && nh->cookie != NULL) {
+		nh->cookie = NULL;
+		put_nexthop(fib, nh);
+	}
+
+	pthread_rwlock_unlock(&fib->lock);
+}
+
+void *fib_lookup(struct fib *fib, const uint8_t *dest)
+{
+	struct fib_route *r;
+
+	r = find_route(fib, dest);
+	if (r == NULL)
+		return NULL;
+
+	return r->nh->cookie;
+}
+
+void fib_read_lock(struct fib *fib)
+{
+	pthread_rwlock_rdlock(&fib->lock);
+}
+
+void fib_read_unlock(struct fib *fib)
+{
+	pthread_rwlock_unlock(&fib->lock);
+}
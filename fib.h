@@ -0,0 +1,43 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __FIB_H
+#define __FIB_H
+
+#include <iv_avl.h>
+#include <pthread.h>
+#include <stdint.h>
+
+struct fib {
+	struct iv_avl_tree	routes;
+	struct iv_avl_tree	nexthops;
+	pthread_rwlock_t	lock;
+};
+
+void fib_init(struct fib *fib);
+void fib_deinit(struct fib *fib);
+int fib_route_set(struct fib *fib, const uint8_t *dest, const uint8_t *nh);
+int fib_nexthop_attach(struct fib *fib, const uint8_t *addr, void *cookie);
+void fib_nexthop_detach(struct fib *fib, const uint8_t *addr);
+void *fib_lookup(struct fib *fib, const uint8_t *dest);
+void fib_read_lock(struct fib *fib);
+void fib_read_unlock(struct fib *fib);
+
+
+#endif
@@ -0,0 +1,155 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "gso.h"
+
+/*
+ * A super-packet, as read from a tun interface that was opened with
+ * IFF_VNET_HDR, is a struct virtio_net_hdr followed by an IP packet
+ * of up to 64 KiB, which the kernel hasn't segmented (or computed
+ * the transport checksum of) yet.  As that is too big for a single
+ * TLS record, it is carried in a sequence of fragment records, each
+ * of which starts with the record type byte, followed by the total
+ * length of the super-packet and the offset of the fragment in it,
+ * as 24-bit big endian numbers.
+ *
+ * The fragments of a super-packet are sent back to back, in order,
+ * so the receiver only ever reassembles a single super-packet at a
+ * time.  A fragment that doesn't continue where the previous one
+ * left off (because a record got dropped in between) causes the
+ * partial super-packet to be thrown away.
+ */
+int gso_fragment(const uint8_t *buf, int len, int type, int maxrec,
+		 void *cookie,
+		 int (*sendv)(void *cookie, const struct iovec *iov,
+			      int iovcnt))
+{
+	int off;
+
+	if (len < GSO_HDR_LEN || len > GSO_MAX_LEN ||
+	    maxrec <= GSO_FRAG_HDR_LEN) {
+		return -1;
+	}
+
+	for (off = 0; off < len; ) {
+		uint8_t hdr[GSO_FRAG_HDR_LEN];
+		struct iovec iov[2];
+		int flen;
+
+		flen = len - off;
+		if (flen > maxrec - GSO_FRAG_HDR_LEN)
+			flen = maxrec - GSO_FRAG_HDR_LEN;
+
+		hdr[0] = type;
+		hdr[1] = len >> 16;
+		hdr[2] = len >> 8;
+		hdr[3] = len & 0xff;
+		hdr[4] = off >> 16;
+		hdr[5] = off >> 8;
+		hdr[6] = off & 0xff;
+
+		iov[0].iov_base = hdr;
+		iov[0].iov_len = sizeof(hdr);
+		iov[1].iov_base = (void *)(buf + off);
+		iov[1].iov_len = flen;
+
+		if (sendv(cookie, iov, 2))
+			return -1;
+
+		off += flen;
+	}
+
+	return 0;
+}
+
+void gso_reasm_init(struct gso_reasm *gr)
+{
+	gr->total = 0;
+	gr->len = 0;
+	gr->buf = NULL;
+}
+
+void gso_reasm_deinit(struct gso_reasm *gr)
+{
+	free(gr->buf);
+	gr->buf = NULL;
+}
+
+/*
+ * Takes a fragment record without its type byte.  Returns the length
+ * of the super-packet in gr->buf once the fragment completes it, 0 if
+ * more fragments are needed, and -1 if the fragment was dropped.
+ */
+int gso_reasm_add(struct gso_reasm *gr, const uint8_t *frag, int len)
+{
+	int total;
+	int off;
+
+	if (len <= GSO_FRAG_HDR_LEN - 1)
+		return -1;
+
+	total = (frag[0] << 16) | (frag[1] << 8) | frag[2];
+	off = (frag[3] << 16) | (frag[4] << 8) | frag[5];
+	frag += GSO_FRAG_HDR_LEN - 1;
+	len -= GSO_FRAG_HDR_LEN - 1;
+
+	if (total < GSO_HDR_LEN || total > GSO_MAX_LEN)
+		return -1;
+
+	if (off == 0) {
+		gr->total = total;
+		gr->len = 0;
+	} else if (total != gr->total || off != gr->len) {
+		gr->total = 0;
+		gr->len = 0;
+		return -1;
+	}
+
+	if (len > total - off) {
+		gr->total = 0;
+		gr->len = 0;
+		return -1;
+	}
+
+	if (gr->buf == NULL) {
+		gr->buf = malloc(GSO_MAX_LEN);
+		if (gr->buf == NULL) {
+			fprintf(stderr, "gso_reasm_add: memory allocation "
+					"failure\n");
+			gr->total = 0;
+			return -1;
+		}
+	}
+
+	memcpy(gr->buf + off, frag, len);
+	gr->len += len;
+
+	if (gr->len < gr->total)
+		return 0;
+
+	total = gr->total;
+	gr->total = 0;
+	gr->len = 0;
+
+	return total;
+}
@@ -0,0 +1,48 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __GSO_H
+#define __GSO_H
+
+#include <linux/virtio_net.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+#define GSO_HDR_LEN		((int)sizeof(struct virtio_net_hdr))
+#define GSO_MAX_LEN		(GSO_HDR_LEN + 65535)
+#define GSO_FRAG_HDR_LEN	7
+
+int gso_fragment(const uint8_t *buf, int len, int type, int maxrec,
+		 void *cookie,
+		 int (*sendv)(void *cookie, const struct iovec *iov,
+			      int iovcnt));
+
+struct gso_reasm {
+	int			total;
+	int			len;
+	uint8_t			*buf;
+};
+
+void gso_reasm_init(struct gso_reasm *gr);
+void gso_reasm_deinit(struct gso_reasm *gr);
+int gso_reasm_add(struct gso_reasm *gr, const uint8_t *frag, int len);
+
+
+#endif
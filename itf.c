@@ -22,175 +22,110 @@
 #include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <net/if.h>
 #include <string.h>
 #include <stdint.h>
-#include <sys/wait.h>
 #include <unistd.h>
 #include "itf.h"
+#include "rtnl.h"
 
 #define DEBUG	0
 
-static void print_args(char *const *argv)
+int itf_add_addr_v6(const char *itf, const uint8_t *addr, int len,
+		    void *cookie, void (*handler)(void *, int))
 {
-	const char *sep = "";
-	char *const *ptr;
-
-	ptr = argv;
-	while (*ptr != NULL) {
-		fprintf(stderr, "%s%s", sep, *ptr);
-		sep = " ";
-		ptr++;
-	}
-}
-
-static int spawnvp(const char *file, char *const *argv)
-{
-	pid_t pid;
-	int status;
-
-	if (DEBUG) {
-		fprintf(stderr, "running \"%s\", \"", file);
-		print_args(argv);
-		fprintf(stderr, "\"\n");
-	}
-
-	pid = fork();
-	if (pid < 0) {
-		perror("fork");
+	struct {
+		struct nlmsghdr		nh;
+		struct ifaddrmsg	ifa;
+		uint8_t			attrbuf[64];
+	} req;
+	int ifindex;
+
+	ifindex = if_nametoindex(itf);
+	if (ifindex == 0)
 		return -1;
-	}
 
-	if (pid == 0) {
-		int err;
+	memset(&req, 0, sizeof(req));
 
-		execvp(file, argv);
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifa));
+	req.nh.nlmsg_type = RTM_NEWADDR;
+	req.nh.nlmsg_flags = NLM_F_CREATE | NLM_F_EXCL;
 
-		err = errno;
-		fprintf(stderr, "execvp(\"%s\", \"", file);
-		print_args(argv);
-		fprintf(stderr, "\"): %s\n", strerror(err));
-
-		exit(1);
-	}
+	req.ifa.ifa_family = AF_INET6;
+	req.ifa.ifa_prefixlen = len;
+	req.ifa.ifa_index = ifindex;
 
-	do {
-		int ret;
+	rtnl_add_attr(&req.nh, sizeof(req), IFA_LOCAL, addr, 16);
+	rtnl_add_attr(&req.nh, sizeof(req), IFA_ADDRESS, addr, 16);
 
-		do {
-			ret = waitpid(pid, &status, 0);
-		} while (ret < 0 && errno == EINTR);
-
-		if (ret < 0) {
-			perror("waitpid");
-			return -1;
-		}
-	} while (!WIFEXITED(status) && !WIFSIGNALED(status));
-
-	if (WIFSIGNALED(status)) {
-		if (DEBUG) {
-			fprintf(stderr, "child died with signal %d%s\n",
-				WTERMSIG(status),
-				WCOREDUMP(status) ? " and dumped core" : "");
-		}
-		return -1;
-	}
+	if (DEBUG) {
+		char caddr[64];
 
-	if (WEXITSTATUS(status)) {
-		if (DEBUG) {
-			fprintf(stderr, "child terminated with exit code %d\n",
-				WEXITSTATUS(status));
-		}
-		return -1;
+		inet_ntop(AF_INET6, addr, caddr, sizeof(caddr));
+		fprintf(stderr, "rtnetlink: addr add %s/%d dev %s\n",
+			caddr, len, itf);
 	}
 
-	return 0;
+	return rtnl_submit(&req.nh, cookie, handler);
 }
 
-int itf_add_addr_v6(const char *itf, const uint8_t *addr, int len)
+static int set_link(const char *itf, int mtu, int flags, int change,
+		    void *cookie, void (*handler)(void *, int))
 {
-	char caddr[64];
-	char *args[7];
-
-	inet_ntop(AF_INET6, addr, caddr, sizeof(caddr));
-	sprintf(caddr + strlen(caddr), "/%d", len);
-
-	args[0] = "ip";
-	args[1] = "addr";
-	args[2] = "add";
-	args[3] = caddr;
-	args[4] = "dev";
-	args[5] = (char *)itf;
-	args[6] = NULL;
-
-	return spawnvp("ip", args);
-}
+	struct {
+		struct nlmsghdr		nh;
+		struct ifinfomsg	ifi;
+		uint8_t			attrbuf[64];
+	} req;
+	int ifindex;
+
+	ifindex = if_nametoindex(itf);
+	if (ifindex == 0)
+		return -1;
 
-static int
-__route_v6_direct(char *action, const uint8_t *dest, const char *itf)
-{
-	char daddr[64];
-	char *args[7];
+	memset(&req, 0, sizeof(req));
 
-	inet_ntop(AF_INET6, dest, daddr, sizeof(daddr));
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.ifi));
+	req.nh.nlmsg_type = RTM_NEWLINK;
 
-	args[0] = "ip";
-	args[1] = "route";
-	args[2] = action;
-	args[3] = daddr;
-	args[4] = "dev";
-	args[5] = (char *)itf;
-	args[6] = NULL;
+	req.ifi.ifi_family = AF_UNSPEC;
+	req.ifi.ifi_index = ifindex;
+	req.ifi.ifi_flags = flags;
+	req.ifi.ifi_change = change;
 
-	return spawnvp("ip", args);
-}
+	if (mtu) {
+		uint32_t val = mtu;
 
-int itf_add_route_v6_direct(const uint8_t *addr, const char *itf)
-{
-	return __route_v6_direct("add", addr, itf);
-}
+		rtnl_add_attr(&req.nh, sizeof(req), IFLA_MTU,
+			      &val, sizeof(val));
+	}
 
-int itf_chg_route_v6_direct(const uint8_t *addr, const char *itf)
-{
-	return __route_v6_direct("chg", addr, itf);
-}
+	if (DEBUG) {
+		fprintf(stderr, "rtnetlink: link set %s", itf);
+		if (mtu)
+			fprintf(stderr, " mtu %d", mtu);
+		if (change & IFF_UP)
+			fprintf(stderr, " %s", (flags & IFF_UP) ? "up" : "down");
+		fprintf(stderr, "\n");
+	}
 
-int itf_del_route_v6_direct(const uint8_t *addr, const char *itf)
-{
-	return __route_v6_direct("del", addr, itf);
+	return rtnl_submit(&req.nh, cookie, handler);
 }
 
-int itf_set_mtu(const char *itf, int mtu)
+int itf_set_mtu(const char *itf, int mtu,
+		void *cookie, void (*handler)(void *, int))
 {
-	char cmtu[32];
-	char *args[7];
-
-	sprintf(cmtu, "%d", mtu);
-
-	args[0] = "ip";
-	args[1] = "link";
-	args[2] = "set";
-	args[3] = (char *)itf;
-	args[4] = "mtu";
-	args[5] = cmtu;
-	args[6] = NULL;
-
-	return spawnvp("ip", args);
+	return set_link(itf, mtu, 0, 0, cookie, handler);
 }
 
-int itf_set_state(const char *itf, int up)
+int itf_set_state(const char *itf, int up,
+		  void *cookie, void (*handler)(void *, int))
 {
-	char *args[6];
-
-	args[0] = "ip";
-	args[1] = "link";
-	args[2] = "set";
-	args[3] = (char *)itf;
-	args[4] = up ? "up" : "down";
-	args[5] = NULL;
-
-	if (spawnvp("ip", args))
-		return -1;
-
+	/*
+	 * disable_ipv6 can't be changed over rtnetlink, but writing
+	 * the sysctl is cheap, and has to happen before addresses
+	 * are added, which the caller will queue up after this.
+	 */
 	if (up) {
 		char path[256];
 		int fd;
@@ -205,5 +140,5 @@ int itf_set_state(const char *itf, int up)
 		}
 	}
 
-	return 0;
+	return set_link(itf, 0, up ? IFF_UP : 0, IFF_UP, cookie, handler);
 }
@@ -20,12 +20,12 @@
 #ifndef __ITF_H
 #define __ITF_H
 
-int itf_add_addr_v6(const char *itf, const uint8_t *addr, int len);
-int itf_add_route_v6_direct(const uint8_t *addr, const char *itf);
-int itf_chg_route_v6_direct(const uint8_t *addr, const char *itf);
-int itf_del_route_v6_direct(const uint8_t *addr, const char *itf);
-int itf_set_mtu(const char *itf, int mtu);
-int itf_set_state(const char *itf, int up);
+int itf_add_addr_v6(const char *itf, const uint8_t *addr, int len,
+		    void *cookie, void (*handler)(void *, int));
+int itf_set_mtu(const char *itf, int mtu,
+		void *cookie, void (*handler)(void *, int));
+int itf_set_state(const char *itf, int up,
+		  void *cookie, void (*handler)(void *, int));
 
 
 #endif
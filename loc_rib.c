@@ -22,7 +22,6 @@
 #include <iv.h>
 #include <iv_avl.h>
 #include <iv_list.h>
-#include <netinet/in.h>
 #include <string.h>
 #include "lsa_diff.h"
 #include "lsa_path.h"
@@ -30,6 +29,19 @@
 #include "lsa_type.h"
 #include "loc_rib.h"
 
+/*
+ * The cost of a candidate LSA only depends on the most recent LSAs of
+ * the nodes on its advertisement path, and on the most recent LSA of
+ * the local node.  Every candidate therefore links a dependency into
+ * each of the nodes on its path, so that when the LSAs of a node
+ * change, only the IDs with candidates that traverse that node need
+ * to be recomputed.  A change to our own LSA dirties everything.
+ */
+struct loc_rib_dep {
+	struct iv_list_head	list;
+	struct loc_rib_lsa_ref	*ref;
+};
+
 static int compare_ids(struct iv_avl_node *_a, struct iv_avl_node *_b)
 {
 	struct loc_rib_id *a;
@@ -41,25 +53,6 @@ static int compare_ids(struct iv_avl_node *_a, struct iv_avl_node *_b)
 	return memcmp(a->id, b->id, NODE_ID_LEN);
 }
 
-static uint64_t lsa_get_version(struct lsa *lsa)
-{
-	struct lsa_attr *attr;
-	uint32_t *data;
-	uint64_t version;
-
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_VERSION, NULL, 0);
-	if (attr == NULL || !attr->attr_signed || attr->datalen != 8)
-		return 0;
-
-	data = lsa_attr_data(attr);
-
-	version = ntohl(data[0]);
-	version <<= 32;
-	version |= ntohl(data[1]);
-
-	return version;
-}
-
 static struct lsa *find_recent_lsa(struct loc_rib *rib, const uint8_t *id)
 {
 	struct loc_rib_id *rid;
@@ -84,7 +77,7 @@ static struct lsa *find_recent_lsa(struct loc_rib *rib, const uint8_t *id)
 static uint32_t
 lsa_path_cost(struct loc_rib *rib, struct loc_rib_id *rid, struct lsa *lsa)
 {
-	struct lsa_attr *pathattr;
+	const struct lsa_decoded *dec;
 	uint8_t *path;
 	int pathlen;
 	struct lsa *from;
@@ -92,15 +85,15 @@ lsa_path_cost(struct loc_rib *rib, struct loc_rib_id *rid, struct lsa *lsa)
 	int cost;
 	int i;
 
-	if (lsa_get_version(lsa) < rid->highest_version_seen)
+	dec = lsa_decode(lsa);
+	if (dec->version < rid->highest_version_seen)
 		return RIB_COST_INELIGIBLE;
 
-	pathattr = lsa_find_attr(lsa, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
-	if (pathattr == NULL)
+	if (dec->adv_path_len < 0)
 		abort();
 
-	path = lsa_attr_data(pathattr);
-	pathlen = pathattr->datalen;
+	path = dec->adv_path;
+	pathlen = dec->adv_path_len;
 
 	if ((pathlen % NODE_ID_LEN) != 0)
 		abort();
@@ -156,20 +149,20 @@ lsa_path_cost(struct loc_rib *rib, struct loc_rib_id *rid, struct lsa *lsa)
 
 static int lsa_has_shorter_adv_path(struct lsa *a, struct lsa *b)
 {
-	struct lsa_attr *apath;
+	const struct lsa_decoded *adec;
 
-	apath = lsa_find_attr(a, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
-	if (apath == NULL)
+	adec = lsa_decode(a);
+	if (adec->adv_path_len < 0)
 		abort();
 
 	if (b != NULL) {
-		struct lsa_attr *bpath;
+		const struct lsa_decoded *bdec;
 
-		bpath = lsa_find_attr(b, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
-		if (bpath == NULL)
+		bdec = lsa_decode(b);
+		if (bdec->adv_path_len < 0)
 			abort();
 
-		if (apath->datalen < bpath->datalen)
+		if (adec->adv_path_len < bdec->adv_path_len)
 			return 1;
 	}
 
@@ -241,14 +234,41 @@ static void recompute_rid(struct loc_rib *rib, struct loc_rib_id *rid)
 static void recompute_rib(void *_rib)
 {
 	struct loc_rib *rib = _rib;
-	struct iv_avl_node *an;
+	int visited;
 
-	iv_avl_tree_for_each (an, &rib->ids) {
-		struct loc_rib_id *rid;
+	visited = 0;
 
-		rid = iv_container_of(an, struct loc_rib_id, an);
-		recompute_rid(rib, rid);
+	if (rib->all_dirty) {
+		struct iv_avl_node *an;
+
+		rib->all_dirty = 0;
+
+		while (!iv_list_empty(&rib->dirty))
+			iv_list_del_init(rib->dirty.next);
+
+		iv_avl_tree_for_each (an, &rib->ids) {
+			struct loc_rib_id *rid;
+
+			rid = iv_container_of(an, struct loc_rib_id, an);
+			recompute_rid(rib, rid);
+			visited++;
+		}
+	} else {
+		while (!iv_list_empty(&rib->dirty)) {
+			struct loc_rib_id *rid;
+
+			rid = iv_container_of(rib->dirty.next,
+					      struct loc_rib_id, dirty);
+			iv_list_del_init(&rid->dirty);
+
+			recompute_rid(rib, rid);
+			visited++;
+		}
 	}
+
+	rib->recompute_runs++;
+	rib->recompute_ids_total += visited;
+	rib->recompute_ids_last = visited;
 }
 
 void loc_rib_init(struct loc_rib *rib)
@@ -259,7 +279,14 @@ void loc_rib_init(struct loc_rib *rib)
 	rib->recompute.cookie = rib;
 	rib->recompute.handler = recompute_rib;
 
+	INIT_IV_LIST_HEAD(&rib->dirty);
+	rib->all_dirty = 0;
+
 	INIT_IV_LIST_HEAD(&rib->listeners);
+
+	rib->recompute_runs = 0;
+	rib->recompute_ids_total = 0;
+	rib->recompute_ids_last = 0;
 }
 
 void loc_rib_deinit(struct loc_rib *rib)
@@ -280,6 +307,7 @@ void loc_rib_deinit(struct loc_rib *rib)
 
 			iv_avl_tree_delete(&rid->lsas, &ref->an);
 			lsa_put(ref->lsa);
+			free(ref->deps);
 			free(ref);
 		}
 
@@ -372,12 +400,82 @@ static struct loc_rib_id *get_id(struct loc_rib *rib, const uint8_t *id)
 	INIT_IV_AVL_TREE(&rid->lsas, compare_lsa_refs);
 	rid->best = NULL;
 	rid->bestcost = RIB_COST_INELIGIBLE;
+	INIT_IV_LIST_HEAD(&rid->dirty);
+	INIT_IV_LIST_HEAD(&rid->deps);
 
 	iv_avl_tree_insert(&rib->ids, &rid->an);
 
 	return rid;
 }
 
+static void ref_link_deps(struct loc_rib *rib, struct loc_rib_lsa_ref *ref)
+{
+	const struct lsa_decoded *dec;
+	int i;
+
+	dec = lsa_decode(ref->lsa);
+
+	ref->num_deps = (dec->adv_path_len > 0) ?
+				dec->adv_path_len / NODE_ID_LEN : 0;
+	if (!ref->num_deps) {
+		ref->deps = NULL;
+		return;
+	}
+
+	ref->deps = malloc(ref->num_deps * sizeof(*ref->deps));
+	if (ref->deps == NULL)
+		abort();
+
+	for (i = 0; i < ref->num_deps; i++) {
+		struct loc_rib_id *hop;
+
+		hop = get_id(rib, dec->adv_path + i * NODE_ID_LEN);
+
+		ref->deps[i].ref = ref;
+		iv_list_add_tail(&ref->deps[i].list, &hop->deps);
+	}
+}
+
+static void ref_unlink_deps(struct loc_rib_lsa_ref *ref)
+{
+	int i;
+
+	for (i = 0; i < ref->num_deps; i++)
+		iv_list_del(&ref->deps[i].list);
+
+	free(ref->deps);
+	ref->num_deps = 0;
+	ref->deps = NULL;
+}
+
+static void mark_dirty(struct loc_rib *rib, struct loc_rib_id *rid)
+{
+	if (iv_list_empty(&rid->dirty))
+		iv_list_add_tail(&rid->dirty, &rib->dirty);
+}
+
+static void id_changed(struct loc_rib *rib, struct loc_rib_id *rid)
+{
+	struct iv_list_head *lh;
+
+	if (rib->myid != NULL && !memcmp(rid->id, rib->myid, NODE_ID_LEN))
+		rib->all_dirty = 1;
+
+	if (!rib->all_dirty) {
+		mark_dirty(rib, rid);
+
+		iv_list_for_each (lh, &rid->deps) {
+			struct loc_rib_dep *dep;
+
+			dep = iv_container_of(lh, struct loc_rib_dep, list);
+			mark_dirty(rib, dep->ref->rid);
+		}
+	}
+
+	if (!iv_task_registered(&rib->recompute))
+		iv_task_register(&rib->recompute);
+}
+
 void loc_rib_add_lsa(struct loc_rib *rib, struct lsa *lsa)
 {
 	struct loc_rib_id *rid;
@@ -395,13 +493,14 @@ void loc_rib_add_lsa(struct loc_rib *rib, struct lsa *lsa)
 		fprintf(stderr, "loc_rib_add_lsa: duplicate LSA inserted!\n");
 		abort();
 	}
+	ref->rid = rid;
+	ref_link_deps(rib, ref);
 
 	ver = lsa_get_version(lsa);
 	if (rid->highest_version_seen < ver)
 		rid->highest_version_seen = ver;
 
-	if (!iv_task_registered(&rib->recompute))
-		iv_task_register(&rib->recompute);
+	id_changed(rib, rid);
 }
 
 static struct loc_rib_lsa_ref *
@@ -446,10 +545,12 @@ void loc_rib_mod_lsa(struct loc_rib *rib, struct lsa *old, struct lsa *new)
 	ref->lsa = lsa_get(new);
 	iv_avl_tree_insert(&rid->lsas, &ref->an);
 
+	ref_unlink_deps(ref);
+	ref_link_deps(rib, ref);
+
 	lsa_put(old);
 
-	if (!iv_task_registered(&rib->recompute))
-		iv_task_register(&rib->recompute);
+	id_changed(rib, rid);
 }
 
 void loc_rib_del_lsa(struct loc_rib *rib, struct lsa *lsa)
@@ -466,12 +567,12 @@ void loc_rib_del_lsa(struct loc_rib *rib, struct lsa *lsa)
 		abort();
 
 	iv_avl_tree_delete(&rid->lsas, &ref->an);
+	ref_unlink_deps(ref);
 
 	lsa_put(lsa);
 	free(ref);
 
-	if (!iv_task_registered(&rib->recompute))
-		iv_task_register(&rib->recompute);
+	id_changed(rib, rid);
 }
 
 void loc_rib_listener_register(struct loc_rib *rib, struct rib_listener *rl)
@@ -31,7 +31,13 @@ struct loc_rib {
 
 	struct iv_avl_tree	ids;
 	struct iv_task		recompute;
+	struct iv_list_head	dirty;
+	int			all_dirty;
 	struct iv_list_head	listeners;
+
+	uint64_t		recompute_runs;
+	uint64_t		recompute_ids_total;
+	int			recompute_ids_last;
 };
 
 struct loc_rib_id {
@@ -41,12 +47,17 @@ struct loc_rib_id {
 	struct iv_avl_tree	lsas;
 	struct lsa		*best;
 	uint32_t		bestcost;
+	struct iv_list_head	dirty;
+	struct iv_list_head	deps;
 };
 
 struct loc_rib_lsa_ref {
 	struct iv_avl_node	an;
 	struct lsa		*lsa;
 	uint32_t		cost;
+	struct loc_rib_id	*rid;
+	int			num_deps;
+	struct loc_rib_dep	*deps;
 };
 
 void loc_rib_init(struct loc_rib *rib);
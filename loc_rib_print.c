@@ -83,12 +83,20 @@ void loc_rib_print(FILE *fp, struct loc_rib *rib)
 	fprintf(fp, "===== BEGIN LOC-RIB DUMP ==============="
 		    "======================================\n");
 
+	fprintf(fp, "recompute runs: %llu, ids visited: %llu total, "
+		    "%d in last run\n",
+		(unsigned long long)rib->recompute_runs,
+		(unsigned long long)rib->recompute_ids_total,
+		rib->recompute_ids_last);
+
 	count = 0;
 	iv_avl_tree_for_each (an, &rib->ids) {
 		struct loc_rib_id *id;
 		struct iv_avl_node *an2;
 
 		id = iv_container_of(an, struct loc_rib_id, an);
+		if (iv_avl_tree_empty(&id->lsas))
+			continue;
 
 		if (count++)
 			fprintf(fp, "\n");
@@ -19,10 +19,12 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <arpa/inet.h>
 #include <iv_list.h>
 #include <string.h>
 #include "lsa.h"
 #include "lsa_serialise.h"
+#include "lsa_type.h"
 
 static size_t lsa_attr_size(const struct lsa_attr *attr);
 
@@ -75,10 +77,28 @@ struct lsa *lsa_alloc(const uint8_t *id)
 	lsa->bytes = MAX_SERIALISED_INT_LEN + NODE_ID_LEN;
 	memcpy(lsa->id, id, NODE_ID_LEN);
 	INIT_IV_AVL_TREE(&lsa->root.attrs, compare_attr_keys);
+	lsa->dec.valid = 0;
+	lsa->dec.peers = NULL;
+	lsa->verified = 0;
+	lsa->wire = NULL;
 
 	return lsa;
 }
 
+struct lsa_wire *lsa_wire_get(struct lsa_wire *wire)
+{
+	if (wire != NULL)
+		wire->refcount++;
+
+	return wire;
+}
+
+void lsa_wire_put(struct lsa_wire *wire)
+{
+	if (wire != NULL && !--wire->refcount)
+		free(wire);
+}
+
 struct lsa *lsa_get(struct lsa *lsa)
 {
 	if (lsa != NULL)
@@ -114,6 +134,8 @@ void lsa_put(struct lsa *lsa)
 	if (lsa != NULL && !--lsa->refcount) {
 		if (!iv_avl_tree_empty(&lsa->root.attrs))
 			attr_tree_free(lsa, lsa->root.attrs.root);
+		free(lsa->dec.peers);
+		lsa_wire_put(lsa->wire);
 		free(lsa);
 	}
 }
@@ -160,6 +182,120 @@ struct lsa *lsa_clone(const struct lsa *lsa)
 	return newlsa;
 }
 
+/*
+ * Shared LSAs are never modified, so the attributes that the routing
+ * code looks at all the time are decoded once and cached in the LSA.
+ * The cache is dropped by every mutator, as are the outcome of any
+ * earlier signature verification and the cached wire image.
+ */
+static void lsa_invalidate(struct lsa *lsa)
+{
+	if (lsa->dec.valid) {
+		free(lsa->dec.peers);
+		lsa->dec.peers = NULL;
+		lsa->dec.valid = 0;
+	}
+	lsa->verified = 0;
+
+	lsa_wire_put(lsa->wire);
+	lsa->wire = NULL;
+}
+
+static void lsa_decode_peer(struct lsa_decoded_peer *peer,
+			    struct lsa_attr *attr)
+{
+	struct lsa_attr_set *set;
+	struct lsa_attr *a;
+
+	memcpy(peer->id, lsa_attr_key(attr), NODE_ID_LEN);
+
+	set = lsa_attr_data(attr);
+
+	a = lsa_attr_set_find_attr(set, LSA_PEER_ATTR_TYPE_METRIC, NULL, 0);
+	if (a != NULL && a->attr_signed && a->datalen == 2)
+		peer->metric = ntohs(*((uint16_t *)lsa_attr_data(a)));
+	else
+		peer->metric = 1;
+
+	a = lsa_attr_set_find_attr(set, LSA_PEER_ATTR_TYPE_PEER_FLAGS,
+				   NULL, 0);
+	if (a != NULL && a->attr_signed && a->datalen == 1)
+		peer->flags = *((uint8_t *)lsa_attr_data(a));
+	else
+		peer->flags = 0;
+}
+
+static void lsa_do_decode(struct lsa *lsa)
+{
+	struct lsa_decoded *dec = &lsa->dec;
+	struct lsa_attr *attr;
+	struct iv_avl_node *an;
+	int num_peers;
+
+	dec->version = 0;
+	dec->adv_path = NULL;
+	dec->adv_path_len = -1;
+	dec->num_peers = 0;
+	dec->peers = NULL;
+
+	num_peers = 0;
+	iv_avl_tree_for_each (an, &lsa->root.attrs) {
+		attr = iv_container_of(an, struct lsa_attr, an);
+
+		if (attr->type == LSA_ATTR_TYPE_ADV_PATH && !attr->keylen) {
+			dec->adv_path = lsa_attr_data(attr);
+			dec->adv_path_len = attr->datalen;
+		} else if (attr->type == LSA_ATTR_TYPE_PEER &&
+			   attr->keylen == NODE_ID_LEN &&
+			   attr->attr_signed && attr->data_is_attr_set) {
+			num_peers++;
+		} else if (attr->type == LSA_ATTR_TYPE_VERSION &&
+			   !attr->keylen && attr->attr_signed &&
+			   attr->datalen == 8) {
+			uint32_t *data = lsa_attr_data(attr);
+
+			dec->version = ntohl(data[0]);
+			dec->version <<= 32;
+			dec->version |= ntohl(data[1]);
+		}
+	}
+
+	if (num_peers) {
+		dec->peers = malloc(num_peers * sizeof(*dec->peers));
+		if (dec->peers == NULL)
+			abort();
+	}
+
+	/*
+	 * Peer attributes with a NODE_ID_LEN key sort by key within
+	 * the attribute tree, so the resulting array is sorted by ID.
+	 */
+	iv_avl_tree_for_each (an, &lsa->root.attrs) {
+		attr = iv_container_of(an, struct lsa_attr, an);
+
+		if (attr->type == LSA_ATTR_TYPE_PEER &&
+		    attr->keylen == NODE_ID_LEN &&
+		    attr->attr_signed && attr->data_is_attr_set) {
+			lsa_decode_peer(&dec->peers[dec->num_peers++], attr);
+		}
+	}
+
+	dec->valid = 1;
+}
+
+const struct lsa_decoded *lsa_decode(struct lsa *lsa)
+{
+	if (!lsa->dec.valid)
+		lsa_do_decode(lsa);
+
+	return &lsa->dec;
+}
+
+uint64_t lsa_get_version(struct lsa *lsa)
+{
+	return lsa_decode(lsa)->version;
+}
+
 
 #define ROUND_UP(size)	(((size) + 7) & ~7)
 
@@ -302,6 +438,8 @@ int lsa_attr_set_add_attr(struct lsa *lsa, struct lsa_attr_set *set,
 		abort();
 	}
 
+	lsa_invalidate(lsa);
+
 	attr = lsa_attr_set_find_attr(set, type, key, keylen);
 	if (attr != NULL)
 		abort();
@@ -352,6 +490,8 @@ lsa_attr_set_add_attr_set(struct lsa *lsa, struct lsa_attr_set *set,
 		abort();
 	}
 
+	lsa_invalidate(lsa);
+
 	attr = lsa_attr_set_find_attr(set, type, key, keylen);
 	if (attr != NULL)
 		abort();
@@ -384,6 +524,8 @@ void lsa_del_attr(struct lsa *lsa, struct lsa_attr *attr)
 		abort();
 	}
 
+	lsa_invalidate(lsa);
+
 	lsa->bytes -= lsa_attr_size(attr);
 	iv_avl_tree_delete(&lsa->root.attrs, &attr->an);
 
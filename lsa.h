@@ -28,11 +28,37 @@ struct lsa_attr_set {
 	struct iv_avl_tree	attrs;
 };
 
+struct lsa_decoded_peer {
+	uint8_t			id[NODE_ID_LEN];
+	int			metric;
+	uint32_t		flags;
+};
+
+struct lsa_decoded {
+	int			valid;
+	uint64_t		version;
+	uint8_t			*adv_path;
+	int			adv_path_len;
+	int			num_peers;
+	struct lsa_decoded_peer	*peers;
+};
+
+struct lsa_wire {
+	int			refcount;
+	int			have_preid;
+	uint8_t			preid[NODE_ID_LEN];
+	size_t			len;
+	uint8_t			buf[0];
+};
+
 struct lsa {
 	int			refcount;
 	size_t			bytes;
 	uint8_t			id[NODE_ID_LEN];
 	struct lsa_attr_set	root;
+	struct lsa_decoded	dec;
+	int			verified;
+	struct lsa_wire		*wire;
 };
 
 struct lsa *lsa_alloc(const uint8_t *id);
@@ -40,6 +66,12 @@ struct lsa *lsa_get(struct lsa *lsa);
 void lsa_put(struct lsa *lsa);
 struct lsa *lsa_clone(const struct lsa *lsa);
 
+const struct lsa_decoded *lsa_decode(struct lsa *lsa);
+uint64_t lsa_get_version(struct lsa *lsa);
+
+struct lsa_wire *lsa_wire_get(struct lsa_wire *wire);
+void lsa_wire_put(struct lsa_wire *wire);
+
 
 struct lsa_attr {
 	struct iv_avl_node	an;
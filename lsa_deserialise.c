@@ -191,6 +191,8 @@ ssize_t lsa_deserialise(struct lsa **lsap, uint8_t *buf, size_t buflen)
 	if (lsa_deserialise_attr_set(lsa, &lsa->root, &src, 8) < 0)
 		goto error;
 
+	lsa_decode(lsa);
+
 	*lsap = lsa;
 
 	return src.off;
@@ -21,19 +21,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include "lsa.h"
-#include "lsa_type.h"
 
-int lsa_path_contains(struct lsa_attr *attr, const uint8_t *id)
+int lsa_path_contains(struct lsa *lsa, const uint8_t *id)
 {
-	void *data;
-	size_t i;
+	const struct lsa_decoded *dec;
+	int i;
 
-	if (attr->type != LSA_ATTR_TYPE_ADV_PATH)
-		abort();
-
-	data = lsa_attr_data(attr);
-	for (i = 0; i < attr->datalen; i += NODE_ID_LEN) {
-		if (!memcmp(data + i, id, NODE_ID_LEN))
+	dec = lsa_decode(lsa);
+	for (i = 0; i + NODE_ID_LEN <= dec->adv_path_len; i += NODE_ID_LEN) {
+		if (!memcmp(dec->adv_path + i, id, NODE_ID_LEN))
 			return 1;
 	}
 
@@ -19,37 +19,42 @@
 
 #include <stdio.h>
 #include <stdlib.h>
-#include <arpa/inet.h>
 #include <stdint.h>
+#include <string.h>
 #include "lsa.h"
 #include "lsa_peer.h"
-#include "lsa_type.h"
 
 int lsa_get_peer_info(struct lsa_peer_info *lpi, struct lsa *lsa,
 		      const uint8_t *peerid)
 {
-	struct lsa_attr *peer;
-	struct lsa_attr_set *set;
-	struct lsa_attr *attr;
-
-	peer = lsa_find_attr(lsa, LSA_ATTR_TYPE_PEER, peerid, NODE_ID_LEN);
-	if (peer == NULL || !peer->attr_signed || !peer->data_is_attr_set)
-		return -1;
-
-	set = lsa_attr_data(peer);
-
-	attr = lsa_attr_set_find_attr(set, LSA_PEER_ATTR_TYPE_METRIC, NULL, 0);
-	if (attr != NULL && attr->attr_signed && attr->datalen == 2)
-		lpi->metric = ntohs(*((uint16_t *)lsa_attr_data(attr)));
-	else
-		lpi->metric = 1;
-
-	attr = lsa_attr_set_find_attr(set, LSA_PEER_ATTR_TYPE_PEER_FLAGS,
-				      NULL, 0);
-	if (attr != NULL && attr->attr_signed && attr->datalen == 1)
-		lpi->flags = *((uint8_t *)lsa_attr_data(attr));
-	else
-		lpi->flags = 0;
-
-	return 0;
+	const struct lsa_decoded *dec;
+	int lo;
+	int hi;
+
+	dec = lsa_decode(lsa);
+
+	lo = 0;
+	hi = dec->num_peers;
+	while (lo < hi) {
+		const struct lsa_decoded_peer *peer;
+		int mid;
+		int ret;
+
+		mid = lo + (hi - lo) / 2;
+		peer = &dec->peers[mid];
+
+		ret = memcmp(peerid, peer->id, NODE_ID_LEN);
+		if (ret == 0) {
+			lpi->metric = peer->metric;
+			lpi->flags = peer->flags;
+			return 0;
+		}
+
+		if (ret < 0)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+
+	return -1;
 }
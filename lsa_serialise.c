@@ -196,6 +196,51 @@ size_t lsa_serialise(uint8_t *buf, size_t buflen, size_t serlen,
 	return dst.off;
 }
 
+/*
+ * The image of an LSA that is sent to DGP peers only depends on the
+ * LSA and on the ID that is prepended to its ADV_PATH, which is our
+ * own node ID for every peer, so it is serialised once and cached in
+ * the LSA.  The returned buffer is owned by the LSA; callers that
+ * want to hang on to it should take their own reference.
+ */
+struct lsa_wire *lsa_serialise_wire(struct lsa *lsa, const uint8_t *preid)
+{
+	struct lsa_wire *wire;
+	size_t serlen;
+	size_t buflen;
+
+	wire = lsa->wire;
+	if (wire != NULL) {
+		if (preid == NULL && !wire->have_preid)
+			return wire;
+
+		if (preid != NULL && wire->have_preid &&
+		    !memcmp(wire->preid, preid, NODE_ID_LEN)) {
+			return wire;
+		}
+
+		lsa_wire_put(wire);
+		lsa->wire = NULL;
+	}
+
+	serlen = lsa_serialise_length(lsa, 0, preid);
+	buflen = serlen + MAX_SERIALISED_INT_LEN;
+
+	wire = malloc(sizeof(*wire) + buflen);
+	if (wire == NULL)
+		return NULL;
+
+	wire->refcount = 1;
+	wire->have_preid = (preid != NULL);
+	if (preid != NULL)
+		memcpy(wire->preid, preid, NODE_ID_LEN);
+	wire->len = lsa_serialise(wire->buf, buflen, serlen, lsa, 0, preid);
+
+	lsa->wire = wire;
+
+	return wire;
+}
+
 size_t lsa_attr_serialise_length(struct lsa_attr *attr)
 {
 	return lsa_attr_serialise(NULL, 0, attr);
@@ -28,6 +28,7 @@ size_t lsa_serialise_length(struct lsa *lsa, int signed_only,
 			    const uint8_t *preid);
 size_t lsa_serialise(uint8_t *buf, size_t buflen, size_t serlen,
 		     struct lsa *lsa, int signed_only, const uint8_t *preid);
+struct lsa_wire *lsa_serialise_wire(struct lsa *lsa, const uint8_t *preid);
 
 size_t lsa_attr_serialise_length(struct lsa_attr *attr);
 size_t lsa_attr_serialise(uint8_t *buf, size_t buflen, struct lsa_attr *attr);
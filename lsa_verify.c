@@ -0,0 +1,394 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iv_avl.h>
+#include <iv_list.h>
+#include <iv_work.h>
+#include <nettle/sha2.h>
+#include <gnutls/abstract.h>
+#include <string.h>
+#include <unistd.h>
+#include "lsa_serialise.h"
+#include "lsa_type.h"
+#include "lsa_verify.h"
+
+/*
+ * The same LSA is typically received from every neighbour, and again
+ * every time a DGP session restarts and the peer re-dumps its RIB.
+ * Successfully verified (origin ID, digest over the signed content and
+ * the signature) pairs are remembered in a bounded cache, so that
+ * duplicate copies don't need another public key operation.
+ */
+#define VERIFY_CACHE_SIZE	16384
+
+struct verified {
+	struct iv_avl_node	an;
+	struct iv_list_head	lru;
+	uint8_t			key[NODE_ID_LEN + SHA256_DIGEST_SIZE];
+};
+
+static int compare_verified(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct verified *a;
+	struct verified *b;
+
+	a = iv_container_of(_a, struct verified, an);
+	b = iv_container_of(_b, struct verified, an);
+
+	return memcmp(a->key, b->key, sizeof(a->key));
+}
+
+static struct iv_avl_tree cache = {
+	.compare	= compare_verified,
+	.root		= NULL,
+};
+static struct iv_list_head cache_lru = IV_LIST_HEAD_INIT(cache_lru);
+static int cache_size;
+
+static uint64_t num_hits;
+static uint64_t num_misses;
+static uint64_t num_failures;
+
+static struct verified *cache_find(const uint8_t *key)
+{
+	struct iv_avl_node *an;
+
+	an = cache.root;
+	while (an != NULL) {
+		struct verified *v;
+		int ret;
+
+		v = iv_container_of(an, struct verified, an);
+
+		ret = memcmp(key, v->key, sizeof(v->key));
+		if (ret == 0)
+			return v;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static void cache_add(const uint8_t *key)
+{
+	struct verified *v;
+
+	if (cache_size == VERIFY_CACHE_SIZE) {
+		v = iv_container_of(cache_lru.prev, struct verified, lru);
+		iv_list_del(&v->lru);
+		iv_avl_tree_delete(&cache, &v->an);
+		cache_size--;
+	} else {
+		v = malloc(sizeof(*v));
+		if (v == NULL)
+			return;
+	}
+
+	memcpy(v->key, key, sizeof(v->key));
+	iv_avl_tree_insert(&cache, &v->an);
+	iv_list_add(&v->lru, &cache_lru);
+	cache_size++;
+}
+
+static int verify_signature(struct lsa_attr *pubkey, struct lsa_attr *sig,
+			    const uint8_t *buf, size_t len)
+{
+	gnutls_pubkey_t pk;
+	int ret;
+	gnutls_datum_t datum;
+	gnutls_datum_t data;
+
+	ret = gnutls_pubkey_init(&pk);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		return -1;
+	}
+
+	datum.data = lsa_attr_data(pubkey);
+	datum.size = pubkey->datalen;
+
+	ret = gnutls_pubkey_import(pk, &datum, GNUTLS_X509_FMT_DER);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		gnutls_pubkey_deinit(pk);
+		return -1;
+	}
+
+	datum.data = lsa_attr_data(sig);
+	datum.size = sig->datalen;
+
+	data.data = (void *)buf;
+	data.size = len;
+
+	ret = gnutls_pubkey_verify_data2(pk, GNUTLS_SIGN_RSA_SHA256,
+					 0, &data, &datum);
+	if (ret < 0) {
+		gnutls_perror(ret);
+		gnutls_pubkey_deinit(pk);
+		return -1;
+	}
+
+	gnutls_pubkey_deinit(pk);
+
+	return 0;
+}
+
+static size_t serialise_signed(struct lsa *lsa, uint8_t *buf, size_t buflen)
+{
+	size_t serlen;
+	size_t len;
+
+	serlen = lsa_serialise_length(lsa, 1, NULL);
+	if (serlen > buflen - 128)
+		abort();
+
+	len = lsa_serialise(buf, buflen, serlen, lsa, 1, NULL);
+	if (len > buflen)
+		abort();
+
+	return len;
+}
+
+/*
+ * Returns 0 if the LSA is known to be good, -1 if it is known to be
+ * bad, and 1 if its signature needs to be checked, in which case the
+ * cache key to file the result under is returned in @key.
+ */
+static int verify_lookup(struct lsa *lsa, uint8_t *key)
+{
+	struct lsa_attr *pubkey;
+	struct lsa_attr *sig;
+	struct sha256_ctx ctx;
+	uint8_t id[NODE_ID_LEN];
+	uint8_t buf[65536];
+	size_t len;
+	struct verified *v;
+
+	if (lsa->verified)
+		return (lsa->verified > 0) ? 0 : -1;
+
+	pubkey = lsa_find_attr(lsa, LSA_ATTR_TYPE_PUBKEY, NULL, 0);
+	if (pubkey == NULL)
+		goto bad;
+
+	sha256_init(&ctx);
+	sha256_update(&ctx, pubkey->datalen, lsa_attr_data(pubkey));
+	sha256_digest(&ctx, SHA256_DIGEST_SIZE, id);
+
+	if (memcmp(lsa->id, id, NODE_ID_LEN))
+		goto bad;
+
+	sig = lsa_find_attr(lsa, LSA_ATTR_TYPE_SIGNATURE, NULL, 0);
+	if (sig == NULL)
+		goto bad;
+
+	len = serialise_signed(lsa, buf, sizeof(buf));
+
+	memcpy(key, lsa->id, NODE_ID_LEN);
+	sha256_init(&ctx);
+	sha256_update(&ctx, len, buf);
+	sha256_update(&ctx, sig->datalen, lsa_attr_data(sig));
+	sha256_digest(&ctx, SHA256_DIGEST_SIZE, key + NODE_ID_LEN);
+
+	v = cache_find(key);
+	if (v != NULL) {
+		num_hits++;
+		iv_list_del(&v->lru);
+		iv_list_add(&v->lru, &cache_lru);
+		lsa->verified = 1;
+		return 0;
+	}
+
+	num_misses++;
+
+	return 1;
+
+bad:
+	lsa->verified = -1;
+	return -1;
+}
+
+/*
+ * This only reads from the LSA, and can therefore be run from a
+ * worker thread, as long as the caller holds a reference to the LSA.
+ */
+static int verify_check(struct lsa *lsa)
+{
+	struct lsa_attr *pubkey;
+	struct lsa_attr *sig;
+	uint8_t buf[65536];
+	size_t len;
+
+	pubkey = lsa_find_attr(lsa, LSA_ATTR_TYPE_PUBKEY, NULL, 0);
+	sig = lsa_find_attr(lsa, LSA_ATTR_TYPE_SIGNATURE, NULL, 0);
+	if (pubkey == NULL || sig == NULL)
+		return -1;
+
+	len = serialise_signed(lsa, buf, sizeof(buf));
+
+	return verify_signature(pubkey, sig, buf, len);
+}
+
+static void verify_done(struct lsa *lsa, const uint8_t *key, int ret)
+{
+	if (ret < 0) {
+		num_failures++;
+		lsa->verified = -1;
+	} else {
+		cache_add(key);
+		lsa->verified = 1;
+	}
+}
+
+int lsa_verify(struct lsa *lsa)
+{
+	uint8_t key[NODE_ID_LEN + SHA256_DIGEST_SIZE];
+	int ret;
+
+	ret = verify_lookup(lsa, key);
+	if (ret <= 0)
+		return ret;
+
+	ret = verify_check(lsa);
+	verify_done(lsa, key, ret);
+
+	return ret;
+}
+
+
+/*
+ * Public key operations on cache misses are farmed out to a pool of
+ * worker threads, so that a flood of new LSAs (such as a full RIB
+ * dump from a new neighbour) doesn't stall the event loop.  The pool
+ * only exists while there are requests outstanding.
+ */
+struct lsa_verify_task {
+	struct lsa_verify_request	*req;
+	struct lsa			*lsa;
+
+	struct iv_work_item		work;
+
+	uint8_t				key[NODE_ID_LEN + SHA256_DIGEST_SIZE];
+	int				ret;
+};
+
+static int num_requests;
+static struct iv_work_pool pool;
+
+static void lsa_verify_task_work(void *_lvt)
+{
+	struct lsa_verify_task *lvt = _lvt;
+
+	lvt->ret = verify_check(lvt->lsa);
+}
+
+static void lsa_verify_task_complete(void *_lvt)
+{
+	struct lsa_verify_task *lvt = _lvt;
+	struct lsa_verify_request *req;
+
+	verify_done(lvt->lsa, lvt->key, lvt->ret);
+
+	req = lvt->req;
+	if (req != NULL) {
+		req->task = NULL;
+		req->handler(req->cookie, lvt->ret);
+	}
+
+	lsa_put(lvt->lsa);
+	free(lvt);
+
+	if (!--num_requests)
+		iv_work_pool_put(&pool);
+}
+
+/*
+ * Returns 0 or -1 if the outcome is known without doing a public key
+ * operation, in which case the handler is not called, and 1 if the
+ * check was queued and the handler will be called later.
+ */
+int lsa_verify_submit(struct lsa_verify_request *req)
+{
+	struct lsa_verify_task *lvt;
+	int ret;
+
+	req->task = NULL;
+
+	lvt = malloc(sizeof(*lvt));
+	if (lvt == NULL)
+		return lsa_verify(req->lsa);
+
+	ret = verify_lookup(req->lsa, lvt->key);
+	if (ret <= 0) {
+		free(lvt);
+		return ret;
+	}
+
+	lvt->req = req;
+	lvt->lsa = lsa_get(req->lsa);
+
+	IV_WORK_ITEM_INIT(&lvt->work);
+	lvt->work.cookie = lvt;
+	lvt->work.work = lsa_verify_task_work;
+	lvt->work.completion = lsa_verify_task_complete;
+
+	if (!num_requests++) {
+		long cpus;
+
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+		IV_WORK_POOL_INIT(&pool);
+		pool.max_threads = (cpus > 0) ? cpus : 1;
+		pool.cookie = NULL;
+		pool.thread_start = NULL;
+		pool.thread_stop = NULL;
+		iv_work_pool_create(&pool);
+	}
+
+	iv_work_pool_submit_work(&pool, &lvt->work);
+
+	req->task = lvt;
+
+	return 1;
+}
+
+void lsa_verify_cancel(struct lsa_verify_request *req)
+{
+	struct lsa_verify_task *lvt = req->task;
+
+	if (lvt != NULL) {
+		req->task = NULL;
+		lvt->req = NULL;
+	}
+}
+
+void lsa_verify_print_stats(FILE *fp)
+{
+	fprintf(fp, "signature cache: %d entries, %llu hits, %llu misses, "
+		    "%llu failed verifications\n", cache_size,
+		(unsigned long long)num_hits,
+		(unsigned long long)num_misses,
+		(unsigned long long)num_failures);
+}
@@ -0,0 +1,42 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __LSA_VERIFY_H
+#define __LSA_VERIFY_H
+
+#include <stdio.h>
+#include "lsa.h"
+
+int lsa_verify(struct lsa *lsa);
+
+struct lsa_verify_request {
+	struct lsa		*lsa;
+	void			*cookie;
+	void			(*handler)(void *cookie, int ret);
+
+	void			*task;
+};
+
+int lsa_verify_submit(struct lsa_verify_request *req);
+void lsa_verify_cancel(struct lsa_verify_request *req);
+
+void lsa_verify_print_stats(FILE *fp);
+
+
+#endif
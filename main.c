@@ -31,6 +31,8 @@ int mkhosts(const char *config);
 int rtmon(const char *config);
 int show_key_id(const char *file);
 int show_key_id_hex(const char *file);
+int tconn_bench(const char *keyfile, const char *threads);
+int tun_bench(void);
 
 enum {
 	TOOL_UNKNOWN = 0,
@@ -43,6 +45,8 @@ enum {
 	TOOL_RTMON,
 	TOOL_SHOW_KEY_ID,
 	TOOL_SHOW_KEY_ID_HEX,
+	TOOL_TCONN_BENCH,
+	TOOL_TUN_BENCH,
 };
 
 static int tool = TOOL_UNKNOWN;
@@ -69,6 +73,8 @@ static void usage(const char *argv0)
 	fprintf(stderr, "       %s --rtmon [-c <config.ini>]\n", argv0);
 	fprintf(stderr, "       %s --show-key-id <key.pem>\n", argv0);
 	fprintf(stderr, "       %s --show-key-id-hex <key.pem>\n", argv0);
+	fprintf(stderr, "       %s --tconn-bench <key.pem> [threads]\n", argv0);
+	fprintf(stderr, "       %s --tun-bench\n", argv0);
 }
 
 static void try_determine_tool(char *argv0)
@@ -134,6 +140,16 @@ static void try_determine_tool(char *argv0)
 		tool = TOOL_SHOW_KEY_ID_HEX;
 		return;
 	}
+
+	if (!strcmp(t, "tconn-bench") || !strcmp(t, "dvpn-tconn-bench")) {
+		tool = TOOL_TCONN_BENCH;
+		return;
+	}
+
+	if (!strcmp(t, "tun-bench") || !strcmp(t, "dvpn-tun-bench")) {
+		tool = TOOL_TUN_BENCH;
+		return;
+	}
 }
 
 int main(int argc, char *argv[])
@@ -149,6 +165,8 @@ int main(int argc, char *argv[])
 		{ "rtmon", no_argument, 0, 'r' },
 		{ "show-key-id", no_argument, 0, 's' },
 		{ "show-key-id-hex", no_argument, 0, 'S' },
+		{ "tconn-bench", no_argument, 0, 'b' },
+		{ "tun-bench", no_argument, 0, 'T' },
 		{ 0, 0, 0, 0, },
 	};
 	const char *config = "/etc/dvpn.ini";
@@ -161,6 +179,10 @@ int main(int argc, char *argv[])
 			break;
 
 		switch (c) {
+		case 'b':
+			set_tool(TOOL_TCONN_BENCH);
+			break;
+
 		case 'c':
 			config = optarg;
 			break;
@@ -201,6 +223,10 @@ int main(int argc, char *argv[])
 			set_tool(TOOL_SHOW_KEY_ID_HEX);
 			break;
 
+		case 'T':
+			set_tool(TOOL_TUN_BENCH);
+			break;
+
 		case '?':
 			usage(argv[0]);
 			return 1;
@@ -232,6 +258,11 @@ int main(int argc, char *argv[])
 		return show_key_id(argv[optind]);
 	case TOOL_SHOW_KEY_ID_HEX:
 		return show_key_id_hex(argv[optind]);
+	case TOOL_TCONN_BENCH:
+		return tconn_bench(argv[optind],
+				   optind + 1 < argc ? argv[optind + 1] : NULL);
+	case TOOL_TUN_BENCH:
+		return tun_bench();
 	}
 
 	return dvpn(config);
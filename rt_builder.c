@@ -21,13 +21,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include "loc_rib.h"
-#include "lsa_type.h"
 #include "rt_builder.h"
 #include "util.h"
 
 static struct lsa *map(struct rt_builder *rb, struct lsa *lsa, uint32_t cost)
 {
-	struct lsa_attr *attr;
+	const struct lsa_decoded *dec;
 
 	if (cost == RIB_COST_INELIGIBLE)
 		abort();
@@ -35,15 +34,15 @@ static struct lsa *map(struct rt_builder *rb, struct lsa *lsa, uint32_t cost)
 	if (cost == RIB_COST_UNREACHABLE)
 		return NULL;
 
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
-	if (attr == NULL)
+	dec = lsa_decode(lsa);
+	if (dec->adv_path_len < 0)
 		abort();
 
-	if (attr->datalen == 0)
+	if (dec->adv_path_len == 0)
 		return NULL;
 
-	if (rb->myid != NULL && attr->datalen == NODE_ID_LEN &&
-	    !memcmp(lsa_attr_data(attr), rb->myid, NODE_ID_LEN)) {
+	if (rb->myid != NULL && dec->adv_path_len == NODE_ID_LEN &&
+	    !memcmp(dec->adv_path, rb->myid, NODE_ID_LEN)) {
 		return NULL;
 	}
 
@@ -52,16 +51,16 @@ static struct lsa *map(struct rt_builder *rb, struct lsa *lsa, uint32_t cost)
 
 static uint8_t *getnh(struct rt_builder *rb, struct lsa *lsa, uint8_t *addr)
 {
-	struct lsa_attr *attr;
+	const struct lsa_decoded *dec;
 	uint8_t *adv_path;
 	int len;
 
-	attr = lsa_find_attr(lsa, LSA_ATTR_TYPE_ADV_PATH, NULL, 0);
-	if (attr == NULL)
+	dec = lsa_decode(lsa);
+	if (dec->adv_path_len < 0)
 		abort();
 
-	adv_path = lsa_attr_data(attr);
-	len = attr->datalen;
+	adv_path = dec->adv_path;
+	len = dec->adv_path_len;
 
 	if (rb->myid != NULL && len >= NODE_ID_LEN &&
 	    !memcmp(adv_path, rb->myid, NODE_ID_LEN)) {
@@ -0,0 +1,416 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+/*
+ * rt_sync keeps the kernel's main IPv6 routing table in sync with
+ * the routes that rt_builder wants.  All routes we install are tagged
+ * with RTPROT_DVPN.  On startup, the routes left behind by a previous
+ * instance are read back from the kernel and adopted, and only those
+ * that haven't been claimed again when the stale timer fires are
+ * deleted, so that a restart doesn't cause any route flaps.  On any
+ * unexpected error, the kernel table is dumped again and diffed
+ * against what we want.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <iv.h>
+#include <string.h>
+#include "rt_sync.h"
+#include "rtnl.h"
+#include "util.h"
+
+#define RTPROT_DVPN		173
+#define RT_SYNC_STALE_TIME	30
+
+struct rt_sync_route {
+	struct iv_avl_node	an;
+	struct rt_sync		*rs;
+	uint8_t			dest[16];
+	int			want;
+	int			have;
+	int			sent;
+	int			busy;
+	int			seen;
+	int			stale;
+	int			failed;
+};
+
+static int compare_routes(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct rt_sync_route *a;
+	struct rt_sync_route *b;
+
+	a = iv_container_of(_a, struct rt_sync_route, an);
+	b = iv_container_of(_b, struct rt_sync_route, an);
+
+	return memcmp(a->dest, b->dest, 16);
+}
+
+static struct rt_sync_route *find_route(struct rt_sync *rs, const uint8_t *dest)
+{
+	struct iv_avl_node *an;
+
+	an = rs->routes.root;
+	while (an != NULL) {
+		struct rt_sync_route *r;
+		int ret;
+
+		r = iv_container_of(an, struct rt_sync_route, an);
+
+		ret = memcmp(dest, r->dest, 16);
+		if (ret == 0)
+			return r;
+
+		if (ret < 0)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static struct rt_sync_route *get_route(struct rt_sync *rs, const uint8_t *dest)
+{
+	struct rt_sync_route *r;
+
+	r = find_route(rs, dest);
+	if (r != NULL)
+		return r;
+
+	r = calloc(1, sizeof(*r));
+	if (r == NULL)
+		return NULL;
+
+	r->rs = rs;
+	memcpy(r->dest, dest, 16);
+	iv_avl_tree_insert(&rs->routes, &r->an);
+
+	return r;
+}
+
+static void schedule_resync(struct rt_sync *rs)
+{
+	if (iv_timer_registered(&rs->resync_timer))
+		return;
+
+	iv_validate_now();
+	rs->resync_timer.expires = iv_now;
+	timespec_add_ms(&rs->resync_timer.expires, 900, 1100);
+	iv_timer_register(&rs->resync_timer);
+}
+
+static void kick_route(struct rt_sync_route *r);
+
+static void route_done(void *_r, int err)
+{
+	struct rt_sync_route *r = _r;
+
+	r->busy = 0;
+
+	if (err == 0) {
+		r->have = r->sent;
+	} else if (!r->sent && (err == -ESRCH || err == -ENOENT)) {
+		r->have = 0;
+	} else {
+		char dst[64];
+
+		inet_ntop(AF_INET6, r->dest, dst, sizeof(dst));
+		fprintf(stderr, "rt_sync: error %s route to %s: %s\n",
+			r->sent ? "installing" : "removing", dst,
+			strerror(-err));
+
+		r->failed = 1;
+		schedule_resync(r->rs);
+	}
+
+	kick_route(r);
+}
+
+static int send_route(struct rt_sync_route *r)
+{
+	struct {
+		struct nlmsghdr	nh;
+		struct rtmsg	rtm;
+		uint8_t		attrbuf[64];
+	} req;
+	uint32_t oif;
+
+	memset(&req, 0, sizeof(req));
+
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+
+	req.rtm.rtm_family = AF_INET6;
+	req.rtm.rtm_dst_len = 128;
+	req.rtm.rtm_table = RT_TABLE_MAIN;
+	req.rtm.rtm_protocol = RTPROT_DVPN;
+
+	if (r->want) {
+		req.nh.nlmsg_type = RTM_NEWROUTE;
+		req.nh.nlmsg_flags = NLM_F_CREATE | NLM_F_REPLACE;
+		req.rtm.rtm_scope = RT_SCOPE_UNIVERSE;
+		req.rtm.rtm_type = RTN_UNICAST;
+		oif = r->want;
+	} else {
+		req.nh.nlmsg_type = RTM_DELROUTE;
+		req.rtm.rtm_scope = RT_SCOPE_NOWHERE;
+		oif = r->have;
+	}
+
+	rtnl_add_attr(&req.nh, sizeof(req), RTA_DST, r->dest, 16);
+	rtnl_add_attr(&req.nh, sizeof(req), RTA_OIF, &oif, sizeof(oif));
+
+	if (rtnl_submit(&req.nh, r, route_done) < 0)
+		return -1;
+
+	r->sent = r->want;
+	r->busy = 1;
+
+	return 0;
+}
+
+static void kick_route(struct rt_sync_route *r)
+{
+	struct rt_sync *rs = r->rs;
+
+	if (r->busy || rs->dumping || r->stale || r->failed)
+		return;
+
+	if (r->want != r->have) {
+		if (send_route(r) < 0)
+			schedule_resync(rs);
+		return;
+	}
+
+	if (!r->want) {
+		iv_avl_tree_delete(&rs->routes, &r->an);
+		free(r);
+	}
+}
+
+static void kick_all(struct rt_sync *rs)
+{
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+
+	iv_avl_tree_for_each_safe (an, an2, &rs->routes) {
+		struct rt_sync_route *r;
+
+		r = iv_container_of(an, struct rt_sync_route, an);
+		kick_route(r);
+	}
+}
+
+static void dump_msg(void *_rs, struct nlmsghdr *nlh)
+{
+	struct rt_sync *rs = _rs;
+	struct rtmsg *rtm;
+	struct rtattr *rta;
+	int len;
+	int table;
+	uint8_t *dst;
+	int oif;
+	struct rt_sync_route *r;
+
+	if (nlh->nlmsg_type != RTM_NEWROUTE)
+		return;
+
+	if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*rtm)))
+		return;
+
+	rtm = NLMSG_DATA(nlh);
+	if (rtm->rtm_family != AF_INET6 || rtm->rtm_dst_len != 128 ||
+	    rtm->rtm_protocol != RTPROT_DVPN || rtm->rtm_type != RTN_UNICAST) {
+		return;
+	}
+
+	table = rtm->rtm_table;
+	dst = NULL;
+	oif = 0;
+
+	len = RTM_PAYLOAD(nlh);
+	for (rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == RTA_TABLE &&
+		    RTA_PAYLOAD(rta) == sizeof(uint32_t)) {
+			table = *((uint32_t *)RTA_DATA(rta));
+		} else if (rta->rta_type == RTA_DST && RTA_PAYLOAD(rta) == 16) {
+			dst = RTA_DATA(rta);
+		} else if (rta->rta_type == RTA_OIF &&
+			   RTA_PAYLOAD(rta) == sizeof(uint32_t)) {
+			oif = *((uint32_t *)RTA_DATA(rta));
+		}
+	}
+
+	if (table != RT_TABLE_MAIN || dst == NULL || !oif)
+		return;
+
+	r = get_route(rs, dst);
+	if (r == NULL)
+		return;
+
+	if (!r->seen && !r->want && rs->stale)
+		r->stale = 1;
+
+	r->have = oif;
+	r->seen = 1;
+}
+
+static void dump_done(void *_rs, int err)
+{
+	struct rt_sync *rs = _rs;
+	struct iv_avl_node *an;
+
+	rs->dumping = 0;
+
+	if (err < 0) {
+		fprintf(stderr, "rt_sync: error dumping routes: %s\n",
+			strerror(-err));
+		schedule_resync(rs);
+	}
+
+	iv_avl_tree_for_each (an, &rs->routes) {
+		struct rt_sync_route *r;
+
+		r = iv_container_of(an, struct rt_sync_route, an);
+		if (!err) {
+			if (!r->busy && !r->seen)
+				r->have = 0;
+			r->failed = 0;
+		}
+		r->seen = 0;
+	}
+
+	kick_all(rs);
+}
+
+static void resync(void *_rs)
+{
+	struct rt_sync *rs = _rs;
+	struct {
+		struct nlmsghdr	nh;
+		struct rtmsg	rtm;
+	} req;
+
+	if (rs->dumping) {
+		schedule_resync(rs);
+		return;
+	}
+
+	memset(&req, 0, sizeof(req));
+
+	req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.rtm));
+	req.nh.nlmsg_type = RTM_GETROUTE;
+	req.rtm.rtm_family = AF_INET6;
+
+	if (rtnl_dump(&req.nh, rs, dump_msg, dump_done) < 0) {
+		schedule_resync(rs);
+		return;
+	}
+
+	rs->dumping = 1;
+}
+
+static void stale_timeout(void *_rs)
+{
+	struct rt_sync *rs = _rs;
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+
+	rs->stale = 0;
+
+	iv_avl_tree_for_each_safe (an, an2, &rs->routes) {
+		struct rt_sync_route *r;
+
+		r = iv_container_of(an, struct rt_sync_route, an);
+		if (r->stale) {
+			r->stale = 0;
+			kick_route(r);
+		}
+	}
+}
+
+void rt_sync_init(struct rt_sync *rs)
+{
+	INIT_IV_AVL_TREE(&rs->routes, compare_routes);
+	rs->dumping = 0;
+	rs->stale = 1;
+
+	IV_TIMER_INIT(&rs->stale_timer);
+	iv_validate_now();
+	rs->stale_timer.expires = iv_now;
+	rs->stale_timer.expires.tv_sec += RT_SYNC_STALE_TIME;
+	rs->stale_timer.cookie = rs;
+	rs->stale_timer.handler = stale_timeout;
+	iv_timer_register(&rs->stale_timer);
+
+	IV_TIMER_INIT(&rs->resync_timer);
+	rs->resync_timer.cookie = rs;
+	rs->resync_timer.handler = resync;
+
+	resync(rs);
+}
+
+void rt_sync_deinit(struct rt_sync *rs)
+{
+	struct iv_avl_node *an;
+	struct iv_avl_node *an2;
+
+	if (iv_timer_registered(&rs->stale_timer))
+		iv_timer_unregister(&rs->stale_timer);
+
+	if (iv_timer_registered(&rs->resync_timer))
+		iv_timer_unregister(&rs->resync_timer);
+
+	rtnl_cancel(rs);
+
+	iv_avl_tree_for_each_safe (an, an2, &rs->routes) {
+		struct rt_sync_route *r;
+
+		r = iv_container_of(an, struct rt_sync_route, an);
+		rtnl_cancel(r);
+		iv_avl_tree_delete(&rs->routes, &r->an);
+		free(r);
+	}
+}
+
+void rt_sync_set(struct rt_sync *rs, const uint8_t *dest, int ifindex)
+{
+	struct rt_sync_route *r;
+
+	if (ifindex) {
+		r = get_route(rs, dest);
+		if (r == NULL) {
+			schedule_resync(rs);
+			return;
+		}
+	} else {
+		r = find_route(rs, dest);
+		if (r == NULL)
+			return;
+	}
+
+	r->want = ifindex;
+	r->stale = 0;
+	r->failed = 0;
+
+	kick_route(r);
+}
@@ -0,0 +1,39 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __RT_SYNC_H
+#define __RT_SYNC_H
+
+#include <iv.h>
+#include <iv_avl.h>
+
+struct rt_sync {
+	struct iv_avl_tree	routes;
+	int			dumping;
+	int			stale;
+	struct iv_timer		stale_timer;
+	struct iv_timer		resync_timer;
+};
+
+void rt_sync_init(struct rt_sync *rs);
+void rt_sync_deinit(struct rt_sync *rs);
+void rt_sync_set(struct rt_sync *rs, const uint8_t *dest, int ifindex);
+
+
+#endif
@@ -0,0 +1,395 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv.h>
+#include <iv_list.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "rtnl.h"
+
+/*
+ * All rtnetlink requests are funneled through a single non-blocking
+ * NETLINK_ROUTE socket.  Requests submitted during one event loop
+ * iteration are sent to the kernel in a single sendmsg() from an
+ * iv_task, and their ACKs are matched up by sequence number as they
+ * arrive.  The socket is closed when there are no requests left, so
+ * that it doesn't keep iv_main() from returning.
+ */
+#define RTNL_MAX_INFLIGHT	256
+#define RTNL_MAX_IOV		64
+#define RTNL_RCVBUF		(1024 * 1024)
+
+struct rtnl_request {
+	struct iv_list_head	list;
+	void			*cookie;
+	void			(*handler)(void *cookie, int err);
+	void			(*dump_msg)(void *cookie,
+					    struct nlmsghdr *nlh);
+	uint32_t		seq;
+	int			len;
+	uint8_t			msg[0];
+};
+
+static int num_requests;
+static int rtnl_is_open;
+static int rtnl_tx_blocked;
+static struct iv_fd rtnl_fd;
+static struct iv_task rtnl_flush;
+static struct iv_list_head pending = IV_LIST_HEAD_INIT(pending);
+static struct iv_list_head inflight = IV_LIST_HEAD_INIT(inflight);
+static int num_inflight;
+static uint32_t rtnl_seq;
+
+void rtnl_add_attr(struct nlmsghdr *nlh, int maxlen, int type,
+		   const void *data, int len)
+{
+	struct rtattr *rta;
+
+	if (NLMSG_ALIGN(nlh->nlmsg_len) + RTA_SPACE(len) > maxlen)
+		abort();
+
+	rta = (struct rtattr *)((uint8_t *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	memcpy(RTA_DATA(rta), data, len);
+
+	nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + RTA_SPACE(len);
+}
+
+static void rtnl_complete(struct rtnl_request *req, int err)
+{
+	iv_list_del(&req->list);
+	num_requests--;
+
+	if (req->handler != NULL)
+		req->handler(req->cookie, err);
+
+	free(req);
+}
+
+static void rtnl_put(void)
+{
+	if (num_requests || !rtnl_is_open)
+		return;
+
+	if (iv_task_registered(&rtnl_flush))
+		iv_task_unregister(&rtnl_flush);
+
+	iv_fd_unregister(&rtnl_fd);
+	close(rtnl_fd.fd);
+	rtnl_is_open = 0;
+	rtnl_tx_blocked = 0;
+}
+
+static void rtnl_fail_all(struct iv_list_head *list, int err)
+{
+	while (!iv_list_empty(list)) {
+		struct rtnl_request *req;
+
+		req = iv_container_of(list->next, struct rtnl_request, list);
+		if (list == &inflight)
+			num_inflight--;
+		rtnl_complete(req, err);
+	}
+}
+
+static void rtnl_send(void *_dummy)
+{
+	while (!iv_list_empty(&pending) && num_inflight < RTNL_MAX_INFLIGHT) {
+		struct sockaddr_nl addr;
+		struct iovec iov[RTNL_MAX_IOV];
+		struct msghdr msg;
+		struct iv_list_head *lh;
+		int n;
+		int ret;
+
+		n = 0;
+		iv_list_for_each (lh, &pending) {
+			struct rtnl_request *req;
+
+			if (n == RTNL_MAX_IOV ||
+			    num_inflight + n == RTNL_MAX_INFLIGHT) {
+				break;
+			}
+
+			req = iv_container_of(lh, struct rtnl_request, list);
+			iov[n].iov_base = req->msg;
+			iov[n].iov_len = req->len;
+			n++;
+		}
+
+		memset(&addr, 0, sizeof(addr));
+		addr.nl_family = AF_NETLINK;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = &addr;
+		msg.msg_namelen = sizeof(addr);
+		msg.msg_iov = iov;
+		msg.msg_iovlen = n;
+
+		do {
+			ret = sendmsg(rtnl_fd.fd, &msg, 0);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			int err = errno;
+
+			if (err == EAGAIN) {
+				if (!rtnl_tx_blocked) {
+					rtnl_tx_blocked = 1;
+					iv_fd_set_handler_out(&rtnl_fd,
+							      rtnl_send);
+				}
+				return;
+			}
+
+			perror("rtnl_send: sendmsg");
+			while (n--) {
+				struct rtnl_request *req;
+
+				req = iv_container_of(pending.next,
+						      struct rtnl_request, list);
+				rtnl_complete(req, -err);
+			}
+
+			continue;
+		}
+
+		while (n--) {
+			struct rtnl_request *req;
+
+			req = iv_container_of(pending.next,
+					      struct rtnl_request, list);
+			iv_list_del(&req->list);
+			iv_list_add_tail(&req->list, &inflight);
+			num_inflight++;
+		}
+	}
+
+	if (rtnl_tx_blocked) {
+		rtnl_tx_blocked = 0;
+		iv_fd_set_handler_out(&rtnl_fd, NULL);
+	}
+
+	rtnl_put();
+}
+
+static struct rtnl_request *rtnl_find(uint32_t seq)
+{
+	struct iv_list_head *lh;
+
+	iv_list_for_each (lh, &inflight) {
+		struct rtnl_request *req;
+
+		req = iv_container_of(lh, struct rtnl_request, list);
+		if (req->seq == seq)
+			return req;
+	}
+
+	return NULL;
+}
+
+static void rtnl_got_msg(struct nlmsghdr *nlh)
+{
+	struct rtnl_request *req;
+	int err;
+
+	req = rtnl_find(nlh->nlmsg_seq);
+	if (req == NULL)
+		return;
+
+	if (nlh->nlmsg_type == NLMSG_ERROR) {
+		struct nlmsgerr *e;
+
+		if (nlh->nlmsg_len < NLMSG_LENGTH(sizeof(*e)))
+			return;
+
+		e = NLMSG_DATA(nlh);
+		err = e->error;
+	} else if (nlh->nlmsg_type == NLMSG_DONE) {
+		if (nlh->nlmsg_len >= NLMSG_LENGTH(sizeof(int)))
+			err = *((int *)NLMSG_DATA(nlh));
+		else
+			err = 0;
+	} else {
+		if (req->dump_msg != NULL)
+			req->dump_msg(req->cookie, nlh);
+		return;
+	}
+
+	num_inflight--;
+	rtnl_complete(req, err);
+}
+
+static void rtnl_got_data(void *_dummy)
+{
+	while (1) {
+		uint8_t buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+		struct nlmsghdr *nlh;
+		int len;
+
+		len = recv(rtnl_fd.fd, buf, sizeof(buf), 0);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN)
+				break;
+
+			/*
+			 * ENOBUFS means that we lost ACKs, and there is
+			 * no way to tell which, so fail everything that
+			 * was in flight and let the callers sort it out.
+			 */
+			if (errno != ENOBUFS) {
+				perror("rtnl_got_data: recv");
+				break;
+			}
+			rtnl_fail_all(&inflight, -ENOBUFS);
+			break;
+		}
+
+		for (nlh = (struct nlmsghdr *)buf; NLMSG_OK(nlh, len);
+		     nlh = NLMSG_NEXT(nlh, len))
+			rtnl_got_msg(nlh);
+	}
+
+	if (!iv_list_empty(&pending))
+		rtnl_send(NULL);
+	else
+		rtnl_put();
+}
+
+static int rtnl_open(void)
+{
+	struct sockaddr_nl addr;
+	int fd;
+	int val;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		perror("rtnl_open: socket");
+		return -1;
+	}
+
+	val = RTNL_RCVBUF;
+	setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &val, sizeof(val));
+
+	val = 1;
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &val, sizeof(val));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("rtnl_open: bind");
+		close(fd);
+		return -1;
+	}
+
+	IV_FD_INIT(&rtnl_fd);
+	rtnl_fd.fd = fd;
+	rtnl_fd.handler_in = rtnl_got_data;
+	iv_fd_register(&rtnl_fd);
+
+	IV_TASK_INIT(&rtnl_flush);
+	rtnl_flush.handler = rtnl_send;
+
+	rtnl_is_open = 1;
+
+	return 0;
+}
+
+static int rtnl_queue(struct nlmsghdr *nlh, void *cookie,
+		      void (*dump_msg)(void *cookie, struct nlmsghdr *nlh),
+		      void (*handler)(void *cookie, int err))
+{
+	struct rtnl_request *req;
+
+	req = malloc(sizeof(*req) + nlh->nlmsg_len);
+	if (req == NULL)
+		return -1;
+
+	if (!rtnl_is_open && rtnl_open() < 0) {
+		free(req);
+		return -1;
+	}
+
+	nlh->nlmsg_flags |= NLM_F_REQUEST;
+	nlh->nlmsg_seq = ++rtnl_seq;
+	nlh->nlmsg_pid = 0;
+
+	req->cookie = cookie;
+	req->handler = handler;
+	req->dump_msg = dump_msg;
+	req->seq = nlh->nlmsg_seq;
+	req->len = nlh->nlmsg_len;
+	memcpy(req->msg, nlh, nlh->nlmsg_len);
+
+	iv_list_add_tail(&req->list, &pending);
+	num_requests++;
+
+	if (!rtnl_tx_blocked && !iv_task_registered(&rtnl_flush))
+		iv_task_register(&rtnl_flush);
+
+	return 0;
+}
+
+int rtnl_submit(struct nlmsghdr *nlh, void *cookie,
+		void (*handler)(void *cookie, int err))
+{
+	nlh->nlmsg_flags |= NLM_F_ACK;
+
+	return rtnl_queue(nlh, cookie, NULL, handler);
+}
+
+int rtnl_dump(struct nlmsghdr *nlh, void *cookie,
+	      void (*dump_msg)(void *cookie, struct nlmsghdr *nlh),
+	      void (*handler)(void *cookie, int err))
+{
+	nlh->nlmsg_flags |= NLM_F_DUMP;
+
+	return rtnl_queue(nlh, cookie, dump_msg, handler);
+}
+
+static void rtnl_cancel_list(struct iv_list_head *list, void *cookie)
+{
+	struct iv_list_head *lh;
+
+	iv_list_for_each (lh, list) {
+		struct rtnl_request *req;
+
+		req = iv_container_of(lh, struct rtnl_request, list);
+		if (req->cookie == cookie) {
+			req->handler = NULL;
+			req->dump_msg = NULL;
+		}
+	}
+}
+
+void rtnl_cancel(void *cookie)
+{
+	rtnl_cancel_list(&pending, cookie);
+	rtnl_cancel_list(&inflight, cookie);
+}
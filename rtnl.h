@@ -0,0 +1,36 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __RTNL_H
+#define __RTNL_H
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+void rtnl_add_attr(struct nlmsghdr *nlh, int maxlen, int type,
+		   const void *data, int len);
+int rtnl_submit(struct nlmsghdr *nlh, void *cookie,
+		void (*handler)(void *cookie, int err));
+int rtnl_dump(struct nlmsghdr *nlh, void *cookie,
+	      void (*dump_msg)(void *cookie, struct nlmsghdr *nlh),
+	      void (*handler)(void *cookie, int err));
+void rtnl_cancel(void *cookie);
+
+
+#endif
@@ -0,0 +1,185 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "spsc.h"
+
+/*
+ * A single producer, single consumer ring of variable length records,
+ * each of which is stored contiguously behind a header that carries
+ * its length, a tag for the user, and the time at which it was
+ * queued.  A record that doesn't fit in the space left before the end
+ * of the buffer is put at the start of the buffer instead, and the
+ * space that is skipped is marked with a header of length SPSC_WRAP
+ * (if there is room for a header at all).
+ *
+ * head and tail are free running byte counters, which only ever get
+ * written by the producer and by the consumer, respectively.  They
+ * are accessed with sequentially consistent atomics, so that of a
+ * producer that finds that the consumer had emptied the ring before
+ * it pushed a record, and a consumer that finds the ring empty after
+ * having popped a record, at least one sees the other's update.  The
+ * producer then knows when to wake up the consumer.
+ */
+#define SPSC_WRAP	0xffffffff
+
+struct spsc_hdr {
+	uint32_t		len;
+	int32_t			tag;
+	struct timespec		ts;
+};
+
+static uint32_t spsc_align(uint32_t len)
+{
+	return (len + 7) & ~7;
+}
+
+int spsc_ring_init(struct spsc_ring *r, int size)
+{
+	if (size & (size - 1)) {
+		fprintf(stderr, "spsc_ring_init: size must be a power "
+				"of two\n");
+		return -1;
+	}
+
+	r->buf = malloc(size);
+	if (r->buf == NULL) {
+		fprintf(stderr, "spsc_ring_init: memory allocation "
+				"failure\n");
+		return -1;
+	}
+
+	r->size = size;
+	r->head = 0;
+	r->tail = 0;
+
+	return 0;
+}
+
+void spsc_ring_deinit(struct spsc_ring *r)
+{
+	free(r->buf);
+	r->buf = NULL;
+}
+
+/*
+ * Returns -1 if the record doesn't fit, 1 if the ring was empty
+ * before this record was pushed, and 0 otherwise.
+ */
+int spsc_ring_push(struct spsc_ring *r, const struct iovec *iov, int iovcnt,
+		   int tag, const struct timespec *ts)
+{
+	uint32_t head;
+	uint32_t tail;
+	uint32_t pos;
+	uint32_t len;
+	uint32_t need;
+	uint32_t skip;
+	struct spsc_hdr *hdr;
+	uint8_t *dst;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	need = spsc_align(sizeof(*hdr) + len);
+	if (need > r->size / 2)
+		return -1;
+
+	head = r->head;
+	tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+
+	pos = head & (r->size - 1);
+	skip = (r->size - pos < need) ? r->size - pos : 0;
+	if (head - tail + skip + need > r->size)
+		return -1;
+
+	if (skip) {
+		if (skip >= sizeof(*hdr)) {
+			hdr = (struct spsc_hdr *)(r->buf + pos);
+			hdr->len = SPSC_WRAP;
+		}
+		pos = 0;
+	}
+
+	hdr = (struct spsc_hdr *)(r->buf + pos);
+	hdr->len = len;
+	hdr->tag = tag;
+	hdr->ts = *ts;
+
+	dst = (uint8_t *)(hdr + 1);
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+		dst += iov[i].iov_len;
+	}
+
+	__atomic_store_n(&r->head, head + skip + need, __ATOMIC_SEQ_CST);
+
+	return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == head;
+}
+
+/*
+ * Copies the oldest record in the ring to buf (of which len bytes
+ * are available) and removes it from the ring.  Returns the length
+ * of the record, or -1 if the ring is empty.  Records that are too
+ * long for buf are dropped, and reported as being of length zero.
+ */
+int spsc_ring_pop(struct spsc_ring *r, uint8_t *buf, int len,
+		  int *tag, struct timespec *ts)
+{
+	uint32_t head;
+	uint32_t tail;
+	uint32_t pos;
+	struct spsc_hdr *hdr;
+	int reclen;
+
+	tail = r->tail;
+	head = __atomic_load_n(&r->head, __ATOMIC_SEQ_CST);
+	if (head == tail)
+		return -1;
+
+	pos = tail & (r->size - 1);
+	hdr = (struct spsc_hdr *)(r->buf + pos);
+	if (r->size - pos < sizeof(*hdr) || hdr->len == SPSC_WRAP) {
+		tail += r->size - pos;
+		hdr = (struct spsc_hdr *)r->buf;
+	}
+
+	reclen = hdr->len;
+	*tag = hdr->tag;
+	*ts = hdr->ts;
+	if (reclen <= len)
+		memcpy(buf, hdr + 1, reclen);
+	else
+		reclen = 0;
+
+	tail += spsc_align(sizeof(*hdr) + hdr->len);
+	__atomic_store_n(&r->tail, tail, __ATOMIC_SEQ_CST);
+
+	return reclen;
+}
+
+int spsc_ring_bytes(struct spsc_ring *r)
+{
+	return __atomic_load_n(&r->head, __ATOMIC_RELAXED) -
+		__atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+}
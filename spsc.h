@@ -0,0 +1,43 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __SPSC_H
+#define __SPSC_H
+
+#include <stdint.h>
+#include <sys/uio.h>
+#include <time.h>
+
+struct spsc_ring {
+	uint8_t			*buf;
+	uint32_t		size;
+	uint32_t		head;
+	uint32_t		tail;
+};
+
+int spsc_ring_init(struct spsc_ring *r, int size);
+void spsc_ring_deinit(struct spsc_ring *r);
+int spsc_ring_push(struct spsc_ring *r, const struct iovec *iov, int iovcnt,
+		   int tag, const struct timespec *ts);
+int spsc_ring_pop(struct spsc_ring *r, uint8_t *buf, int len,
+		  int *tag, struct timespec *ts);
+int spsc_ring_bytes(struct spsc_ring *r);
+
+
+#endif
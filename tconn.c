@@ -33,9 +33,16 @@
 #include <gnutls/abstract.h>
 #include <gnutls/x509.h>
 #include <iv.h>
+#include <iv_list.h>
+#include <linux/tls.h>
 #include <netinet/tcp.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "spsc.h"
 #include "tconn.h"
+#include "uring.h"
 #include "util.h"
 #include "x509.h"
 
@@ -44,6 +51,171 @@
 #define STATE_TX_CONGESTION	3
 #define STATE_DEAD		4
 
+#ifndef SOL_TLS
+#define SOL_TLS			282
+#endif
+
+#ifndef TCP_ULP
+#define TCP_ULP			31
+#endif
+
+/*
+ * Records submitted while the socket is congested are held in a
+ * per-connection queue for their class, and the queues are drained in
+ * strict priority order.  The bulk queue is managed with CoDel (RFC
+ * 8289): once records have been waiting for longer than TXQ_TARGET_US
+ * for at least TXQ_INTERVAL_US, records are dropped from the head of
+ * the queue at an increasing rate until the standing queue is gone.
+ * The priority queue carries low-volume latency sensitive traffic, and
+ * is never dropped from for latency.  TXQ_MAX_BYTES bounds both of
+ * these if the socket stays blocked altogether.
+ *
+ * The control queue carries records that must not be lost without
+ * losing the connection (such as the DGP stream), and is never
+ * dropped from at all.  Its users are expected to bound it themselves,
+ * by looking at its length and waiting for the tx_ready callback.
+ */
+#define TXQ_TARGET_US		5000
+#define TXQ_INTERVAL_US		100000
+#define TXQ_MAX_BYTES		(512 * 1024)
+
+struct txq_entry {
+	struct iv_list_head	list;
+	int64_t			time;
+	int			len;
+	uint8_t			data[0];
+};
+
+/*
+ * With tconn_set_io_uring() enabled, a running tconn that doesn't use
+ * kernel TLS moves its socket over to io_uring (see uring.c) the next
+ * time that it receives or sends a record, and moves back once
+ * io_uring is disabled again.  Data is then received by a multishot
+ * recv that the kernel completes into one of TCONN_URING_BUFS buffers
+ * from a ring of provided buffers, which GnuTLS reads from directly,
+ * and which is handed back to the kernel once it has been drained.
+ * Ciphertext is always queued to the transmit ring, which is drained
+ * by one sendmsg request at a time, queued at the end of the event
+ * loop iteration, so that all records that GnuTLS produces during an
+ * iteration go out together, with the system call shared with every
+ * other io_uring user on the thread.
+ *
+ * Everything else sees the same fd handlers being set and called as
+ * without io_uring, see tconn_set_handler_in() and friends below.
+ * The receive buffers and the transmit ring belong to the tconn_uring,
+ * which stays around until the kernel is done with them, and a tconn
+ * that is using io_uring can't be handed to another thread.
+ *
+ * If the kernel turns out to lack io_uring, provided buffer rings or
+ * multishot receives, we fall back to recv()/writev() for good.
+ */
+#define TCONN_URING_BUFS	8
+#define TCONN_URING_BUF_SIZE	16384
+
+struct tconn_uring {
+	struct tconn		*tc;
+	int			refcount;
+	int			want_in;
+	int			want_out;
+	int			stopping;
+
+	struct uring_req	rx_req;
+	int			rx_armed;
+	int			rx_eof;
+	int			rx_err;
+	int			bgid;
+	struct io_uring_buf_ring *br;
+	uint16_t		br_tail;
+	int			rx_bid;
+	int			fifo_head;
+	int			fifo_count;
+	uint16_t		fifo_bid[TCONN_URING_BUFS];
+	int			fifo_len[TCONN_URING_BUFS];
+	struct iv_task		in_task;
+
+	struct uring_req	tx_req;
+	int			tx_inflight;
+	int			tx_res;
+	struct msghdr		tx_msg;
+	struct iovec		tx_iov[2];
+	struct iv_task		tx_kick;
+
+	uint8_t			tx_buf[32768];	/* same size as tconn's */
+	uint8_t			bufs[TCONN_URING_BUFS][TCONN_URING_BUF_SIZE];
+};
+
+static int kernel_tls;
+static int handshake_offload;
+static int io_uring_enabled;
+static int io_uring_unsupported;
+
+static void tconn_txq_drain(struct tconn *tc);
+static void tconn_fd_handler_in(void *_tc);
+static void tconn_fd_handler_out(void *_tc);
+
+static int tconn_want_io_uring(void)
+{
+	return __atomic_load_n(&io_uring_enabled, __ATOMIC_RELAXED) &&
+	       !__atomic_load_n(&io_uring_unsupported, __ATOMIC_RELAXED);
+}
+
+static int tconn_uring_rx_ready(struct tconn_uring *ur)
+{
+	return ur->fifo_count || ur->rx_eof || ur->rx_err;
+}
+
+/*
+ * Once a tconn is on io_uring, its fd handlers only say whether we
+ * want to be told about received data and about sends completing.
+ */
+static void tconn_set_handler_in(struct tconn *tc, void (*handler)(void *))
+{
+	struct tconn_uring *ur = tc->ur;
+
+	if (ur == NULL) {
+		iv_fd_set_handler_in(tc->fd, handler);
+		return;
+	}
+
+	ur->want_in = (handler != NULL);
+	if (ur->want_in && tconn_uring_rx_ready(ur) &&
+	    !iv_task_registered(&ur->in_task)) {
+		iv_task_register(&ur->in_task);
+	}
+}
+
+static void tconn_set_handler_out(struct tconn *tc, void (*handler)(void *))
+{
+	struct tconn_uring *ur = tc->ur;
+
+	if (ur == NULL) {
+		iv_fd_set_handler_out(tc->fd, handler);
+		return;
+	}
+
+	ur->want_out = (handler != NULL);
+	if (ur->want_out && !ur->tx_inflight &&
+	    !iv_task_registered(&ur->tx_kick)) {
+		iv_task_register(&ur->tx_kick);
+	}
+}
+
+static int tconn_handler_in(struct tconn *tc)
+{
+	if (tc->ur != NULL)
+		return tc->ur->want_in;
+
+	return tc->fd->handler_in != NULL;
+}
+
+static int tconn_handler_out(struct tconn *tc)
+{
+	if (tc->ur != NULL)
+		return tc->ur->want_out;
+
+	return tc->fd->handler_out != NULL;
+}
+
 static int verify_state_pollin(struct tconn *tc)
 {
 	/*
@@ -52,6 +224,12 @@ static int verify_state_pollin(struct tconn *tc)
 	if (tc->state == STATE_DEAD || tc->io_error)
 		return 0;
 
+	/*
+	 * Don't read while our owner has paused reception.
+	 */
+	if (tc->rx_paused)
+		return 0;
+
 	/*
 	 * Don't read if our input buffer contains data or if we've
 	 * seen EOF.
@@ -98,6 +276,7 @@ static int verify_state_rx_task(struct tconn *tc)
 	}
 
 	if ((tc->state == STATE_RUNNING || tc->state == STATE_TX_CONGESTION) &&
+	    !tc->rx_paused &&
 	    (gnutls_record_check_pending(tc->sess) || tc->io_error ||
 	     tc->rx_start != tc->rx_end || tc->rx_eof)) {
 		return 1;
@@ -115,7 +294,8 @@ static int verify_state_tx_task(struct tconn *tc)
 	}
 
 	if (tc->state == STATE_TX_CONGESTION &&
-	    (tc->io_error || tc->tx_bytes < sizeof(tc->tx_buf))) {
+	    (tc->io_error ||
+	     (!tc->ktls_tx && tc->tx_bytes < sizeof(tc->tx_buf)))) {
 		return 1;
 	}
 
@@ -127,19 +307,19 @@ static void verify_state(struct tconn *tc)
 	int st;
 
 	st = verify_state_pollin(tc);
-	if (!st && tc->fd->handler_in != NULL) {
+	if (!st && tconn_handler_in(tc)) {
 		fprintf(stderr, "error: handler_in should be NULL\n");
 		abort();
-	} else if (st && tc->fd->handler_in == NULL) {
+	} else if (st && !tconn_handler_in(tc)) {
 		fprintf(stderr, "error: handler_in is unexpectedly NULL\n");
 		abort();
 	}
 
 	st = verify_state_pollout(tc);
-	if (!st && tc->fd->handler_out != NULL) {
+	if (!st && tconn_handler_out(tc)) {
 		fprintf(stderr, "error: handler_out should be NULL\n");
 		abort();
-	} else if (st && tc->fd->handler_out == NULL) {
+	} else if (st && !tconn_handler_out(tc)) {
 		fprintf(stderr, "warning: handler_out is unexpectedly NULL\n");
 	}
 
@@ -165,14 +345,14 @@ static void verify_state(struct tconn *tc)
 
 static void got_io_error(struct tconn *tc)
 {
-	iv_fd_set_handler_in(tc->fd, NULL);
-	iv_fd_set_handler_out(tc->fd, NULL);
+	tconn_set_handler_in(tc, NULL);
+	tconn_set_handler_out(tc, NULL);
 
 	if (!iv_task_registered(&tc->rx_task) &&
 	    ((tc->state == STATE_HANDSHAKE &&
 	      gnutls_record_get_direction(tc->sess) == 0) ||
-	     tc->state == STATE_RUNNING ||
-	     tc->state == STATE_TX_CONGESTION)) {
+	     ((tc->state == STATE_RUNNING ||
+	       tc->state == STATE_TX_CONGESTION) && !tc->rx_paused))) {
 		iv_task_register(&tc->rx_task);
 	}
 
@@ -184,6 +364,10 @@ static void got_io_error(struct tconn *tc)
 	}
 }
 
+static int tconn_uring_start(struct tconn *tc);
+static int tconn_uring_recv(struct tconn *tc);
+static void tconn_uring_release(struct tconn *tc);
+
 static void tconn_fd_handler_in(void *_tc)
 {
 	struct tconn *tc = _tc;
@@ -194,12 +378,25 @@ static void tconn_fd_handler_in(void *_tc)
 	if (tc->rx_start != tc->rx_end)
 		abort();
 
+	if (tc->ur == NULL && tconn_want_io_uring() &&
+	    tconn_uring_start(tc) == 0) {
+		verify_state(tc);
+		return;
+	}
+
 	tc->rx_start = 0;
 	tc->rx_end = 0;
 
-	do {
-		ret = recv(tc->fd->fd, tc->rx_buf, sizeof(tc->rx_buf), 0);
-	} while (ret < 0 && errno == EINTR);
+	if (tc->ur != NULL) {
+		ret = tconn_uring_recv(tc);
+	} else {
+		tc->rx_data = tc->rx_buf;
+		do {
+			tc->syscalls++;
+			ret = recv(tc->fd->fd, tc->rx_buf,
+				   sizeof(tc->rx_buf), 0);
+		} while (ret < 0 && errno == EINTR);
+	}
 
 	if (ret <= 0) {
 		if (ret == 0 || errno != EAGAIN) {
@@ -216,7 +413,7 @@ static void tconn_fd_handler_in(void *_tc)
 		return;
 	}
 
-	iv_fd_set_handler_in(tc->fd, NULL);
+	tconn_set_handler_in(tc, NULL);
 
 	if ((tc->state == STATE_HANDSHAKE &&
 	     gnutls_record_get_direction(tc->sess) == 0) ||
@@ -247,11 +444,15 @@ tconn_gtls_pull_func(gnutls_transport_ptr_t _tc, void *buf, size_t len)
 		if (tocopy > len)
 			tocopy = len;
 
-		memcpy(buf, tc->rx_buf + tc->rx_start, tocopy);
+		memcpy(buf, tc->rx_data + tc->rx_start, tocopy);
 
 		tc->rx_start += tocopy;
-		if (tc->rx_start == tc->rx_end)
-			iv_fd_set_handler_in(tc->fd, tconn_fd_handler_in);
+		if (tc->rx_start == tc->rx_end) {
+			if (tc->ur != NULL)
+				tconn_uring_release(tc);
+			if (!tc->rx_paused)
+				tconn_set_handler_in(tc, tconn_fd_handler_in);
+		}
 
 		return tocopy;
 	}
@@ -264,17 +465,108 @@ tconn_gtls_pull_func(gnutls_transport_ptr_t _tc, void *buf, size_t len)
 	return -1;
 }
 
-static void tconn_fd_handler_out(void *_tc)
+/*
+ * tx_buf is a ring buffer holding ciphertext that the kernel hasn't
+ * accepted yet.  GnuTLS hands us its record buffers through a vectored
+ * push function, and as long as nothing is queued, those are passed
+ * straight to writev(), so that in the common case ciphertext is never
+ * copied at all, and only the part that the socket doesn't take ends
+ * up in the ring.  Draining the ring never needs to move data around.
+ * On io_uring, the ring lives in the tconn_uring instead, and all
+ * ciphertext goes through it.
+ */
+static uint8_t *tconn_tx_base(struct tconn *tc)
 {
-	struct tconn *tc = _tc;
+	return (tc->ur != NULL) ? tc->ur->tx_buf : tc->tx_buf;
+}
+
+static int tconn_tx_iov(struct tconn *tc, struct iovec *iov)
+{
+	uint8_t *base = tconn_tx_base(tc);
+	int head;
+
+	head = sizeof(tc->tx_buf) - tc->tx_start;
+	if (tc->tx_bytes <= head) {
+		iov[0].iov_base = base + tc->tx_start;
+		iov[0].iov_len = tc->tx_bytes;
+		return 1;
+	}
+
+	iov[0].iov_base = base + tc->tx_start;
+	iov[0].iov_len = head;
+	iov[1].iov_base = base;
+	iov[1].iov_len = tc->tx_bytes - head;
+
+	return 2;
+}
+
+static void tconn_tx_consume(struct tconn *tc, int len)
+{
+	tc->tx_bytes -= len;
+	if (tc->tx_bytes)
+		tc->tx_start = (tc->tx_start + len) % sizeof(tc->tx_buf);
+	else
+		tc->tx_start = 0;
+}
+
+static int tconn_tx_append(struct tconn *tc, const uint8_t *buf, int len)
+{
+	uint8_t *base = tconn_tx_base(tc);
+	int tail;
+	int tocopy;
+
+	if (len > sizeof(tc->tx_buf) - tc->tx_bytes)
+		len = sizeof(tc->tx_buf) - tc->tx_bytes;
+
+	tail = (tc->tx_start + tc->tx_bytes) % sizeof(tc->tx_buf);
+
+	tocopy = sizeof(tc->tx_buf) - tail;
+	if (tocopy > len)
+		tocopy = len;
+
+	memcpy(base + tail, buf, tocopy);
+	memcpy(base, buf + tocopy, len - tocopy);
+	tc->tx_bytes += len;
+
+	return len;
+}
+
+/*
+ * On io_uring, this is only called when a sendmsg has completed, and
+ * returns its result.
+ */
+static int tconn_tx_send(struct tconn *tc)
+{
+	struct iovec iov[2];
+	int iovcnt;
 	int ret;
 
-	verify_state(tc);
+	if (tc->ur != NULL) {
+		if (tc->ur->tx_res < 0) {
+			errno = -tc->ur->tx_res;
+			return -1;
+		}
+		return tc->ur->tx_res;
+	}
+
+	iovcnt = tconn_tx_iov(tc, iov);
 
 	do {
-		ret = send(tc->fd->fd, tc->tx_buf, tc->tx_bytes, 0);
+		tc->syscalls++;
+		ret = writev(tc->fd->fd, iov, iovcnt);
 	} while (ret < 0 && errno == EINTR);
 
+	return ret;
+}
+
+static void tconn_fd_handler_out(void *_tc)
+{
+	struct tconn *tc = _tc;
+	int ret;
+
+	verify_state(tc);
+
+	ret = tconn_tx_send(tc);
 	if (ret < 0) {
 		if (errno != EAGAIN) {
 			tc->io_error = errno;
@@ -286,7 +578,7 @@ static void tconn_fd_handler_out(void *_tc)
 		return;
 	}
 
-	if (tc->tx_bytes == sizeof(tc->tx_buf)) {
+	if (tc->tx_bytes == sizeof(tc->tx_buf) && !tc->ktls_tx) {
 		if ((tc->state == STATE_HANDSHAKE &&
 		     gnutls_record_get_direction(tc->sess) == 1) ||
 		    tc->state == STATE_TX_CONGESTION) {
@@ -294,74 +586,90 @@ static void tconn_fd_handler_out(void *_tc)
 		}
 	}
 
-	tc->tx_bytes -= ret;
-	if (tc->tx_bytes)
-		memmove(tc->tx_buf, tc->tx_buf + ret, tc->tx_bytes);
-	else
-		iv_fd_set_handler_out(tc->fd, NULL);
+	tconn_tx_consume(tc, ret);
+	if (!tc->tx_bytes) {
+		tconn_set_handler_out(tc, NULL);
+
+		/*
+		 * With kernel TLS, the ring holds the plaintext tail of
+		 * the one record that didn't fit, and congestion ends
+		 * as soon as the kernel has taken all of it.
+		 */
+		if (tc->ktls_tx && tc->state == STATE_TX_CONGESTION) {
+			tc->state = STATE_RUNNING;
+			verify_state(tc);
+			tconn_txq_drain(tc);
+			return;
+		}
+	}
 
 	verify_state(tc);
 }
 
-static ssize_t
-tconn_gtls_push_func(gnutls_transport_ptr_t _tc, const void *buf, size_t len)
+static ssize_t tconn_gtls_vec_push_func(gnutls_transport_ptr_t _tc,
+					const giovec_t *iov, int iovcnt)
 {
 	struct tconn *tc = _tc;
-	int copied;
-	int tocopy;
+	ssize_t sent;
+	ssize_t skip;
+	ssize_t copied;
+	int i;
 
 	if (tc->io_error) {
 		gnutls_transport_set_errno(tc->sess, tc->io_error);
 		return -1;
 	}
 
+	/*
+	 * Once the kernel owns the transmit direction, records that
+	 * GnuTLS encrypts would carry stale sequence numbers.
+	 */
+	if (tc->ktls_tx) {
+		gnutls_transport_set_errno(tc->sess, EIO);
+		return -1;
+	}
+
 	if (tc->tx_bytes == sizeof(tc->tx_buf)) {
 		gnutls_transport_set_errno(tc->sess, EAGAIN);
 		return -1;
 	}
 
-	copied = 0;
-
-again:
-	tocopy = sizeof(tc->tx_buf) - tc->tx_bytes;
-	if (tocopy > len)
-		tocopy = len;
-
-	memcpy(tc->tx_buf + tc->tx_bytes, buf, tocopy);
-	tc->tx_bytes += tocopy;
-	copied += tocopy;
-	buf += tocopy;
-	len -= tocopy;
-
-	if (tc->fd->handler_out == NULL && tc->tx_bytes == sizeof(tc->tx_buf)) {
-		int ret;
-
+	sent = 0;
+	if (tc->tx_bytes == 0 && tc->ur == NULL) {
 		do {
-			ret = send(tc->fd->fd, tc->tx_buf, tc->tx_bytes, 0);
-		} while (ret < 0 && errno == EINTR);
-
-		if (ret < 0 && errno != EAGAIN) {
-			tc->io_error = errno;
-			gnutls_transport_set_errno(tc->sess, errno);
-			return -1;
-		}
+			tc->syscalls++;
+			sent = writev(tc->fd->fd, iov, iovcnt);
+		} while (sent < 0 && errno == EINTR);
 
-		if (ret > 0) {
-			tc->tx_bytes -= ret;
-			if (tc->tx_bytes) {
-				memmove(tc->tx_buf, tc->tx_buf + ret,
-					tc->tx_bytes);
+		if (sent < 0) {
+			if (errno != EAGAIN) {
+				tc->io_error = errno;
+				gnutls_transport_set_errno(tc->sess, errno);
+				return -1;
 			}
+			sent = 0;
 		}
+	}
+
+	skip = sent;
+	copied = 0;
+	for (i = 0; i < iovcnt && tc->tx_bytes < sizeof(tc->tx_buf); i++) {
+		const uint8_t *base = iov[i].iov_base;
+		size_t len = iov[i].iov_len;
 
-		if (tc->tx_bytes)
-			iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
+		if (skip >= len) {
+			skip -= len;
+			continue;
+		}
 
-		if (len && tc->tx_bytes < sizeof(tc->tx_buf))
-			goto again;
+		copied += tconn_tx_append(tc, base + skip, len - skip);
+		skip = 0;
 	}
 
-	return copied;
+	if (tc->tx_bytes && !tconn_handler_out(tc))
+		tconn_set_handler_out(tc, tconn_fd_handler_out);
+
+	return sent + copied;
 }
 
 static int tconn_tx_flush(struct tconn *tc)
@@ -371,16 +679,18 @@ static int tconn_tx_flush(struct tconn *tc)
 	if (tc->io_error)
 		return 1;
 
-	if (tc->fd->handler_out != NULL || tc->tx_bytes == 0)
+	if (tconn_handler_out(tc) || tc->tx_bytes == 0)
 		return 0;
 
-	do {
-		ret = send(tc->fd->fd, tc->tx_buf, tc->tx_bytes, 0);
-	} while (ret < 0 && errno == EINTR);
+	if (tc->ur != NULL) {
+		tconn_set_handler_out(tc, tconn_fd_handler_out);
+		return 0;
+	}
 
+	ret = tconn_tx_send(tc);
 	if (ret < 0) {
 		if (errno == EAGAIN) {
-			iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
+			tconn_set_handler_out(tc, tconn_fd_handler_out);
 			return 0;
 		}
 
@@ -389,467 +699,2488 @@ static int tconn_tx_flush(struct tconn *tc)
 		return 1;
 	}
 
-	tc->tx_bytes -= ret;
-	if (tc->tx_bytes) {
-		memmove(tc->tx_buf, tc->tx_buf + ret, tc->tx_bytes);
-		iv_fd_set_handler_out(tc->fd, tconn_fd_handler_out);
-	}
+	tconn_tx_consume(tc, ret);
+	if (tc->tx_bytes)
+		tconn_set_handler_out(tc, tconn_fd_handler_out);
 
 	return 0;
 }
 
-static void gtls_perror(const char *str, int error)
+static void tconn_uring_put(struct tconn_uring *ur)
 {
-	fprintf(stderr, "%s: %s\n", str, gnutls_strerror(error));
+	if (--ur->refcount)
+		return;
+
+	uring_unregister_buf_ring(ur->bgid);
+	munmap(ur->br, TCONN_URING_BUFS * sizeof(struct io_uring_buf));
+	free(ur);
+
+	uring_put();
 }
 
-static void tconn_connection_abort(struct tconn *tc, int notify_err)
+static void tconn_uring_recycle(struct tconn_uring *ur, int bid)
 {
-	iv_fd_set_handler_in(tc->fd, NULL);
-	iv_fd_set_handler_out(tc->fd, NULL);
+	struct io_uring_buf *buf;
 
-	tc->state = STATE_DEAD;
+	buf = &ur->br->bufs[ur->br_tail & (TCONN_URING_BUFS - 1)];
+	buf->addr = (uintptr_t)ur->bufs[bid];
+	buf->len = TCONN_URING_BUF_SIZE;
+	buf->bid = bid;
 
-	if (iv_task_registered(&tc->rx_task))
-		iv_task_unregister(&tc->rx_task);
+	ur->br_tail++;
+	__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
 
-	if (iv_task_registered(&tc->tx_task))
-		iv_task_unregister(&tc->tx_task);
+static int tconn_uring_arm_recv(struct tconn_uring *ur)
+{
+	struct io_uring_sqe *sqe;
 
-	if (notify_err)
-		tc->connection_lost(tc->cookie);
+	sqe = uring_get_sqe(&ur->rx_req);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = ur->tc->fd->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = ur->bgid;
+
+	ur->rx_armed = 1;
+	ur->refcount++;
+
+	return 0;
 }
 
-static int tconn_do_handshake(struct tconn *tc, int notify_err)
+/*
+ * Moves a tconn back to recv()/writev(), once the multishot recv is
+ * gone, all received data has been consumed and no send is in flight.
+ */
+static void tconn_uring_stop(struct tconn_uring *ur)
 {
-	char *desc;
-	int ret;
-	int i;
+	struct tconn *tc = ur->tc;
 
-	ret = gnutls_handshake(tc->sess);
-	if ((!ret || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
-		ret = gnutls_handshake(tc->sess);
+	ur->tc = NULL;
+	tc->ur = NULL;
 
-	if (ret) {
-		if (ret != GNUTLS_E_AGAIN) {
-			gtls_perror("gnutls_handshake", ret);
-			tconn_connection_abort(tc, notify_err);
-			return -1;
-		}
-		verify_state(tc);
-		return 0;
-	}
+	if (iv_task_registered(&ur->in_task))
+		iv_task_unregister(&ur->in_task);
 
-	gnutls_record_disable_padding(tc->sess);
+	if (iv_task_registered(&ur->tx_kick))
+		iv_task_unregister(&ur->tx_kick);
 
-	tc->state = STATE_RUNNING;
+	tc->rx_data = tc->rx_buf;
+	memcpy(tc->tx_buf, ur->tx_buf, sizeof(tc->tx_buf));
 
-	if (gnutls_record_check_pending(tc->sess) ||
-	    tc->rx_start != tc->rx_end || tc->rx_eof)
-		iv_task_register(&tc->rx_task);
+	iv_fd_set_handler_in(tc->fd, ur->want_in ? tconn_fd_handler_in : NULL);
+	iv_fd_set_handler_out(tc->fd,
+			      ur->want_out ? tconn_fd_handler_out : NULL);
 
-	verify_state(tc);
+	tconn_uring_put(ur);
+}
 
-	i = 1;
-	if (setsockopt(tc->fd->fd, SOL_TCP, TCP_NODELAY, &i, sizeof(i)) < 0) {
-		perror("setsockopt(SOL_TCP, TCP_NODELAY)");
-		abort();
-	}
+static void tconn_uring_check(struct tconn_uring *ur)
+{
+	if (ur->tc == NULL)
+		return;
 
-	desc = gnutls_session_get_desc(tc->sess);
-	tc->handshake_done(tc->cookie, desc);
-	gnutls_free(desc);
+	if (!ur->stopping && !tconn_want_io_uring()) {
+		ur->stopping = 1;
+		if (ur->rx_armed)
+			uring_cancel(&ur->rx_req);
+	}
 
-	return 0;
+	if (ur->stopping && !ur->rx_armed && !ur->fifo_count &&
+	    ur->rx_bid < 0 && !ur->rx_eof && !ur->rx_err && !ur->tx_inflight)
+		tconn_uring_stop(ur);
 }
 
-static void tconn_do_record_recv(struct tconn *tc)
+static void tconn_uring_recv_done(void *_ur, int res, unsigned int flags)
 {
-	uint8_t buf[32768];
-	int ret;
-
-	ret = gnutls_record_recv(tc->sess, buf, sizeof(buf));
+	struct tconn_uring *ur = _ur;
+	struct tconn *tc = ur->tc;
+	int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+	int final;
+
+	final = !(flags & IORING_CQE_F_MORE);
+	if (final)
+		ur->rx_armed = 0;
+
+	if (tc == NULL || res <= 0) {
+		if (flags & IORING_CQE_F_BUFFER)
+			tconn_uring_recycle(ur, bid);
+	} else if (flags & IORING_CQE_F_BUFFER) {
+		int i;
+
+		i = (ur->fifo_head + ur->fifo_count) % TCONN_URING_BUFS;
+		ur->fifo_bid[i] = bid;
+		ur->fifo_len[i] = res;
+		ur->fifo_count++;
+	}
 
-	if (ret == GNUTLS_E_AGAIN) {
-		verify_state(tc);
+	if (tc == NULL) {
+		if (final)
+			tconn_uring_put(ur);
 		return;
 	}
 
-	if ((ret < 0 && ret != GNUTLS_E_REHANDSHAKE) || ret == 0) {
-		if (ret)
-			gtls_perror("gnutls_record_recv", ret);
-		tconn_connection_abort(tc, 1);
-		return;
+	if (res == 0) {
+		ur->rx_eof = 1;
+	} else if (res == -EINVAL || res == -EOPNOTSUPP) {
+		fprintf(stderr, "tconn_uring_recv_done: multishot recv "
+				"not supported: %s\n", strerror(-res));
+		__atomic_store_n(&io_uring_unsupported, 1, __ATOMIC_RELAXED);
+		ur->stopping = 1;
+	} else if (res < 0 && res != -ENOBUFS && res != -ECANCELED) {
+		ur->rx_err = -res;
 	}
 
-	if (gnutls_record_check_pending(tc->sess) ||
-	    tc->rx_start != tc->rx_end || tc->rx_eof)
-		iv_task_register(&tc->rx_task);
+	/*
+	 * The multishot recv ends when we run out of buffers, and is
+	 * rearmed once one is free again, which may already be the
+	 * case by the time that we see it end.
+	 */
+	if (final && !ur->stopping && !ur->rx_eof && !ur->rx_err &&
+	    ur->fifo_count + (ur->rx_bid >= 0) < TCONN_URING_BUFS) {
+		if (tconn_uring_arm_recv(ur) < 0)
+			ur->stopping = 1;
+	}
 
-	verify_state(tc);
+	if (ur->want_in && tconn_uring_rx_ready(ur))
+		tconn_fd_handler_in(tc);
 
-	if (ret == GNUTLS_E_REHANDSHAKE) {
-		fprintf(stderr, "received HelloRequest\n");
-	} else {
-		tc->record_received(tc->cookie, buf, ret);
-	}
+	tconn_uring_check(ur);
+
+	if (final)
+		tconn_uring_put(ur);
 }
 
-static void tconn_do_record_send(struct tconn *tc)
+static void tconn_uring_in(void *_ur)
 {
-	int ret;
+	struct tconn_uring *ur = _ur;
 
-	ret = gnutls_record_send(tc->sess, NULL, 0);
-	if ((ret > 0 || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
-		ret = gnutls_record_send(tc->sess, NULL, 0);
+	if (ur->want_in && tconn_uring_rx_ready(ur))
+		tconn_fd_handler_in(ur->tc);
+}
 
-	if (ret == GNUTLS_E_AGAIN) {
-		verify_state(tc);
-		return;
+/*
+ * Hands the oldest received buffer to the tconn as its receive
+ * buffer, or else reports end of file, an error or EAGAIN, like
+ * recv() would.
+ */
+static int tconn_uring_recv(struct tconn *tc)
+{
+	struct tconn_uring *ur = tc->ur;
+	int len;
+
+	if (ur->fifo_count) {
+		ur->rx_bid = ur->fifo_bid[ur->fifo_head];
+		len = ur->fifo_len[ur->fifo_head];
+
+		ur->fifo_head = (ur->fifo_head + 1) % TCONN_URING_BUFS;
+		ur->fifo_count--;
+
+		tc->rx_data = ur->bufs[ur->rx_bid];
+
+		return len;
 	}
 
-	if (ret < 0) {
-		gtls_perror("gnutls_record_send", ret);
-		tconn_connection_abort(tc, 1);
-		return;
+	if (ur->rx_err) {
+		errno = ur->rx_err;
+		return -1;
 	}
 
-	// @@@ handle fewer bytes having been sent than passed in
+	if (ur->rx_eof)
+		return 0;
 
-	if (tc->state == STATE_TX_CONGESTION) {
-		tc->state = STATE_RUNNING;
-		verify_state(tc);
-	} else {
-		fprintf(stderr, "handle_record_send: called in state %d\n",
-			tc->state);
-		tconn_connection_abort(tc, 1);
-	}
+	errno = EAGAIN;
+
+	return -1;
 }
 
-static void tconn_rx_task_handler(void *_tc)
+static void tconn_uring_release(struct tconn *tc)
 {
-	struct tconn *tc = _tc;
+	struct tconn_uring *ur = tc->ur;
 
-	if (tc->state == STATE_HANDSHAKE &&
-	    gnutls_record_get_direction(tc->sess) == 0 &&
-	    (tc->io_error || tc->rx_start != tc->rx_end || tc->rx_eof)) {
-		tconn_do_handshake(tc, 1);
+	/*
+	 * The data may have been received before we moved over.
+	 */
+	if (ur->rx_bid < 0)
 		return;
-	}
 
-	if ((tc->state == STATE_RUNNING || tc->state == STATE_TX_CONGESTION) &&
-	    (gnutls_record_check_pending(tc->sess) || tc->io_error ||
-	     tc->rx_start != tc->rx_end || tc->rx_eof)) {
-		tconn_do_record_recv(tc);
-		return;
+	tconn_uring_recycle(ur, ur->rx_bid);
+	ur->rx_bid = -1;
+
+	if (!ur->rx_armed && !ur->stopping && !ur->rx_eof && !ur->rx_err &&
+	    tconn_uring_arm_recv(ur) < 0) {
+		ur->stopping = 1;
 	}
 
-	abort();
+	tconn_uring_check(ur);
 }
 
-static void tconn_tx_task_handler(void *_tc)
+static void tconn_uring_kick(void *_ur)
 {
-	struct tconn *tc = _tc;
+	struct tconn_uring *ur = _ur;
+	struct tconn *tc = ur->tc;
+	struct io_uring_sqe *sqe;
 
-	if (tc->state == STATE_HANDSHAKE &&
-	    gnutls_record_get_direction(tc->sess) == 1 &&
-	    (tc->io_error || tc->tx_bytes < sizeof(tc->tx_buf))) {
-		tconn_do_handshake(tc, 1);
+	if (!ur->want_out || !tc->tx_bytes || ur->tx_inflight)
 		return;
-	}
 
-	if (tc->state == STATE_TX_CONGESTION &&
-	    (tc->io_error || tc->tx_bytes < sizeof(tc->tx_buf))) {
-		tconn_do_record_send(tc);
+	sqe = uring_get_sqe(&ur->tx_req);
+	if (sqe == NULL) {
+		iv_task_register(&ur->tx_kick);
 		return;
 	}
 
-	abort();
+	ur->tx_msg.msg_iov = ur->tx_iov;
+	ur->tx_msg.msg_iovlen = tconn_tx_iov(tc, ur->tx_iov);
+
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = tc->fd->fd;
+	sqe->addr = (uintptr_t)&ur->tx_msg;
+	sqe->msg_flags = MSG_NOSIGNAL;
+
+	ur->tx_inflight = 1;
+	ur->refcount++;
 }
 
-static int cert_refers_to_nodeid(gnutls_x509_crt_t cert, uint8_t *nodeid)
+static void tconn_uring_send_done(void *_ur, int res, unsigned int flags)
 {
-	char expected_dn[128];
-	int i;
-	int ret;
-	gnutls_datum_t cert_dn;
+	struct tconn_uring *ur = _ur;
+	struct tconn *tc = ur->tc;
 
-	sprintf(expected_dn, "CN=");
-	for (i = 0; i < NODE_ID_LEN; i++)
-		sprintf(expected_dn + 3 + (2 * i), "%.2x", nodeid[i]);
-	expected_dn[67] = 0;
+	ur->tx_inflight = 0;
 
-	ret = gnutls_x509_crt_get_dn2(cert, &cert_dn);
-	if (ret < 0) {
-		gtls_perror("gnutls_x509_crt_init", ret);
-		return 0;
-	}
+	if (tc != NULL && ur->want_out) {
+		ur->tx_res = res;
+		tconn_fd_handler_out(tc);
 
-	if (strcmp(expected_dn, (char *)cert_dn.data)) {
-		gnutls_free(cert_dn.data);
-		return 0;
+		if (ur->want_out && !iv_task_registered(&ur->tx_kick))
+			iv_task_register(&ur->tx_kick);
 	}
 
-	gnutls_free(cert_dn.data);
-
-	return 1;
+	tconn_uring_check(ur);
+	tconn_uring_put(ur);
 }
 
-static int tconn_verify_cert(gnutls_session_t sess)
+static int tconn_uring_start(struct tconn *tc)
 {
-	struct tconn *tc = gnutls_transport_get_ptr(sess);
-	const gnutls_datum_t *certs;
-	unsigned int num_certs;
-	uint8_t *nodeids;
-	gnutls_x509_crt_t cert;
-	gnutls_pubkey_t key;
+	struct tconn_uring *ur;
 	int i;
-	int ret;
-	int j;
 
-	certs = gnutls_certificate_get_peers(tc->sess, &num_certs);
-	if (num_certs < 1) {
-		fprintf(stderr, "tconn_verify_cert: no certificates found\n");
-		goto err;
+	if ((tc->state != STATE_RUNNING && tc->state != STATE_TX_CONGESTION) ||
+	    tc->hs_offload || tc->ktls_tx || tc->io_error || tc->rx_eof) {
+		return -1;
 	}
 
-	nodeids = malloc(num_certs * NODE_ID_LEN);
-	if (nodeids == NULL)
-		goto err;
+	if (uring_get() < 0) {
+		__atomic_store_n(&io_uring_unsupported, 1, __ATOMIC_RELAXED);
+		return -1;
+	}
 
-	ret = gnutls_x509_crt_init(&cert);
-	if (ret) {
-		gtls_perror("gnutls_x509_crt_init", ret);
-		goto err_free_ids;
+	ur = calloc(1, sizeof(*ur));
+	if (ur == NULL) {
+		uring_put();
+		return -1;
 	}
 
-	ret = gnutls_pubkey_init(&key);
-	if (ret) {
-		gtls_perror("gnutls_pubkey_init", ret);
-		goto err_free_crt;
+	ur->br = mmap(NULL, TCONN_URING_BUFS * sizeof(struct io_uring_buf),
+		      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		      -1, 0);
+	if (ur->br == MAP_FAILED) {
+		free(ur);
+		uring_put();
+		return -1;
 	}
 
-	/*
-	 * TBD: @@@
-	 * - verify that signature verifies to embedded public key
-	 * - verify that fingerprint matches what we expect
-	 * - check validity in case of non self signed certificate
-	 */
-	for (i = 0, j = 0 ; i < num_certs; i++) {
-		uint8_t id[NODE_ID_LEN];
+	ur->bgid = uring_register_buf_ring(ur->br, TCONN_URING_BUFS);
+	if (ur->bgid < 0) {
+		__atomic_store_n(&io_uring_unsupported, 1, __ATOMIC_RELAXED);
+		munmap(ur->br, TCONN_URING_BUFS * sizeof(struct io_uring_buf));
+		free(ur);
+		uring_put();
+		return -1;
+	}
 
-		ret = gnutls_x509_crt_import(cert, &certs[i],
-					     GNUTLS_X509_FMT_DER);
-		if (ret) {
-			gtls_perror("gnutls_x509_crt_import", ret);
-			goto err_free_key;
-		}
+	ur->tc = tc;
+	ur->refcount = 1;
+	ur->want_in = (tc->fd->handler_in != NULL);
+	ur->want_out = (tc->fd->handler_out != NULL);
+	ur->rx_req.cookie = ur;
+	ur->rx_req.complete = tconn_uring_recv_done;
+	ur->rx_bid = -1;
+	IV_TASK_INIT(&ur->in_task);
+	ur->in_task.cookie = ur;
+	ur->in_task.handler = tconn_uring_in;
+	ur->tx_req.cookie = ur;
+	ur->tx_req.complete = tconn_uring_send_done;
+	IV_TASK_INIT(&ur->tx_kick);
+	ur->tx_kick.cookie = ur;
+	ur->tx_kick.handler = tconn_uring_kick;
+	memcpy(ur->tx_buf, tc->tx_buf, sizeof(ur->tx_buf));
+
+	for (i = 0; i < TCONN_URING_BUFS; i++)
+		tconn_uring_recycle(ur, i);
+
+	if (tconn_uring_arm_recv(ur) < 0) {
+		tconn_uring_put(ur);
+		return -1;
+	}
 
-		ret = gnutls_pubkey_import_x509(key, cert, 0);
-		if (ret) {
-			gtls_perror("gnutls_pubkey_import_x509", ret);
-			goto err_free_key;
-		}
+	tc->ur = ur;
+	iv_fd_set_handler_in(tc->fd, NULL);
+	iv_fd_set_handler_out(tc->fd, NULL);
 
-		ret = get_pubkey_id(id, key);
-		if (ret) {
-			gtls_perror("get_pubkey_id", ret);
-			goto err_free_key;
-		}
+	if (ur->want_out)
+		iv_task_register(&ur->tx_kick);
 
-		if (i == 0 || cert_refers_to_nodeid(cert, nodeids)) {
-			memcpy(nodeids + (j * NODE_ID_LEN), id, NODE_ID_LEN);
-			j++;
-		}
+	return 0;
+}
+
+/*
+ * A tconn that only sends would never get to move over from
+ * tconn_fd_handler_in(), so sending a record schedules this as well.
+ * Doing this from a task keeps a tconn from moving before its owner
+ * has had a chance to hand it to a worker from handshake_done.
+ */
+static void tconn_uring_task_handler(void *_tc)
+{
+	struct tconn *tc = _tc;
+
+	if (tc->ur == NULL && tconn_want_io_uring()) {
+		tconn_uring_start(tc);
+		verify_state(tc);
 	}
+}
 
-	gnutls_x509_crt_deinit(cert);
-	gnutls_pubkey_deinit(key);
+/*
+ * For tconn_destroy(), which doesn't care about any data still in
+ * flight in either direction, and treats the tconn as if it had seen
+ * an I/O error from then on.
+ */
+static void tconn_uring_abandon(struct tconn *tc)
+{
+	struct tconn_uring *ur = tc->ur;
 
-	ret = tc->verify_key_ids(tc->cookie, nodeids, j);
+	ur->tc = NULL;
+	tc->ur = NULL;
 
-	free(nodeids);
+	if (iv_task_registered(&ur->in_task))
+		iv_task_unregister(&ur->in_task);
 
-	return ret;
+	if (iv_task_registered(&ur->tx_kick))
+		iv_task_unregister(&ur->tx_kick);
 
-err_free_key:
-	gnutls_pubkey_deinit(key);
+	if (ur->rx_armed)
+		uring_cancel(&ur->rx_req);
 
-err_free_crt:
-	gnutls_x509_crt_deinit(cert);
+	if (ur->tx_inflight)
+		uring_cancel(&ur->tx_req);
 
-err_free_ids:
-	free(nodeids);
+	tc->rx_data = tc->rx_buf;
+	tc->rx_start = 0;
+	tc->rx_end = 0;
+	tc->tx_start = 0;
+	tc->tx_bytes = 0;
 
-err:
-	return 1;
+	if (!tc->io_error)
+		tc->io_error = ECONNABORTED;
+	got_io_error(tc);
+
+	tconn_uring_put(ur);
 }
 
-static int tconn_start_handshake(struct tconn *tc)
+static void gtls_perror(const char *str, int error)
 {
-	int ret;
+	fprintf(stderr, "%s: %s\n", str, gnutls_strerror(error));
+}
 
-	ret = gnutls_certificate_allocate_credentials(&tc->cert);
-	if (ret) {
-		gtls_perror("gnutls_certificate_allocate_credentials", ret);
-		goto err;
-	}
+/*
+ * Records travel between a tconn on a worker thread and its owner
+ * through a pair of per-session SPSC rings: rx_ring carries received
+ * records from the worker to the owner, and tx_ring carries records
+ * to be sent the other way.  The consumer of a ring is woken up via
+ * an iv_event when a record is pushed to an empty ring, and each
+ * record is stamped on the way in, so that the time that records
+ * spend in the ring can be tracked, along with the ring's depth.
+ *
+ * As most sessions only ever carry a trickle of records, rings start
+ * out at TCONN_RING_MIN_SIZE.  When a record doesn't fit, the producer
+ * moves on to a new ring of twice the size (up to TCONN_RING_MAX_SIZE),
+ * which it links to from the old one, and the consumer follows that
+ * link once it has drained the old ring, and frees it.  Rings don't
+ * shrink again for as long as the session lasts.
+ *
+ * If a ring is full, records are instead posted (in a message) to the
+ * consumer's queue, and all further records are sent that way until
+ * all the posted ones have been consumed.  A posted record is only
+ * handled after everything in the ring has been drained, so records
+ * are always delivered in the order in which they were submitted.
+ * Bulk class records that are to be sent are dropped instead.  Beyond
+ * TCONN_RING_MAX_SPILLED posted records, a consumer that can't keep
+ * up would make the messages pile up without bound, and as dropping
+ * anything but bulk records would silently break the protocol that
+ * runs over the connection, the connection is failed instead.
+ */
+#define TCONN_RING_MIN_SIZE	(16 * 1024)
+#define TCONN_RING_MAX_SIZE	(256 * 1024)
+#define TCONN_RING_MAX_SPILLED	1024
 
-	gnutls_certificate_set_verify_function(tc->cert, tconn_verify_cert);
+struct tconn_ring_buf {
+	struct spsc_ring	ring;
+	struct tconn_ring_buf	*next;
+};
 
-	ret = gnutls_certificate_set_x509_key(tc->cert, tc->mycrts,
-					      tc->numcrts, tc->mykey);
-	if (ret) {
-		gtls_perror("gnutls_certificate_set_x509_key", ret);
-		goto err_free;
-	}
+static struct tconn_ring_buf *tconn_ring_buf_alloc(int size)
+{
+	struct tconn_ring_buf *rb;
 
-	ret = gnutls_credentials_set(tc->sess, GNUTLS_CRD_CERTIFICATE,
-				     tc->cert);
-	if (ret) {
-		gtls_perror("gnutls_credentials_set", ret);
-		goto err_free;
+	rb = malloc(sizeof(*rb));
+	if (rb == NULL)
+		return NULL;
+
+	if (spsc_ring_init(&rb->ring, size) < 0) {
+		free(rb);
+		return NULL;
 	}
 
-	tc->state = STATE_HANDSHAKE;
+	rb->next = NULL;
 
-	ret = tconn_do_handshake(tc, 0);
-	if (ret)
-		goto err_free;
+	return rb;
+}
 
-	return 0;
+static void tconn_ring_buf_free(struct tconn_ring_buf *rb)
+{
+	spsc_ring_deinit(&rb->ring);
+	free(rb);
+}
 
-err_free:
-	gnutls_certificate_free_credentials(tc->cert);
+/*
+ * Runs on the producer's thread.  All records that were pushed to
+ * the old ring are visible to a consumer that sees the link to the
+ * new one.
+ */
+static int tconn_ring_grow(struct tconn_ring *r)
+{
+	struct tconn_ring_buf *rb;
 
-err:
-	return -1;
+	if (r->prod->ring.size >= TCONN_RING_MAX_SIZE)
+		return -1;
+
+	rb = tconn_ring_buf_alloc(2 * r->prod->ring.size);
+	if (rb == NULL)
+		return -1;
+
+	__atomic_store_n(&r->prod->next, rb, __ATOMIC_RELEASE);
+	r->prod = rb;
+
+	return 0;
 }
 
-int tconn_start(struct tconn *tc)
+/*
+ * Besides received records, the rx ring carries messages that the
+ * data plane on the worker passes to the owner.  Ring entries are
+ * tagged with which of the two they are.
+ */
+#define RING_TAG_RECORD		0
+#define RING_TAG_DP_MESSAGE	1
+
+static int tconn_ring_push(struct tconn_ring *r, const struct iovec *iov,
+			   int iovcnt, int tag)
 {
-	static char prio[] =
-		"NONE:+CIPHER-ALL:+ECDHE-RSA:+MAC-ALL:+COMP-NULL:"
-		"+VERS-TLS1.2:+SIGN-ALL:+CURVE-SECP256R1:%SAFE_RENEGOTIATION";
-	unsigned int flags;
 	int ret;
-	const char *err;
 
-	flags = GNUTLS_NONBLOCK | GNUTLS_NO_EXTENSIONS;
-	if (tc->role == TCONN_ROLE_SERVER)
-		flags |= GNUTLS_SERVER;
-	else
-		flags |= GNUTLS_CLIENT;
+	if (__atomic_load_n(&r->spilled, __ATOMIC_ACQUIRE))
+		return -1;
 
-	ret = gnutls_init(&tc->sess, flags);
-	if (ret) {
-		gtls_perror("gnutls_init", ret);
-		goto err;
-	}
+	iv_validate_now();
 
-	if (tc->role == TCONN_ROLE_SERVER) {
-		gnutls_certificate_server_set_request(tc->sess,
-						      GNUTLS_CERT_REQUIRE);
-		gnutls_certificate_send_x509_rdn_sequence(tc->sess, 1);
+	while ((ret = spsc_ring_push(&r->prod->ring, iov, iovcnt,
+				     tag, &iv_now)) < 0) {
+		if (tconn_ring_grow(r) < 0)
+			return -1;
 	}
 
-	ret = gnutls_priority_set_direct(tc->sess, prio, &err);
-	if (ret) {
-		const char *p;
+	__atomic_store_n(&r->pushed, r->pushed + 1, __ATOMIC_RELAXED);
+	if (ret)
+		iv_event_post(&r->ev);
 
-		gtls_perror("gnutls_priority_set_direct", ret);
+	return 0;
+}
 
-		fprintf(stderr, "%s\n", prio);
-		for (p = prio; p < err; p++)
-			fprintf(stderr, " ");
-		fprintf(stderr, "^ error in priority string\n");
+static void tconn_ring_drop(struct tconn_ring *r)
+{
+	__atomic_store_n(&r->drops, r->drops + 1, __ATOMIC_RELAXED);
+}
 
-		goto err_deinit;
+/*
+ * Accounts for a record that couldn't be pushed, and returns 0 if
+ * it is to be posted instead, or -1 if it has been dropped.
+ */
+static int tconn_ring_spill(struct tconn_ring *r)
+{
+	if (__atomic_load_n(&r->spilled, __ATOMIC_ACQUIRE) >=
+	    TCONN_RING_MAX_SPILLED) {
+		tconn_ring_drop(r);
+		return -1;
 	}
 
-	gnutls_transport_set_ptr(tc->sess, tc);
-	gnutls_transport_set_pull_function(tc->sess, tconn_gtls_pull_func);
-	gnutls_transport_set_push_function(tc->sess, tconn_gtls_push_func);
+	__atomic_fetch_add(&r->spilled, 1, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&r->spills, r->spills + 1, __ATOMIC_RELAXED);
 
-	tc->fd->cookie = tc;
-	iv_fd_set_handler_in(tc->fd, tconn_fd_handler_in);
-	iv_fd_set_handler_out(tc->fd, NULL);
-	iv_fd_set_handler_err(tc->fd, NULL);
+	return 0;
+}
 
-	tc->io_error = 0;
+static int tconn_ring_pop(struct tconn_ring *r, uint8_t *buf, int len,
+			  int *tag)
+{
+	struct tconn_ring_stats *st = &r->stats;
+	struct timespec ts;
+	int64_t lat;
+	int bytes;
+	int ret;
 
-	IV_TASK_INIT(&tc->rx_task);
-	tc->rx_task.cookie = tc;
-	tc->rx_task.handler = tconn_rx_task_handler;
-	tc->rx_start = 0;
-	tc->rx_end = 0;
-	tc->rx_eof = 0;
+	while (1) {
+		struct tconn_ring_buf *next;
 
-	IV_TASK_INIT(&tc->tx_task);
-	tc->tx_task.cookie = tc;
-	tc->tx_task.handler = tconn_tx_task_handler;
-	tc->tx_bytes = 0;
+		bytes = spsc_ring_bytes(&r->cons->ring);
 
-	ret = tconn_start_handshake(tc);
-	if (ret)
-		goto err_deinit;
+		ret = spsc_ring_pop(&r->cons->ring, buf, len, tag, &ts);
+		if (ret >= 0)
+			break;
+
+		next = __atomic_load_n(&r->cons->next, __ATOMIC_ACQUIRE);
+		if (next == NULL)
+			return -1;
+
+		/*
+		 * Records can have been pushed to the old ring after
+		 * we found it empty, but before it was replaced.
+		 */
+		if (spsc_ring_bytes(&r->cons->ring))
+			continue;
+
+		tconn_ring_buf_free(r->cons);
+		r->cons = next;
+	}
+
+	iv_validate_now();
+	lat = (int64_t)(iv_now.tv_sec - ts.tv_sec) * 1000000 +
+		(iv_now.tv_nsec - ts.tv_nsec) / 1000;
+
+	st->records++;
+	st->latency_total_us += lat;
+	if (lat > st->latency_max_us)
+		st->latency_max_us = lat;
+	if (bytes > st->queue_max_bytes)
+		st->queue_max_bytes = bytes;
+
+	return ret;
+}
+
+static void tconn_ring_unspill(struct tconn_ring *r)
+{
+	__atomic_fetch_sub(&r->spilled, 1, __ATOMIC_ACQ_REL);
+}
+
+static int tconn_ring_init(struct tconn_ring *r)
+{
+	r->cons = tconn_ring_buf_alloc(TCONN_RING_MIN_SIZE);
+	if (r->cons == NULL)
+		return -1;
+
+	r->prod = r->cons;
+
+	r->spilled = 0;
+	r->pushed = 0;
+	r->spills = 0;
+	r->drops = 0;
+	memset(&r->stats, 0, sizeof(r->stats));
 
 	return 0;
+}
 
-err_deinit:
-	gnutls_deinit(tc->sess);
+static void tconn_ring_deinit(struct tconn_ring *r)
+{
+	while (r->cons != NULL) {
+		struct tconn_ring_buf *next = r->cons->next;
 
-err:
-	return -1;
+		tconn_ring_buf_free(r->cons);
+		r->cons = next;
+	}
+
+	r->prod = NULL;
 }
 
-void tconn_destroy(struct tconn *tc)
+static void tconn_ring_event_register(struct tconn_ring *r, struct tconn *tc,
+				      void (*handler)(void *))
 {
-	verify_state(tc);
+	IV_EVENT_INIT(&r->ev);
+	r->ev.cookie = tc;
+	r->ev.handler = handler;
+	iv_event_register(&r->ev);
+}
 
-	iv_fd_set_handler_in(tc->fd, NULL);
-	iv_fd_set_handler_out(tc->fd, NULL);
+static void tconn_rx_deliver(struct tconn *tc, int tag,
+			     const uint8_t *buf, int len)
+{
+	if (tag == RING_TAG_RECORD)
+		tc->record_received(tc->cookie, buf, len);
+	else if (tc->dp_message != NULL)
+		tc->dp_message(tc->dp_cookie, buf, len);
+	else if (tc->dp_message_discard != NULL)
+		tc->dp_message_discard(buf, len);
+}
 
-	gnutls_deinit(tc->sess);
+/*
+ * Runs on the owner's thread.  Delivering a record can destroy the
+ * tconn, in which case -1 is returned.  There are no rings yet while
+ * the handshake is running on a worker.
+ */
+static int tconn_rx_ring_drain(struct tconn *tc)
+{
+	uint8_t buf[32768];
+	int destroyed;
+	int tag;
+	int len;
 
-	gnutls_certificate_free_credentials(tc->cert);
+	if (tc->hs_offload)
+		return 0;
+
+	destroyed = 0;
+	tc->destroyed = &destroyed;
+
+	while ((len = tconn_ring_pop(&tc->rx_ring, buf, sizeof(buf),
+				     &tag)) >= 0) {
+		if (len)
+			tconn_rx_deliver(tc, tag, buf, len);
+		if (destroyed)
+			return -1;
+	}
+
+	tc->destroyed = NULL;
+
+	return 0;
+}
+
+static void tconn_rx_ring_run(void *_tc)
+{
+	tconn_rx_ring_drain(_tc);
+}
+
+static void tconn_rx_ring_discard(struct tconn *tc)
+{
+	uint8_t buf[32768];
+	int tag;
+	int len;
+
+	while ((len = tconn_ring_pop(&tc->rx_ring, buf, sizeof(buf),
+				     &tag)) >= 0) {
+		if (len && tag == RING_TAG_DP_MESSAGE &&
+		    tc->dp_message_discard != NULL) {
+			tc->dp_message_discard(buf, len);
+		}
+	}
+}
+
+/*
+ * Once a tconn has been handed to a worker thread (see
+ * tconn_set_worker()), the callbacks into its owner are made from the
+ * owner's thread, by posting control messages to it.
+ */
+#define CTL_RECORD		1
+#define CTL_ACTIVITY		2
+#define CTL_TX_READY		3
+#define CTL_LOST		4
+#define CTL_DP_MESSAGE		5
+#define CTL_HANDSHAKE		6
+
+#define ACTIVITY_INTERVAL	1
+
+struct tconn_ctl {
+	struct worker_msg	msg;
+	struct tconn		*tc;
+	int			type;
+	int			len;
+	uint8_t			data[0];
+};
+
+static void tconn_handshake_complete(struct tconn *tc);
+
+static void tconn_ctl_run(struct worker_msg *msg)
+{
+	struct tconn_ctl *ctl = iv_container_of(msg, struct tconn_ctl, msg);
+	struct tconn *tc = ctl->tc;
+	void (*discard)(const uint8_t *msg, int len);
+
+	switch (ctl->type) {
+	case CTL_RECORD:
+		if (tconn_rx_ring_drain(tc) < 0)
+			break;
+		tconn_ring_unspill(&tc->rx_ring);
+		tc->record_received(tc->cookie, ctl->data, ctl->len);
+		break;
+
+	case CTL_DP_MESSAGE:
+		discard = tc->dp_message_discard;
+		if (tconn_rx_ring_drain(tc) < 0) {
+			if (discard != NULL)
+				discard(ctl->data, ctl->len);
+			break;
+		}
+		tconn_ring_unspill(&tc->rx_ring);
+		tconn_rx_deliver(tc, RING_TAG_DP_MESSAGE, ctl->data, ctl->len);
+		break;
+
+	case CTL_HANDSHAKE:
+		tconn_handshake_complete(tc);
+		break;
+
+	case CTL_ACTIVITY:
+		if (tc->rx_activity != NULL)
+			tc->rx_activity(tc->cookie);
+		break;
+
+	case CTL_TX_READY:
+		if (tc->tx_ready != NULL)
+			tc->tx_ready(tc->cookie);
+		break;
+
+	case CTL_LOST:
+		if (tconn_rx_ring_drain(tc) == 0)
+			tc->connection_lost(tc->cookie);
+		break;
+	}
+
+	free(ctl);
+}
+
+static void tconn_ctl_discard(struct worker_msg *msg)
+{
+	struct tconn_ctl *ctl = iv_container_of(msg, struct tconn_ctl, msg);
+	struct tconn *tc = ctl->tc;
+
+	if (ctl->type == CTL_DP_MESSAGE && tc->dp_message_discard != NULL)
+		tc->dp_message_discard(ctl->data, ctl->len);
+
+	free(ctl);
+}
+
+static void tconn_post_ctl(struct tconn *tc, int type,
+			   const uint8_t *data, int len)
+{
+	struct tconn_ctl *ctl;
+
+	ctl = malloc(sizeof(*ctl) + len);
+	if (ctl == NULL) {
+		fprintf(stderr, "tconn_post_ctl: memory allocation "
+				"failure\n");
+		abort();
+	}
+
+	ctl->msg.handler = tconn_ctl_run;
+	ctl->tc = tc;
+	ctl->type = type;
+	ctl->len = len;
+	if (len)
+		memcpy(ctl->data, data, len);
+
+	worker_queue_post(&tc->ctl_queue, &ctl->msg);
+}
+
+static void tconn_notify_lost(struct tconn *tc)
+{
+	if (tc->worker != NULL)
+		tconn_post_ctl(tc, CTL_LOST, NULL, 0);
+	else
+		tc->connection_lost(tc->cookie);
+}
+
+static void tconn_connection_abort(struct tconn *tc, int notify_err);
+
+static int tconn_rx_pass(struct tconn *tc, int tag,
+			 const uint8_t *buf, int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+	if (tconn_ring_push(&tc->rx_ring, &iov, 1, tag) == 0)
+		return 0;
+
+	if (tconn_ring_spill(&tc->rx_ring) < 0) {
+		if (tag == RING_TAG_RECORD) {
+			fprintf(stderr, "tconn_rx_pass: receive ring "
+					"overflow\n");
+			tconn_connection_abort(tc, 1);
+		}
+		return -1;
+	}
+
+	tconn_post_ctl(tc, (tag == RING_TAG_RECORD) ? CTL_RECORD :
+			   CTL_DP_MESSAGE, buf, len);
+
+	return 0;
+}
+
+/*
+ * On a worker, records are offered to the data plane first, and only
+ * the ones that it doesn't consume are passed on to our owner.  As
+ * the owner then no longer sees all incoming traffic, it is told
+ * every ACTIVITY_INTERVAL seconds that the connection is alive.
+ */
+static void tconn_deliver_record(struct tconn *tc, const uint8_t *rec, int len)
+{
+	if (tc->worker == NULL) {
+		tc->record_received(tc->cookie, rec, len);
+		return;
+	}
+
+	if (tc->dp_record_received == NULL ||
+	    tc->dp_record_received(tc->dp_cookie, rec, len) < 0) {
+		tconn_rx_pass(tc, RING_TAG_RECORD, rec, len);
+		return;
+	}
+
+	iv_validate_now();
+	if (iv_now.tv_sec - tc->activity_posted.tv_sec >= ACTIVITY_INTERVAL) {
+		tc->activity_posted = iv_now;
+		tconn_post_ctl(tc, CTL_ACTIVITY, NULL, 0);
+	}
+}
+
+static void tconn_connection_abort(struct tconn *tc, int notify_err)
+{
+	tconn_set_handler_in(tc, NULL);
+	tconn_set_handler_out(tc, NULL);
+
+	tc->state = STATE_DEAD;
 
 	if (iv_task_registered(&tc->rx_task))
 		iv_task_unregister(&tc->rx_task);
 
 	if (iv_task_registered(&tc->tx_task))
 		iv_task_unregister(&tc->tx_task);
+
+	if (iv_task_registered(&tc->tx_ready_task))
+		iv_task_unregister(&tc->tx_ready_task);
+
+	if (iv_task_registered(&tc->uring_task))
+		iv_task_unregister(&tc->uring_task);
+
+	if (notify_err)
+		tconn_notify_lost(tc);
 }
 
-int tconn_record_send(struct tconn *tc, const uint8_t *rec, int len)
+/*
+ * Optionally hand the transmit direction of an established session
+ * to the kernel (kTLS), so that records are encrypted by send() with
+ * no further involvement from GnuTLS.  Only AES-GCM under TLS 1.2 is
+ * supported, and anything unexpected (no tls module, a different
+ * cipher, ciphertext still queued) leaves the session in user space.
+ *
+ * The receive direction is always left to GnuTLS, as kTLS RX merges
+ * back-to-back data records into a single recv(), while dvpn relies
+ * on record boundaries.
+ */
+static void tconn_try_kernel_tls(struct tconn *tc)
+{
+	union {
+		struct tls12_crypto_info_aes_gcm_128	gcm128;
+		struct tls12_crypto_info_aes_gcm_256	gcm256;
+	} ci;
+	gnutls_datum_t mac_key;
+	gnutls_datum_t iv;
+	gnutls_datum_t key;
+	uint8_t seq[8];
+	int len;
+	int ret;
+
+	if (!kernel_tls || tc->tx_bytes)
+		return;
+
+	if (gnutls_protocol_get_version(tc->sess) != GNUTLS_TLS1_2)
+		return;
+
+	ret = gnutls_record_get_state(tc->sess, 0, &mac_key, &iv, &key, seq);
+	if (ret) {
+		gtls_perror("gnutls_record_get_state", ret);
+		return;
+	}
+
+	memset(&ci, 0, sizeof(ci));
+
+	switch (gnutls_cipher_get(tc->sess)) {
+	case GNUTLS_CIPHER_AES_128_GCM:
+		if (iv.size != TLS_CIPHER_AES_GCM_128_SALT_SIZE ||
+		    key.size != TLS_CIPHER_AES_GCM_128_KEY_SIZE)
+			return;
+
+		ci.gcm128.info.version = TLS_1_2_VERSION;
+		ci.gcm128.info.cipher_type = TLS_CIPHER_AES_GCM_128;
+		memcpy(ci.gcm128.iv, seq, TLS_CIPHER_AES_GCM_128_IV_SIZE);
+		memcpy(ci.gcm128.key, key.data, key.size);
+		memcpy(ci.gcm128.salt, iv.data, iv.size);
+		memcpy(ci.gcm128.rec_seq, seq, sizeof(seq));
+		len = sizeof(ci.gcm128);
+		break;
+
+	case GNUTLS_CIPHER_AES_256_GCM:
+		if (iv.size != TLS_CIPHER_AES_GCM_256_SALT_SIZE ||
+		    key.size != TLS_CIPHER_AES_GCM_256_KEY_SIZE)
+			return;
+
+		ci.gcm256.info.version = TLS_1_2_VERSION;
+		ci.gcm256.info.cipher_type = TLS_CIPHER_AES_GCM_256;
+		memcpy(ci.gcm256.iv, seq, TLS_CIPHER_AES_GCM_256_IV_SIZE);
+		memcpy(ci.gcm256.key, key.data, key.size);
+		memcpy(ci.gcm256.salt, iv.data, iv.size);
+		memcpy(ci.gcm256.rec_seq, seq, sizeof(seq));
+		len = sizeof(ci.gcm256);
+		break;
+
+	default:
+		return;
+	}
+
+	/*
+	 * An attached tls ULP without TLS_TX configured behaves like a
+	 * plain TCP socket, so failing either step is harmless.
+	 */
+	if (setsockopt(tc->fd->fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) < 0)
+		goto out;
+
+	if (setsockopt(tc->fd->fd, SOL_TLS, TLS_TX, &ci, len) < 0)
+		goto out;
+
+	tc->ktls_tx = 1;
+
+out:
+	memset(&ci, 0, sizeof(ci));
+}
+
+static void tconn_unhook(struct tconn *tc, struct tconn_move *mv);
+
+static int tconn_do_handshake(struct tconn *tc, int notify_err)
 {
+	char *desc;
 	int ret;
+	int i;
+
+	ret = gnutls_handshake(tc->sess);
+	if ((!ret || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
+		ret = gnutls_handshake(tc->sess);
+
+	if (ret) {
+		if (ret != GNUTLS_E_AGAIN) {
+			gtls_perror("gnutls_handshake", ret);
+			tconn_connection_abort(tc, notify_err);
+			return -1;
+		}
+		verify_state(tc);
+		return 0;
+	}
+
+	gnutls_record_disable_padding(tc->sess);
+
+	tc->state = STATE_RUNNING;
+
+	tconn_try_kernel_tls(tc);
+
+	if (gnutls_record_check_pending(tc->sess) ||
+	    tc->rx_start != tc->rx_end || tc->rx_eof)
+		iv_task_register(&tc->rx_task);
 
 	verify_state(tc);
 
-	if (tc->state == STATE_TX_CONGESTION) {
+	i = 1;
+	if (setsockopt(tc->fd->fd, SOL_TCP, TCP_NODELAY, &i, sizeof(i)) < 0) {
+		perror("setsockopt(SOL_TCP, TCP_NODELAY)");
+		abort();
+	}
+
+	if (tc->hs_offload) {
+		tconn_unhook(tc, &tc->hs_move);
+		tc->hs_move.tc = tc;
+		tconn_post_ctl(tc, CTL_HANDSHAKE, NULL, 0);
 		return 0;
-	} else if (tc->state != STATE_RUNNING) {
-		fprintf(stderr, "got packet in [%d]\n", tc->state);
-		return -1;
 	}
 
-	ret = gnutls_record_send(tc->sess, rec, len);
+	desc = gnutls_session_get_desc(tc->sess);
+	tc->handshake_done(tc->cookie, desc);
+	gnutls_free(desc);
+
+	return 0;
+}
+
+static void tconn_do_record_recv(struct tconn *tc)
+{
+	uint8_t buf[32768];
+	int ret;
+
+	ret = gnutls_record_recv(tc->sess, buf, sizeof(buf));
+
+	if (ret == GNUTLS_E_AGAIN) {
+		verify_state(tc);
+		return;
+	}
+
+	if ((ret < 0 && ret != GNUTLS_E_REHANDSHAKE) || ret == 0) {
+		if (ret)
+			gtls_perror("gnutls_record_recv", ret);
+		tconn_connection_abort(tc, 1);
+		return;
+	}
+
+	if (gnutls_record_check_pending(tc->sess) ||
+	    tc->rx_start != tc->rx_end || tc->rx_eof)
+		iv_task_register(&tc->rx_task);
+
+	verify_state(tc);
+
+	if (ret == GNUTLS_E_REHANDSHAKE) {
+		fprintf(stderr, "received HelloRequest\n");
+	} else {
+		tconn_deliver_record(tc, buf, ret);
+	}
+}
+
+static void tconn_do_record_send(struct tconn *tc)
+{
+	int ret;
+
+	ret = gnutls_record_send(tc->sess, NULL, 0);
 	if ((ret > 0 || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
 		ret = gnutls_record_send(tc->sess, NULL, 0);
 
-	if (ret < 0 && ret != GNUTLS_E_AGAIN) {
-		gtls_perror("gnutls_record_send", ret);
-		tconn_connection_abort(tc, 0);
-		return -1;
+	if (ret == GNUTLS_E_AGAIN) {
+		verify_state(tc);
+		return;
 	}
 
-	if (ret == GNUTLS_E_AGAIN)
-		tc->state = STATE_TX_CONGESTION;
+	if (ret < 0) {
+		gtls_perror("gnutls_record_send", ret);
+		tconn_connection_abort(tc, 1);
+		return;
+	}
 
 	// @@@ handle fewer bytes having been sent than passed in
 
-	verify_state(tc);
-
-	return 0;
+	if (tc->state == STATE_TX_CONGESTION) {
+		tc->state = STATE_RUNNING;
+		verify_state(tc);
+		tconn_txq_drain(tc);
+	} else {
+		fprintf(stderr, "handle_record_send: called in state %d\n",
+			tc->state);
+		tconn_connection_abort(tc, 1);
+	}
+}
+
+static void tconn_rx_task_handler(void *_tc)
+{
+	struct tconn *tc = _tc;
+
+	if (tc->state == STATE_HANDSHAKE &&
+	    gnutls_record_get_direction(tc->sess) == 0 &&
+	    (tc->io_error || tc->rx_start != tc->rx_end || tc->rx_eof)) {
+		tconn_do_handshake(tc, 1);
+		return;
+	}
+
+	if ((tc->state == STATE_RUNNING || tc->state == STATE_TX_CONGESTION) &&
+	    (gnutls_record_check_pending(tc->sess) || tc->io_error ||
+	     tc->rx_start != tc->rx_end || tc->rx_eof)) {
+		tconn_do_record_recv(tc);
+		return;
+	}
+
+	abort();
+}
+
+static void tconn_tx_task_handler(void *_tc)
+{
+	struct tconn *tc = _tc;
+
+	if (tc->state == STATE_HANDSHAKE &&
+	    gnutls_record_get_direction(tc->sess) == 1 &&
+	    (tc->io_error || tc->tx_bytes < sizeof(tc->tx_buf))) {
+		tconn_do_handshake(tc, 1);
+		return;
+	}
+
+	if (tc->state == STATE_TX_CONGESTION && tc->ktls_tx && tc->io_error) {
+		tconn_connection_abort(tc, 1);
+		return;
+	}
+
+	if (tc->state == STATE_TX_CONGESTION &&
+	    (tc->io_error || tc->tx_bytes < sizeof(tc->tx_buf))) {
+		tconn_do_record_send(tc);
+		return;
+	}
+
+	abort();
+}
+
+static void tconn_tx_ready_task_handler(void *_tc)
+{
+	struct tconn *tc = _tc;
+
+	if (tc->worker != NULL)
+		tconn_post_ctl(tc, CTL_TX_READY, NULL, 0);
+	else
+		tc->tx_ready(tc->cookie);
+}
+
+static int cert_refers_to_nodeid(gnutls_x509_crt_t cert, uint8_t *nodeid)
+{
+	char expected_dn[128];
+	int i;
+	int ret;
+	gnutls_datum_t cert_dn;
+
+	sprintf(expected_dn, "CN=");
+	for (i = 0; i < NODE_ID_LEN; i++)
+		sprintf(expected_dn + 3 + (2 * i), "%.2x", nodeid[i]);
+	expected_dn[67] = 0;
+
+	ret = gnutls_x509_crt_get_dn2(cert, &cert_dn);
+	if (ret < 0) {
+		gtls_perror("gnutls_x509_crt_init", ret);
+		return 0;
+	}
+
+	if (strcmp(expected_dn, (char *)cert_dn.data)) {
+		gnutls_free(cert_dn.data);
+		return 0;
+	}
+
+	gnutls_free(cert_dn.data);
+
+	return 1;
+}
+
+static int tconn_verify_cert(gnutls_session_t sess)
+{
+	struct tconn *tc = gnutls_transport_get_ptr(sess);
+	const gnutls_datum_t *certs;
+	unsigned int num_certs;
+	uint8_t *nodeids;
+	gnutls_x509_crt_t cert;
+	gnutls_pubkey_t key;
+	int i;
+	int ret;
+	int j;
+
+	certs = gnutls_certificate_get_peers(tc->sess, &num_certs);
+	if (num_certs < 1) {
+		fprintf(stderr, "tconn_verify_cert: no certificates found\n");
+		goto err;
+	}
+
+	nodeids = malloc(num_certs * NODE_ID_LEN);
+	if (nodeids == NULL)
+		goto err;
+
+	ret = gnutls_x509_crt_init(&cert);
+	if (ret) {
+		gtls_perror("gnutls_x509_crt_init", ret);
+		goto err_free_ids;
+	}
+
+	ret = gnutls_pubkey_init(&key);
+	if (ret) {
+		gtls_perror("gnutls_pubkey_init", ret);
+		goto err_free_crt;
+	}
+
+	/*
+	 * TBD: @@@
+	 * - verify that signature verifies to embedded public key
+	 * - verify that fingerprint matches what we expect
+	 * - check validity in case of non self signed certificate
+	 */
+	for (i = 0, j = 0 ; i < num_certs; i++) {
+		uint8_t id[NODE_ID_LEN];
+
+		ret = gnutls_x509_crt_import(cert, &certs[i],
+					     GNUTLS_X509_FMT_DER);
+		if (ret) {
+			gtls_perror("gnutls_x509_crt_import", ret);
+			goto err_free_key;
+		}
+
+		ret = gnutls_pubkey_import_x509(key, cert, 0);
+		if (ret) {
+			gtls_perror("gnutls_pubkey_import_x509", ret);
+			goto err_free_key;
+		}
+
+		ret = get_pubkey_id(id, key);
+		if (ret) {
+			gtls_perror("get_pubkey_id", ret);
+			goto err_free_key;
+		}
+
+		if (i == 0 || cert_refers_to_nodeid(cert, nodeids)) {
+			memcpy(nodeids + (j * NODE_ID_LEN), id, NODE_ID_LEN);
+			j++;
+		}
+	}
+
+	gnutls_x509_crt_deinit(cert);
+	gnutls_pubkey_deinit(key);
+
+	/*
+	 * The owner can't be called from a worker, so the key IDs are
+	 * checked once the handshake is done and we are back on the
+	 * owner's thread, before anything is sent or received.
+	 */
+	if (tc->hs_offload) {
+		free(tc->hs_ids);
+		tc->hs_ids = nodeids;
+		tc->hs_num_ids = j;
+		return 0;
+	}
+
+	ret = tc->verify_key_ids(tc->cookie, nodeids, j);
+
+	free(nodeids);
+
+	return ret;
+
+err_free_key:
+	gnutls_pubkey_deinit(key);
+
+err_free_crt:
+	gnutls_x509_crt_deinit(cert);
+
+err_free_ids:
+	free(nodeids);
+
+err:
+	return 1;
+}
+
+static int tconn_offload_handshake(struct tconn *tc);
+
+static int tconn_start_handshake(struct tconn *tc)
+{
+	int ret;
+
+	ret = gnutls_certificate_allocate_credentials(&tc->cert);
+	if (ret) {
+		gtls_perror("gnutls_certificate_allocate_credentials", ret);
+		goto err;
+	}
+
+	gnutls_certificate_set_verify_function(tc->cert, tconn_verify_cert);
+
+	ret = gnutls_certificate_set_x509_key(tc->cert, tc->mycrts,
+					      tc->numcrts, tc->mykey);
+	if (ret) {
+		gtls_perror("gnutls_certificate_set_x509_key", ret);
+		goto err_free;
+	}
+
+	ret = gnutls_credentials_set(tc->sess, GNUTLS_CRD_CERTIFICATE,
+				     tc->cert);
+	if (ret) {
+		gtls_perror("gnutls_credentials_set", ret);
+		goto err_free;
+	}
+
+	tc->state = STATE_HANDSHAKE;
+
+	if (handshake_offload && tconn_offload_handshake(tc) == 0)
+		return 0;
+
+	ret = tconn_do_handshake(tc, 0);
+	if (ret)
+		goto err_free;
+
+	return 0;
+
+err_free:
+	gnutls_certificate_free_credentials(tc->cert);
+
+err:
+	return -1;
+}
+
+int tconn_start(struct tconn *tc)
+{
+	static char prio[] =
+		"NONE:+CIPHER-ALL:+ECDHE-RSA:+MAC-ALL:+COMP-NULL:"
+		"+VERS-TLS1.2:+SIGN-ALL:+CURVE-SECP256R1:%SAFE_RENEGOTIATION";
+	unsigned int flags;
+	int ret;
+	const char *err;
+	int i;
+
+	flags = GNUTLS_NONBLOCK | GNUTLS_NO_EXTENSIONS;
+	if (tc->role == TCONN_ROLE_SERVER)
+		flags |= GNUTLS_SERVER;
+	else
+		flags |= GNUTLS_CLIENT;
+
+	ret = gnutls_init(&tc->sess, flags);
+	if (ret) {
+		gtls_perror("gnutls_init", ret);
+		goto err;
+	}
+
+	if (tc->role == TCONN_ROLE_SERVER) {
+		gnutls_certificate_server_set_request(tc->sess,
+						      GNUTLS_CERT_REQUIRE);
+		gnutls_certificate_send_x509_rdn_sequence(tc->sess, 1);
+	}
+
+	ret = gnutls_priority_set_direct(tc->sess, prio, &err);
+	if (ret) {
+		const char *p;
+
+		gtls_perror("gnutls_priority_set_direct", ret);
+
+		fprintf(stderr, "%s\n", prio);
+		for (p = prio; p < err; p++)
+			fprintf(stderr, " ");
+		fprintf(stderr, "^ error in priority string\n");
+
+		goto err_deinit;
+	}
+
+	gnutls_transport_set_ptr(tc->sess, tc);
+	gnutls_transport_set_pull_function(tc->sess, tconn_gtls_pull_func);
+	gnutls_transport_set_vec_push_function(tc->sess,
+					       tconn_gtls_vec_push_func);
+
+	tc->fd->cookie = tc;
+	iv_fd_set_handler_in(tc->fd, tconn_fd_handler_in);
+	iv_fd_set_handler_out(tc->fd, NULL);
+	iv_fd_set_handler_err(tc->fd, NULL);
+
+	tc->io_error = 0;
+	tc->ur = NULL;
+	tc->syscalls = 0;
+
+	IV_TASK_INIT(&tc->rx_task);
+	tc->rx_task.cookie = tc;
+	tc->rx_task.handler = tconn_rx_task_handler;
+	tc->rx_start = 0;
+	tc->rx_end = 0;
+	tc->rx_data = tc->rx_buf;
+	tc->rx_eof = 0;
+	tc->rx_paused = 0;
+
+	IV_TASK_INIT(&tc->tx_task);
+	tc->tx_task.cookie = tc;
+	tc->tx_task.handler = tconn_tx_task_handler;
+	tc->tx_start = 0;
+	tc->tx_bytes = 0;
+	tc->ktls_tx = 0;
+
+	for (i = 0; i < TCONN_NUM_CLASSES; i++) {
+		struct tconn_txq *q = &tc->txq[i];
+
+		INIT_IV_LIST_HEAD(&q->list);
+		q->codel = (i == TCONN_CLASS_BULK);
+		q->max_bytes = (i == TCONN_CLASS_CTRL) ? 0 : TXQ_MAX_BYTES;
+		q->dropping = 0;
+		q->drop_count = 0;
+		q->first_above = 0;
+		q->drop_next = 0;
+		memset(&q->stats, 0, sizeof(q->stats));
+		q->backlog = 0;
+	}
+
+	IV_TASK_INIT(&tc->tx_ready_task);
+	tc->tx_ready_task.cookie = tc;
+	tc->tx_ready_task.handler = tconn_tx_ready_task_handler;
+
+	IV_TASK_INIT(&tc->uring_task);
+	tc->uring_task.cookie = tc;
+	tc->uring_task.handler = tconn_uring_task_handler;
+
+	tc->worker = NULL;
+	tc->tx_failed = 0;
+	tc->destroyed = NULL;
+	tc->hs_offload = 0;
+	tc->hs_ids = NULL;
+	tc->hs_move.tc = NULL;
+
+	ret = tconn_start_handshake(tc);
+	if (ret)
+		goto err_deinit;
+
+	return 0;
+
+err_deinit:
+	gnutls_deinit(tc->sess);
+
+err:
+	return -1;
+}
+
+/*
+ * Moving a tconn between threads means moving its socket and any
+ * pending tasks from one event loop to the other.
+ */
+static void tconn_unhook(struct tconn *tc, struct tconn_move *mv)
+{
+	mv->handler_in = tc->fd->handler_in;
+	mv->handler_out = tc->fd->handler_out;
+	iv_fd_unregister(tc->fd);
+
+	mv->rx_task = iv_task_registered(&tc->rx_task);
+	if (mv->rx_task)
+		iv_task_unregister(&tc->rx_task);
+
+	mv->tx_task = iv_task_registered(&tc->tx_task);
+	if (mv->tx_task)
+		iv_task_unregister(&tc->tx_task);
+
+	mv->tx_ready_task = iv_task_registered(&tc->tx_ready_task);
+	if (mv->tx_ready_task)
+		iv_task_unregister(&tc->tx_ready_task);
+
+	mv->uring_task = iv_task_registered(&tc->uring_task);
+	if (mv->uring_task)
+		iv_task_unregister(&tc->uring_task);
+}
+
+static void tconn_rehook(struct tconn *tc, struct tconn_move *mv)
+{
+	int fd;
+
+	fd = tc->fd->fd;
+
+	IV_FD_INIT(tc->fd);
+	tc->fd->fd = fd;
+	tc->fd->cookie = tc;
+	tc->fd->handler_in = mv->handler_in;
+	tc->fd->handler_out = mv->handler_out;
+	iv_fd_register(tc->fd);
+
+	if (mv->rx_task)
+		iv_task_register(&tc->rx_task);
+
+	if (mv->tx_task)
+		iv_task_register(&tc->tx_task);
+
+	if (mv->tx_ready_task)
+		iv_task_register(&tc->tx_ready_task);
+
+	if (mv->uring_task)
+		iv_task_register(&tc->uring_task);
+}
+
+/*
+ * With handshake offload enabled, the TLS handshake (and with it,
+ * the public key operations) of each new tconn is run on the least
+ * loaded worker, and the tconn is moved back to its owner's thread
+ * once the handshake is done, before verify_key_ids and
+ * handshake_done are called there.  If the handshake fails,
+ * connection_lost is called on the owner's thread.
+ */
+struct tconn_hs_start {
+	struct worker_msg	msg;
+	struct tconn_move	mv;
+};
+
+static void tconn_hs_start_run(struct worker_msg *msg)
+{
+	struct tconn_hs_start *hs;
+	struct tconn *tc;
+
+	hs = iv_container_of(msg, struct tconn_hs_start, msg);
+	tc = hs->mv.tc;
+
+	tconn_rehook(tc, &hs->mv);
+	free(hs);
+
+	tconn_do_handshake(tc, 1);
+}
+
+static int tconn_offload_handshake(struct tconn *tc)
+{
+	struct tconn_hs_start *hs;
+	struct worker *w;
+
+	w = worker_get();
+	if (w == NULL)
+		return -1;
+
+	hs = malloc(sizeof(*hs));
+	if (hs == NULL) {
+		worker_put(w);
+		return -1;
+	}
+
+	tc->ctl_queue.discard = tconn_ctl_discard;
+	worker_queue_register(&tc->ctl_queue);
+
+	tc->hs_offload = 1;
+
+	hs->msg.handler = tconn_hs_start_run;
+	hs->mv.tc = tc;
+	tconn_unhook(tc, &hs->mv);
+
+	tc->worker = w;
+	worker_post(w, &hs->msg);
+
+	return 0;
+}
+
+static void tconn_handshake_complete(struct tconn *tc)
+{
+	char *desc;
+	int ret;
+
+	worker_queue_unregister(&tc->ctl_queue);
+
+	worker_put(tc->worker);
+	tc->worker = NULL;
+	tc->hs_offload = 0;
+
+	tconn_rehook(tc, &tc->hs_move);
+	tc->hs_move.tc = NULL;
+
+	verify_state(tc);
+
+	ret = 1;
+	if (tc->hs_ids != NULL) {
+		ret = tc->verify_key_ids(tc->cookie, tc->hs_ids,
+					 tc->hs_num_ids);
+		free(tc->hs_ids);
+		tc->hs_ids = NULL;
+	}
+
+	if (ret) {
+		tconn_connection_abort(tc, 1);
+		return;
+	}
+
+	desc = gnutls_session_get_desc(tc->sess);
+	tc->handshake_done(tc->cookie, desc);
+	gnutls_free(desc);
+}
+
+static void tconn_tx_ring_run(void *_tc);
+static void tconn_tx_ring_drain(struct tconn *tc);
+
+static void tconn_attach(void *_mv)
+{
+	struct tconn_move *mv = _mv;
+	struct tconn *tc = mv->tc;
+
+	tconn_rehook(tc, mv);
+
+	tconn_ring_event_register(&tc->tx_ring, tc, tconn_tx_ring_run);
+
+	iv_validate_now();
+	tc->activity_posted = iv_now;
+
+	if (tc->dp_attached != NULL)
+		tc->dp_attached(tc->dp_cookie);
+}
+
+static void tconn_detach(void *_mv)
+{
+	struct tconn_move *mv = _mv;
+	struct tconn *tc = mv->tc;
+
+	if (tc->hs_offload) {
+		if (tc->hs_move.tc != NULL)
+			*mv = tc->hs_move;
+		else
+			tconn_unhook(tc, mv);
+		return;
+	}
+
+	tconn_tx_ring_drain(tc);
+	iv_event_unregister(&tc->tx_ring.ev);
+
+	if (tc->dp_detached != NULL)
+		tc->dp_detached(tc->dp_cookie);
+
+	if (tc->ur != NULL)
+		tconn_uring_abandon(tc);
+
+	tconn_unhook(tc, mv);
+}
+
+void tconn_destroy(struct tconn *tc)
+{
+	int i;
+
+	if (tc->worker != NULL) {
+		struct tconn_move mv;
+
+		mv.tc = tc;
+		worker_call(tc->worker, tconn_detach, &mv);
+
+		tconn_rehook(tc, &mv);
+
+		worker_queue_unregister(&tc->ctl_queue);
+
+		if (tc->hs_offload) {
+			worker_put(tc->worker);
+			tc->hs_offload = 0;
+			free(tc->hs_ids);
+			tc->hs_ids = NULL;
+		} else {
+			iv_event_unregister(&tc->rx_ring.ev);
+			tconn_rx_ring_discard(tc);
+			tconn_ring_deinit(&tc->rx_ring);
+			tconn_ring_deinit(&tc->tx_ring);
+		}
+
+		tc->worker = NULL;
+	}
+
+	if (tc->destroyed != NULL) {
+		*tc->destroyed = 1;
+		tc->destroyed = NULL;
+	}
+
+	verify_state(tc);
+
+	if (tc->ur != NULL)
+		tconn_uring_abandon(tc);
+
+	iv_fd_set_handler_in(tc->fd, NULL);
+	iv_fd_set_handler_out(tc->fd, NULL);
+
+	gnutls_deinit(tc->sess);
+
+	gnutls_certificate_free_credentials(tc->cert);
+
+	if (iv_task_registered(&tc->rx_task))
+		iv_task_unregister(&tc->rx_task);
+
+	if (iv_task_registered(&tc->tx_task))
+		iv_task_unregister(&tc->tx_task);
+
+	if (iv_task_registered(&tc->tx_ready_task))
+		iv_task_unregister(&tc->tx_ready_task);
+
+	if (iv_task_registered(&tc->uring_task))
+		iv_task_unregister(&tc->uring_task);
+
+	for (i = 0; i < TCONN_NUM_CLASSES; i++) {
+		struct iv_list_head *lh = &tc->txq[i].list;
+
+		while (!iv_list_empty(lh)) {
+			struct txq_entry *e;
+
+			e = iv_container_of(lh->next, struct txq_entry, list);
+			iv_list_del(&e->list);
+			free(e);
+		}
+	}
+}
+
+static int tconn_ktls_record_sendv(struct tconn *tc,
+				   const struct iovec *iov, int iovcnt)
+{
+	int len;
+	int ret;
+	int skip;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len > 16384) {
+		fprintf(stderr, "tconn_record_send: record too long\n");
+		return -1;
+	}
+
+	/*
+	 * Without MSG_MORE, the kernel closes the record at the end of
+	 * each send, so every call here produces exactly one record.
+	 * If the socket only takes part of it, the kernel keeps the
+	 * record open, and we hold on to the rest of it until POLLOUT.
+	 */
+	do {
+		tc->syscalls++;
+		ret = writev(tc->fd->fd, iov, iovcnt);
+	} while (ret < 0 && errno == EINTR);
+
+	if (ret < 0) {
+		if (errno != EAGAIN) {
+			perror("tconn_record_send: writev");
+			tconn_connection_abort(tc, 0);
+			return -1;
+		}
+		ret = 0;
+	}
+
+	if (ret < len) {
+		skip = ret;
+		for (i = 0; i < iovcnt; i++) {
+			if (skip >= iov[i].iov_len) {
+				skip -= iov[i].iov_len;
+				continue;
+			}
+
+			tconn_tx_append(tc, iov[i].iov_base + skip,
+					iov[i].iov_len - skip);
+			skip = 0;
+		}
+
+		tc->state = STATE_TX_CONGESTION;
+		tconn_set_handler_out(tc, tconn_fd_handler_out);
+	}
+
+	verify_state(tc);
+
+	return 0;
+}
+
+static int tconn_do_send(struct tconn *tc, const uint8_t *rec, int len)
+{
+	int ret;
+
+	if (tc->ktls_tx) {
+		struct iovec iov;
+
+		iov.iov_base = (void *)rec;
+		iov.iov_len = len;
+
+		return tconn_ktls_record_sendv(tc, &iov, 1);
+	}
+
+	if (tc->ur == NULL && tconn_want_io_uring() &&
+	    !iv_task_registered(&tc->uring_task)) {
+		iv_task_register(&tc->uring_task);
+	}
+
+	ret = gnutls_record_send(tc->sess, rec, len);
+	if ((ret > 0 || ret == GNUTLS_E_AGAIN) && tconn_tx_flush(tc))
+		ret = gnutls_record_send(tc->sess, NULL, 0);
+
+	if (ret < 0 && ret != GNUTLS_E_AGAIN) {
+		gtls_perror("gnutls_record_send", ret);
+		tconn_connection_abort(tc, 0);
+		return -1;
+	}
+
+	if (ret == GNUTLS_E_AGAIN)
+		tc->state = STATE_TX_CONGESTION;
+
+	// @@@ handle fewer bytes having been sent than passed in
+
+	verify_state(tc);
+
+	return 0;
+}
+
+static int64_t txq_now(void)
+{
+	iv_validate_now();
+
+	return (int64_t)iv_now.tv_sec * 1000000 + iv_now.tv_nsec / 1000;
+}
+
+/*
+ * The number of bytes queued is published separately from the rest of
+ * the statistics, so that the owner of a tconn that has been handed to
+ * a worker can look at it without a round trip to the worker.
+ */
+static void txq_publish(struct tconn_txq *q)
+{
+	__atomic_store_n(&q->backlog, q->stats.queue_bytes, __ATOMIC_RELAXED);
+}
+
+static void tconn_txq_enqueue(struct tconn_txq *q, const uint8_t *rec, int len)
+{
+	struct tconn_txq_stats *st = &q->stats;
+	struct txq_entry *e;
+
+	while (q->max_bytes && st->queue_len &&
+	       st->queue_bytes + len > q->max_bytes) {
+		e = iv_container_of(q->list.next, struct txq_entry, list);
+		iv_list_del(&e->list);
+		st->queue_len--;
+		st->queue_bytes -= e->len;
+		st->overflows++;
+		free(e);
+	}
+
+	e = malloc(sizeof(*e) + len);
+	if (e == NULL) {
+		st->overflows++;
+		txq_publish(q);
+		return;
+	}
+
+	e->time = txq_now();
+	e->len = len;
+	memcpy(e->data, rec, len);
+
+	iv_list_add_tail(&e->list, &q->list);
+	st->queue_len++;
+	st->queue_bytes += len;
+	st->enqueued++;
+
+	txq_publish(q);
+}
+
+static uint32_t isqrt(uint64_t x)
+{
+	uint64_t r;
+	uint64_t bit;
+
+	r = 0;
+	for (bit = 1ULL << 62; bit; bit >>= 2) {
+		if (x >= r + bit) {
+			x -= r + bit;
+			r = (r >> 1) + bit;
+		} else {
+			r >>= 1;
+		}
+	}
+
+	return r;
+}
+
+static int64_t txq_control_law(int64_t t, int count)
+{
+	return t + ((int64_t)TXQ_INTERVAL_US << 10) / isqrt((uint64_t)count << 20);
+}
+
+static struct txq_entry *
+txq_pop(struct tconn_txq *q, int64_t now, int *ok_to_drop)
+{
+	struct tconn_txq_stats *st = &q->stats;
+	struct txq_entry *e;
+	int64_t sojourn;
+
+	*ok_to_drop = 0;
+
+	if (iv_list_empty(&q->list)) {
+		q->first_above = 0;
+		return NULL;
+	}
+
+	e = iv_container_of(q->list.next, struct txq_entry, list);
+	iv_list_del(&e->list);
+	st->queue_len--;
+	st->queue_bytes -= e->len;
+	txq_publish(q);
+
+	sojourn = now - e->time;
+	st->dequeued++;
+	st->sojourn_total_us += sojourn;
+	if (sojourn > st->sojourn_max_us)
+		st->sojourn_max_us = sojourn;
+
+	/*
+	 * Never drop the last record-sized chunk of the queue, as
+	 * a single record can't make for a standing queue.
+	 */
+	if (sojourn < TXQ_TARGET_US || st->queue_bytes <= 16384) {
+		q->first_above = 0;
+	} else if (!q->first_above) {
+		q->first_above = now + TXQ_INTERVAL_US;
+	} else if (now >= q->first_above) {
+		*ok_to_drop = 1;
+	}
+
+	return e;
+}
+
+static void txq_drop(struct tconn_txq *q, struct txq_entry *e)
+{
+	q->stats.dropped++;
+	free(e);
+}
+
+static struct txq_entry *tconn_txq_dequeue(struct tconn_txq *q)
+{
+	struct txq_entry *e;
+	int64_t now;
+	int ok_to_drop;
+
+	now = txq_now();
+
+	e = txq_pop(q, now, &ok_to_drop);
+	if (e == NULL) {
+		q->dropping = 0;
+		return NULL;
+	}
+
+	if (!q->codel)
+		return e;
+
+	if (q->dropping) {
+		if (!ok_to_drop) {
+			q->dropping = 0;
+		} else {
+			while (q->dropping && now >= q->drop_next) {
+				txq_drop(q, e);
+				q->drop_count++;
+
+				e = txq_pop(q, now, &ok_to_drop);
+				if (e == NULL || !ok_to_drop) {
+					q->dropping = 0;
+				} else {
+					q->drop_next = txq_control_law(
+						q->drop_next, q->drop_count);
+				}
+			}
+		}
+	} else if (ok_to_drop) {
+		int delta;
+
+		txq_drop(q, e);
+		e = txq_pop(q, now, &ok_to_drop);
+		q->dropping = 1;
+
+		/*
+		 * If we were dropping not long ago, resume at close to
+		 * the drop rate that brought the queue under control
+		 * last time.
+		 */
+		delta = q->drop_count - 2;
+		if (delta > 0 && now - q->drop_next < 16 * TXQ_INTERVAL_US)
+			q->drop_count = delta;
+		else
+			q->drop_count = 1;
+		q->drop_next = txq_control_law(now, q->drop_count);
+	}
+
+	return e;
+}
+
+static void tconn_txq_drain(struct tconn *tc)
+{
+	int cls;
+
+	/*
+	 * Strict priority: a lower class only gets to send once every
+	 * higher class queue is empty.
+	 */
+	for (cls = TCONN_NUM_CLASSES - 1; cls >= 0; cls--) {
+		while (tc->state == STATE_RUNNING) {
+			struct txq_entry *e;
+			int ret;
+
+			e = tconn_txq_dequeue(&tc->txq[cls]);
+			if (e == NULL)
+				break;
+
+			ret = tconn_do_send(tc, e->data, e->len);
+			free(e);
+
+			if (ret < 0) {
+				tconn_notify_lost(tc);
+				return;
+			}
+		}
+	}
+
+	/*
+	 * Let the owner know that it can queue more control records,
+	 * from a task of our own, so that it doesn't send (and possibly
+	 * tear down the connection) from under our caller.
+	 */
+	if (tc->tx_ready != NULL && !iv_task_registered(&tc->tx_ready_task))
+		iv_task_register(&tc->tx_ready_task);
+}
+
+static int tconn_record_send_class(struct tconn *tc, const uint8_t *rec,
+				   int len, int cls)
+{
+	verify_state(tc);
+
+	if (tc->state == STATE_TX_CONGESTION) {
+		tconn_txq_enqueue(&tc->txq[cls], rec, len);
+		return 0;
+	} else if (tc->state != STATE_RUNNING) {
+		fprintf(stderr, "got packet in [%d]\n", tc->state);
+		return -1;
+	}
+
+	return tconn_do_send(tc, rec, len);
+}
+
+static int tconn_sendv(struct tconn *tc, const struct iovec *iov, int iovcnt,
+		       int cls)
+{
+	uint8_t buf[16384];
+	int len;
+	int i;
+
+	if (cls < 0 || cls >= TCONN_NUM_CLASSES)
+		cls = TCONN_CLASS_BULK;
+
+	if (tc->ktls_tx && tc->state == STATE_RUNNING) {
+		verify_state(tc);
+		return tconn_ktls_record_sendv(tc, iov, iovcnt);
+	}
+
+	if (iovcnt == 1) {
+		return tconn_record_send_class(tc, iov[0].iov_base,
+					       iov[0].iov_len, cls);
+	}
+
+	/*
+	 * GnuTLS can only encrypt from a single contiguous buffer (its
+	 * corked send path would copy into an internal buffer just the
+	 * same), so gather scattered records here.  Callers that can
+	 * leave room for their header in front of the payload should
+	 * pass a single iovec, which is encrypted in place.
+	 */
+	len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len > sizeof(buf) - len) {
+			fprintf(stderr, "tconn_record_sendv: record too "
+					"long\n");
+			return -1;
+		}
+
+		memcpy(buf + len, iov[i].iov_base, iov[i].iov_len);
+		len += iov[i].iov_len;
+	}
+
+	return tconn_record_send_class(tc, buf, len, cls);
+}
+
+/*
+ * On its worker, a tconn that fails to send is torn down right away,
+ * but as the owner lives on another thread, it is told about that
+ * asynchronously, and further sends are ignored until it gets around
+ * to destroying the tconn.
+ */
+static int tconn_worker_sendv(struct tconn *tc, const struct iovec *iov,
+			      int iovcnt, int cls)
+{
+	if (tc->state == STATE_DEAD)
+		return -1;
+
+	if (tconn_sendv(tc, iov, iovcnt, cls) < 0) {
+		if (tc->state != STATE_DEAD)
+			tconn_connection_abort(tc, 0);
+		tconn_notify_lost(tc);
+		return -1;
+	}
+
+	return 0;
+}
+
+struct tconn_send {
+	struct worker_msg	msg;
+	struct tconn		*tc;
+	int			cls;
+	int			len;
+	uint8_t			data[0];
+};
+
+static void tconn_tx_ring_drain(struct tconn *tc)
+{
+	uint8_t buf[16384];
+	struct iovec iov;
+	int cls;
+	int len;
+
+	while ((len = tconn_ring_pop(&tc->tx_ring, buf, sizeof(buf),
+				     &cls)) >= 0) {
+		iov.iov_base = buf;
+		iov.iov_len = len;
+		tconn_worker_sendv(tc, &iov, 1, cls);
+	}
+}
+
+static void tconn_tx_ring_run(void *_tc)
+{
+	tconn_tx_ring_drain(_tc);
+}
+
+static void tconn_send_run(struct worker_msg *msg)
+{
+	struct tconn_send *ts = iv_container_of(msg, struct tconn_send, msg);
+	struct iovec iov;
+
+	tconn_tx_ring_drain(ts->tc);
+	tconn_ring_unspill(&ts->tc->tx_ring);
+
+	iov.iov_base = ts->data;
+	iov.iov_len = ts->len;
+	tconn_worker_sendv(ts->tc, &iov, 1, ts->cls);
+
+	free(ts);
+}
+
+static void tconn_fail_run(struct worker_msg *msg)
+{
+	struct tconn *tc = iv_container_of(msg, struct tconn, tx_fail);
+
+	if (tc->state != STATE_DEAD)
+		tconn_connection_abort(tc, 1);
+}
+
+/*
+ * Has the worker tear the connection down, as a record that mustn't
+ * be dropped couldn't be queued for it.  The worker queue is FIFO, so
+ * this is handled before the tconn can be detached from the worker.
+ */
+static void tconn_post_fail(struct tconn *tc)
+{
+	if (tc->tx_failed)
+		return;
+
+	fprintf(stderr, "tconn_record_sendv: transmit ring overflow\n");
+
+	tc->tx_failed = 1;
+	tc->tx_fail.handler = tconn_fail_run;
+	worker_post(tc->worker, &tc->tx_fail);
+}
+
+static int tconn_post_sendv(struct tconn *tc, const struct iovec *iov,
+			    int iovcnt, int cls)
+{
+	struct tconn_send *ts;
+	int len;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (len > 16384) {
+		fprintf(stderr, "tconn_record_sendv: record too long\n");
+		return -1;
+	}
+
+	if (tconn_ring_push(&tc->tx_ring, iov, iovcnt, cls) == 0)
+		return 0;
+
+	if (cls == TCONN_CLASS_BULK) {
+		tconn_ring_drop(&tc->tx_ring);
+		return 0;
+	}
+
+	if (tconn_ring_spill(&tc->tx_ring) < 0) {
+		tconn_post_fail(tc);
+		return -1;
+	}
+
+	ts = malloc(sizeof(*ts) + len);
+	if (ts == NULL) {
+		tconn_ring_unspill(&tc->tx_ring);
+		return -1;
+	}
+
+	ts->msg.handler = tconn_send_run;
+	ts->tc = tc;
+	ts->cls = cls;
+	ts->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(ts->data + ts->len, iov[i].iov_base, iov[i].iov_len);
+		ts->len += iov[i].iov_len;
+	}
+
+	worker_post(tc->worker, &ts->msg);
+
+	return 0;
+}
+
+int tconn_record_sendv(struct tconn *tc, const struct iovec *iov, int iovcnt,
+		       int cls)
+{
+	if (tc->worker == NULL)
+		return tconn_sendv(tc, iov, iovcnt, cls);
+
+	if (tc->hs_offload) {
+		fprintf(stderr, "tconn_record_sendv: handshake not done\n");
+		return -1;
+	}
+
+	if (worker_self() != tc->worker)
+		return tconn_post_sendv(tc, iov, iovcnt, cls);
+
+	return tconn_worker_sendv(tc, iov, iovcnt, cls);
+}
+
+int tconn_record_send(struct tconn *tc, const uint8_t *rec, int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)rec;
+	iov.iov_len = len;
+
+	return tconn_record_sendv(tc, &iov, 1, TCONN_CLASS_BULK);
+}
+
+struct tconn_export {
+	struct tconn		*tc;
+	const char		*label;
+	uint8_t			*buf;
+	int			len;
+	int			ret;
+};
+
+static void tconn_export_run(void *_te)
+{
+	struct tconn_export *te = _te;
+	struct tconn *tc = te->tc;
+	int ret;
+
+	te->ret = -1;
+
+	if (tc->state != STATE_RUNNING && tc->state != STATE_TX_CONGESTION)
+		return;
+
+	ret = gnutls_prf_rfc5705(tc->sess, strlen(te->label), te->label,
+				 0, NULL, te->len, (char *)te->buf);
+	if (ret) {
+		gtls_perror("gnutls_prf_rfc5705", ret);
+		return;
+	}
+
+	te->ret = 0;
+}
+
+int tconn_export_keys(struct tconn *tc, const char *label,
+		      uint8_t *buf, int len)
+{
+	struct tconn_export te;
+
+	te.tc = tc;
+	te.label = label;
+	te.buf = buf;
+	te.len = len;
+	worker_call(tc->worker, tconn_export_run, &te);
+
+	return te.ret;
+}
+
+struct tconn_stats {
+	struct tconn		*tc;
+	struct tconn_txq_stats	*st;
+};
+
+static void tconn_stats_run(void *_ts)
+{
+	struct tconn_stats *ts = _ts;
+	int i;
+
+	for (i = 0; i < TCONN_NUM_CLASSES; i++)
+		ts->st[i] = ts->tc->txq[i].stats;
+}
+
+void tconn_get_txq_stats(struct tconn *tc, struct tconn_txq_stats *st)
+{
+	struct tconn_stats ts;
+
+	ts.tc = tc;
+	ts.st = st;
+	worker_call(tc->worker, tconn_stats_run, &ts);
+}
+
+/*
+ * Returns the number of bytes waiting in the given class's transmit
+ * queue, without synchronising with the worker that the tconn may
+ * have been handed to, so the value can be slightly out of date.
+ */
+int tconn_get_txq_backlog(struct tconn *tc, int cls)
+{
+	return __atomic_load_n(&tc->txq[cls].backlog, __ATOMIC_RELAXED);
+}
+
+/*
+ * Lets the owner stop the tconn from reading from its socket for a
+ * while, so that a consumer of received records that falls behind
+ * pushes back on the peer through TCP flow control.  Records that are
+ * already on their way to the owner are still delivered.  Only valid
+ * once the handshake is done.
+ */
+static void tconn_rx_pause(struct tconn *tc, int paused)
+{
+	tc->rx_paused = paused;
+
+	tconn_set_handler_in(tc, verify_state_pollin(tc) ?
+			     tconn_fd_handler_in : NULL);
+
+	if (verify_state_rx_task(tc)) {
+		if (!iv_task_registered(&tc->rx_task))
+			iv_task_register(&tc->rx_task);
+	} else if (iv_task_registered(&tc->rx_task)) {
+		iv_task_unregister(&tc->rx_task);
+	}
+
+	verify_state(tc);
+}
+
+struct tconn_pause {
+	struct worker_msg	msg;
+	struct tconn		*tc;
+	int			paused;
+};
+
+static void tconn_pause_run(struct worker_msg *msg)
+{
+	struct tconn_pause *tp = iv_container_of(msg, struct tconn_pause, msg);
+
+	tconn_rx_pause(tp->tc, tp->paused);
+	free(tp);
+}
+
+void tconn_set_rx_paused(struct tconn *tc, int paused)
+{
+	struct tconn_pause *tp;
+
+	if (tc->worker == NULL || worker_self() == tc->worker) {
+		tconn_rx_pause(tc, paused);
+		return;
+	}
+
+	tp = malloc(sizeof(*tp));
+	if (tp == NULL) {
+		fprintf(stderr, "tconn_set_rx_paused: memory allocation "
+				"failure\n");
+		abort();
+	}
+
+	tp->msg.handler = tconn_pause_run;
+	tp->tc = tc;
+	tp->paused = paused;
+
+	worker_post(tc->worker, &tp->msg);
+}
+
+void tconn_set_kernel_tls(int enable)
+{
+	kernel_tls = enable;
+}
+
+void tconn_set_handshake_offload(int enable)
+{
+	handshake_offload = enable;
+}
+
+void tconn_set_io_uring(int enable)
+{
+	__atomic_store_n(&io_uring_enabled, !!enable, __ATOMIC_RELAXED);
+}
+
+/*
+ * Hands a running tconn over to a worker thread: its socket and tasks
+ * are moved over to the worker's event loop, and dp_attached is called
+ * on the worker once that is done, so that the caller can set up its
+ * side of the data plane there before any traffic is processed.
+ * Everything but the handshake and tconn_destroy() then happens on
+ * the worker, and records are passed between the worker and the
+ * owner through the session's rings.  Only the worker and the owner
+ * may send records on the tconn from then on.  tconn_destroy() calls
+ * dp_detached on the worker before taking the tconn back.  The dp_*
+ * fields (which may be NULL) must have been set up by the caller, and
+ * may be changed on the worker.  This fails for a tconn that has
+ * moved over to io_uring, so it should be done from handshake_done.
+ */
+int tconn_set_worker(struct tconn *tc, struct worker *w)
+{
+	struct tconn_move mv;
+
+	if (w == NULL || tc->worker != NULL || tc->ur != NULL ||
+	    (tc->state != STATE_RUNNING && tc->state != STATE_TX_CONGESTION))
+		return -1;
+
+	verify_state(tc);
+
+	if (tconn_ring_init(&tc->rx_ring) < 0)
+		return -1;
+
+	if (tconn_ring_init(&tc->tx_ring) < 0) {
+		tconn_ring_deinit(&tc->rx_ring);
+		return -1;
+	}
+
+	tconn_ring_event_register(&tc->rx_ring, tc, tconn_rx_ring_run);
+
+	tc->ctl_queue.discard = tconn_ctl_discard;
+	worker_queue_register(&tc->ctl_queue);
+
+	mv.tc = tc;
+	tconn_unhook(tc, &mv);
+
+	tc->worker = w;
+	worker_call(w, tconn_attach, &mv);
+
+	return 0;
+}
+
+struct tconn_ring_query {
+	struct tconn		*tc;
+	struct tconn_ring_stats	*rx;
+	struct tconn_ring_stats	*tx;
+};
+
+/*
+ * Runs on the worker, which is the producer of rx_ring and the
+ * consumer of tx_ring, and so can only look at the ring buffer that
+ * it is using itself (the other one can be freed under it).
+ */
+static void tconn_ring_stats_get(struct tconn_ring *r,
+				 struct tconn_ring_buf *rb,
+				 struct tconn_ring_stats *st)
+{
+	*st = r->stats;
+	st->queue_len = __atomic_load_n(&r->pushed, __ATOMIC_RELAXED) -
+			st->records;
+	st->queue_bytes = spsc_ring_bytes(&rb->ring);
+	st->spilled = __atomic_load_n(&r->spills, __ATOMIC_RELAXED);
+	st->dropped = __atomic_load_n(&r->drops, __ATOMIC_RELAXED);
+}
+
+static void tconn_ring_stats_run(void *_q)
+{
+	struct tconn_ring_query *q = _q;
+
+	tconn_ring_stats_get(&q->tc->rx_ring, q->tc->rx_ring.prod, q->rx);
+	tconn_ring_stats_get(&q->tc->tx_ring, q->tc->tx_ring.cons, q->tx);
+}
+
+/*
+ * Returns the statistics for both of the rings of a tconn that has
+ * been handed to a worker, or -1 if it hasn't.  The depth is sampled
+ * at the time of the call, and the rest are totals since the tconn
+ * was handed over.  Records that went around a full ring are counted
+ * as spilled, and not included in the latency figures, and records
+ * that were thrown away because of that are counted as dropped.
+ */
+int tconn_get_ring_stats(struct tconn *tc, struct tconn_ring_stats *rx,
+			 struct tconn_ring_stats *tx)
+{
+	struct tconn_ring_query q;
+
+	if (tc->worker == NULL || tc->hs_offload)
+		return -1;
+
+	q.tc = tc;
+	q.rx = rx;
+	q.tx = tx;
+	worker_call(tc->worker, tconn_ring_stats_run, &q);
+
+	return 0;
+}
+
+/*
+ * Called from the data plane on the worker, to pass a message to the
+ * owner's thread, where ->dp_message is called with it (and with
+ * dp_cookie), in order with the records that the data plane doesn't
+ * consume.  Messages that never make it there, because the tconn is
+ * destroyed first, are passed to ->dp_message_discard instead, so
+ * that anything they refer to can be released.  Returns -1 if the
+ * message couldn't be queued, in which case it remains the caller's.
+ */
+int tconn_dp_message_post(struct tconn *tc, const void *msg, int len)
+{
+	return tconn_rx_pass(tc, RING_TAG_DP_MESSAGE, msg, len);
 }
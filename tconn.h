@@ -22,7 +22,74 @@
 
 #include <gnutls/gnutls.h>
 #include <iv.h>
+#include <iv_event.h>
+#include <iv_list.h>
 #include <stdint.h>
+#include <sys/uio.h>
+#include "worker.h"
+
+#define TCONN_CLASS_BULK	0
+#define TCONN_CLASS_PRIO	1
+#define TCONN_CLASS_CTRL	2
+#define TCONN_NUM_CLASSES	3
+
+struct tconn_txq_stats {
+	int			queue_len;
+	int			queue_bytes;
+	uint64_t		enqueued;
+	uint64_t		dequeued;
+	uint64_t		dropped;
+	uint64_t		overflows;
+	uint64_t		sojourn_total_us;
+	int			sojourn_max_us;
+};
+
+struct tconn_txq {
+	struct iv_list_head	list;
+	int			codel;
+	int			max_bytes;
+	int			dropping;
+	int			drop_count;
+	int64_t			first_above;
+	int64_t			drop_next;
+	struct tconn_txq_stats	stats;
+	int			backlog;
+};
+
+struct tconn_ring_stats {
+	int			queue_len;
+	int			queue_bytes;
+	int			queue_max_bytes;
+	uint64_t		records;
+	uint64_t		spilled;
+	uint64_t		dropped;
+	uint64_t		latency_total_us;
+	int			latency_max_us;
+};
+
+struct tconn_ring_buf;
+struct tconn_uring;
+
+struct tconn_ring {
+	struct tconn_ring_buf	*cons;
+	struct tconn_ring_buf	*prod;
+	struct iv_event		ev;
+	int			spilled;
+	uint64_t		pushed;
+	uint64_t		spills;
+	uint64_t		drops;
+	struct tconn_ring_stats	stats;
+};
+
+struct tconn_move {
+	struct tconn		*tc;
+	void			(*handler_in)(void *);
+	void			(*handler_out)(void *);
+	int			rx_task;
+	int			tx_task;
+	int			tx_ready_task;
+	int			uring_task;
+};
 
 struct tconn {
 	struct iv_fd		*fd;
@@ -37,20 +104,55 @@ struct tconn {
 	void			(*record_received)(void *cookie,
 						   const uint8_t *rec, int len);
 	void			(*connection_lost)(void *cookie);
+	void			(*tx_ready)(void *cookie);
+	void			(*rx_activity)(void *cookie);
+	void			(*dp_message)(void *cookie,
+					      const uint8_t *msg, int len);
+	void			(*dp_message_discard)(const uint8_t *msg,
+						      int len);
+	void			*dp_cookie;
+	void			(*dp_attached)(void *dp_cookie);
+	int			(*dp_record_received)(void *dp_cookie,
+						      const uint8_t *rec,
+						      int len);
+	void			(*dp_detached)(void *dp_cookie);
 
 	gnutls_session_t	sess;
 	gnutls_certificate_credentials_t cert;
 	int			state;
 
 	int			io_error;
+	struct tconn_uring	*ur;
+	struct iv_task		uring_task;
+	uint64_t		syscalls;
 	struct iv_task		rx_task;
 	uint8_t			rx_buf[32768];
+	uint8_t			*rx_data;
 	int			rx_start;
 	int			rx_end;
 	int			rx_eof;
+	int			rx_paused;
 	struct iv_task		tx_task;
 	uint8_t			tx_buf[32768];
+	int			tx_start;
 	int			tx_bytes;
+	int			ktls_tx;
+
+	struct tconn_txq	txq[TCONN_NUM_CLASSES];
+	struct iv_task		tx_ready_task;
+
+	struct worker		*worker;
+	struct worker_queue	ctl_queue;
+	struct timespec		activity_posted;
+	struct tconn_ring	rx_ring;
+	struct tconn_ring	tx_ring;
+	int			tx_failed;
+	struct worker_msg	tx_fail;
+	int			*destroyed;
+	int			hs_offload;
+	uint8_t			*hs_ids;
+	int			hs_num_ids;
+	struct tconn_move	hs_move;
 };
 
 #define TCONN_ROLE_SERVER	0
@@ -59,6 +161,20 @@ struct tconn {
 int tconn_start(struct tconn *tc);
 void tconn_destroy(struct tconn *tc);
 int tconn_record_send(struct tconn *tc, const uint8_t *rec, int len);
+int tconn_record_sendv(struct tconn *tc, const struct iovec *iov, int iovcnt,
+		       int cls);
+int tconn_export_keys(struct tconn *tc, const char *label,
+		      uint8_t *buf, int len);
+void tconn_get_txq_stats(struct tconn *tc, struct tconn_txq_stats *st);
+int tconn_get_txq_backlog(struct tconn *tc, int cls);
+void tconn_set_rx_paused(struct tconn *tc, int paused);
+void tconn_set_kernel_tls(int enable);
+void tconn_set_handshake_offload(int enable);
+void tconn_set_io_uring(int enable);
+int tconn_set_worker(struct tconn *tc, struct worker *w);
+int tconn_dp_message_post(struct tconn *tc, const void *msg, int len);
+int tconn_get_ring_stats(struct tconn *tc, struct tconn_ring_stats *rx,
+			 struct tconn_ring_stats *tx);
 
 
 #endif
@@ -0,0 +1,552 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <gnutls/gnutls.h>
+#include <gnutls/x509.h>
+#include <iv.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "gso.h"
+#include "tconn.h"
+#include "uring.h"
+#include "util.h"
+#include "worker.h"
+#include "x509.h"
+
+/*
+ * Pushes packet-sized records from one tconn to another over a
+ * loopback TCP connection for a few seconds, once with all record
+ * encryption done by GnuTLS, once more with the sockets on io_uring,
+ * and once with kernel TLS enabled, and reports the throughput, the
+ * CPU time used and the number of system calls made on the sockets
+ * (or on io_uring) per record for each.  If a number of
+ * threads is given, this is followed by runs with 1 up to that many
+ * tconn pairs, with their handshakes run on the threads and each
+ * pair handed to a data plane thread of its own once connected, to
+ * show how throughput scales with threads.
+ * Last come runs with user space TLS where the records are sent and
+ * received from the main thread, and only the record encryption and
+ * decryption is offloaded to the data plane threads.
+ *
+ * In between, for both user space and kernel TLS, 64 KiB TSO
+ * super-packets are pushed over a single pair the way that dvpn
+ * carries them with TunOffload set, as fragment records that are
+ * reassembled on the receiving end, to compare with the throughput
+ * of sending the same data as MTU-sized packets.
+ */
+#define BENCH_SECONDS		5
+#define BENCH_RECORD_LEN	1400
+#define BENCH_BURST		64
+#define BENCH_GSO_LEN		65000
+#define BENCH_GSO_BURST		2
+#define BENCH_MAX_THREADS	64
+
+struct bench_pair;
+
+struct bench_end {
+	struct bench_pair	*bp;
+	struct iv_fd		fd;
+	struct tconn		tconn;
+	int			up;
+};
+
+struct bench_pair {
+	struct bench_end	tx;
+	struct bench_end	rx;
+	struct worker		*worker;
+	struct iv_task		send_task;
+};
+
+static struct bench_pair *pairs;
+static int num_pairs;
+static int num_up;
+static int offload;
+static int gso;
+static int io_uring;
+static struct gso_reasm gso_reasm;
+static struct iv_timer stop_timer;
+static int running;
+static struct timespec start_time;
+static struct timespec stop_time;
+static long long rx_bytes;
+static long long rx_records;
+static uint64_t syscalls;
+
+static void bench_pair_stop(struct bench_pair *bp)
+{
+	tconn_destroy(&bp->tx.tconn);
+	iv_fd_unregister(&bp->tx.fd);
+	close(bp->tx.fd.fd);
+
+	tconn_destroy(&bp->rx.tconn);
+	iv_fd_unregister(&bp->rx.fd);
+	close(bp->rx.fd.fd);
+
+	syscalls += bp->tx.tconn.syscalls + bp->rx.tconn.syscalls;
+}
+
+static void bench_send_stop(void *_bp)
+{
+	struct bench_pair *bp = _bp;
+
+	if (iv_task_registered(&bp->send_task))
+		iv_task_unregister(&bp->send_task);
+}
+
+static void bench_stop(void *_dummy)
+{
+	int i;
+
+	if (!running)
+		return;
+	running = 0;
+
+	iv_validate_now();
+	stop_time = iv_now;
+
+	if (iv_timer_registered(&stop_timer))
+		iv_timer_unregister(&stop_timer);
+
+	/*
+	 * Destroying a tconn that was handed to a data plane thread
+	 * stops its sender from that thread, as it detaches.
+	 */
+	for (i = 0; i < num_pairs; i++) {
+		struct bench_pair *bp = &pairs[i];
+
+		if (bp->worker == NULL || offload)
+			bench_send_stop(bp);
+		bench_pair_stop(bp);
+	}
+}
+
+static int bench_gso_sendv(void *_tc, const struct iovec *iov, int iovcnt)
+{
+	return tconn_record_sendv(_tc, iov, iovcnt, TCONN_CLASS_BULK);
+}
+
+static void bench_send_gso(struct bench_pair *bp)
+{
+	static uint8_t buf[GSO_HDR_LEN + BENCH_GSO_LEN];
+	int i;
+
+	for (i = 0; i < BENCH_GSO_BURST; i++) {
+		if (gso_fragment(buf, sizeof(buf), 0, 16384,
+				 &bp->tx.tconn, bench_gso_sendv)) {
+			bench_stop(NULL);
+			return;
+		}
+	}
+
+	iv_task_register(&bp->send_task);
+}
+
+static void bench_send(void *_bp)
+{
+	static uint8_t rec[BENCH_RECORD_LEN];
+	struct bench_pair *bp = _bp;
+	int i;
+
+	if (gso) {
+		bench_send_gso(bp);
+		return;
+	}
+
+	for (i = 0; i < BENCH_BURST; i++) {
+		if (tconn_record_send(&bp->tx.tconn, rec, sizeof(rec))) {
+			if (bp->worker == NULL || offload)
+				bench_stop(NULL);
+			return;
+		}
+	}
+
+	iv_task_register(&bp->send_task);
+}
+
+static void bench_send_start(void *_bp)
+{
+	struct bench_pair *bp = _bp;
+
+	IV_TASK_INIT(&bp->send_task);
+	bp->send_task.cookie = bp;
+	bp->send_task.handler = bench_send;
+	iv_task_register(&bp->send_task);
+}
+
+static void bench_count(int len)
+{
+	__atomic_fetch_add(&rx_bytes, len, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&rx_records, 1, __ATOMIC_RELAXED);
+}
+
+static int bench_verify_key_ids(void *_be, const uint8_t *ids, int num)
+{
+	return 0;
+}
+
+static void bench_handshake_done(void *_be, char *desc)
+{
+	struct bench_end *be = _be;
+	int i;
+
+	be->up = 1;
+	if (++num_up < 2 * num_pairs)
+		return;
+
+	fprintf(stderr, "  %s\n", desc);
+
+	iv_validate_now();
+	start_time = iv_now;
+
+	for (i = 0; i < num_pairs; i++) {
+		struct bench_pair *bp = &pairs[i];
+
+		if (bp->worker != NULL) {
+			tconn_set_worker(&bp->rx.tconn, bp->worker);
+			tconn_set_worker(&bp->tx.tconn, bp->worker);
+		}
+
+		if (bp->worker == NULL || offload)
+			bench_send_start(bp);
+	}
+
+	stop_timer.expires = iv_now;
+	timespec_add_ms(&stop_timer.expires, 1000 * BENCH_SECONDS,
+			1000 * BENCH_SECONDS);
+	iv_timer_register(&stop_timer);
+}
+
+static void bench_record_received(void *_be, const uint8_t *rec, int len)
+{
+	struct bench_end *be = _be;
+
+	if (be != &be->bp->rx)
+		return;
+
+	if (gso) {
+		len = gso_reasm_add(&gso_reasm, rec + 1, len - 1);
+		if (len > 0)
+			bench_count(len - GSO_HDR_LEN);
+		return;
+	}
+
+	bench_count(len);
+}
+
+static int bench_dp_record_received(void *_bp, const uint8_t *rec, int len)
+{
+	bench_count(len);
+
+	return 0;
+}
+
+static void bench_connection_lost(void *_be)
+{
+	fprintf(stderr, "tconn_bench: connection lost\n");
+	bench_stop(NULL);
+}
+
+static int bench_connect(int *cfd, int *sfd)
+{
+	struct sockaddr_in addr;
+	socklen_t addrlen;
+	int lfd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		perror("socket");
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	addrlen = sizeof(addr);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(lfd, 1) < 0 ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &addrlen) < 0) {
+		perror("tconn_bench: listening socket");
+		close(lfd);
+		return -1;
+	}
+
+	*cfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (*cfd < 0) {
+		perror("socket");
+		close(lfd);
+		return -1;
+	}
+
+	if (connect(*cfd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("connect");
+		close(*cfd);
+		close(lfd);
+		return -1;
+	}
+
+	*sfd = accept(lfd, NULL, NULL);
+	if (*sfd < 0) {
+		perror("accept");
+		close(*cfd);
+		close(lfd);
+		return -1;
+	}
+
+	close(lfd);
+
+	return 0;
+}
+
+static int bench_end_start(struct bench_end *be, int fd, int role,
+			   gnutls_x509_privkey_t key, gnutls_x509_crt_t *crt)
+{
+	IV_FD_INIT(&be->fd);
+	be->fd.fd = fd;
+	iv_fd_register(&be->fd);
+
+	be->tconn.fd = &be->fd;
+	be->tconn.role = role;
+	be->tconn.mykey = key;
+	be->tconn.numcrts = 1;
+	be->tconn.mycrts = crt;
+	be->tconn.cookie = be;
+	be->tconn.verify_key_ids = bench_verify_key_ids;
+	be->tconn.handshake_done = bench_handshake_done;
+	be->tconn.record_received = bench_record_received;
+	be->tconn.connection_lost = bench_connection_lost;
+	be->up = 0;
+
+	if (tconn_start(&be->tconn)) {
+		iv_fd_unregister(&be->fd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static int bench_pair_start(struct bench_pair *bp, gnutls_x509_privkey_t key,
+			    gnutls_x509_crt_t *crt)
+{
+	int cfd;
+	int sfd;
+
+	if (bench_connect(&cfd, &sfd) < 0)
+		return -1;
+
+	bp->tx.bp = bp;
+	bp->rx.bp = bp;
+
+	if (!offload) {
+		bp->tx.tconn.dp_cookie = bp;
+		bp->tx.tconn.dp_attached = bench_send_start;
+		bp->tx.tconn.dp_detached = bench_send_stop;
+
+		bp->rx.tconn.dp_cookie = bp;
+		bp->rx.tconn.dp_record_received = bench_dp_record_received;
+	}
+
+	if (bench_end_start(&bp->rx, sfd, TCONN_ROLE_SERVER, key, crt) < 0) {
+		close(cfd);
+		close(sfd);
+		return -1;
+	}
+
+	if (bench_end_start(&bp->tx, cfd, TCONN_ROLE_CLIENT, key, crt) < 0) {
+		tconn_destroy(&bp->rx.tconn);
+		iv_fd_unregister(&bp->rx.fd);
+		close(cfd);
+		close(sfd);
+		return -1;
+	}
+
+	return 0;
+}
+
+static double rusage_secs(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_stime.tv_sec +
+		(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e6;
+}
+
+static int bench_run(int use_ktls, int threads, gnutls_x509_privkey_t key,
+		     gnutls_x509_crt_t *crt)
+{
+	struct rusage ru_start;
+	struct rusage ru_end;
+	uint64_t uring_start;
+	double secs;
+	double cpu;
+	int i;
+
+	if (threads) {
+		fprintf(stderr, "%s, %d thread%s%s:\n",
+			use_ktls ? "kernel TLS" : "user space TLS",
+			threads, threads == 1 ? "" : "s",
+			offload ? " (offload)" : "");
+	} else {
+		fprintf(stderr, "%s%s%s:\n",
+			use_ktls ? "kernel TLS" : "user space TLS",
+			gso ? ", super-packets" : "",
+			io_uring ? ", io_uring" : "");
+	}
+
+	tconn_set_kernel_tls(use_ktls);
+
+	num_pairs = threads ? threads : 1;
+	pairs = calloc(num_pairs, sizeof(*pairs));
+	if (pairs == NULL)
+		return -1;
+
+	num_up = 0;
+	rx_bytes = 0;
+	rx_records = 0;
+	syscalls = 0;
+	uring_start = uring_syscalls();
+	running = 1;
+
+	for (i = 0; i < num_pairs; i++) {
+		struct bench_pair *bp = &pairs[i];
+
+		bp->worker = threads ? worker_pool_member(i) : NULL;
+		if (bench_pair_start(bp, key, crt) < 0) {
+			while (--i >= 0)
+				bench_pair_stop(&pairs[i]);
+			free(pairs);
+			return -1;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	iv_main();
+	getrusage(RUSAGE_SELF, &ru_end);
+
+	free(pairs);
+
+	syscalls += uring_syscalls() - uring_start;
+
+	if (num_up < 2 * num_pairs)
+		return -1;
+
+	secs = (stop_time.tv_sec - start_time.tv_sec) +
+		(stop_time.tv_nsec - start_time.tv_nsec) / 1e9;
+	cpu = rusage_secs(&ru_end) - rusage_secs(&ru_start);
+
+	fprintf(stderr, "  %lld %s, %.1f MB/s, %.1f MB per CPU second, "
+			"%.2f TCP syscalls per %s\n",
+		rx_records, gso ? "super-packets" : "records",
+		rx_bytes / secs / 1e6,
+		cpu > 0 ? rx_bytes / cpu / 1e6 : 0.0,
+		rx_records ? (double)syscalls / rx_records : 0.0,
+		gso ? "super-packet" : "record");
+
+	return 0;
+}
+
+int tconn_bench(const char *keyfile, const char *threads)
+{
+	gnutls_x509_privkey_t key;
+	gnutls_x509_crt_t crt;
+	int num_threads;
+	int ret;
+	int i;
+
+	if (keyfile == NULL) {
+		fprintf(stderr, "usage: tconn-bench <key.pem> [threads]\n");
+		return 1;
+	}
+
+	num_threads = 0;
+	if (threads != NULL) {
+		num_threads = atoi(threads);
+		if (num_threads < 1 || num_threads > BENCH_MAX_THREADS) {
+			fprintf(stderr, "tconn_bench: number of threads "
+					"must be between 1 and %d\n",
+				BENCH_MAX_THREADS);
+			return 1;
+		}
+	}
+
+	gnutls_global_init();
+
+	if (x509_read_privkey(&key, keyfile, 0) < 0)
+		return 1;
+
+	if (x509_generate_self_signed_cert(&crt, key) < 0)
+		return 1;
+
+	iv_init();
+
+	IV_TIMER_INIT(&stop_timer);
+	stop_timer.handler = bench_stop;
+
+	ret = bench_run(0, 0, key, &crt);
+
+	io_uring = 1;
+	tconn_set_io_uring(1);
+	if (ret == 0)
+		ret = bench_run(0, 0, key, &crt);
+	tconn_set_io_uring(0);
+	io_uring = 0;
+
+	if (ret == 0)
+		ret = bench_run(1, 0, key, &crt);
+
+	gso_reasm_init(&gso_reasm);
+	gso = 1;
+	if (ret == 0)
+		ret = bench_run(0, 0, key, &crt);
+	if (ret == 0)
+		ret = bench_run(1, 0, key, &crt);
+	gso = 0;
+	gso_reasm_deinit(&gso_reasm);
+
+	if (ret == 0 && num_threads) {
+		if (worker_pool_start(num_threads) < 0) {
+			ret = -1;
+		} else {
+			tconn_set_handshake_offload(1);
+
+			for (i = 1; ret == 0 && i <= num_threads; i++)
+				ret = bench_run(1, i, key, &crt);
+
+			offload = 1;
+			for (i = 1; ret == 0 && i <= num_threads; i++)
+				ret = bench_run(0, i, key, &crt);
+			offload = 0;
+
+			tconn_set_handshake_offload(0);
+			worker_pool_stop();
+		}
+	}
+
+	iv_deinit();
+
+	gnutls_x509_crt_deinit(crt);
+	gnutls_x509_privkey_deinit(key);
+
+	gnutls_global_deinit();
+
+	return !!ret;
+}
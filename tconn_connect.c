@@ -92,6 +92,14 @@ static void record_received(void *_tc, const uint8_t *rec, int len)
 	tc->record_received(tc->conncookie, rec, len);
 }
 
+static void tx_ready(void *_tc)
+{
+	struct tconn_connect *tc = _tc;
+
+	if (tc->state == STATE_CONNECTED && tc->tx_ready != NULL)
+		tc->tx_ready(tc->conncookie);
+}
+
 static void connection_failed(void *_tc)
 {
 	struct tconn_connect *tc = _tc;
@@ -156,6 +164,7 @@ static void resolve_complete(void *_tc, int rc, struct addrinfo *res)
 		tc->tco_connect.connected = connected;
 		tc->tco_connect.record_received = record_received;
 		tc->tco_connect.connection_failed = connection_failed;
+		tc->tco_connect.tx_ready = tx_ready;
 
 		tc->res = res;
 		tc->rp = res;
@@ -270,14 +279,15 @@ int tconn_connect_get_maxseg(void *conn)
 	return tconn_connect_one_get_maxseg(&tc->tco);
 }
 
-void tconn_connect_record_send(void *conn, const uint8_t *rec, int len)
+void tconn_connect_record_sendv(void *conn, const struct iovec *iov,
+				int iovcnt, int cls)
 {
 	struct tconn_connect *tc = conn;
 
 	if (tc->state != STATE_CONNECTED)
 		return;
 
-	if (tconn_connect_one_record_send(&tc->tco, rec, len)) {
+	if (tconn_connect_one_record_sendv(&tc->tco, iov, iovcnt, cls)) {
 		fprintf(stderr, "%s: error sending TLS record, disconnecting "
 				"and retrying in %d seconds\n",
 			tc->name, SHORT_RETRY_WAIT_TIME);
@@ -285,3 +295,74 @@ void tconn_connect_record_send(void *conn, const uint8_t *rec, int len)
 		schedule_retry(tc, SHORT_RETRY_WAIT_TIME);
 	}
 }
+
+void tconn_connect_record_send(void *conn, const uint8_t *rec, int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)rec;
+	iov.iov_len = len;
+
+	tconn_connect_record_sendv(conn, &iov, 1, TCONN_CLASS_BULK);
+}
+
+void tconn_connect_disconnect(void *conn)
+{
+	struct tconn_connect *tc = conn;
+
+	if (tc->state != STATE_CONNECTED)
+		return;
+
+	fprintf(stderr, "%s: disconnecting, retrying in %d seconds\n",
+		tc->name, SHORT_RETRY_WAIT_TIME);
+	tconn_connect_one_disconnect(&tc->tco);
+	schedule_retry(tc, SHORT_RETRY_WAIT_TIME);
+}
+
+int tconn_connect_export_keys(void *conn, const char *label,
+			      uint8_t *buf, int len)
+{
+	struct tconn_connect *tc = conn;
+
+	if (tc->state != STATE_CONNECTED)
+		return -1;
+
+	return tconn_connect_one_export_keys(&tc->tco, label, buf, len);
+}
+
+int tconn_connect_get_txq_stats(void *conn, struct tconn_txq_stats *st)
+{
+	struct tconn_connect *tc = conn;
+
+	if (tc->state != STATE_CONNECTED)
+		return -1;
+
+	return tconn_connect_one_get_txq_stats(&tc->tco, st);
+}
+
+int tconn_connect_get_peer_addr(void *conn, struct sockaddr_storage *addr)
+{
+	struct tconn_connect *tc = conn;
+	socklen_t len;
+
+	if (tc->state != STATE_CONNECTED)
+		return -1;
+
+	len = sizeof(*addr);
+	if (getpeername(tc->tco.fd.fd, (struct sockaddr *)addr, &len) < 0) {
+		perror("getpeername");
+		return -1;
+	}
+
+	return 0;
+}
+
+struct tconn *tconn_connect_get_tconn(void *conn)
+{
+	struct tconn_connect *tc = conn;
+
+	if (tc->state != STATE_CONNECTED)
+		return NULL;
+
+	return &tc->tco.tconn;
+}
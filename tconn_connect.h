@@ -42,6 +42,7 @@ struct tconn_connect {
 	void			(*record_received)(void *cookie,
 						   const uint8_t *rec, int len);
 	void			(*disconnect)(void *cookie);
+	void			(*tx_ready)(void *cookie);
 
 	int			state;
 	union {
@@ -79,6 +80,14 @@ void tconn_connect_destroy(struct tconn_connect *tc);
 int tconn_connect_get_rtt(void *conn);
 int tconn_connect_get_maxseg(void *conn);
 void tconn_connect_record_send(void *conn, const uint8_t *rec, int len);
+void tconn_connect_record_sendv(void *conn, const struct iovec *iov,
+				int iovcnt, int cls);
+void tconn_connect_disconnect(void *conn);
+int tconn_connect_export_keys(void *conn, const char *label,
+			      uint8_t *buf, int len);
+int tconn_connect_get_txq_stats(void *conn, struct tconn_txq_stats *st);
+int tconn_connect_get_peer_addr(void *conn, struct sockaddr_storage *addr);
+struct tconn *tconn_connect_get_tconn(void *conn);
 
 
 #endif
@@ -151,6 +151,7 @@ static void send_keepalive(void *_tco)
 {
 	static uint8_t keepalive[] = { 0x00, 0x00, 0x00 };
 	struct tconn_connect_one *tco = _tco;
+	struct iovec iov;
 
 	if (tco->state != STATE_CONNECTED)
 		abort();
@@ -159,7 +160,10 @@ static void send_keepalive(void *_tco)
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&tco->keepalive_timer);
 
-	if (tconn_record_send(&tco->tconn, keepalive, 3)) {
+	iov.iov_base = keepalive;
+	iov.iov_len = sizeof(keepalive);
+
+	if (tconn_record_sendv(&tco->tconn, &iov, 1, TCONN_CLASS_CTRL)) {
 		fprintf(stderr, "%s: error sending keepalive, disconnecting\n",
 			tco->name);
 		connection_failed(tco);
@@ -193,20 +197,40 @@ static void handshake_done(void *_tco, char *desc)
 	tco->connected(tco->cookie, tco->id);
 }
 
-static void record_received(void *_tco, const uint8_t *rec, int len)
+static void rx_timeout_rearm(struct tconn_connect_one *tco)
 {
-	struct tconn_connect_one *tco = _tco;
-
 	iv_timer_unregister(&tco->rx_timeout);
 	iv_validate_now();
 	tco->rx_timeout.expires = iv_now;
 	timespec_add_ms(&tco->rx_timeout.expires,
 			1000 * KEEPALIVE_TIMEOUT, 1000 * KEEPALIVE_TIMEOUT);
 	iv_timer_register(&tco->rx_timeout);
+}
+
+static void record_received(void *_tco, const uint8_t *rec, int len)
+{
+	struct tconn_connect_one *tco = _tco;
+
+	rx_timeout_rearm(tco);
 
 	tco->record_received(tco->cookie, rec, len);
 }
 
+static void rx_activity(void *_tco)
+{
+	struct tconn_connect_one *tco = _tco;
+
+	rx_timeout_rearm(tco);
+}
+
+static void tx_ready(void *_tco)
+{
+	struct tconn_connect_one *tco = _tco;
+
+	if (tco->state == STATE_CONNECTED && tco->tx_ready != NULL)
+		tco->tx_ready(tco->cookie);
+}
+
 static void connection_lost(void *_tco)
 {
 	struct tconn_connect_one *tco = _tco;
@@ -228,6 +252,13 @@ static int start_handshake(struct tconn_connect_one *tco)
 	tco->tconn.verify_key_ids = verify_key_ids;
 	tco->tconn.handshake_done = handshake_done;
 	tco->tconn.record_received = record_received;
+	tco->tconn.tx_ready = tx_ready;
+	tco->tconn.rx_activity = rx_activity;
+	tco->tconn.dp_attached = NULL;
+	tco->tconn.dp_record_received = NULL;
+	tco->tconn.dp_detached = NULL;
+	tco->tconn.dp_message = NULL;
+	tco->tconn.dp_message_discard = NULL;
 	tco->tconn.connection_lost = connection_lost;
 	if (tconn_start(&tco->tconn) < 0)
 		return -1;
@@ -359,8 +390,8 @@ int tconn_connect_one_get_maxseg(struct tconn_connect_one *tco)
 	return mseg;
 }
 
-int tconn_connect_one_record_send(struct tconn_connect_one *tco,
-				  const uint8_t *rec, int len)
+int tconn_connect_one_record_sendv(struct tconn_connect_one *tco,
+				   const struct iovec *iov, int iovcnt, int cls)
 {
 	if (tco->state != STATE_CONNECTED)
 		return 0;
@@ -372,7 +403,7 @@ int tconn_connect_one_record_send(struct tconn_connect_one *tco,
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&tco->keepalive_timer);
 
-	if (tconn_record_send(&tco->tconn, rec, len)) {
+	if (tconn_record_sendv(&tco->tconn, iov, iovcnt, cls)) {
 		fprintf(stderr, "%s: error sending TLS record, disconnecting\n",
 			tco->name);
 		connection_failed(tco);
@@ -381,3 +412,34 @@ int tconn_connect_one_record_send(struct tconn_connect_one *tco,
 
 	return 0;
 }
+
+int tconn_connect_one_record_send(struct tconn_connect_one *tco,
+				  const uint8_t *rec, int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)rec;
+	iov.iov_len = len;
+
+	return tconn_connect_one_record_sendv(tco, &iov, 1, TCONN_CLASS_BULK);
+}
+
+int tconn_connect_one_export_keys(struct tconn_connect_one *tco,
+				  const char *label, uint8_t *buf, int len)
+{
+	if (tco->state != STATE_CONNECTED)
+		return -1;
+
+	return tconn_export_keys(&tco->tconn, label, buf, len);
+}
+
+int tconn_connect_one_get_txq_stats(struct tconn_connect_one *tco,
+				    struct tconn_txq_stats *st)
+{
+	if (tco->state != STATE_CONNECTED)
+		return -1;
+
+	tconn_get_txq_stats(&tco->tconn, st);
+
+	return 0;
+}
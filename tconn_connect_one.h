@@ -40,6 +40,7 @@ struct tconn_connect_one {
 	void			(*record_received)(void *cookie,
 						   const uint8_t *rec, int len);
 	void			(*connection_failed)(void *cookie);
+	void			(*tx_ready)(void *cookie);
 
 	int			state;
 
@@ -61,6 +62,12 @@ int tconn_connect_one_get_rtt(struct tconn_connect_one *tco);
 int tconn_connect_one_get_maxseg(struct tconn_connect_one *tco);
 int tconn_connect_one_record_send(struct tconn_connect_one *tco,
 				  const uint8_t *rec, int len);
+int tconn_connect_one_record_sendv(struct tconn_connect_one *tco,
+				   const struct iovec *iov, int iovcnt, int cls);
+int tconn_connect_one_export_keys(struct tconn_connect_one *tco,
+				  const char *label, uint8_t *buf, int len);
+int tconn_connect_one_get_txq_stats(struct tconn_connect_one *tco,
+				    struct tconn_txq_stats *st);
 
 
 #endif
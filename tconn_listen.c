@@ -189,12 +189,16 @@ static void send_keepalive(void *_cc)
 {
 	static uint8_t keepalive[] = { 0x00, 0x00, 0x00 };
 	struct client_conn *cc = _cc;
+	struct iovec iov;
 
 	timespec_add_ms(&cc->keepalive_timer.expires,
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&cc->keepalive_timer);
 
-	if (tconn_record_send(&cc->tconn, keepalive, 3)) {
+	iov.iov_base = keepalive;
+	iov.iov_len = sizeof(keepalive);
+
+	if (tconn_record_sendv(&cc->tconn, &iov, 1, TCONN_CLASS_CTRL)) {
 		print_name(stderr, cc);
 		fprintf(stderr, ": error sending keepalive, disconnecting\n");
 		client_conn_kill(cc, 1);
@@ -240,11 +244,8 @@ static void handshake_done(void *_cc, char *desc)
 	iv_timer_register(&cc->keepalive_timer);
 }
 
-static void record_received(void *_cc, const uint8_t *rec, int len)
+static void rx_timeout_rearm(struct client_conn *cc)
 {
-	struct client_conn *cc = _cc;
-	struct tconn_listen_entry *tle = cc->tle;
-
 	iv_validate_now();
 
 	iv_timer_unregister(&cc->rx_timeout);
@@ -252,10 +253,33 @@ static void record_received(void *_cc, const uint8_t *rec, int len)
 	timespec_add_ms(&cc->rx_timeout.expires,
 			1000 * KEEPALIVE_TIMEOUT, 1000 * KEEPALIVE_TIMEOUT);
 	iv_timer_register(&cc->rx_timeout);
+}
+
+static void record_received(void *_cc, const uint8_t *rec, int len)
+{
+	struct client_conn *cc = _cc;
+	struct tconn_listen_entry *tle = cc->tle;
+
+	rx_timeout_rearm(cc);
 
 	tle->record_received(cc->cookie, rec, len);
 }
 
+static void rx_activity(void *_cc)
+{
+	struct client_conn *cc = _cc;
+
+	rx_timeout_rearm(cc);
+}
+
+static void tx_ready(void *_cc)
+{
+	struct client_conn *cc = _cc;
+
+	if (cc->state == STATE_CONNECTED && cc->tle->tx_ready != NULL)
+		cc->tle->tx_ready(cc->cookie);
+}
+
 static void connection_lost(void *_cc)
 {
 	struct client_conn *cc = _cc;
@@ -323,6 +347,8 @@ static void got_connection(void *_ls)
 	cc->tconn.verify_key_ids = verify_key_ids;
 	cc->tconn.handshake_done = handshake_done;
 	cc->tconn.record_received = record_received;
+	cc->tconn.tx_ready = tx_ready;
+	cc->tconn.rx_activity = rx_activity;
 	cc->tconn.connection_lost = connection_lost;
 	tconn_start(&cc->tconn);
 
@@ -483,7 +509,8 @@ int tconn_listen_entry_get_maxseg(void *conn)
 	return mseg;
 }
 
-void tconn_listen_entry_record_send(void *conn, const uint8_t *rec, int len)
+void tconn_listen_entry_record_sendv(void *conn, const struct iovec *iov,
+				     int iovcnt, int cls)
 {
 	struct client_conn *cc = conn;
 
@@ -495,16 +522,48 @@ void tconn_listen_entry_record_send(void *conn, const uint8_t *rec, int len)
 			900 * KEEPALIVE_INTERVAL, 1100 * KEEPALIVE_INTERVAL);
 	iv_timer_register(&cc->keepalive_timer);
 
-	if (tconn_record_send(&cc->tconn, rec, len)) {
+	if (tconn_record_sendv(&cc->tconn, iov, iovcnt, cls)) {
 		print_name(stderr, cc);
 		fprintf(stderr, ": error sending TLS record, disconnecting\n");
 		client_conn_kill(cc, 1);
 	}
 }
 
+void tconn_listen_entry_record_send(void *conn, const uint8_t *rec, int len)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)rec;
+	iov.iov_len = len;
+
+	tconn_listen_entry_record_sendv(conn, &iov, 1, TCONN_CLASS_BULK);
+}
+
+int tconn_listen_entry_export_keys(void *conn, const char *label,
+				   uint8_t *buf, int len)
+{
+	struct client_conn *cc = conn;
+
+	return tconn_export_keys(&cc->tconn, label, buf, len);
+}
+
+void tconn_listen_entry_get_txq_stats(void *conn, struct tconn_txq_stats *st)
+{
+	struct client_conn *cc = conn;
+
+	tconn_get_txq_stats(&cc->tconn, st);
+}
+
 void tconn_listen_entry_disconnect(void *conn)
 {
 	struct client_conn *cc = conn;
 
 	client_conn_kill(cc, 0);
 }
+
+struct tconn *tconn_listen_entry_get_tconn(void *conn)
+{
+	struct client_conn *cc = conn;
+
+	return &cc->tconn;
+}
@@ -21,7 +21,9 @@
 #define __TCONN_LISTEN_H
 
 #include <gnutls/x509.h>
+#include <sys/uio.h>
 #include "conf.h"
+#include "tconn.h"
 
 struct tconn_listen_socket {
 	struct sockaddr_storage		listen_address;
@@ -49,6 +51,7 @@ struct tconn_listen_entry {
 							   const uint8_t *rec,
 							   int len);
 	void				(*disconnect)(void *cookie);
+	void				(*tx_ready)(void *cookie);
 
 	struct iv_avl_node		an;
 	struct iv_list_head		connections;
@@ -60,7 +63,13 @@ void tconn_listen_entry_unregister(struct tconn_listen_entry *tle);
 int tconn_listen_entry_get_rtt(void *conn);
 int tconn_listen_entry_get_maxseg(void *conn);
 void tconn_listen_entry_record_send(void *conn, const uint8_t *rec, int len);
+void tconn_listen_entry_record_sendv(void *conn, const struct iovec *iov,
+				     int iovcnt, int cls);
+int tconn_listen_entry_export_keys(void *conn, const char *label,
+				   uint8_t *buf, int len);
+void tconn_listen_entry_get_txq_stats(void *conn, struct tconn_txq_stats *st);
 void tconn_listen_entry_disconnect(void *conn);
+struct tconn *tconn_listen_entry_get_tconn(void *conn);
 
 
 #endif
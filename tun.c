@@ -26,33 +26,528 @@
 #include <stdlib.h>
 #include <fcntl.h>
 #include <iv.h>
+#include <iv_list.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
 #include <stdint.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "gso.h"
 #include "tun.h"
+#include "uring.h"
+
+/*
+ * Drain up to TUN_MAX_BATCH packets per wakeup, so that the consumer
+ * can aggregate them before sending them on.  The consumer may refuse
+ * a packet (for lack of room to batch it), in which case it is asked
+ * to flush, and is then offered the same packet again.
+ *
+ * Packets are read TUN_HEADROOM bytes into the receive buffer, so
+ * that the consumer can prepend its own header in place instead of
+ * copying the packet to make room for it.
+ *
+ * An interface that is opened with vnet_hdr set has a virtio-net
+ * header in front of every packet.  As long as no offloads are
+ * enabled on it, the kernel hands us fully formed packets, with an
+ * empty header, which is read into the headroom and otherwise
+ * ignored.  Once tun_interface_set_offload() has enabled checksum
+ * and TSO offload, the kernel can hand us TCP super-packets of up to
+ * 64 KiB, and packets with a partial checksum, which need the header
+ * to be passed on with them.  These are given to got_gso_packet, with
+ * the header in front, instead of to got_packet.
+ */
+#define TUN_MAX_BATCH	64
+
+/*
+ * The tun file descriptor is non-blocking, so that a tun interface
+ * that can't take any more packets for the moment can't stall the
+ * thread that writes to it, and with it, the traffic of every other
+ * peer that it serves.  Packets that the kernel won't take are kept
+ * on a per-interface egress queue instead, which is drained (up to
+ * TUN_MAX_BATCH packets at a time) once the file descriptor becomes
+ * writable again, and until it has been drained, packets are added
+ * to the end of it, to keep them in order.  Packets that would push
+ * the queue beyond TUN_EGRESS_MAX_BYTES are dropped, and counted.
+ */
+#define TUN_EGRESS_MAX_BYTES	(1024 * 1024)
+
+struct tun_egress_packet {
+	struct iv_list_head	list;
+	int			len;
+	uint8_t			buf[0];
+};
+
+/*
+ * With tun_set_io_uring() enabled, interfaces are switched over to
+ * io_uring (see uring.c) at their next wakeup, or as they are
+ * registered, and back again once it is disabled.  Reads are then
+ * done by a multishot read that the kernel completes with a packet
+ * in one of TUN_URING_BUFS buffers from a ring of provided buffers
+ * that is registered with the thread's io_uring, each laid out like
+ * the receive buffer above, until it runs out of buffers.  Only
+ * interfaces with vnet_hdr set can hand us GSO super-packets, so the
+ * buffers of the others are sized for TUN_URING_MAX_PACKET instead.
+ * Writes are queued to the ring as well, with a copy of the packet in
+ * one of TUN_URING_WRITES more such buffers (or, if those are all in
+ * flight, in one that is allocated for the occasion), and the writes
+ * queued during one event loop iteration are submitted with a single
+ * system call.  Writes that are in flight count towards the egress
+ * queue limit.
+ *
+ * If the kernel turns out to lack io_uring, provided buffer rings or
+ * multishot reads, we fall back to read()/write() for good.
+ */
+#define TUN_URING_BUFS		32
+#define TUN_URING_WRITES	32
+#define TUN_URING_MAX_PACKET	16384
+
+struct tun_uring_write {
+	struct uring_req	req;
+	struct tun_uring	*tu;
+	struct tun_uring_write	*next;
+	int			pooled;
+	int			len;
+	uint8_t			*buf;
+};
+
+struct tun_uring {
+	struct tun_interface	*ti;
+	int			refcount;
+	int			writes;
+	struct uring_req	read_req;
+	int			read_armed;
+	int			bgid;
+	struct io_uring_buf_ring *br;
+	uint16_t		br_tail;
+	uint8_t			*bufs;
+	int			buf_size;
+	int			rxoff;
+	struct iv_task		flush_task;
+	struct tun_uring_write	*wfree;
+	struct tun_uring_write	wslots[TUN_URING_WRITES];
+};
+
+static int io_uring_enabled;
+static int io_uring_unsupported;
+
+#ifndef IFF_MULTI_QUEUE
+#define IFF_MULTI_QUEUE	0x0100
+#endif
+
+/*
+ * Hands a packet that was read to rbuf (at TUN_HEADROOM into its
+ * receive buffer, less the virtio-net header, if any) to the
+ * consumer.  Returns -1 if the interface got unregistered meanwhile.
+ */
+static int tun_dispatch(struct tun_interface *ti, uint8_t *rbuf, int len,
+			int *destroyed)
+{
+	int (*got)(void *cookie, uint8_t *buf, int len);
+	uint8_t *p;
+
+	got = ti->got_packet;
+	p = rbuf;
+	if (ti->vnet_hdr) {
+		struct virtio_net_hdr *hdr = (void *)rbuf;
+
+		if (len <= GSO_HDR_LEN)
+			return 0;
+
+		if (hdr->flags || hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE) {
+			got = ti->got_gso_packet;
+			if (got == NULL)
+				return 0;
+		} else {
+			p += GSO_HDR_LEN;
+			len -= GSO_HDR_LEN;
+		}
+	}
+
+	while (got(ti->cookie, p, len) < 0) {
+		ti->flush(ti->cookie);
+		if (*destroyed)
+			return -1;
+	}
+
+	return *destroyed ? -1 : 0;
+}
+
+static int tun_want_io_uring(void)
+{
+	return __atomic_load_n(&io_uring_enabled, __ATOMIC_RELAXED) &&
+	       !__atomic_load_n(&io_uring_unsupported, __ATOMIC_RELAXED);
+}
+
+static void tun_io_uring_unsupported(void)
+{
+	__atomic_store_n(&io_uring_unsupported, 1, __ATOMIC_RELAXED);
+}
+
+static int tun_uring_start(struct tun_interface *ti);
 
 static void tun_got_packet(void *cookie)
 {
 	struct tun_interface *ti = cookie;
-	uint8_t buf[16384];
-	int ret;
+	uint8_t buf[TUN_HEADROOM + GSO_MAX_LEN];
+	uint8_t *pkt = buf + TUN_HEADROOM;
+	uint8_t *rbuf;
+	int destroyed;
+	int i;
 
-	do {
-		ret = read(ti->fd.fd, buf, sizeof(buf));
-	} while (ret == -1 && errno == EINTR);
-
-	if (ret <= 0) {
-		if (ret < 0 && errno != EAGAIN) {
-			fprintf(stderr, "tun_got_packet: read(2) got "
-					"error: %s\n", strerror(errno));
-			abort();
+	if (tun_want_io_uring() && tun_uring_start(ti) == 0)
+		return;
+
+	rbuf = pkt;
+	if (ti->vnet_hdr)
+		rbuf -= GSO_HDR_LEN;
+
+	destroyed = 0;
+	ti->destroyed = &destroyed;
+
+	for (i = 0; i < TUN_MAX_BATCH; i++) {
+		int ret;
+
+		do {
+			ti->syscalls++;
+			ret = read(ti->fd.fd, rbuf, buf + sizeof(buf) - rbuf);
+		} while (ret == -1 && errno == EINTR);
+
+		if (ret <= 0) {
+			if (ret < 0 && errno != EAGAIN) {
+				fprintf(stderr, "tun_got_packet: read(2) got "
+						"error: %s\n", strerror(errno));
+				abort();
+			}
+			break;
 		}
+
+		if (tun_dispatch(ti, rbuf, ret, &destroyed) < 0)
+			return;
+	}
+
+	ti->destroyed = NULL;
+
+	if (ti->flush != NULL)
+		ti->flush(ti->cookie);
+}
+
+static void tun_uring_put(struct tun_uring *tu)
+{
+	if (--tu->refcount)
 		return;
+
+	uring_unregister_buf_ring(tu->bgid);
+	munmap(tu->br, TUN_URING_BUFS * sizeof(struct io_uring_buf));
+	free(tu->bufs);
+	free(tu);
+
+	uring_put();
+}
+
+static void tun_uring_recycle(struct tun_uring *tu, int bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &tu->br->bufs[tu->br_tail & (TUN_URING_BUFS - 1)];
+	buf->addr = (uintptr_t)(tu->bufs + bid * tu->buf_size + tu->rxoff);
+	buf->len = tu->buf_size - tu->rxoff;
+	buf->bid = bid;
+
+	tu->br_tail++;
+	__atomic_store_n(&tu->br->tail, tu->br_tail, __ATOMIC_RELEASE);
+}
+
+static int tun_uring_arm_read(struct tun_uring *tu)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(&tu->read_req);
+	if (sqe == NULL)
+		return -1;
+
+	sqe->opcode = URING_OP_READ_MULTISHOT;
+	sqe->fd = tu->ti->fd.fd;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = tu->bgid;
+
+	tu->read_armed = 1;
+	tu->refcount++;
+
+	return 0;
+}
+
+/*
+ * Switches an interface back to read()/write().  The buffers stay
+ * around until the kernel is done with the multishot read, and with
+ * any writes that are still in flight.
+ */
+static void tun_uring_stop(struct tun_interface *ti)
+{
+	struct tun_uring *tu = ti->tu;
+
+	tu->ti = NULL;
+	ti->tu = NULL;
+
+	if (iv_task_registered(&tu->flush_task))
+		iv_task_unregister(&tu->flush_task);
+
+	if (tu->read_armed)
+		uring_cancel(&tu->read_req);
+
+	iv_fd_set_handler_in(&ti->fd, tun_got_packet);
+
+	tun_uring_put(tu);
+}
+
+static void tun_uring_read_done(void *_tu, int res, unsigned int flags)
+{
+	struct tun_uring *tu = _tu;
+	struct tun_interface *ti = tu->ti;
+	int final;
+
+	final = !(flags & IORING_CQE_F_MORE);
+	if (final)
+		tu->read_armed = 0;
+
+	if (ti == NULL) {
+		if (flags & IORING_CQE_F_BUFFER)
+			tun_uring_recycle(tu, flags >> IORING_CQE_BUFFER_SHIFT);
+	} else if (res < 0 && res != -ENOBUFS) {
+		fprintf(stderr, "tun_uring_read_done: read got error: %s\n",
+			strerror(-res));
+		if (res == -EINVAL || res == -EOPNOTSUPP || res == -EBADFD)
+			tun_io_uring_unsupported();
+		tun_uring_stop(ti);
+	} else if (res >= 0 && (flags & IORING_CQE_F_BUFFER)) {
+		int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+		int destroyed;
+
+		destroyed = 0;
+		ti->destroyed = &destroyed;
+
+		if (tun_dispatch(ti, tu->bufs + bid * tu->buf_size +
+				     tu->rxoff, res, &destroyed) == 0) {
+			ti->destroyed = NULL;
+			if (!iv_task_registered(&tu->flush_task))
+				iv_task_register(&tu->flush_task);
+		}
+
+		tun_uring_recycle(tu, bid);
+	}
+
+	/*
+	 * Switching back waits for writes in flight, so that those
+	 * can still be accounted to the interface when they complete.
+	 */
+	ti = tu->ti;
+	if (ti != NULL && !tun_want_io_uring() && !tu->writes) {
+		tun_uring_stop(ti);
+	} else if (ti != NULL && final) {
+		if (tun_uring_arm_read(tu) < 0)
+			tun_uring_stop(ti);
+	}
+
+	if (final)
+		tun_uring_put(tu);
+}
+
+static void tun_uring_flush(void *_tu)
+{
+	struct tun_uring *tu = _tu;
+
+	if (tu->ti->flush != NULL)
+		tu->ti->flush(tu->ti->cookie);
+}
+
+static int tun_uring_start(struct tun_interface *ti)
+{
+	struct tun_uring *tu;
+	int i;
+
+	if (!iv_list_empty(&ti->egress))
+		return -1;
+
+	if (uring_get() < 0) {
+		tun_io_uring_unsupported();
+		return -1;
+	}
+
+	tu = calloc(1, sizeof(*tu));
+	if (tu == NULL) {
+		uring_put();
+		return -1;
 	}
 
-	ti->got_packet(ti->cookie, buf, ret);
+	tu->buf_size = TUN_HEADROOM;
+	if (ti->vnet_hdr)
+		tu->buf_size += GSO_MAX_LEN;
+	else
+		tu->buf_size += TUN_URING_MAX_PACKET;
+
+	tu->bufs = malloc((TUN_URING_BUFS + TUN_URING_WRITES) * tu->buf_size);
+	tu->br = mmap(NULL, TUN_URING_BUFS * sizeof(struct io_uring_buf),
+		      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		      -1, 0);
+	if (tu->bufs == NULL || tu->br == MAP_FAILED) {
+		if (tu->br != MAP_FAILED) {
+			munmap(tu->br,
+			       TUN_URING_BUFS * sizeof(struct io_uring_buf));
+		}
+		free(tu->bufs);
+		free(tu);
+		uring_put();
+		return -1;
+	}
+
+	tu->bgid = uring_register_buf_ring(tu->br, TUN_URING_BUFS);
+	if (tu->bgid < 0) {
+		tun_io_uring_unsupported();
+		munmap(tu->br, TUN_URING_BUFS * sizeof(struct io_uring_buf));
+		free(tu->bufs);
+		free(tu);
+		uring_put();
+		return -1;
+	}
+
+	tu->ti = ti;
+	tu->refcount = 1;
+	tu->read_req.cookie = tu;
+	tu->read_req.complete = tun_uring_read_done;
+	tu->rxoff = TUN_HEADROOM;
+	if (ti->vnet_hdr)
+		tu->rxoff -= GSO_HDR_LEN;
+	IV_TASK_INIT(&tu->flush_task);
+	tu->flush_task.cookie = tu;
+	tu->flush_task.handler = tun_uring_flush;
+
+	for (i = 0; i < TUN_URING_BUFS; i++)
+		tun_uring_recycle(tu, i);
+
+	for (i = 0; i < TUN_URING_WRITES; i++) {
+		struct tun_uring_write *w = &tu->wslots[i];
+
+		w->pooled = 1;
+		w->buf = tu->bufs + (TUN_URING_BUFS + i) * tu->buf_size;
+		w->next = tu->wfree;
+		tu->wfree = w;
+	}
+
+	ti->tu = tu;
+	iv_fd_set_handler_in(&ti->fd, NULL);
+
+	if (tun_uring_arm_read(tu) < 0) {
+		tun_uring_stop(ti);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void tun_uring_write_free(struct tun_uring *tu,
+				struct tun_uring_write *w)
+{
+	if (w->pooled) {
+		w->next = tu->wfree;
+		tu->wfree = w;
+	} else {
+		free(w);
+	}
+}
+
+static void tun_uring_write_done(void *_w, int res, unsigned int flags)
+{
+	struct tun_uring_write *w = _w;
+	struct tun_uring *tu = w->tu;
+	struct tun_interface *ti = tu->ti;
+
+	tu->writes--;
+
+	if (ti != NULL) {
+		ti->egress_len--;
+		ti->egress_bytes -= w->len;
+
+		if (res < 0) {
+			fprintf(stderr, "tun_uring_write_done: write got "
+					"error: %s\n", strerror(-res));
+			ti->dropped++;
+		} else {
+			ti->written++;
+		}
+	}
+
+	tun_uring_write_free(tu, w);
+	tun_uring_put(tu);
+}
+
+static int tun_uring_write(struct tun_interface *ti,
+			   const struct iovec *iov, int iovcnt)
+{
+	struct tun_uring *tu = ti->tu;
+	struct tun_uring_write *w;
+	struct io_uring_sqe *sqe;
+	int len;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (ti->egress_bytes + len > TUN_EGRESS_MAX_BYTES) {
+		ti->dropped++;
+		return -1;
+	}
+
+	w = tu->wfree;
+	if (w != NULL && len <= tu->buf_size) {
+		tu->wfree = w->next;
+	} else {
+		w = malloc(sizeof(*w) + len);
+		if (w == NULL) {
+			ti->dropped++;
+			return -1;
+		}
+		w->pooled = 0;
+		w->buf = (uint8_t *)(w + 1);
+	}
+
+	sqe = uring_get_sqe(&w->req);
+	if (sqe == NULL) {
+		tun_uring_write_free(tu, w);
+		ti->dropped++;
+		return -1;
+	}
+
+	w->req.cookie = w;
+	w->req.complete = tun_uring_write_done;
+	w->tu = tu;
+	w->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(w->buf + w->len, iov[i].iov_base, iov[i].iov_len);
+		w->len += iov[i].iov_len;
+	}
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd = ti->fd.fd;
+	sqe->addr = (uintptr_t)w->buf;
+	sqe->len = len;
+
+	tu->refcount++;
+	tu->writes++;
+
+	ti->egress_len++;
+	ti->egress_bytes += len;
+	if (ti->egress_max_bytes < ti->egress_bytes)
+		ti->egress_max_bytes = ti->egress_bytes;
+	ti->queued++;
+
+	return len;
+}
+
+void tun_set_io_uring(int enable)
+{
+	__atomic_store_n(&io_uring_enabled, !!enable, __ATOMIC_RELAXED);
 }
 
 int tun_interface_register(struct tun_interface *ti)
@@ -61,7 +556,7 @@ int tun_interface_register(struct tun_interface *ti)
 	struct ifreq ifr;
 	int ret;
 
-	fd = open("/dev/net/tun", O_RDWR);
+	fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
 	if (fd < 0) {
 		fprintf(stderr, "tun_interface_register: open(2) of "
 				"/dev/net/tun got error: %s\n",
@@ -69,8 +564,18 @@ int tun_interface_register(struct tun_interface *ti)
 		return -1;
 	}
 
+	/*
+	 * Registering a multi-queue interface by the name of one that
+	 * already exists adds another queue to it, with its own file
+	 * descriptor, and the kernel spreads the packets that it sends
+	 * out over the interface over the queues by flow.
+	 */
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TUN | IFF_NO_PI;
+	if (ti->multi_queue)
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	if (ti->vnet_hdr)
+		ifr.ifr_flags |= IFF_VNET_HDR;
 	if (ti->itfname != NULL)
 		strncpy(ifr.ifr_name, ti->itfname, IFNAMSIZ);
 
@@ -82,7 +587,30 @@ int tun_interface_register(struct tun_interface *ti)
 		return -1;
 	}
 
+	if (ti->vnet_hdr) {
+		int hdrlen = GSO_HDR_LEN;
+
+		if (ioctl(fd, TUNSETVNETHDRSZ, &hdrlen) < 0 ||
+		    ioctl(fd, TUNSETOFFLOAD, 0) < 0) {
+			fprintf(stderr, "tun_interface_register: vnet header "
+					"ioctl(2) got error: %s\n",
+				strerror(errno));
+			close(fd);
+			return -1;
+		}
+	}
+
 	memcpy(ti->name, ifr.ifr_name, IFNAMSIZ);
+	ti->destroyed = NULL;
+
+	INIT_IV_LIST_HEAD(&ti->egress);
+	ti->egress_len = 0;
+	ti->egress_bytes = 0;
+	ti->egress_max_bytes = 0;
+	ti->written = 0;
+	ti->queued = 0;
+	ti->dropped = 0;
+	ti->syscalls = 0;
 
 	IV_FD_INIT(&ti->fd);
 	ti->fd.fd = fd;
@@ -90,13 +618,32 @@ int tun_interface_register(struct tun_interface *ti)
 	ti->fd.handler_in = tun_got_packet;
 	iv_fd_register(&ti->fd);
 
+	ti->tu = NULL;
+	if (tun_want_io_uring())
+		tun_uring_start(ti);
+
 	return 0;
 }
 
 void tun_interface_unregister(struct tun_interface *ti)
 {
+	if (ti->destroyed != NULL)
+		*ti->destroyed = 1;
+
+	if (ti->tu != NULL)
+		tun_uring_stop(ti);
+
 	iv_fd_unregister(&ti->fd);
 	close(ti->fd.fd);
+
+	while (!iv_list_empty(&ti->egress)) {
+		struct tun_egress_packet *p;
+
+		p = iv_container_of(ti->egress.next,
+				    struct tun_egress_packet, list);
+		iv_list_del(&p->list);
+		free(p);
+	}
 }
 
 char *tun_interface_get_name(struct tun_interface *ti)
@@ -104,19 +651,198 @@ char *tun_interface_get_name(struct tun_interface *ti)
 	return ti->name;
 }
 
-int tun_interface_send_packet(struct tun_interface *ti,
-			      const uint8_t *buf, int len)
+/*
+ * The offload flags are per device, so on a multi-queue interface,
+ * this affects what is read from all of its queues.
+ */
+int tun_interface_set_offload(struct tun_interface *ti, int enable)
+{
+	unsigned int flags;
+
+	if (!ti->vnet_hdr)
+		return -1;
+
+	flags = 0;
+	if (enable)
+		flags = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6 | TUN_F_TSO_ECN;
+
+	if (ioctl(ti->fd.fd, TUNSETOFFLOAD, flags) < 0) {
+		fprintf(stderr, "tun_interface_set_offload: ioctl(2) got "
+				"error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+static int tun_write(struct tun_interface *ti, const struct iovec *iov,
+		     int iovcnt)
 {
 	int ret;
 
 	do {
-		ret = write(ti->fd.fd, buf, len);
+		ti->syscalls++;
+		ret = writev(ti->fd.fd, iov, iovcnt);
 	} while (ret < 0 && errno == EINTR);
 
+	return ret;
+}
+
+static void tun_write_error(struct tun_interface *ti)
+{
+	fprintf(stderr, "tun_write: write(2) got error: %s\n",
+		strerror(errno));
+	ti->dropped++;
+}
+
+static void tun_egress_drain(void *cookie)
+{
+	struct tun_interface *ti = cookie;
+	int i;
+
+	for (i = 0; i < TUN_MAX_BATCH && !iv_list_empty(&ti->egress); i++) {
+		struct tun_egress_packet *p;
+		struct iovec iov;
+
+		p = iv_container_of(ti->egress.next,
+				    struct tun_egress_packet, list);
+
+		iov.iov_base = p->buf;
+		iov.iov_len = p->len;
+		if (tun_write(ti, &iov, 1) < 0) {
+			if (errno == EAGAIN)
+				return;
+			tun_write_error(ti);
+		} else {
+			ti->written++;
+		}
+
+		iv_list_del(&p->list);
+		ti->egress_len--;
+		ti->egress_bytes -= p->len;
+		free(p);
+	}
+
+	if (iv_list_empty(&ti->egress))
+		iv_fd_set_handler_out(&ti->fd, NULL);
+}
+
+static int tun_egress_queue(struct tun_interface *ti,
+			    const struct iovec *iov, int iovcnt)
+{
+	struct tun_egress_packet *p;
+	int len;
+	int i;
+
+	len = 0;
+	for (i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	if (ti->egress_bytes + len > TUN_EGRESS_MAX_BYTES) {
+		ti->dropped++;
+		return -1;
+	}
+
+	p = malloc(sizeof(*p) + len);
+	if (p == NULL) {
+		ti->dropped++;
+		return -1;
+	}
+
+	p->len = 0;
+	for (i = 0; i < iovcnt; i++) {
+		memcpy(p->buf + p->len, iov[i].iov_base, iov[i].iov_len);
+		p->len += iov[i].iov_len;
+	}
+
+	if (iv_list_empty(&ti->egress))
+		iv_fd_set_handler_out(&ti->fd, tun_egress_drain);
+
+	iv_list_add_tail(&p->list, &ti->egress);
+	ti->egress_len++;
+	ti->egress_bytes += len;
+	if (ti->egress_max_bytes < ti->egress_bytes)
+		ti->egress_max_bytes = ti->egress_bytes;
+	ti->queued++;
+
+	return len;
+}
+
+static int tun_send(struct tun_interface *ti, const struct iovec *iov,
+		    int iovcnt)
+{
+	int ret;
+
+	if (ti->tu != NULL)
+		return tun_uring_write(ti, iov, iovcnt);
+
+	if (!iv_list_empty(&ti->egress))
+		return tun_egress_queue(ti, iov, iovcnt);
+
+	ret = tun_write(ti, iov, iovcnt);
 	if (ret < 0) {
-		fprintf(stderr, "tun_interface_send_packet: write(2) got "
-				"error: %s\n", strerror(errno));
+		if (errno == EAGAIN)
+			return tun_egress_queue(ti, iov, iovcnt);
+		tun_write_error(ti);
+		return ret;
 	}
 
+	ti->written++;
+
 	return ret;
 }
+
+int tun_interface_send_packet(struct tun_interface *ti,
+			      const uint8_t *buf, int len)
+{
+	struct virtio_net_hdr hdr;
+	struct iovec iov[2];
+
+	if (!ti->vnet_hdr) {
+		iov[0].iov_base = (void *)buf;
+		iov[0].iov_len = len;
+
+		return tun_send(ti, iov, 1);
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)buf;
+	iov[1].iov_len = len;
+
+	return tun_send(ti, iov, 2);
+}
+
+/*
+ * Writes a packet that is preceded by its virtio-net header, as read
+ * from a tun interface with offloads enabled, so that the kernel can
+ * segment it and/or fill in its checksum as needed.
+ */
+int tun_interface_send_gso_packet(struct tun_interface *ti,
+				  const uint8_t *buf, int len)
+{
+	struct iovec iov;
+
+	if (!ti->vnet_hdr)
+		return -1;
+
+	iov.iov_base = (void *)buf;
+	iov.iov_len = len;
+
+	return tun_send(ti, &iov, 1);
+}
+
+void tun_interface_get_egress_stats(struct tun_interface *ti,
+				    struct tun_egress_stats *st)
+{
+	st->queue_len = ti->egress_len;
+	st->queue_bytes = ti->egress_bytes;
+	st->queue_max_bytes = ti->egress_max_bytes;
+	st->written = ti->written;
+	st->queued = ti->queued;
+	st->dropped = ti->dropped;
+	st->syscalls = ti->syscalls;
+	st->io_uring = ti->tu != NULL;
+}
@@ -21,22 +21,58 @@
 #define __TUN_H
 
 #include <iv.h>
+#include <iv_list.h>
 #include <net/if.h>
+#include <stdint.h>
+
+#define TUN_HEADROOM	16
 
 struct tun_interface {
 	const char	*itfname;
+	int		multi_queue;
+	int		vnet_hdr;
 	void		*cookie;
-	void		(*got_packet)(void *cookie, uint8_t *buf, int len);
+	int		(*got_packet)(void *cookie, uint8_t *buf, int len);
+	int		(*got_gso_packet)(void *cookie, uint8_t *buf, int len);
+	void		(*flush)(void *cookie);
 
 	char		name[IFNAMSIZ];
 	struct iv_fd	fd;
+	int		*destroyed;
+	struct tun_uring	*tu;
+
+	struct iv_list_head	egress;
+	int		egress_len;
+	int		egress_bytes;
+	int		egress_max_bytes;
+	uint64_t	written;
+	uint64_t	queued;
+	uint64_t	dropped;
+	uint64_t	syscalls;
+};
+
+struct tun_egress_stats {
+	int		queue_len;
+	int		queue_bytes;
+	int		queue_max_bytes;
+	uint64_t	written;
+	uint64_t	queued;
+	uint64_t	dropped;
+	uint64_t	syscalls;
+	int		io_uring;
 };
 
+void tun_set_io_uring(int enable);
 int tun_interface_register(struct tun_interface *ti);
 void tun_interface_unregister(struct tun_interface *ti);
 char *tun_interface_get_name(struct tun_interface *ti);
+int tun_interface_set_offload(struct tun_interface *ti, int enable);
 int tun_interface_send_packet(struct tun_interface *ti,
 			      const uint8_t *buf, int len);
+int tun_interface_send_gso_packet(struct tun_interface *ti,
+				  const uint8_t *buf, int len);
+void tun_interface_get_egress_stats(struct tun_interface *ti,
+				    struct tun_egress_stats *st);
 
 
 #endif
@@ -0,0 +1,267 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "itf.h"
+#include "tun.h"
+#include "uring.h"
+#include "util.h"
+
+/*
+ * Reflects UDP traffic through a tun interface for a few seconds,
+ * first with read() and write() on the tun file descriptor, and then
+ * with the io_uring backend, which the interface is switched over to
+ * at runtime, and reports the packet rate, the CPU time used and the
+ * number of system calls made by the tun layer per packet for each.
+ *
+ * Packets are sent from a UDP socket to an address that is routed
+ * to the tun interface, and each packet that is read from it has its
+ * source and destination addresses and ports swapped (which leaves
+ * the UDP checksum intact) and is written back, so that the kernel
+ * delivers it to the socket that sent it.  The number of packets in
+ * flight is capped, so that none get dropped along the way.
+ */
+#define BENCH_SECONDS		5
+#define BENCH_PACKET_LEN	1200
+#define BENCH_BURST		64
+#define BENCH_MAX_INFLIGHT	512
+
+static struct tun_interface tun;
+static int itf_pending;
+static int itf_error;
+static struct iv_fd sock;
+static struct sockaddr_in6 dst;
+static struct iv_task send_task;
+static struct iv_timer stop_timer;
+static int running;
+static long long tx_packets;
+static long long rx_packets;
+
+static const uint8_t local_addr[16] = {
+	0xfd, 0x00, 0xd7, 0x9e, 0xbe, 0x4c, 0x00, 0x00,
+	0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x01,
+};
+
+static int bench_got_packet(void *_dummy, uint8_t *buf, int len)
+{
+	uint8_t tmp[16];
+
+	if (len < 48 || (buf[0] >> 4) != 6 || buf[6] != IPPROTO_UDP)
+		return 0;
+
+	memcpy(tmp, buf + 8, 16);
+	memcpy(buf + 8, buf + 24, 16);
+	memcpy(buf + 24, tmp, 16);
+
+	memcpy(tmp, buf + 40, 2);
+	memcpy(buf + 40, buf + 42, 2);
+	memcpy(buf + 42, tmp, 2);
+
+	tun_interface_send_packet(&tun, buf, len);
+
+	return 0;
+}
+
+static void bench_send(void *_dummy)
+{
+	static uint8_t pkt[BENCH_PACKET_LEN];
+	int i;
+
+	for (i = 0; i < BENCH_BURST; i++) {
+		if (tx_packets - rx_packets >= BENCH_MAX_INFLIGHT)
+			return;
+
+		if (sendto(sock.fd, pkt, sizeof(pkt), 0,
+			   (struct sockaddr *)&dst, sizeof(dst)) < 0) {
+			if (errno != EAGAIN && errno != ENOBUFS) {
+				perror("tun_bench: sendto");
+				running = 0;
+				return;
+			}
+			break;
+		}
+
+		tx_packets++;
+	}
+
+	iv_task_register(&send_task);
+}
+
+static void bench_sock_in(void *_dummy)
+{
+	uint8_t buf[2048];
+
+	while (recv(sock.fd, buf, sizeof(buf), 0) > 0)
+		rx_packets++;
+
+	if (running && !iv_task_registered(&send_task))
+		iv_task_register(&send_task);
+}
+
+static void bench_stop(void *_dummy)
+{
+	running = 0;
+
+	if (iv_task_registered(&send_task))
+		iv_task_unregister(&send_task);
+
+	iv_fd_unregister(&sock);
+	close(sock.fd);
+
+	iv_quit();
+}
+
+static void bench_itf_done(void *_dummy, int err)
+{
+	if (err < 0) {
+		fprintf(stderr, "tun_bench: error configuring interface: "
+				"%s\n", strerror(-err));
+		itf_error = 1;
+	}
+
+	if (!--itf_pending)
+		iv_quit();
+}
+
+static int bench_setup(void)
+{
+	char *name;
+
+	tun.itfname = NULL;
+	tun.got_packet = bench_got_packet;
+	if (tun_interface_register(&tun) < 0)
+		return -1;
+
+	name = tun_interface_get_name(&tun);
+
+	itf_pending = 2;
+	itf_error = 0;
+	itf_set_state(name, 1, NULL, bench_itf_done);
+	itf_add_addr_v6(name, local_addr, 64, NULL, bench_itf_done);
+
+	iv_main();
+
+	if (itf_error) {
+		tun_interface_unregister(&tun);
+		return -1;
+	}
+
+	memset(&dst, 0, sizeof(dst));
+	dst.sin6_family = AF_INET6;
+	dst.sin6_port = htons(9);
+	memcpy(&dst.sin6_addr, local_addr, 16);
+	dst.sin6_addr.s6_addr[15] = 2;
+
+	return 0;
+}
+
+static double rusage_secs(const struct rusage *ru)
+{
+	return ru->ru_utime.tv_sec + ru->ru_stime.tv_sec +
+		(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) / 1e6;
+}
+
+static int bench_run(int use_io_uring)
+{
+	struct tun_egress_stats st;
+	struct rusage ru_start;
+	struct rusage ru_end;
+	uint64_t syscalls;
+	double cpu;
+
+	fprintf(stderr, "%s:\n", use_io_uring ? "io_uring" : "read/write");
+
+	tun_set_io_uring(use_io_uring);
+
+	IV_FD_INIT(&sock);
+	sock.fd = socket(AF_INET6, SOCK_DGRAM, 0);
+	if (sock.fd < 0) {
+		perror("tun_bench: socket");
+		return -1;
+	}
+	sock.handler_in = bench_sock_in;
+	iv_fd_register(&sock);
+
+	IV_TASK_INIT(&send_task);
+	send_task.handler = bench_send;
+	iv_task_register(&send_task);
+
+	IV_TIMER_INIT(&stop_timer);
+	iv_validate_now();
+	stop_timer.expires = iv_now;
+	timespec_add_ms(&stop_timer.expires, 1000 * BENCH_SECONDS,
+			1000 * BENCH_SECONDS);
+	stop_timer.handler = bench_stop;
+	iv_timer_register(&stop_timer);
+
+	tun_interface_get_egress_stats(&tun, &st);
+	syscalls = st.syscalls + uring_syscalls();
+	tx_packets = 0;
+	rx_packets = 0;
+	running = 1;
+
+	getrusage(RUSAGE_SELF, &ru_start);
+	iv_main();
+	getrusage(RUSAGE_SELF, &ru_end);
+
+	tun_interface_get_egress_stats(&tun, &st);
+	syscalls = st.syscalls + uring_syscalls() - syscalls;
+	cpu = rusage_secs(&ru_end) - rusage_secs(&ru_start);
+
+	fprintf(stderr, "  %lld packets, %.0f packets/s, %.0f packets per "
+			"CPU second, %.2f tun syscalls per packet\n",
+		rx_packets, (double)rx_packets / BENCH_SECONDS,
+		cpu > 0 ? rx_packets / cpu : 0.0,
+		rx_packets ? (double)syscalls / rx_packets : 0.0);
+
+	return 0;
+}
+
+int tun_bench(void)
+{
+	int ret;
+
+	iv_init();
+
+	ret = bench_setup();
+	if (ret == 0) {
+		ret = bench_run(0);
+		if (ret == 0)
+			ret = bench_run(1);
+		if (ret == 0)
+			ret = bench_run(0);
+
+		tun_set_io_uring(0);
+		tun_interface_unregister(&tun);
+		iv_main();
+	}
+
+	iv_deinit();
+
+	return !!ret;
+}
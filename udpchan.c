@@ -0,0 +1,487 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <gnutls/crypto.h>
+#include <gnutls/gnutls.h>
+#include <iv.h>
+#include <nettle/memops.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <unistd.h>
+#include "udpchan.h"
+#include "util.h"
+
+/*
+ * A UDP data channel carries tun packets between two peers that
+ * already share an authenticated TLS session.  The keys are taken from
+ * the TLS key exporter, and each datagram looks like this:
+ *
+ *	receiver id (4) | seq (8) | type (1) | ciphertext | tag (16)
+ *
+ * The message body is encrypted with AES-256-GCM, using the salt
+ * exported for the sending direction plus the sequence number as the
+ * nonce, and the 13 header bytes as associated data.  The receiver id
+ * lets a single server socket demultiplex many clients (and lets
+ * clients roam), and sequence numbers are checked against a sliding
+ * anti-replay window.
+ *
+ * Both sides send a keepalive every UDPCHAN_KEEPALIVE seconds that says
+ * whether they have heard from the other side recently.  The channel
+ * is only used for sending once the peer has confirmed that our
+ * datagrams get through, and falls back to the TCP connection if those
+ * confirmations stop.
+ */
+#define UDPCHAN_HDR_LEN		13
+#define UDPCHAN_TAG_LEN		16
+#define UDPCHAN_MAX_BATCH	64
+
+#define UDPCHAN_KEEPALIVE	5
+#define UDPCHAN_TIMEOUT		15
+
+#define MSG_TYPE_PACKET		0x00
+#define MSG_TYPE_KEEPALIVE	0x01
+
+static int compare_chans(struct iv_avl_node *_a, struct iv_avl_node *_b)
+{
+	struct udpchan *a = iv_container_of(_a, struct udpchan, an);
+	struct udpchan *b = iv_container_of(_b, struct udpchan, an);
+
+	if (a->rx_id < b->rx_id)
+		return -1;
+	if (a->rx_id > b->rx_id)
+		return 1;
+
+	return 0;
+}
+
+static struct udpchan *udpchan_find(struct udpchan_socket *us, uint32_t id)
+{
+	struct iv_avl_node *an;
+
+	an = us->chans.root;
+	while (an != NULL) {
+		struct udpchan *uc;
+
+		uc = iv_container_of(an, struct udpchan, an);
+		if (id == uc->rx_id)
+			return uc;
+
+		if (id < uc->rx_id)
+			an = an->left;
+		else
+			an = an->right;
+	}
+
+	return NULL;
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b)
+{
+	if (a->tv_sec != b->tv_sec)
+		return a->tv_sec < b->tv_sec;
+
+	return a->tv_nsec < b->tv_nsec;
+}
+
+static int udpchan_heard_recently(struct udpchan *uc)
+{
+	struct timespec until;
+
+	if (!uc->rx_top)
+		return 0;
+
+	until = uc->last_rx;
+	timespec_add_ms(&until, 1000 * UDPCHAN_TIMEOUT, 1000 * UDPCHAN_TIMEOUT);
+
+	return timespec_before(&iv_now, &until);
+}
+
+static void put_be32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+}
+
+static uint32_t get_be32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void put_be64(uint8_t *p, uint64_t v)
+{
+	put_be32(p, v >> 32);
+	put_be32(p + 4, v);
+}
+
+static uint64_t get_be64(const uint8_t *p)
+{
+	return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static int udpchan_replay_check(struct udpchan *uc, uint64_t seq)
+{
+	if (seq == 0)
+		return 0;
+
+	if (seq > uc->rx_top)
+		return 1;
+
+	if (uc->rx_top - seq >= UDPCHAN_WINDOW)
+		return 0;
+
+	seq %= UDPCHAN_WINDOW;
+
+	return !(uc->rx_window[seq / 64] & (1ULL << (seq % 64)));
+}
+
+static void udpchan_replay_update(struct udpchan *uc, uint64_t seq)
+{
+	uint64_t bit;
+
+	if (seq > uc->rx_top) {
+		if (seq - uc->rx_top >= UDPCHAN_WINDOW) {
+			memset(uc->rx_window, 0, sizeof(uc->rx_window));
+		} else {
+			uint64_t s;
+
+			for (s = uc->rx_top + 1; s < seq; s++) {
+				bit = s % UDPCHAN_WINDOW;
+				uc->rx_window[bit / 64] &= ~(1ULL << (bit % 64));
+			}
+		}
+		uc->rx_top = seq;
+	}
+
+	bit = seq % UDPCHAN_WINDOW;
+	uc->rx_window[bit / 64] |= 1ULL << (bit % 64);
+}
+
+static void udpchan_xmit(struct udpchan *uc, int type,
+			 const uint8_t *body, int len)
+{
+	uint8_t buf[UDPCHAN_HDR_LEN + len + UDPCHAN_TAG_LEN];
+	uint8_t nonce[12];
+	int ret;
+
+	if (!uc->keyed || !uc->have_peer)
+		return;
+
+	uc->tx_seq++;
+
+	put_be32(buf, uc->tx_id);
+	put_be64(buf + 4, uc->tx_seq);
+	buf[12] = type;
+
+	memcpy(nonce, uc->tx_salt, 4);
+	memcpy(nonce + 4, buf + 4, 8);
+
+	gcm_aes256_set_iv(&uc->tx_ctx, sizeof(nonce), nonce);
+	gcm_aes256_update(&uc->tx_ctx, UDPCHAN_HDR_LEN, buf);
+	gcm_aes256_encrypt(&uc->tx_ctx, len, buf + UDPCHAN_HDR_LEN, body);
+	gcm_aes256_digest(&uc->tx_ctx, UDPCHAN_TAG_LEN,
+			  buf + UDPCHAN_HDR_LEN + len);
+
+	do {
+		ret = sendto(uc->us->fd.fd, buf, sizeof(buf), 0,
+			     (struct sockaddr *)&uc->peer, sizeof(uc->peer));
+	} while (ret < 0 && errno == EINTR);
+
+	/*
+	 * Losing a datagram to a full socket buffer is no different
+	 * from losing it on the wire.
+	 */
+	if (ret < 0 && errno != EAGAIN && errno != ENOBUFS)
+		perror("udpchan_xmit: sendto");
+}
+
+static void udpchan_send_keepalive(struct udpchan *uc)
+{
+	uint8_t heard;
+
+	iv_validate_now();
+	heard = udpchan_heard_recently(uc);
+
+	udpchan_xmit(uc, MSG_TYPE_KEEPALIVE, &heard, 1);
+}
+
+static void udpchan_keepalive_expired(void *_uc)
+{
+	struct udpchan *uc = _uc;
+
+	udpchan_send_keepalive(uc);
+
+	iv_validate_now();
+	uc->keepalive.expires = iv_now;
+	timespec_add_ms(&uc->keepalive.expires, 900 * UDPCHAN_KEEPALIVE,
+			1100 * UDPCHAN_KEEPALIVE);
+	iv_timer_register(&uc->keepalive);
+}
+
+static void udpchan_input(struct udpchan_socket *us, uint8_t *buf, int len,
+			  const struct sockaddr_storage *from)
+{
+	struct udpchan *uc;
+	uint8_t nonce[12];
+	uint8_t tag[UDPCHAN_TAG_LEN];
+	uint64_t seq;
+	uint8_t *msg;
+	int msglen;
+	int heard;
+
+	if (len <= UDPCHAN_HDR_LEN + UDPCHAN_TAG_LEN)
+		return;
+
+	uc = udpchan_find(us, get_be32(buf));
+	if (uc == NULL || !uc->keyed)
+		return;
+
+	seq = get_be64(buf + 4);
+	if (!udpchan_replay_check(uc, seq))
+		return;
+
+	msg = buf + UDPCHAN_HDR_LEN;
+	msglen = len - UDPCHAN_HDR_LEN - UDPCHAN_TAG_LEN;
+
+	memcpy(nonce, uc->rx_salt, 4);
+	memcpy(nonce + 4, buf + 4, 8);
+
+	gcm_aes256_set_iv(&uc->rx_ctx, sizeof(nonce), nonce);
+	gcm_aes256_update(&uc->rx_ctx, UDPCHAN_HDR_LEN, buf);
+	gcm_aes256_decrypt(&uc->rx_ctx, msglen, msg, msg);
+	gcm_aes256_digest(&uc->rx_ctx, sizeof(tag), tag);
+
+	if (!memeql_sec(tag, msg + msglen, sizeof(tag)))
+		return;
+
+	iv_validate_now();
+	heard = udpchan_heard_recently(uc);
+
+	/*
+	 * Follow the peer to whatever address its newest datagram
+	 * came from.
+	 */
+	if (seq > uc->rx_top) {
+		uc->peer = *from;
+		uc->have_peer = 1;
+	}
+
+	udpchan_replay_update(uc, seq);
+	uc->last_rx = iv_now;
+
+	switch (buf[12]) {
+	case MSG_TYPE_PACKET:
+		uc->packet_received(uc->cookie, msg, msglen);
+		break;
+
+	case MSG_TYPE_KEEPALIVE:
+		if (msg[0]) {
+			uc->tx_ok_until = iv_now;
+			timespec_add_ms(&uc->tx_ok_until,
+					1000 * UDPCHAN_TIMEOUT,
+					1000 * UDPCHAN_TIMEOUT);
+		}
+
+		/*
+		 * Answer right away if the peer doesn't know yet that
+		 * we hear it, or if it just came back, so that both
+		 * directions come up within a round trip or two.
+		 */
+		if (!msg[0] || !heard)
+			udpchan_send_keepalive(uc);
+		break;
+	}
+}
+
+static void udpchan_socket_got_data(void *_us)
+{
+	struct udpchan_socket *us = _us;
+	int i;
+
+	for (i = 0; i < UDPCHAN_MAX_BATCH; i++) {
+		uint8_t buf[65536];
+		struct sockaddr_storage from;
+		socklen_t fromlen;
+		int ret;
+
+		fromlen = sizeof(from);
+
+		do {
+			ret = recvfrom(us->fd.fd, buf, sizeof(buf), 0,
+				       (struct sockaddr *)&from, &fromlen);
+		} while (ret < 0 && errno == EINTR);
+
+		if (ret < 0) {
+			if (errno != EAGAIN)
+				perror("udpchan_socket_got_data: recvfrom");
+			break;
+		}
+
+		udpchan_input(us, buf, ret, &from);
+	}
+}
+
+int udpchan_socket_register(struct udpchan_socket *us)
+{
+	int fd;
+
+	fd = socket(us->local_address.ss_family, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("udpchan_socket: socket");
+		return 1;
+	}
+
+	if (bind(fd, (struct sockaddr *)&us->local_address,
+		 sizeof(us->local_address)) < 0) {
+		perror("udpchan_socket: bind");
+		close(fd);
+		return 1;
+	}
+
+	IV_FD_INIT(&us->fd);
+	us->fd.fd = fd;
+	us->fd.cookie = us;
+	us->fd.handler_in = udpchan_socket_got_data;
+	iv_fd_register(&us->fd);
+
+	INIT_IV_AVL_TREE(&us->chans, compare_chans);
+
+	return 0;
+}
+
+void udpchan_socket_unregister(struct udpchan_socket *us)
+{
+	iv_fd_unregister(&us->fd);
+	close(us->fd.fd);
+}
+
+int udpchan_socket_get_port(struct udpchan_socket *us)
+{
+	struct sockaddr_storage addr;
+	socklen_t len;
+
+	len = sizeof(addr);
+	if (getsockname(us->fd.fd, (struct sockaddr *)&addr, &len) < 0) {
+		perror("udpchan_socket_get_port: getsockname");
+		return -1;
+	}
+
+	if (addr.ss_family == AF_INET)
+		return ntohs(((struct sockaddr_in *)&addr)->sin_port);
+
+	if (addr.ss_family == AF_INET6)
+		return ntohs(((struct sockaddr_in6 *)&addr)->sin6_port);
+
+	return -1;
+}
+
+int udpchan_register(struct udpchan *uc)
+{
+	int i;
+
+	for (i = 0; i < 16; i++) {
+		gnutls_rnd(GNUTLS_RND_NONCE, &uc->rx_id, sizeof(uc->rx_id));
+		if (uc->rx_id && !iv_avl_tree_insert(&uc->us->chans, &uc->an))
+			break;
+	}
+
+	if (i == 16)
+		return -1;
+
+	uc->keyed = 0;
+	uc->have_peer = 0;
+
+	IV_TIMER_INIT(&uc->keepalive);
+	uc->keepalive.cookie = uc;
+	uc->keepalive.handler = udpchan_keepalive_expired;
+
+	return 0;
+}
+
+void udpchan_unregister(struct udpchan *uc)
+{
+	iv_avl_tree_delete(&uc->us->chans, &uc->an);
+
+	if (iv_timer_registered(&uc->keepalive))
+		iv_timer_unregister(&uc->keepalive);
+
+	memset(&uc->tx_ctx, 0, sizeof(uc->tx_ctx));
+	memset(&uc->rx_ctx, 0, sizeof(uc->rx_ctx));
+}
+
+int udpchan_set_keys(struct udpchan *uc, const uint8_t *keys, int initiator,
+		     uint32_t tx_id, const struct sockaddr_storage *peer)
+{
+	const uint8_t *tx;
+	const uint8_t *rx;
+
+	if (uc->keyed)
+		return -1;
+
+	if (initiator) {
+		tx = keys;
+		rx = keys + 36;
+	} else {
+		tx = keys + 36;
+		rx = keys;
+	}
+
+	gcm_aes256_set_key(&uc->tx_ctx, tx);
+	memcpy(uc->tx_salt, tx + 32, 4);
+	uc->tx_seq = 0;
+
+	gcm_aes256_set_key(&uc->rx_ctx, rx);
+	memcpy(uc->rx_salt, rx + 32, 4);
+	uc->rx_top = 0;
+	memset(uc->rx_window, 0, sizeof(uc->rx_window));
+
+	uc->tx_id = tx_id;
+	uc->keyed = 1;
+
+	if (peer != NULL) {
+		uc->peer = *peer;
+		uc->have_peer = 1;
+	}
+
+	uc->tx_ok_until.tv_sec = 0;
+	uc->tx_ok_until.tv_nsec = 0;
+
+	udpchan_keepalive_expired(uc);
+
+	return 0;
+}
+
+int udpchan_usable(struct udpchan *uc)
+{
+	if (!uc->keyed || !uc->have_peer)
+		return 0;
+
+	iv_validate_now();
+
+	return timespec_before(&iv_now, &uc->tx_ok_until);
+}
+
+void udpchan_send(struct udpchan *uc, const uint8_t *pkt, int len)
+{
+	udpchan_xmit(uc, MSG_TYPE_PACKET, pkt, len);
+}
@@ -0,0 +1,77 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __UDPCHAN_H
+#define __UDPCHAN_H
+
+#include <iv.h>
+#include <iv_avl.h>
+#include <nettle/gcm.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define UDPCHAN_KEY_LABEL	"EXPORTER-dvpn-udp-data-channel"
+#define UDPCHAN_KEY_BYTES	(2 * (32 + 4))
+#define UDPCHAN_WINDOW		1024
+
+struct udpchan_socket {
+	struct sockaddr_storage	local_address;
+
+	struct iv_fd		fd;
+	struct iv_avl_tree	chans;
+};
+
+int udpchan_socket_register(struct udpchan_socket *us);
+void udpchan_socket_unregister(struct udpchan_socket *us);
+int udpchan_socket_get_port(struct udpchan_socket *us);
+
+struct udpchan {
+	struct udpchan_socket	*us;
+	void			*cookie;
+	void			(*packet_received)(void *cookie,
+						   const uint8_t *pkt,
+						   int len);
+
+	struct iv_avl_node	an;
+	uint32_t		rx_id;
+	uint32_t		tx_id;
+	int			keyed;
+	struct gcm_aes256_ctx	tx_ctx;
+	uint8_t			tx_salt[4];
+	uint64_t		tx_seq;
+	struct gcm_aes256_ctx	rx_ctx;
+	uint8_t			rx_salt[4];
+	uint64_t		rx_top;
+	uint64_t		rx_window[UDPCHAN_WINDOW / 64];
+	struct sockaddr_storage	peer;
+	int			have_peer;
+	struct timespec		last_rx;
+	struct timespec		tx_ok_until;
+	struct iv_timer		keepalive;
+};
+
+int udpchan_register(struct udpchan *uc);
+void udpchan_unregister(struct udpchan *uc);
+int udpchan_set_keys(struct udpchan *uc, const uint8_t *keys, int initiator,
+		     uint32_t tx_id, const struct sockaddr_storage *peer);
+int udpchan_usable(struct udpchan *uc);
+void udpchan_send(struct udpchan *uc, const uint8_t *pkt, int len);
+
+
+#endif
@@ -0,0 +1,407 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "uring.h"
+
+/*
+ * A minimal io_uring driver, built on the raw system calls, with one
+ * ring per thread.  Requests that are queued during one event loop
+ * iteration are submitted to the kernel together, with a single
+ * io_uring_enter() from an iv_task.  Completions are signalled on an
+ * eventfd that is registered with the ring, and with ivykis, and are
+ * reaped from the completion queue without any system calls beyond
+ * the read() of that eventfd.
+ *
+ * Each uring_req is passed to its ->complete handler with the result
+ * and the flags of each of its completions.  The ring is torn down
+ * once all its users have called uring_put() and every request that
+ * was submitted to it has seen its last completion (the one without
+ * IORING_CQE_F_MORE set), so that it doesn't keep iv_main() from
+ * returning.
+ */
+#define URING_ENTRIES		256
+
+struct uring {
+	int			fd;
+	int			refcount;
+	int			inflight;
+	int			next_bgid;
+	int			reaping;
+
+	void			*sq_ring;
+	size_t			sq_ring_size;
+	unsigned int		*sq_head;
+	unsigned int		*sq_tail;
+	unsigned int		sq_mask;
+	unsigned int		*sq_array;
+	unsigned int		sq_local_tail;
+	unsigned int		to_submit;
+	struct io_uring_sqe	*sqes;
+	size_t			sqes_size;
+
+	void			*cq_ring;
+	size_t			cq_ring_size;
+	unsigned int		*cq_head;
+	unsigned int		*cq_tail;
+	unsigned int		cq_mask;
+	struct io_uring_cqe	*cqes;
+
+	struct iv_fd		efd;
+	struct iv_task		submit_task;
+};
+
+static __thread struct uring *uring;
+static uint64_t syscalls;
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+			      unsigned int min_complete, unsigned int flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode,
+				 void *arg, unsigned int nr_args)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_submit(void *_ur)
+{
+	struct uring *ur = _ur;
+
+	while (ur->to_submit) {
+		int ret;
+
+		__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+		ret = sys_io_uring_enter(ur->fd, ur->to_submit, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/*
+			 * EAGAIN and EBUSY mean that the kernel is short
+			 * on memory or on completion queue space, which
+			 * the completions that we are about to reap will
+			 * take care of.
+			 */
+			if (errno == EAGAIN || errno == EBUSY)
+				break;
+
+			fprintf(stderr, "uring_submit: io_uring_enter(2) got "
+					"error: %s\n", strerror(errno));
+			abort();
+		}
+
+		ur->to_submit -= ret;
+	}
+
+	if (ur->to_submit && !iv_task_registered(&ur->submit_task))
+		iv_task_register(&ur->submit_task);
+}
+
+static void uring_destroy(struct uring *ur)
+{
+	if (iv_task_registered(&ur->submit_task))
+		iv_task_unregister(&ur->submit_task);
+
+	iv_fd_unregister(&ur->efd);
+	close(ur->efd.fd);
+
+	munmap(ur->sqes, ur->sqes_size);
+	munmap(ur->cq_ring, ur->cq_ring_size);
+	munmap(ur->sq_ring, ur->sq_ring_size);
+	close(ur->fd);
+
+	free(ur);
+	uring = NULL;
+}
+
+static void uring_reap(void *_ur)
+{
+	struct uring *ur = _ur;
+	uint64_t val;
+	unsigned int head;
+
+	__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+	if (read(ur->efd.fd, &val, sizeof(val)) < 0 && errno != EAGAIN) {
+		fprintf(stderr, "uring_reap: read(2) got error: %s\n",
+			strerror(errno));
+	}
+
+	ur->reaping = 1;
+
+	head = *ur->cq_head;
+	while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe;
+		struct uring_req *req;
+		unsigned int flags;
+		int res;
+
+		cqe = &ur->cqes[head & ur->cq_mask];
+		req = (struct uring_req *)(uintptr_t)cqe->user_data;
+		res = cqe->res;
+		flags = cqe->flags;
+
+		head++;
+		__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+
+		if (!(flags & IORING_CQE_F_MORE))
+			ur->inflight--;
+
+		if (req != NULL)
+			req->complete(req->cookie, res, flags);
+	}
+
+	ur->reaping = 0;
+
+	if (!ur->refcount && !ur->inflight)
+		uring_destroy(ur);
+}
+
+static int uring_create(void)
+{
+	struct io_uring_params p;
+	struct uring *ur;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_COOP_TASKRUN;
+
+	fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	if (fd < 0 && errno == EINVAL) {
+		memset(&p, 0, sizeof(p));
+		fd = sys_io_uring_setup(URING_ENTRIES, &p);
+	}
+
+	if (fd < 0) {
+		fprintf(stderr, "uring_create: io_uring_setup(2) got "
+				"error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	ur = calloc(1, sizeof(*ur));
+	if (ur == NULL) {
+		close(fd);
+		return -1;
+	}
+
+	ur->fd = fd;
+
+	ur->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ur->sq_ring = mmap(NULL, ur->sq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+
+	ur->cq_ring_size = p.cq_off.cqes +
+			   p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->cq_ring = mmap(NULL, ur->cq_ring_size, PROT_READ | PROT_WRITE,
+			   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+
+	ur->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ur->sqes = mmap(NULL, ur->sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+
+	if (ur->sq_ring == MAP_FAILED || ur->cq_ring == MAP_FAILED ||
+	    ur->sqes == MAP_FAILED) {
+		fprintf(stderr, "uring_create: mmap(2) of ring failed\n");
+		if (ur->sqes != MAP_FAILED)
+			munmap(ur->sqes, ur->sqes_size);
+		if (ur->cq_ring != MAP_FAILED)
+			munmap(ur->cq_ring, ur->cq_ring_size);
+		if (ur->sq_ring != MAP_FAILED)
+			munmap(ur->sq_ring, ur->sq_ring_size);
+		free(ur);
+		close(fd);
+		return -1;
+	}
+
+	ur->sq_head = ur->sq_ring + p.sq_off.head;
+	ur->sq_tail = ur->sq_ring + p.sq_off.tail;
+	ur->sq_mask = *(unsigned int *)(ur->sq_ring + p.sq_off.ring_mask);
+	ur->sq_array = ur->sq_ring + p.sq_off.array;
+	ur->sq_local_tail = *ur->sq_tail;
+
+	ur->cq_head = ur->cq_ring + p.cq_off.head;
+	ur->cq_tail = ur->cq_ring + p.cq_off.tail;
+	ur->cq_mask = *(unsigned int *)(ur->cq_ring + p.cq_off.ring_mask);
+	ur->cqes = ur->cq_ring + p.cq_off.cqes;
+
+	IV_FD_INIT(&ur->efd);
+	ur->efd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ur->efd.fd < 0 ||
+	    sys_io_uring_register(fd, IORING_REGISTER_EVENTFD,
+				  &ur->efd.fd, 1) < 0) {
+		fprintf(stderr, "uring_create: eventfd setup failed: %s\n",
+			strerror(errno));
+		if (ur->efd.fd >= 0)
+			close(ur->efd.fd);
+		munmap(ur->sqes, ur->sqes_size);
+		munmap(ur->cq_ring, ur->cq_ring_size);
+		munmap(ur->sq_ring, ur->sq_ring_size);
+		free(ur);
+		close(fd);
+		return -1;
+	}
+	ur->efd.cookie = ur;
+	ur->efd.handler_in = uring_reap;
+	iv_fd_register(&ur->efd);
+
+	IV_TASK_INIT(&ur->submit_task);
+	ur->submit_task.cookie = ur;
+	ur->submit_task.handler = uring_submit;
+
+	uring = ur;
+
+	return 0;
+}
+
+int uring_get(void)
+{
+	if (uring == NULL && uring_create() < 0)
+		return -1;
+
+	uring->refcount++;
+
+	return 0;
+}
+
+void uring_put(void)
+{
+	struct uring *ur = uring;
+
+	ur->refcount--;
+	if (!ur->refcount && !ur->inflight && !ur->reaping)
+		uring_destroy(ur);
+}
+
+/*
+ * Returns a zeroed submission queue entry for the given request,
+ * which will be submitted at the end of this event loop iteration,
+ * or NULL if the submission queue is full.
+ */
+struct io_uring_sqe *uring_get_sqe(struct uring_req *req)
+{
+	struct uring *ur = uring;
+	struct io_uring_sqe *sqe;
+	unsigned int idx;
+
+	if (ur->sq_local_tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE)
+	    > ur->sq_mask) {
+		uring_submit(ur);
+		if (ur->to_submit)
+			return NULL;
+	}
+
+	idx = ur->sq_local_tail & ur->sq_mask;
+
+	sqe = &ur->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)req;
+
+	ur->sq_array[idx] = idx;
+	ur->sq_local_tail++;
+	__atomic_store_n(ur->sq_tail, ur->sq_local_tail, __ATOMIC_RELEASE);
+
+	ur->to_submit++;
+	ur->inflight++;
+
+	if (!iv_task_registered(&ur->submit_task))
+		iv_task_register(&ur->submit_task);
+
+	return sqe;
+}
+
+/*
+ * Asks the kernel to cancel a request (typically a multishot one),
+ * which will then see its final completion with -ECANCELED.
+ */
+void uring_cancel(struct uring_req *req)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe(NULL);
+	if (sqe == NULL) {
+		fprintf(stderr, "uring_cancel: submission queue full\n");
+		return;
+	}
+
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uintptr_t)req;
+}
+
+/*
+ * Registers a ring of provided buffers with a newly allocated buffer
+ * group ID, which is returned.
+ */
+int uring_register_buf_ring(struct io_uring_buf_ring *br, int entries)
+{
+	struct uring *ur = uring;
+	struct io_uring_buf_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)br;
+	reg.ring_entries = entries;
+	reg.bgid = ur->next_bgid;
+
+	__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+	if (sys_io_uring_register(ur->fd, IORING_REGISTER_PBUF_RING,
+				  &reg, 1) < 0) {
+		fprintf(stderr, "uring_register_buf_ring: io_uring_register(2) "
+				"got error: %s\n", strerror(errno));
+		return -1;
+	}
+
+	return ur->next_bgid++;
+}
+
+void uring_unregister_buf_ring(int bgid)
+{
+	struct uring *ur = uring;
+	struct io_uring_buf_reg reg;
+
+	memset(&reg, 0, sizeof(reg));
+	reg.bgid = bgid;
+
+	__atomic_fetch_add(&syscalls, 1, __ATOMIC_RELAXED);
+	sys_io_uring_register(ur->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+}
+
+/*
+ * The number of system calls made on all threads' rings so far.
+ */
+uint64_t uring_syscalls(void)
+{
+	return __atomic_load_n(&syscalls, __ATOMIC_RELAXED);
+}
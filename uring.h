@@ -0,0 +1,47 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+
+#ifndef __URING_H
+#define __URING_H
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+
+/*
+ * Not in older kernel headers.
+ */
+#define URING_OP_READ_MULTISHOT	49
+
+struct uring_req {
+	void			*cookie;
+	void			(*complete)(void *cookie, int res,
+					    unsigned int flags);
+};
+
+int uring_get(void);
+void uring_put(void);
+struct io_uring_sqe *uring_get_sqe(struct uring_req *req);
+void uring_cancel(struct uring_req *req);
+int uring_register_buf_ring(struct io_uring_buf_ring *br, int entries);
+void uring_unregister_buf_ring(int bgid);
+uint64_t uring_syscalls(void);
+
+
+#endif
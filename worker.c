@@ -0,0 +1,341 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <iv.h>
+#include <iv_event.h>
+#include <iv_thread.h>
+#include <semaphore.h>
+#include "worker.h"
+
+/*
+ * Data plane worker threads each run an event loop of their own, and
+ * the objects that they service (tconn sessions, tun queues) are only
+ * ever touched from that thread once they have been handed over.
+ * Other threads talk to a worker by posting messages to its queue.
+ *
+ * A worker_queue is a lock-free multiple producer, single consumer
+ * queue: producers push messages onto a singly linked stack with a
+ * compare-and-swap, and the consuming thread takes the whole stack in
+ * one atomic exchange and reverses it, which gives back the order in
+ * which the messages were posted.  The consumer is only woken up (via
+ * an iv_event) when a message is posted to an empty queue.
+ *
+ * Messages posted to the same queue are handled in the order in which
+ * they were posted, which the users of this rely on: worker_call() of
+ * some teardown function, for example, is guaranteed to run after all
+ * messages that were posted to the same worker before it.
+ */
+static void worker_queue_run(void *_wq)
+{
+	struct worker_queue *wq = _wq;
+	struct worker_msg *msg;
+	int unregistered;
+
+	msg = __atomic_exchange_n(&wq->head, NULL, __ATOMIC_ACQUIRE);
+	while (msg != NULL) {
+		struct worker_msg *next;
+
+		next = msg->next;
+		msg->next = wq->batch;
+		wq->batch = msg;
+		msg = next;
+	}
+
+	unregistered = 0;
+	wq->unregistered = &unregistered;
+
+	while (wq->batch != NULL) {
+		msg = wq->batch;
+		wq->batch = msg->next;
+
+		msg->handler(msg);
+		if (unregistered)
+			return;
+	}
+
+	wq->unregistered = NULL;
+}
+
+void worker_queue_register(struct worker_queue *wq)
+{
+	IV_EVENT_INIT(&wq->ev);
+	wq->ev.cookie = wq;
+	wq->ev.handler = worker_queue_run;
+	iv_event_register(&wq->ev);
+
+	wq->head = NULL;
+	wq->batch = NULL;
+	wq->unregistered = NULL;
+}
+
+static void worker_queue_discard(struct worker_queue *wq,
+				 struct worker_msg *msg)
+{
+	while (msg != NULL) {
+		struct worker_msg *next;
+
+		next = msg->next;
+		if (wq->discard != NULL)
+			wq->discard(msg);
+		msg = next;
+	}
+}
+
+/*
+ * The caller must make sure that nothing is posted to the queue from
+ * here on.  Messages that haven't been handled yet are passed to the
+ * discard callback, if there is one.
+ */
+void worker_queue_unregister(struct worker_queue *wq)
+{
+	struct worker_msg *msg;
+
+	if (wq->unregistered != NULL)
+		*wq->unregistered = 1;
+
+	iv_event_unregister(&wq->ev);
+
+	worker_queue_discard(wq, wq->batch);
+	wq->batch = NULL;
+
+	msg = __atomic_exchange_n(&wq->head, NULL, __ATOMIC_ACQUIRE);
+	worker_queue_discard(wq, msg);
+}
+
+void worker_queue_post(struct worker_queue *wq, struct worker_msg *msg)
+{
+	struct worker_msg *head;
+
+	head = __atomic_load_n(&wq->head, __ATOMIC_RELAXED);
+	do {
+		msg->next = head;
+	} while (!__atomic_compare_exchange_n(&wq->head, &head, msg, 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+
+	if (head == NULL)
+		iv_event_post(&wq->ev);
+}
+
+
+struct worker {
+	int			index;
+	int			load;
+	sem_t			sem;
+	struct worker_queue	queue;
+	struct worker_msg	stop;
+};
+
+static int num_workers;
+static struct worker *workers;
+static __thread struct worker *self;
+
+static void sem_wait_nointr(sem_t *sem)
+{
+	while (sem_wait(sem) < 0) {
+		if (errno != EINTR) {
+			perror("sem_wait");
+			abort();
+		}
+	}
+}
+
+static void worker_thread(void *_w)
+{
+	struct worker *w = _w;
+
+	iv_init();
+
+	self = w;
+
+	w->queue.discard = NULL;
+	worker_queue_register(&w->queue);
+
+	sem_post(&w->sem);
+
+	iv_main();
+
+	iv_deinit();
+
+	sem_post(&w->sem);
+}
+
+static void worker_stop(struct worker_msg *msg)
+{
+	struct worker *w = iv_container_of(msg, struct worker, stop);
+
+	worker_queue_unregister(&w->queue);
+}
+
+int worker_pool_start(int num)
+{
+	int i;
+
+	workers = calloc(num, sizeof(*workers));
+	if (workers == NULL) {
+		fprintf(stderr, "worker_pool_start: memory allocation "
+				"failure\n");
+		return -1;
+	}
+
+	for (i = 0; i < num; i++) {
+		struct worker *w = &workers[i];
+		char name[32];
+
+		w->index = i;
+		w->load = 0;
+		sem_init(&w->sem, 0, 0);
+		w->stop.handler = worker_stop;
+
+		snprintf(name, sizeof(name), "dvpn worker %d", i);
+		if (iv_thread_create(name, worker_thread, w) < 0) {
+			fprintf(stderr, "worker_pool_start: error creating "
+					"worker thread\n");
+			sem_destroy(&w->sem);
+			break;
+		}
+
+		sem_wait_nointr(&w->sem);
+
+		num_workers++;
+	}
+
+	if (num_workers < num) {
+		worker_pool_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * A worker's event loop (and thread) only terminates once everything
+ * that was handed to it has been taken back.
+ */
+void worker_pool_stop(void)
+{
+	int i;
+
+	for (i = 0; i < num_workers; i++) {
+		struct worker *w = &workers[i];
+
+		worker_queue_post(&w->queue, &w->stop);
+		sem_wait_nointr(&w->sem);
+		sem_destroy(&w->sem);
+	}
+
+	free(workers);
+	workers = NULL;
+	num_workers = 0;
+}
+
+int worker_pool_size(void)
+{
+	return num_workers;
+}
+
+struct worker *worker_pool_member(int index)
+{
+	if (index < 0 || index >= num_workers)
+		return NULL;
+
+	return &workers[index];
+}
+
+/*
+ * Returns the least loaded worker, or NULL (meaning: the calling
+ * thread) if there is no worker pool.  Only to be called from the
+ * thread that started the pool.
+ */
+struct worker *worker_get(void)
+{
+	struct worker *best;
+	int i;
+
+	best = NULL;
+	for (i = 0; i < num_workers; i++) {
+		if (best == NULL || workers[i].load < best->load)
+			best = &workers[i];
+	}
+
+	if (best != NULL)
+		best->load++;
+
+	return best;
+}
+
+void worker_put(struct worker *w)
+{
+	if (w != NULL)
+		w->load--;
+}
+
+struct worker *worker_self(void)
+{
+	return self;
+}
+
+void worker_post(struct worker *w, struct worker_msg *msg)
+{
+	worker_queue_post(&w->queue, msg);
+}
+
+
+struct worker_call {
+	struct worker_msg	msg;
+	void			(*fn)(void *cookie);
+	void			*cookie;
+	sem_t			done;
+};
+
+static void worker_call_run(struct worker_msg *msg)
+{
+	struct worker_call *wc = iv_container_of(msg, struct worker_call, msg);
+
+	wc->fn(wc->cookie);
+	sem_post(&wc->done);
+}
+
+/*
+ * Runs fn on the given worker, and waits for it to complete.  Workers
+ * never wait for other threads, so this can't deadlock as long as it
+ * isn't called from a worker for another worker.
+ */
+void worker_call(struct worker *w, void (*fn)(void *cookie), void *cookie)
+{
+	struct worker_call wc;
+
+	if (w == NULL || w == self) {
+		fn(cookie);
+		return;
+	}
+
+	wc.msg.handler = worker_call_run;
+	wc.fn = fn;
+	wc.cookie = cookie;
+	sem_init(&wc.done, 0, 0);
+
+	worker_queue_post(&w->queue, &wc.msg);
+	sem_wait_nointr(&wc.done);
+
+	sem_destroy(&wc.done);
+}
@@ -0,0 +1,57 @@
+/*
+ * dvpn, a multipoint vpn implementation
+ * Copyright (C) 2016 Lennert Buytenhek
+ *
+ * This library is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License version
+ * 2.1 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License version 2.1 for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License version 2.1 along with this library; if not, write to the
+ * Free Software Foundation, Inc., 51 Franklin Street - Fifth Floor,
+ * Boston, MA 02110-1301, USA.
+ */
+
+#ifndef __WORKER_H
+#define __WORKER_H
+
+#include <iv.h>
+#include <iv_event.h>
+
+struct worker_msg {
+	struct worker_msg	*next;
+	void			(*handler)(struct worker_msg *msg);
+};
+
+struct worker_queue {
+	void			(*discard)(struct worker_msg *msg);
+
+	struct iv_event		ev;
+	struct worker_msg	*head;
+	struct worker_msg	*batch;
+	int			*unregistered;
+};
+
+void worker_queue_register(struct worker_queue *wq);
+void worker_queue_unregister(struct worker_queue *wq);
+void worker_queue_post(struct worker_queue *wq, struct worker_msg *msg);
+
+struct worker;
+
+int worker_pool_start(int num);
+void worker_pool_stop(void);
+int worker_pool_size(void);
+struct worker *worker_pool_member(int index);
+struct worker *worker_get(void);
+void worker_put(struct worker *w);
+struct worker *worker_self(void);
+void worker_post(struct worker *w, struct worker_msg *msg);
+void worker_call(struct worker *w, void (*fn)(void *cookie), void *cookie);
+
+
+#endif